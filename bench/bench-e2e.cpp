@@ -0,0 +1,285 @@
+/**
+ * @file   bench-e2e.cpp
+ * @brief  End-to-end benchmark of identify/query/dump against the emulator.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <boost/bind.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+#include "../src/identify.hpp"
+#include "../src/maygion-mips.hpp"
+#include "emulator.hpp"
+
+namespace po = boost::program_options;
+
+#define PROGNAME "bench-e2e"
+
+/// Stream buffer that discards everything, to silence progress messages.
+class NullBuffer: public std::streambuf
+{
+	protected:
+		virtual int overflow(int c)
+		{
+			return c;
+		}
+};
+
+/// Counts bytes written to it instead of storing them.
+class CountingBuffer: public std::streambuf
+{
+	public:
+		CountingBuffer()
+			: count(0)
+		{
+		}
+
+		unsigned long count;
+
+	protected:
+		virtual int overflow(int c)
+		{
+			if (c != EOF) this->count++;
+			return c;
+		}
+
+		virtual std::streamsize xsputn(const char *s, std::streamsize n)
+		{
+			this->count += n;
+			return n;
+		}
+};
+
+/// State shared between the threads running one benchmark.
+struct Run
+{
+	Emulator *emulator;
+	std::string op;
+	unsigned int total;             ///< Number of operations to perform
+	unsigned int next;              ///< Next operation to start
+	boost::mutex lock;              ///< Protects everything below
+	std::vector<double> latencies;  ///< Milliseconds taken by each operation
+	unsigned long bytes;            ///< Firmware bytes downloaded
+	unsigned int errors;
+};
+
+void noProgress(unsigned long amount, unsigned long total)
+{
+	return;
+}
+
+/// Perform one operation against the emulator.
+/**
+ * @return Number of bytes of firmware downloaded.
+ *
+ * @throw std::string on failure.
+ */
+unsigned long runOp(Emulator *emulator, const std::string& op)
+{
+	std::string host = "127.0.0.1";
+	Network network(host);
+	network.set_port("http", emulator->port("http"));
+	network.set_port("ftp", emulator->port("ftp"));
+	network.set_port("telnet", emulator->port("telnet"));
+
+	if (op.compare("identify") == 0) {
+		Identify id(&network, NULL, NULL, noProgress);
+		std::string type = id.getType();
+		if (type.compare("maygion-mips") != 0) {
+			throw std::string("identified as " + type);
+		}
+		return 0;
+
+	} else if (op.compare("query") == 0) {
+		maygion_mips dev(&network);
+		unsigned long lenFlash;
+		dev.getFlashInfo(&lenFlash);
+		unsigned short idVendor, idProduct;
+		unsigned char bInterfaceClass;
+		dev.getCameraInfo(&idVendor, &idProduct, &bInterfaceClass);
+		if (lenFlash != emulator->flash().length()) {
+			throw std::string("wrong flash size");
+		}
+		return 0;
+
+	} else if (op.compare("dump") == 0) {
+		maygion_mips dev(&network);
+		CountingBuffer counter;
+		std::ostream target(&counter);
+		dev.getFirmware(target, noProgress);
+		network.ftp_close();
+		if (counter.count != emulator->flash().length()) {
+			throw std::string("short download");
+		}
+		return counter.count;
+	}
+	throw std::string("unknown operation " + op);
+}
+
+void worker(Run *run)
+{
+	for (;;) {
+		{
+			boost::mutex::scoped_lock guard(run->lock);
+			if (run->next >= run->total) break;
+			run->next++;
+		}
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		unsigned long bytes = 0;
+		bool ok = true;
+		try {
+			bytes = runOp(run->emulator, run->op);
+		} catch (const std::string& e) {
+			ok = false;
+		} catch (const boost::system::system_error& e) {
+			ok = false;
+		}
+		double ms = (boost::posix_time::microsec_clock::universal_time() - start)
+			.total_microseconds() / 1000.0;
+
+		boost::mutex::scoped_lock guard(run->lock);
+		if (ok) {
+			run->latencies.push_back(ms);
+			run->bytes += bytes;
+		} else {
+			run->errors++;
+		}
+	}
+	return;
+}
+
+/// Split a comma-separated list.
+std::vector<std::string> split(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::string::size_type start = 0, end;
+	do {
+		end = list.find(',', start);
+		items.push_back(list.substr(start, end - start));
+		start = end + 1;
+	} while (end != std::string::npos);
+	return items;
+}
+
+/// Get a percentile from a sorted list.
+double percentile(const std::vector<double>& sorted, double p)
+{
+	if (sorted.empty()) return 0;
+	std::vector<double>::size_type i = (std::vector<double>::size_type)(p * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+int main(int argc, char *argv[])
+{
+	po::options_description poOptions("Options");
+	poOptions.add_options()
+		("help", "produce help message")
+		("ops", po::value<std::string>()->default_value("identify,query,dump"),
+			"comma-separated list of operations to benchmark")
+		("concurrency", po::value<std::string>()->default_value("1,4,16"),
+			"comma-separated list of concurrency levels")
+		("requests", po::value<unsigned int>()->default_value(32),
+			"number of operations at each concurrency level")
+		("latency", po::value<unsigned int>()->default_value(0),
+			"emulated milliseconds of delay before each reply")
+		("bandwidth", po::value<unsigned long>()->default_value(0),
+			"emulated bytes/sec per connection (0 for unlimited)")
+		("loss", po::value<double>()->default_value(0),
+			"emulated chance (0-1) of each TCP segment being resent")
+		("flash-size", po::value<unsigned long>()->default_value(0x400000),
+			"size of the emulated flash in bytes")
+	;
+
+	po::variables_map mpArgs;
+	try {
+		po::store(po::parse_command_line(argc, argv, poOptions), mpArgs);
+		po::notify(mpArgs);
+	} catch (const po::error& e) {
+		std::cerr << PROGNAME ": " << e.what() << std::endl;
+		return 1;
+	}
+	if (mpArgs.count("help")) {
+		std::cout << "Benchmark camtickler operations against an emulated camera."
+			"\n\nUsage: " PROGNAME " [options]\n" << poOptions << std::endl;
+		return 0;
+	}
+
+	EmulatorConfig config;
+	config.latency = mpArgs["latency"].as<unsigned int>();
+	config.bandwidth = mpArgs["bandwidth"].as<unsigned long>();
+	config.loss = mpArgs["loss"].as<double>();
+	config.flashSize = mpArgs["flash-size"].as<unsigned long>();
+	Emulator emulator(config);
+	emulator.start("127.0.0.1", 0, 0, 0);
+
+	std::vector<std::string> ops = split(mpArgs["ops"].as<std::string>());
+	std::vector<std::string> levels = split(mpArgs["concurrency"].as<std::string>());
+
+	// The library code reports progress on stderr, which would swamp the
+	// results, so silence it while the benchmarks run.
+	NullBuffer null;
+	std::streambuf *oldCerr = std::cerr.rdbuf(&null);
+
+	std::cout << std::fixed << std::setprecision(2);
+	for (std::vector<std::string>::const_iterator op = ops.begin(); op != ops.end(); op++) {
+		for (std::vector<std::string>::const_iterator l = levels.begin(); l != levels.end(); l++) {
+			unsigned int concurrency = strtoul(l->c_str(), NULL, 10);
+			Run run;
+			run.emulator = &emulator;
+			run.op = *op;
+			run.total = mpArgs["requests"].as<unsigned int>();
+			run.next = 0;
+			run.bytes = 0;
+			run.errors = 0;
+
+			boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+			boost::thread_group threads;
+			for (unsigned int i = 0; i < concurrency; i++) {
+				threads.create_thread(boost::bind(worker, &run));
+			}
+			threads.join_all();
+			double secs = (boost::posix_time::microsec_clock::universal_time() - start)
+				.total_microseconds() / 1000000.0;
+
+			std::sort(run.latencies.begin(), run.latencies.end());
+			double sum = 0;
+			for (std::vector<double>::const_iterator i = run.latencies.begin();
+				i != run.latencies.end(); i++
+			) {
+				sum += *i;
+			}
+			std::cout << "op=" << *op
+				<< " concurrency=" << concurrency
+				<< " ok=" << run.latencies.size()
+				<< " errors=" << run.errors
+				<< " mean_ms=" << (run.latencies.empty() ? 0 : sum / run.latencies.size())
+				<< " p50_ms=" << percentile(run.latencies, 0.50)
+				<< " p95_ms=" << percentile(run.latencies, 0.95)
+				<< " max_ms=" << percentile(run.latencies, 1.00)
+				<< " ops_per_sec=" << run.latencies.size() / secs
+				<< " mb_per_sec=" << run.bytes / secs / 1048576.0
+				<< std::endl;
+		}
+	}
+
+	std::cerr.rdbuf(oldCerr);
+	emulator.stop();
+	return 0;
+}
@@ -0,0 +1,178 @@
+/**
+ * @file   bench-parse.cpp
+ * @brief  Microbenchmark for the protocol and config parsers.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <stdlib.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "../src/analyse.hpp"
+#include "../src/parse.hpp"
+#include "samples.hpp"
+
+#define PROGNAME "bench-parse"
+
+/// Number of heap allocations made so far.
+static unsigned long allocations = 0;
+
+void *operator new(std::size_t size)
+{
+	allocations++;
+	void *p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+
+void operator delete(void *p, std::size_t) throw()
+{
+	free(p);
+}
+
+/// Something for the parsers to write to so they can't be optimised away.
+static volatile unsigned long sink;
+
+typedef void (*fn_parse)(const std::string& input);
+
+void parsePASV(const std::string& input)
+{
+	unsigned short port = 0;
+	parse_pasv(input, &port);
+	sink += port;
+}
+
+void parseHTTP(const std::string& input)
+{
+	unsigned int status = 0;
+	std::string::size_type eol = input.find("\r\n");
+	parse_http_status(input.substr(0, eol), &status);
+	std::vector<std::string> headers = parse_http_headers(input.substr(eol + 2));
+	sink += status + headers.size();
+}
+
+void parseMTD(const std::string& input)
+{
+	std::vector<MTDPartition> parts;
+	parse_proc_mtd(input, &parts);
+	sink += parts.size();
+}
+
+void parseLoad(const std::string& input)
+{
+	double load = 0;
+	parse_loadavg(input, &load);
+	std::vector<NetDevice> devs;
+	parse_proc_net_dev(input, &devs);
+	sink += (unsigned long)(load * 100) + devs.size();
+}
+
+void parseINI(const std::string& input)
+{
+	unsigned int port;
+	std::string user, pass;
+	parse_cs_ini(input, &port, &user, &pass);
+	sink += port + user.length() + pass.length();
+}
+
+void parseBase64(const std::string& input)
+{
+	sink += base64_decode(input).length();
+}
+
+void parseFirmware(const std::string& input)
+{
+	FirmwareLayout layout;
+	analyseFirmware(input.data(), input.length(), &layout);
+	sink += layout.parts.size() + layout.erasedBlocks;
+}
+
+/// Make a 1 MB image that is part code-like data, part text and part erased.
+std::string sampleFirmware()
+{
+	std::string image;
+	unsigned long seed = 1;
+	for (unsigned int i = 0; i < 0x80000; i++) {
+		seed = seed * 1103515245 + 12345;
+		image += (char)(seed >> 16);
+	}
+	while (image.length() < 0xC0000) image += SAMPLE_CS_INI;
+	image.resize(0xC0000);
+	image.resize(0x100000, '\xFF');
+	return image;
+}
+
+/// Run a parser repeatedly and print its speed.
+void bench(const char *name, fn_parse fnParse, const std::string& input,
+	double minTime)
+{
+	// Warm up, and check how many allocations a single parse makes
+	fnParse(input);
+	unsigned long before = allocations;
+	fnParse(input);
+	unsigned long allocsPerParse = allocations - before;
+
+	unsigned long iterations = 0;
+	unsigned long batch = 1000;
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	double elapsed;
+	do {
+		for (unsigned long i = 0; i < batch; i++) fnParse(input);
+		iterations += batch;
+		elapsed = (boost::posix_time::microsec_clock::universal_time() - start)
+			.total_microseconds() / 1000000.0;
+	} while (elapsed < minTime);
+
+	std::cout << "parser=" << name
+		<< " input_bytes=" << input.length()
+		<< " iterations=" << iterations
+		<< " ns_per_parse=" << elapsed * 1e9 / iterations
+		<< " mb_per_sec=" << input.length() * iterations / elapsed / 1048576.0
+		<< " allocs_per_parse=" << allocsPerParse
+		<< std::endl;
+	return;
+}
+
+int main(int argc, char *argv[])
+{
+	double minTime = 0.5;
+	if (argc > 1) minTime = strtod(argv[1], NULL);
+	if (minTime <= 0) {
+		std::cerr << "Usage: " PROGNAME " [seconds per parser]" << std::endl;
+		return 1;
+	}
+
+	std::string ini = SAMPLE_CS_INI;
+	std::string ui = ini.substr(ini.find("ui=") + 3);
+	ui = ui.substr(0, ui.find('\r'));
+
+	std::cout << std::fixed << std::setprecision(1);
+	bench("pasv", parsePASV, SAMPLE_PASV, minTime);
+	bench("http_headers", parseHTTP, SAMPLE_HTTP_STATUS SAMPLE_HTTP_HEADERS, minTime);
+	bench("proc_mtd", parseMTD, SAMPLE_PROC_MTD, minTime);
+	bench("proc_load_net", parseLoad, SAMPLE_PROC_LOAD_NET, minTime);
+	bench("cs_ini", parseINI, ini, minTime);
+	bench("base64", parseBase64, ui, minTime);
+	bench("firmware", parseFirmware, sampleFirmware(), minTime);
+	return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file   camemu.cpp
+ * @brief  Standalone MayGion MIPS camera emulator for manual testing.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <boost/bind.hpp>
+#include <boost/program_options.hpp>
+#include "emulator.hpp"
+
+namespace po = boost::program_options;
+
+#define PROGNAME "camemu"
+
+int main(int argc, char *argv[])
+{
+	po::options_description poOptions("Options");
+	poOptions.add_options()
+		("help", "produce help message")
+		("address", po::value<std::string>()->default_value("127.0.0.1"),
+			"address to listen on")
+		("http-port", po::value<unsigned short>()->default_value(8081),
+			"port for the web server")
+		("ftp-port", po::value<unsigned short>()->default_value(2121),
+			"port for the FTP server")
+		("telnet-port", po::value<unsigned short>()->default_value(2323),
+			"port for the telnet server")
+		("latency", po::value<unsigned int>(),
+			"milliseconds of delay before each reply")
+		("bandwidth", po::value<unsigned long>(),
+			"bytes/sec per connection (default unlimited)")
+		("loss", po::value<double>(),
+			"chance (0-1) of each TCP segment being resent")
+		("flash-size", po::value<unsigned long>(),
+			"size of the emulated flash in bytes")
+		("busy-rate", po::value<unsigned long>(),
+			"bytes/sec sent at which the camera's load average reaches 1.0 "
+			"(default never)")
+		("video-rate", po::value<unsigned long>(),
+			"bytes/sec of video the camera streams while idle, reduced as it gets "
+			"busy (default 0)")
+		("user", po::value<std::string>(),
+			"web interface username stored in cs.ini")
+		("password", po::value<std::string>(),
+			"web interface password stored in cs.ini")
+	;
+
+	po::variables_map mpArgs;
+	try {
+		po::store(po::parse_command_line(argc, argv, poOptions), mpArgs);
+		po::notify(mpArgs);
+	} catch (const po::error& e) {
+		std::cerr << PROGNAME ": " << e.what() << std::endl;
+		return 1;
+	}
+	if (mpArgs.count("help")) {
+		std::cout << "Emulate a MayGion MIPS camera for testing camtickler.\n\n"
+			"Usage: " PROGNAME " [options]\n" << poOptions << "\n"
+			"Example:\n"
+			"  " PROGNAME " &\n"
+			"  camtickler --host 127.0.0.1 --port http=8081 --port ftp=2121 "
+			"--port telnet=2323 --identify\n" << std::endl;
+		return 0;
+	}
+
+	EmulatorConfig config;
+	if (mpArgs.count("latency")) config.latency = mpArgs["latency"].as<unsigned int>();
+	if (mpArgs.count("bandwidth")) config.bandwidth = mpArgs["bandwidth"].as<unsigned long>();
+	if (mpArgs.count("loss")) config.loss = mpArgs["loss"].as<double>();
+	if (mpArgs.count("flash-size")) config.flashSize = mpArgs["flash-size"].as<unsigned long>();
+	if (mpArgs.count("busy-rate")) config.busyRate = mpArgs["busy-rate"].as<unsigned long>();
+	if (mpArgs.count("video-rate")) config.videoRate = mpArgs["video-rate"].as<unsigned long>();
+	if (mpArgs.count("user")) config.user = mpArgs["user"].as<std::string>();
+	if (mpArgs.count("password")) config.pass = mpArgs["password"].as<std::string>();
+
+	Emulator emulator(config);
+	try {
+		emulator.start(mpArgs["address"].as<std::string>(),
+			mpArgs["http-port"].as<unsigned short>(),
+			mpArgs["ftp-port"].as<unsigned short>(),
+			mpArgs["telnet-port"].as<unsigned short>());
+	} catch (const boost::system::system_error& e) {
+		std::cerr << PROGNAME ": " << e.what() << std::endl;
+		return 1;
+	}
+	std::cout << "http_port=" << emulator.port("http")
+		<< "\nftp_port=" << emulator.port("ftp")
+		<< "\ntelnet_port=" << emulator.port("telnet") << std::endl;
+
+	// Run until interrupted
+	boost::asio::io_service io_service;
+	boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
+	signals.async_wait(boost::bind(&boost::asio::io_service::stop, &io_service));
+	io_service.run();
+
+	emulator.stop();
+	return 0;
+}
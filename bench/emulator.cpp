@@ -0,0 +1,668 @@
+/**
+ * @file   emulator.cpp
+ * @brief  Local stand-in for a MayGion MIPS camera.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <stdlib.h>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "../src/checksum.hpp"
+#include "emulator.hpp"
+
+/// Size of a TCP segment, for emulating loss.
+#define SEGMENT_SIZE 1460
+
+/// Delay caused by a lost segment, as a typical minimum retransmit timeout.
+#define RETRANSMIT_MS 200
+
+/// Shell prompt printed by the camera's busybox.
+#define PROMPT "# "
+
+EmulatorConfig::EmulatorConfig()
+	: latency(0),
+	  bandwidth(0),
+	  loss(0),
+	  flashSize(0x400000),
+	  eraseSize(0x10000),
+	  user("admin"),
+	  pass("secret"),
+	  iniPort(80),
+	  busyRate(0),
+	  videoRate(0)
+{
+}
+
+/// Encode data as base64, the way the camera stores credentials in cs.ini.
+static std::string base64(const std::string& in)
+{
+	static const char cb64[]
+		= "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (std::string::size_type i = 0; i < in.length(); i += 3) {
+		unsigned long v = (unsigned char)in[i] << 16;
+		if (i + 1 < in.length()) v |= (unsigned char)in[i + 1] << 8;
+		if (i + 2 < in.length()) v |= (unsigned char)in[i + 2];
+		out += cb64[(v >> 18) & 0x3F];
+		out += cb64[(v >> 12) & 0x3F];
+		out += (i + 1 < in.length()) ? cb64[(v >> 6) & 0x3F] : '=';
+		out += (i + 2 < in.length()) ? cb64[v & 0x3F] : '=';
+	}
+	return out;
+}
+
+/// Extract a parameter from an HTTP query string.
+static std::string queryParam(const std::string& path, const std::string& name)
+{
+	std::string::size_type pos = path.find('?');
+	while (pos != std::string::npos) {
+		pos++;
+		if (path.compare(pos, name.length() + 1, name + "=") == 0) {
+			pos += name.length() + 1;
+			return path.substr(pos, path.find('&', pos) - pos);
+		}
+		pos = path.find('&', pos);
+	}
+	return std::string();
+}
+
+Emulator::Emulator(const EmulatorConfig& config)
+	: config(config),
+	  sent(0),
+	  videoSent(0),
+	  load(0),
+	  lastSample(boost::posix_time::microsec_clock::universal_time()),
+	  lastSent(0)
+{
+	// Fill the first part of flash with pseudorandom data standing in for the
+	// bootloader, kernel and rootfs, and leave the rest erased.
+	std::string& flash = this->files["/dev/mtdblock0"];
+	flash.assign(config.flashSize, '\xFF');
+	unsigned long used = config.flashSize / 10 * 6;
+	unsigned long seed = 0x1234;
+	for (unsigned long i = 0; i < used; i++) {
+		seed = seed * 1103515245 + 12345;
+		flash[i] = (char)(seed >> 16);
+	}
+
+	std::stringstream ini;
+	ini << "[http]\r\nport=" << config.iniPort << "\r\n"
+		<< "[smtp]\r\nport=25\r\n"
+		<< "[usr]\r\nui=" << base64("usr=" + config.user + "\r\npwd="
+			+ config.pass + "\r\n") << "\r\n";
+	this->files["/tmp/eye/app/cs.ini"] = ini.str();
+
+	// Every file appears to have been written when the camera booted
+	std::string now = boost::posix_time::to_iso_string(
+		boost::posix_time::second_clock::universal_time());
+	this->modified = now.substr(0, 8) + now.substr(9, 6);
+}
+
+Emulator::~Emulator()
+{
+	this->stop();
+}
+
+void Emulator::start(const std::string& address, unsigned short portHTTP,
+	unsigned short portFTP, unsigned short portTelnet)
+{
+	boost::asio::ip::address addr = boost::asio::ip::address::from_string(address);
+	const char *names[] = {"http", "ftp", "telnet"};
+	unsigned short ports[] = {portHTTP, portFTP, portTelnet};
+	handler handlers[] = {&Emulator::serveHTTP, &Emulator::serveFTP,
+		&Emulator::serveTelnet};
+	for (int i = 0; i < 3; i++) {
+		acceptor_ptr acceptor(new boost::asio::ip::tcp::acceptor(this->io_service,
+			boost::asio::ip::tcp::endpoint(addr, ports[i])));
+		this->acceptors[names[i]] = acceptor;
+		this->accept(acceptor, handlers[i]);
+	}
+	this->acceptThread = boost::thread(
+		boost::bind(&boost::asio::io_service::run, &this->io_service));
+	return;
+}
+
+void Emulator::stop()
+{
+	if (this->acceptors.empty()) return;
+	this->io_service.stop();
+	this->acceptThread.join();
+	this->acceptors.clear();
+
+	// Kick off any clients still connected and wait for their threads to end
+	boost::mutex::scoped_lock guard(this->lock);
+	for (std::set<socket_ptr>::iterator i = this->clients.begin();
+		i != this->clients.end(); i++
+	) {
+		boost::system::error_code ignored;
+		(*i)->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+	}
+	while (!this->clients.empty()) this->idle.wait(guard);
+	return;
+}
+
+unsigned short Emulator::port(const std::string& service)
+{
+	std::map<std::string, acceptor_ptr>::iterator i = this->acceptors.find(service);
+	if (i == this->acceptors.end()) return 0;
+	return i->second->local_endpoint().port();
+}
+
+const std::string& Emulator::flash()
+{
+	boost::mutex::scoped_lock guard(this->filesLock);
+	return this->files["/dev/mtdblock0"];
+}
+
+void Emulator::accept(acceptor_ptr acceptor, handler fnHandler)
+{
+	socket_ptr socket(new boost::asio::ip::tcp::socket(this->io_service));
+	acceptor->async_accept(*socket, boost::bind(&Emulator::onAccept, this,
+		acceptor, fnHandler, socket, boost::asio::placeholders::error));
+	return;
+}
+
+void Emulator::onAccept(acceptor_ptr acceptor, handler fnHandler,
+	socket_ptr socket, const boost::system::error_code& error)
+{
+	if (error) return;
+	{
+		boost::mutex::scoped_lock guard(this->lock);
+		this->clients.insert(socket);
+	}
+	boost::thread(boost::bind(&Emulator::run, this, fnHandler, socket)).detach();
+	this->accept(acceptor, fnHandler);
+	return;
+}
+
+void Emulator::run(handler fnHandler, socket_ptr socket)
+{
+	try {
+		(this->*fnHandler)(socket);
+	} catch (const boost::system::system_error& e) {
+		// Client went away
+	}
+	boost::system::error_code ignored;
+	socket->close(ignored);
+
+	boost::mutex::scoped_lock guard(this->lock);
+	this->clients.erase(socket);
+	if (this->clients.empty()) this->idle.notify_all();
+	return;
+}
+
+void Emulator::send(boost::asio::ip::tcp::socket& socket,
+	const std::string& data, unsigned int *seed)
+{
+	if (this->config.latency) {
+		boost::this_thread::sleep(boost::posix_time::milliseconds(this->config.latency));
+	}
+	if (
+		(this->config.bandwidth == 0) && (this->config.loss == 0)
+		&& (this->config.busyRate == 0)
+	) {
+		boost::asio::write(socket, boost::asio::buffer(data));
+		boost::mutex::scoped_lock guard(this->statsLock);
+		this->sent += data.length();
+		return;
+	}
+
+	// Send in small chunks, pausing as needed to keep to the bandwidth limit
+	std::string::size_type chunk = SEGMENT_SIZE * 8;
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	unsigned long penalty = 0; // ms of retransmit delays so far
+	for (std::string::size_type pos = 0; pos < data.length(); pos += chunk) {
+		std::string::size_type len = std::min(chunk, data.length() - pos);
+		for (std::string::size_type s = 0; s < len; s += SEGMENT_SIZE) {
+			if ((double)rand_r(seed) / RAND_MAX < this->config.loss) {
+				penalty += RETRANSMIT_MS;
+			}
+		}
+		unsigned long ms = penalty;
+		if (this->config.bandwidth) {
+			ms += (unsigned long)((pos + len) * 1000.0 / this->config.bandwidth);
+		}
+		boost::posix_time::ptime due = start + boost::posix_time::milliseconds(ms);
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		if (due > now) boost::this_thread::sleep(due - now);
+		boost::asio::write(socket, boost::asio::buffer(data.data() + pos, len));
+		boost::mutex::scoped_lock guard(this->statsLock);
+		this->sent += len;
+	}
+	return;
+}
+
+void Emulator::serveHTTP(socket_ptr socket)
+{
+	unsigned int seed = (unsigned long)socket.get();
+	boost::asio::streambuf request;
+	boost::asio::read_until(*socket, request, "\r\n\r\n");
+	std::istream request_stream(&request);
+	std::string method, path;
+	request_stream >> method >> path;
+
+	std::string status = "200 OK", type = "text/html", body;
+	std::string::size_type query = path.find('?');
+	std::string file = path.substr(0, query);
+	if (file.compare("/") == 0) {
+		body = "<html><head><title>IPCamera</title></head><body></body></html>";
+	} else if (file.compare("/sysinfo.xml") == 0) {
+		type = "text/xml";
+		if (
+			(queryParam(path, "user").compare(this->config.user) == 0)
+			&& (queryParam(path, "password").compare(this->config.pass) == 0)
+		) {
+			body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+				"<Result><Success>1</Success><Board>MIPS</Board>"
+				"<Version>2.0.1.8</Version></Result>\r\n";
+		} else {
+			body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+				"<Result><Success>0</Success>"
+				"<ErrorCode>eHttpError_No_Auth</ErrorCode></Result>\r\n";
+		}
+	} else {
+		status = "404 Not Found";
+		body = "<html><body>404 Not Found</body></html>";
+	}
+
+	std::stringstream response;
+	response << "HTTP/1.0 " << status << "\r\n"
+		<< "Server: WebServer(IPCamera_Logo)\r\n"
+		<< "Content-Type: " << type << "\r\n"
+		<< "Content-Length: " << body.length() << "\r\n"
+		<< "Connection: close\r\n\r\n"
+		<< body;
+	this->send(*socket, response.str(), &seed);
+	return;
+}
+
+void Emulator::serveFTP(socket_ptr socket)
+{
+	unsigned int seed = (unsigned long)socket.get();
+	boost::asio::streambuf request;
+	std::istream request_stream(&request);
+	std::string cwd = "/";
+	bool loggedIn = false;
+	std::string user;
+	acceptor_ptr pasv;
+
+	this->send(*socket, "220 MayGion FTP server (GNU inetutils 1.4.1) ready.\r\n",
+		&seed);
+	for (;;) {
+		boost::asio::read_until(*socket, request, "\r\n");
+		std::string line;
+		std::getline(request_stream, line);
+		if (!line.empty() && (line[line.length() - 1] == '\r')) {
+			line.erase(line.length() - 1);
+		}
+		std::string::size_type space = line.find(' ');
+		std::string cmd = line.substr(0, space);
+		std::string arg = (space == std::string::npos) ? std::string()
+			: line.substr(space + 1);
+
+		if (cmd.compare("USER") == 0) {
+			user = arg;
+			this->send(*socket, "331 Password required for " + arg + ".\r\n", &seed);
+
+		} else if (cmd.compare("PASS") == 0) {
+			if ((user.compare("MayGion") == 0) && (arg.compare("maygion.com") == 0)) {
+				loggedIn = true;
+				this->send(*socket, "230 User " + user + " logged in.\r\n", &seed);
+			} else {
+				this->send(*socket, "530 Login incorrect.\r\n", &seed);
+			}
+
+		} else if (cmd.compare("QUIT") == 0) {
+			this->send(*socket, "221 Goodbye.\r\n", &seed);
+			return;
+
+		} else if (!loggedIn) {
+			this->send(*socket, "530 Please login with USER and PASS.\r\n", &seed);
+
+		} else if (cmd.compare("TYPE") == 0) {
+			this->send(*socket, "200 Type set to " + arg + ".\r\n", &seed);
+
+		} else if (cmd.compare("PASV") == 0) {
+			boost::asio::ip::address addr = socket->local_endpoint().address();
+			pasv.reset(new boost::asio::ip::tcp::acceptor(this->io_service,
+				boost::asio::ip::tcp::endpoint(addr, 0)));
+			unsigned short port = pasv->local_endpoint().port();
+			boost::asio::ip::address_v4::bytes_type ip = addr.to_v4().to_bytes();
+			std::stringstream reply;
+			reply << "227 Entering Passive Mode (" << (int)ip[0] << ',' << (int)ip[1]
+				<< ',' << (int)ip[2] << ',' << (int)ip[3] << ',' << (port >> 8) << ','
+				<< (port & 0xFF) << ")\r\n";
+			this->send(*socket, reply.str(), &seed);
+
+		} else if (cmd.compare("CWD") == 0) {
+			std::string dir = arg;
+			if (dir.empty() || (dir[dir.length() - 1] != '/')) dir += '/';
+			bool found = false;
+			boost::mutex::scoped_lock guard(this->filesLock);
+			for (std::map<std::string, std::string>::const_iterator i = this->files.begin();
+				i != this->files.end(); i++
+			) {
+				if (i->first.compare(0, dir.length(), dir) == 0) found = true;
+			}
+			if (found) {
+				cwd = dir;
+				this->send(*socket, "250 CWD command successful.\r\n", &seed);
+			} else {
+				this->send(*socket, "550 " + arg + ": No such file or directory.\r\n",
+					&seed);
+			}
+
+		} else if ((cmd.compare("SIZE") == 0) || (cmd.compare("MDTM") == 0)) {
+			boost::mutex::scoped_lock guard(this->filesLock);
+			std::map<std::string, std::string>::const_iterator file
+				= this->files.find((!arg.empty() && (arg[0] == '/')) ? arg : cwd + arg);
+			if (file == this->files.end()) {
+				this->send(*socket, "550 " + arg + ": No such file or directory.\r\n",
+					&seed);
+			} else {
+				std::stringstream reply;
+				reply << "213 ";
+				if (cmd.compare("SIZE") == 0) {
+					reply << file->second.length();
+				} else {
+					reply << this->modified;
+				}
+				reply << "\r\n";
+				this->send(*socket, reply.str(), &seed);
+			}
+
+		} else if (cmd.compare("RETR") == 0) {
+			bool found;
+			std::string content;
+			{
+				boost::mutex::scoped_lock guard(this->filesLock);
+				std::map<std::string, std::string>::const_iterator file
+					= this->files.find(cwd + arg);
+				found = file != this->files.end();
+				if (found) content = file->second;
+			}
+			if (!found) {
+				this->send(*socket, "550 " + arg + ": No such file or directory.\r\n",
+					&seed);
+			} else if (!pasv) {
+				this->send(*socket, "425 Can't open data connection.\r\n", &seed);
+			} else {
+				boost::asio::ip::tcp::socket data(this->io_service);
+				pasv->accept(data);
+				pasv.reset();
+				// The camera has little memory to spare for socket buffers
+				data.set_option(boost::asio::socket_base::send_buffer_size(65536));
+				this->send(*socket, "150 Opening BINARY mode data connection.\r\n",
+					&seed);
+				this->send(data, content, &seed);
+				data.close();
+				this->send(*socket, "226 Transfer complete.\r\n", &seed);
+			}
+
+		} else if (cmd.compare("STOR") == 0) {
+			if (!pasv) {
+				this->send(*socket, "425 Can't open data connection.\r\n", &seed);
+			} else {
+				boost::asio::ip::tcp::socket data(this->io_service);
+				pasv->accept(data);
+				pasv.reset();
+				this->send(*socket, "150 Opening BINARY mode data connection.\r\n",
+					&seed);
+				// The client closes the data connection at the end of the file
+				std::string content;
+				char buffer[65536];
+				boost::system::error_code ec;
+				while (!ec) {
+					std::size_t len = data.read_some(boost::asio::buffer(buffer), ec);
+					content.append(buffer, len);
+				}
+				data.close();
+				if (ec != boost::asio::error::eof) {
+					this->send(*socket, "426 Connection closed; transfer aborted.\r\n",
+						&seed);
+				} else {
+					{
+						boost::mutex::scoped_lock guard(this->filesLock);
+						this->files[cwd + arg] = content;
+					}
+					this->send(*socket, "226 Transfer complete.\r\n", &seed);
+				}
+			}
+
+		} else {
+			this->send(*socket, "502 " + cmd + " command not implemented.\r\n",
+				&seed);
+		}
+	}
+}
+
+void Emulator::serveTelnet(socket_ptr socket)
+{
+	unsigned int seed = (unsigned long)socket.get();
+	boost::asio::streambuf request;
+	std::istream request_stream(&request);
+
+	this->send(*socket, "\r\n\r\nBusyBox v1.12.1 (2011-05-23 14:12:11 CST) "
+		"built-in shell (ash)\r\nEnter 'help' for a list of built-in commands."
+		"\r\n\r\n" PROMPT, &seed);
+	for (;;) {
+		boost::asio::read_until(*socket, request, "\r\n");
+		std::string line;
+		std::getline(request_stream, line);
+		if (!line.empty() && (line[line.length() - 1] == '\r')) {
+			line.erase(line.length() - 1);
+		}
+		if (line.find_first_of("\x03\x1A") != std::string::npos) return;
+
+		// Echo the command back as the terminal would, then run it
+		this->send(*socket, line + "\r\n" + this->shell(line) + PROMPT, &seed);
+	}
+}
+
+std::string Emulator::shell(const std::string& cmd)
+{
+	std::stringstream out;
+	std::string::size_type pos;
+	if (cmd.empty()) {
+		// Nothing to do
+
+	} else if ((pos = cmd.find("; ")) != std::string::npos) {
+		// Separate statements, as the order of operands to + is unspecified
+		std::string first = this->shell(cmd.substr(0, pos));
+		return first + this->shell(cmd.substr(pos + 2));
+
+	} else if ((pos = cmd.find(" | ")) != std::string::npos) {
+		// cksum is the only filter anything pipes into
+		std::string input = this->shell(cmd.substr(0, pos));
+		std::string filter = cmd.substr(pos + 3);
+		if (filter.compare("cksum") == 0) {
+			out << posix_cksum(input.data(), input.length()) << ' '
+				<< input.length() << "\r\n";
+		} else {
+			out << "-sh: " << filter.substr(0, filter.find(' ')) << ": not found\r\n";
+		}
+
+	} else if (cmd.find("/idVendor") != std::string::npos) {
+		// idVendor, idProduct and bInterfaceClass of the UVC image sensor
+		out << "0c45\r\n6360\r\n0e\r\n";
+
+	} else if (cmd.compare(0, 4, "cat ") == 0) {
+		std::stringstream args(cmd.substr(4));
+		std::string name;
+		while (args >> name) {
+			if (!this->procFile(name, out)) {
+				out << "cat: can't open '" << name << "': No such file or directory\r\n";
+			}
+		}
+
+	} else if (cmd.compare(0, 6, "cksum ") == 0) {
+		std::stringstream args(cmd.substr(6));
+		std::string name;
+		boost::mutex::scoped_lock guard(this->filesLock);
+		while (args >> name) {
+			std::map<std::string, std::string>::const_iterator file
+				= this->files.find(deviceFile(name));
+			if (file == this->files.end()) {
+				out << "cksum: " << name << ": No such file or directory\r\n";
+			} else {
+				out << posix_cksum(file->second.data(), file->second.length()) << ' '
+					<< file->second.length() << ' ' << name << "\r\n";
+			}
+		}
+
+	} else if (cmd.compare(0, 3, "rm ") == 0) {
+		std::stringstream args(cmd.substr(3));
+		std::string name;
+		boost::mutex::scoped_lock guard(this->filesLock);
+		while (args >> name) {
+			if (this->files.erase(name) == 0) {
+				out << "rm: cannot remove '" << name << "': No such file or directory\r\n";
+			}
+		}
+
+	} else if (cmd.compare(0, 3, "dd ") == 0) {
+		out << this->dd(cmd.substr(3));
+
+	} else if (cmd.compare(0, 5, "echo ") == 0) {
+		// Only empty quotes are used, to keep the echoed line distinct
+		std::string text = cmd.substr(5);
+		text.erase(std::remove(text.begin(), text.end(), '"'), text.end());
+		out << text << "\r\n";
+
+	} else if (cmd.compare(0, 3, "sh ") == 0) {
+		std::string name = cmd.substr(3), script;
+		{
+			boost::mutex::scoped_lock guard(this->filesLock);
+			std::map<std::string, std::string>::const_iterator file
+				= this->files.find(deviceFile(name));
+			if (file == this->files.end()) {
+				return "sh: can't open '" + name + "': No such file or directory\r\n";
+			}
+			script = file->second;
+		}
+		std::istringstream lines(script);
+		std::string line;
+		while (std::getline(lines, line)) out << this->shell(line);
+
+	} else {
+		out << "-sh: " << cmd.substr(0, cmd.find(' ')) << ": not found\r\n";
+	}
+	return out.str();
+}
+
+std::string Emulator::dd(const std::string& cmd)
+{
+	std::stringstream args(cmd);
+	std::string arg, in, of;
+	unsigned long bs = 512, skip = 0, seek = 0, count = (unsigned long)-1;
+	while (args >> arg) {
+		std::string::size_type eq = arg.find('=');
+		if (eq == std::string::npos) continue; // redirection
+		std::string key = arg.substr(0, eq);
+		std::string value = arg.substr(eq + 1);
+		unsigned long n = strtoul(value.c_str(), NULL, 10);
+		if (key.compare("if") == 0) in = deviceFile(value);
+		else if (key.compare("of") == 0) of = deviceFile(value);
+		else if (key.compare("bs") == 0) bs = n;
+		else if (key.compare("skip") == 0) skip = n;
+		else if (key.compare("seek") == 0) seek = n;
+		else if (key.compare("count") == 0) count = n;
+	}
+
+	boost::mutex::scoped_lock guard(this->filesLock);
+	std::map<std::string, std::string>::const_iterator src = this->files.find(in);
+	if (src == this->files.end()) {
+		return "dd: can't open '" + in + "': No such file or directory\r\n";
+	}
+	std::string data;
+	if (skip * bs < src->second.length()) {
+		data = src->second.substr(skip * bs,
+			(count == (unsigned long)-1) ? std::string::npos : count * bs);
+	}
+	if (of.empty()) return data;
+
+	std::string& dst = this->files[of];
+	if (dst.length() < seek * bs + data.length()) {
+		dst.resize(seek * bs + data.length(), '\0');
+	}
+	dst.replace(seek * bs, data.length(), data);
+	return std::string();
+}
+
+std::string Emulator::deviceFile(const std::string& name)
+{
+	// Both devices are the same flash, only the caching differs on a real camera
+	if (name.compare(0, 8, "/dev/mtd") == 0) {
+		std::string num = name.substr(name.compare(0, 13, "/dev/mtdblock") == 0 ? 13 : 8);
+		return "/dev/mtdblock" + num;
+	}
+	return name;
+}
+
+bool Emulator::procFile(const std::string& name, std::ostream& out)
+{
+	if (name.compare("/proc/mtd") == 0) {
+		out << std::hex << std::setfill('0')
+			<< "dev:    size   erasesize  name\r\n"
+			<< "mtd0: " << std::setw(8) << this->config.flashSize
+			<< ' ' << std::setw(8) << this->config.eraseSize
+			<< " \"spi_flash\"\r\n" << std::dec;
+
+	} else if (name.compare("/proc/loadavg") == 0) {
+		boost::mutex::scoped_lock guard(this->statsLock);
+		this->updateLoad();
+		out << std::fixed << std::setprecision(2) << this->load << ' ' << this->load
+			<< ' ' << this->load << " 1/45 123\r\n";
+
+	} else if (name.compare("/proc/net/dev") == 0) {
+		boost::mutex::scoped_lock guard(this->statsLock);
+		this->updateLoad();
+		// The camera's kernel has 32-bit counters
+		unsigned long tx = (this->sent + (unsigned long)this->videoSent) & 0xFFFFFFFFUL;
+		out << "Inter-|   Receive                                                |  Transmit\r\n"
+			" face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\r\n"
+			"    lo:       0       0    0    0    0     0          0         0        0       0    0    0    0     0       0          0\r\n"
+			"  eth0:       0       0    0    0    0     0          0         0 "
+			<< std::setw(8) << std::setfill(' ') << tx
+			<< " " << std::setw(7) << tx / 1400
+			<< "    0    0    0     0       0          0\r\n";
+
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void Emulator::updateLoad()
+{
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+	double elapsed = (now - this->lastSample).total_microseconds() / 1000000.0;
+	if (elapsed < 0.1) return;
+
+	double busy = 0;
+	if (this->config.busyRate) {
+		busy = (this->sent - this->lastSent) / elapsed / this->config.busyRate;
+	}
+	this->load = 0.1 + busy;
+	if (busy < 1) this->videoSent += this->config.videoRate * elapsed * (1 - busy);
+	this->lastSample = now;
+	this->lastSent = this->sent;
+	return;
+}
@@ -0,0 +1,169 @@
+/**
+ * @file   emulator.hpp
+ * @brief  Local stand-in for a MayGion MIPS camera.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EMULATOR_HPP
+#define EMULATOR_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+/// Behaviour of the emulated camera and the link to it.
+struct EmulatorConfig
+{
+	/// Set everything to defaults matching a real 4MB MayGion MIPS camera.
+	EmulatorConfig();
+
+	unsigned int latency;     ///< Milliseconds of delay before each reply
+	unsigned long bandwidth;  ///< Bytes/sec per connection, 0 for unlimited
+	double loss;              ///< Chance (0-1) of each segment needing resending
+	unsigned long flashSize;  ///< Size of /dev/mtdblock0 in bytes
+	unsigned long eraseSize;  ///< Flash erase block size in bytes
+	std::string user;         ///< Web interface username stored in cs.ini
+	std::string pass;         ///< Web interface password stored in cs.ini
+	unsigned short iniPort;   ///< HTTP port listed in cs.ini
+	unsigned long busyRate;   ///< Bytes/sec sent at which the CPU is fully loaded, 0 for never
+	unsigned long videoRate;  ///< Bytes/sec of video streamed while the CPU is idle
+};
+
+/// Emulated camera serving HTTP, FTP and telnet on local ports.
+/**
+ * Each connection is handled by its own thread using blocking I/O, which is
+ * close enough to the camera's own behaviour and keeps the protocol code easy
+ * to follow.  Loss is emulated by the delay a TCP retransmit would cause
+ * rather than by dropping data.
+ */
+class Emulator
+{
+	public:
+		Emulator(const EmulatorConfig& config);
+		~Emulator();
+
+		/// Begin listening for connections.
+		/**
+		 * @param address
+		 *   IP address to listen on.
+		 *
+		 * @param portHTTP
+		 *   Port for the web server, or 0 to pick any free port.
+		 *
+		 * @param portFTP
+		 *   Port for the FTP server, or 0 to pick any free port.
+		 *
+		 * @param portTelnet
+		 *   Port for the telnet server, or 0 to pick any free port.
+		 */
+		void start(const std::string& address, unsigned short portHTTP,
+			unsigned short portFTP, unsigned short portTelnet);
+
+		/// Stop listening and disconnect any open connections.
+		void stop();
+
+		/// Get the port a service is listening on.
+		/**
+		 * @param service
+		 *   "http", "ftp" or "telnet".
+		 *
+		 * @return The port number, or 0 if the service name is unknown.
+		 */
+		unsigned short port(const std::string& service);
+
+		/// Get the emulated flash content.
+		/**
+		 * @return The data returned when /dev/mtdblock0 is downloaded.
+		 */
+		const std::string& flash();
+
+	private:
+		typedef boost::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+		typedef boost::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor_ptr;
+		typedef void (Emulator::*handler)(socket_ptr);
+
+		EmulatorConfig config;
+		boost::mutex filesLock;       ///< Protects files
+		std::map<std::string, std::string> files; ///< Files available via FTP
+		std::string modified; ///< Modification time of every file, for MDTM
+
+		boost::asio::io_service io_service;
+		std::map<std::string, acceptor_ptr> acceptors;
+		boost::thread acceptThread;
+
+		boost::mutex lock;            ///< Protects clients
+		boost::condition_variable idle; ///< Signalled when clients is empty
+		std::set<socket_ptr> clients; ///< Connections currently being handled
+
+		void accept(acceptor_ptr acceptor, handler fnHandler);
+		void onAccept(acceptor_ptr acceptor, handler fnHandler, socket_ptr socket,
+			const boost::system::error_code& error);
+		void run(handler fnHandler, socket_ptr socket);
+
+		void serveHTTP(socket_ptr socket);
+		void serveFTP(socket_ptr socket);
+		void serveTelnet(socket_ptr socket);
+
+		boost::mutex statsLock;       ///< Protects the fields below
+		unsigned long sent;           ///< Bytes sent on all connections
+		double videoSent;             ///< Bytes of emulated video sent
+		double load;                  ///< Current load average
+		boost::posix_time::ptime lastSample;
+		unsigned long lastSent;
+
+		/// Run a shell command typed over telnet and return its output.
+		std::string shell(const std::string& cmd);
+
+		/// Run dd, copying between files.
+		/**
+		 * @param cmd
+		 *   The arguments after "dd ".
+		 *
+		 * @return What dd writes to stdout: the data if there is no of=,
+		 *   otherwise nothing.
+		 */
+		std::string dd(const std::string& cmd);
+
+		/// Get the name a device is kept under in files.
+		/**
+		 * /dev/mtdN and /dev/mtdblockN are both kept as /dev/mtdblockN.
+		 */
+		static std::string deviceFile(const std::string& name);
+
+		/// Get the content of a file in /proc.
+		/**
+		 * @return true if the file exists, false if not.
+		 */
+		bool procFile(const std::string& name, std::ostream& out);
+
+		/// Work out the load and video traffic from how much data is being sent.
+		/**
+		 * The load rises with the rate data is sent, reaching 1.0 at busyRate,
+		 * and the video stream loses whatever share of the CPU is in use.
+		 * Must be called with statsLock held.
+		 */
+		void updateLoad();
+
+		/// Send data, applying the configured latency, bandwidth and loss.
+		void send(boost::asio::ip::tcp::socket& socket, const std::string& data,
+			unsigned int *seed);
+};
+
+#endif // EMULATOR_HPP
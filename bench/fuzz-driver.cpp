@@ -0,0 +1,123 @@
+/**
+ * @file   fuzz-driver.cpp
+ * @brief  Standalone runner for libFuzzer-style fuzz targets.
+ *
+ * This allows the fuzz targets to be run without clang/libFuzzer.  Given
+ * files on the command line, each one is passed to the target once (e.g. to
+ * reproduce a crash).  Otherwise the built-in seeds are repeatedly mutated
+ * and passed to the target.  Build with -fsanitize=address,undefined to catch
+ * memory errors that don't cause an immediate crash.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "samples.hpp"
+
+#define PROGNAME "fuzz-driver"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/// Bytes that are likely to change the path taken through the parsers.
+static const char interesting[] = "\r\n\0 ,:=()[]\"#0129afAF/+";
+
+/// Apply a random change to the input.
+static void mutate(std::string *data, unsigned int *seed)
+{
+	unsigned int pos = data->empty() ? 0 : rand_r(seed) % data->length();
+	switch (rand_r(seed) % 6) {
+		case 0: // flip a bit
+			if (!data->empty()) (*data)[pos] ^= 1 << (rand_r(seed) % 8);
+			break;
+		case 1: // replace a byte
+			if (!data->empty()) (*data)[pos] = rand_r(seed) & 0xFF;
+			break;
+		case 2: // insert an interesting byte
+			data->insert(pos, 1, interesting[rand_r(seed) % (sizeof(interesting) - 1)]);
+			break;
+		case 3: // delete a range
+			data->erase(pos, rand_r(seed) % 8 + 1);
+			break;
+		case 4: // truncate
+			data->resize(pos);
+			break;
+		case 5: // duplicate a range
+			data->insert(pos, data->substr(pos, rand_r(seed) % 16 + 1));
+			break;
+	}
+	return;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = 200000;
+	unsigned int seed = 1;
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-runs=", 6) == 0) {
+			iterations = strtoul(argv[i] + 6, NULL, 10);
+		} else if (strncmp(argv[i], "-seed=", 6) == 0) {
+			seed = strtoul(argv[i] + 6, NULL, 10);
+		} else if (argv[i][0] == '-') {
+			std::cerr << "Usage: " << argv[0] << " [-runs=N] [-seed=N] [file...]"
+				<< std::endl;
+			return 1;
+		} else {
+			files.push_back(argv[i]);
+		}
+	}
+
+	if (!files.empty()) {
+		for (std::vector<std::string>::const_iterator i = files.begin(); i != files.end(); i++) {
+			std::ifstream file(i->c_str(), std::ios::binary);
+			std::stringstream content;
+			content << file.rdbuf();
+			std::string data = content.str();
+			std::cerr << "Running " << *i << std::endl;
+			LLVMFuzzerTestOneInput((const uint8_t *)data.data(), data.length());
+		}
+		return 0;
+	}
+
+	std::vector<std::string> corpus;
+	corpus.push_back(SAMPLE_PASV);
+	corpus.push_back(SAMPLE_HTTP_STATUS);
+	corpus.push_back(SAMPLE_HTTP_HEADERS);
+	corpus.push_back(SAMPLE_PROC_MTD);
+	corpus.push_back(SAMPLE_PROC_LOAD_NET);
+	corpus.push_back(SAMPLE_CS_INI);
+	corpus.push_back(std::string());
+
+	std::cerr << PROGNAME ": " << iterations << " runs, seed " << seed << std::endl;
+	for (unsigned long i = 0; i < iterations; i++) {
+		std::string data = corpus[rand_r(&seed) % corpus.size()];
+		unsigned int count = rand_r(&seed) % 8 + 1;
+		for (unsigned int m = 0; m < count; m++) mutate(&data, &seed);
+		LLVMFuzzerTestOneInput((const uint8_t *)data.data(), data.length());
+
+		// Keep some mutations around so changes can build on each other
+		if ((i % 64 == 0) && (corpus.size() < 1024)) corpus.push_back(data);
+	}
+	std::cerr << PROGNAME ": done, no crashes" << std::endl;
+	return 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file   fuzz-parse.cpp
+ * @brief  Fuzz target for the protocol and config parsers.
+ *
+ * This uses the libFuzzer entry point, so it can be built with clang's
+ * -fsanitize=fuzzer, or linked with fuzz-driver.cpp to run anywhere.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../src/analyse.hpp"
+#include "../src/parse.hpp"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	std::string input((const char *)data, size);
+
+	unsigned short port16;
+	parse_pasv(input, &port16);
+
+	unsigned int status;
+	parse_http_status(input, &status);
+	parse_http_headers(input);
+
+	unsigned long first, last, total;
+	parse_content_range(input, &first, &last, &total);
+
+	std::vector<MTDPartition> parts;
+	parse_proc_mtd(input, &parts);
+
+	double load;
+	parse_loadavg(input, &load);
+
+	std::vector<NetDevice> devs;
+	parse_proc_net_dev(input, &devs);
+
+	base64_decode(input);
+
+	unsigned int port;
+	std::string user, pass;
+	parse_cs_ini(input, &port, &user, &pass);
+
+	IniFile ini;
+	parse_ini(input, &ini);
+
+	std::map<std::string, std::string> vars;
+	parse_cgi_vars(input, &vars);
+
+	FirmwareLayout layout;
+	analyseFirmware((const char *)data, size, &layout);
+
+	return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file   samples.hpp
+ * @brief  Typical device responses, used as benchmark input and fuzz seeds.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SAMPLES_HPP
+#define SAMPLES_HPP
+
+#include <string>
+
+/// Reply to the FTP PASV command.
+#define SAMPLE_PASV "227 Entering Passive Mode (192,168,1,10,195,80)\r\n"
+
+/// HTTP status line from the camera's web server.
+#define SAMPLE_HTTP_STATUS "HTTP/1.0 200 OK\r\n"
+
+/// HTTP headers from the camera's web server.
+#define SAMPLE_HTTP_HEADERS \
+	"Server: WebServer(IPCamera_Logo)\r\n" \
+	"Date: Tue, 05 Mar 2013 10:21:43 GMT\r\n" \
+	"Content-Type: text/html\r\n" \
+	"Content-Length: 1873\r\n" \
+	"Cache-Control: no-cache\r\n" \
+	"Pragma: no-cache\r\n" \
+	"Expires: 0\r\n" \
+	"Connection: close\r\n" \
+	"\r\n"
+
+/// Output of "cat /proc/mtd" on a MayGion MIPS camera.
+#define SAMPLE_PROC_MTD \
+	"dev:    size   erasesize  name\r\n" \
+	"mtd0: 00400000 00010000 \"spi_flash\"\r\n" \
+	"mtd1: 00030000 00010000 \"boot\"\r\n" \
+	"mtd2: 00100000 00010000 \"kernel\"\r\n" \
+	"mtd3: 00280000 00010000 \"rootfs\"\r\n" \
+	"mtd4: 00020000 00010000 \"config\"\r\n"
+
+/// Output of "cat /proc/loadavg /proc/net/dev" on a MayGion MIPS camera.
+#define SAMPLE_PROC_LOAD_NET \
+	"0.52 0.48 0.40 1/45 123\r\n" \
+	"Inter-|   Receive                                                |  Transmit\r\n" \
+	" face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\r\n" \
+	"    lo:    1680      20    0    0    0     0          0         0     1680      20    0    0    0     0       0          0\r\n" \
+	"  eth0:28617452  182733    0    0    0     0          0       412 3796542817 2714983    0    0    0     0       0          0\r\n"
+
+/// /tmp/eye/app/cs.ini from a MayGion MIPS camera ("usr=admin", "pwd=secret").
+#define SAMPLE_CS_INI \
+	"[network]\r\ndhcp=0\r\nip=192.168.1.10\r\nmask=255.255.255.0\r\n" \
+	"gateway=192.168.1.1\r\ndns1=192.168.1.1\r\ndns2=0.0.0.0\r\n" \
+	"[http]\r\nport=81\r\n" \
+	"[smtp]\r\nserver=mail.example.com\r\nport=25\r\nuser=\r\npassword=\r\n" \
+	"[ftp]\r\nserver=\r\nport=21\r\nuser=\r\npassword=\r\npath=/\r\n" \
+	"[ddns]\r\nenable=0\r\nprovider=0\r\nhost=\r\nuser=\r\npassword=\r\n" \
+	"[video]\r\nresolution=640x480\r\nfps=25\r\nbrightness=128\r\n" \
+	"contrast=128\r\nsaturation=128\r\n" \
+	"[usr]\r\nui=dXNyPWFkbWluDQpwd2Q9c2VjcmV0DQo=\r\n" \
+	"[alarm]\r\nmotion=0\r\nsensitivity=5\r\nemail=0\r\nftp=0\r\n"
+
+#endif // SAMPLES_HPP
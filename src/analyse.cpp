@@ -0,0 +1,497 @@
+/**
+ * @file   analyse.cpp
+ * @brief  Find the parts of a firmware image without a device to ask.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "analyse.hpp"
+#include "fileutil.hpp"
+#include "sparse.hpp"
+
+/// Size of a U-Boot image header.
+#define UIMAGE_HEADER_LEN 64
+
+/// Smallest and largest U-Boot environment looked for.
+#define UBOOT_ENV_MIN 0x1000
+#define UBOOT_ENV_MAX 0x20000
+
+/// Longest version string kept.
+#define VERSION_MAX_LEN 128
+
+/// First two bytes of each header looked for.
+static const unsigned char prefixes[][2] = {
+	{0x27, 0x05},  // uImage
+	{'h', 's'},    // squashfs, little endian
+	{'s', 'q'},    // squashfs, big endian
+	{0x85, 0x19},  // jffs2, little endian
+	{0x19, 0x85},  // jffs2, big endian
+	{0x1f, 0x8b},  // gzip
+	{0x5d, 0x00},  // lzma
+	{'U', '-'},    // "U-Boot " version
+	{'L', 'i'},    // "Linux version "
+};
+
+#define NUM_PREFIXES (sizeof(prefixes) / sizeof(prefixes[0]))
+
+/// Copy a printable string, stopping at the first byte that isn't.
+static std::string printable(const unsigned char *p, size_t max)
+{
+	std::string s;
+	while ((s.length() < max) && (p[s.length()] >= 0x20) && (p[s.length()] < 0x7F)) {
+		s += p[s.length()];
+	}
+	return s;
+}
+
+const char *firmwarePartName(FirmwarePart::Type type)
+{
+	switch (type) {
+		case FirmwarePart::UImage: return "uimage";
+		case FirmwarePart::SquashFS: return "squashfs";
+		case FirmwarePart::JFFS2: return "jffs2";
+		case FirmwarePart::Gzip: return "gzip";
+		case FirmwarePart::LZMA: return "lzma";
+		case FirmwarePart::UBootEnv: return "uboot-env";
+	}
+	return "unknown";
+}
+
+std::string firmwarePartLabel(const FirmwarePart& part)
+{
+	char offset[20];
+	snprintf(offset, sizeof(offset), "-0x%08llx", (unsigned long long)part.offset);
+	return firmwarePartName(part.type) + std::string(offset);
+}
+
+/// State kept while walking through the candidates in order.
+struct Scanner
+{
+	const unsigned char *data;
+	size_t len;
+	FirmwareLayout *layout;
+	uint64_t skipUntil;    ///< End of the last part whose length is known
+	bool inJFFS2;          ///< Last part is a run of JFFS2 nodes still going
+
+	void add(FirmwarePart::Type type, uint64_t offset, uint64_t length,
+		const std::string& detail)
+	{
+		FirmwarePart part;
+		part.type = type;
+		part.offset = offset;
+		part.length = length;
+		part.detail = detail;
+		this->layout->parts.push_back(part);
+		if (length) this->skipUntil = offset + length;
+		this->inJFFS2 = false;
+		return;
+	}
+
+	void addVersion(size_t pos, size_t prefixLen)
+	{
+		if ((pos + prefixLen >= this->len) || !isdigit(this->data[pos + prefixLen])) return;
+		std::string v = printable(this->data + pos,
+			std::min<size_t>(VERSION_MAX_LEN, this->len - pos));
+		std::vector<std::string>& versions = this->layout->versions;
+		if (std::find(versions.begin(), versions.end(), v) == versions.end()) {
+			versions.push_back(v);
+		}
+		return;
+	}
+
+	void checkUImage(size_t pos)
+	{
+		const unsigned char *p = this->data + pos;
+		if ((this->len - pos < UIMAGE_HEADER_LEN) || (get32be(p) != 0x27051956)) return;
+		unsigned char header[UIMAGE_HEADER_LEN];
+		memcpy(header, p, sizeof(header));
+		memset(header + 4, 0, 4);
+		if (crc32(0, header, sizeof(header)) != get32be(p + 4)) return;
+
+		static const char *comp[] = {"none", "gzip", "bzip2", "lzma", "lzo", "lz4", "zstd"};
+		std::string detail = printable(p + 32, 32);
+		if (p[31] < sizeof(comp) / sizeof(comp[0])) {
+			detail += std::string(" (") + comp[p[31]] + ")";
+		}
+		uint64_t length = UIMAGE_HEADER_LEN + (uint64_t)get32be(p + 12);
+		this->add(FirmwarePart::UImage, pos, length, detail);
+		return;
+	}
+
+	void checkSquashFS(size_t pos, bool bigEndian)
+	{
+		const unsigned char *p = this->data + pos;
+		if (this->len - pos < 96) return;
+		uint16_t (*get16)(const unsigned char *) = bigEndian ? get16be : get16le;
+		uint64_t (*get64)(const unsigned char *) = bigEndian ? get64be : get64le;
+		if (memcmp(p, bigEndian ? "sqsh" : "hsqs", 4) != 0) return;
+
+		uint16_t major = get16(p + 28), minor = get16(p + 30);
+		uint64_t length = 0;
+		std::ostringstream detail;
+		detail << "v" << major << "." << minor;
+		if (major == 4) {
+			static const char *comp[] = {"", "gzip", "lzma", "lzo", "xz", "lz4", "zstd"};
+			uint16_t c = get16(p + 20);
+			if ((c == 0) || (c >= sizeof(comp) / sizeof(comp[0]))) return;
+			detail << " " << comp[c];
+			length = get64(p + 40);
+		} else if (major == 3) {
+			length = get64(p + 63);
+		} else if ((major < 1) || (major > 4)) {
+			return;
+		}
+		if (length > this->len - pos) return;
+		this->add(FirmwarePart::SquashFS, pos, length, detail.str());
+		return;
+	}
+
+	void checkJFFS2(size_t pos, bool bigEndian)
+	{
+		const unsigned char *p = this->data + pos;
+		if ((pos & 3) || (this->len - pos < 12)) return;
+		uint16_t (*get16)(const unsigned char *) = bigEndian ? get16be : get16le;
+		uint32_t (*get32)(const unsigned char *) = bigEndian ? get32be : get32le;
+		if (get16(p) != 0x1985) return;
+		// JFFS2 uses the CRC-32 polynomial with no inversion, which is zlib's
+		// with the inversions undone
+		if ((~crc32(0xFFFFFFFF, p, 8) & 0xFFFFFFFF) != get32(p + 8)) return;
+		uint32_t totlen = get32(p + 4);
+		if ((totlen < 12) || (totlen > this->len - pos)) return;
+
+		uint64_t end = pos + ((totlen + 3) & ~3);
+		if (this->inJFFS2) {
+			// Another node in the same filesystem
+			FirmwarePart& last = this->layout->parts.back();
+			last.length = end - last.offset;
+			this->skipUntil = end;
+		} else {
+			this->add(FirmwarePart::JFFS2, pos, end - pos,
+				bigEndian ? "big endian" : "little endian");
+			this->inJFFS2 = true;
+		}
+		return;
+	}
+
+	void checkGzip(size_t pos)
+	{
+		const unsigned char *p = this->data + pos;
+		if (this->len - pos < 18) return;
+		// Deflate, no reserved flags, a known extra flag and OS
+		if ((p[2] != 0x08) || (p[3] & 0xE0)) return;
+		if ((p[8] != 0) && (p[8] != 2) && (p[8] != 4)) return;
+		if ((p[9] > 13) && (p[9] != 255)) return;
+		std::string detail;
+		if (p[3] & 0x08) {
+			// Original filename follows the header, unless there are extra fields
+			size_t nameAt = 10;
+			if (p[3] & 0x04) nameAt += 2 + get16le(p + 10);
+			if (nameAt < this->len - pos) {
+				detail = printable(p + nameAt, std::min<size_t>(64, this->len - pos - nameAt));
+			}
+		}
+		this->add(FirmwarePart::Gzip, pos, 0, detail);
+		return;
+	}
+
+	void checkLZMA(size_t pos)
+	{
+		const unsigned char *p = this->data + pos;
+		if (this->len - pos < 13) return;
+		// Properties byte 0x5d (lc=3 lp=0 pb=2), then a power of two
+		// dictionary size and a sensible (or unknown) uncompressed size
+		uint32_t dict = get32le(p + 1);
+		if ((dict < 0x10000) || (dict > 0x4000000) || (dict & (dict - 1))) return;
+		uint64_t size = get64le(p + 5);
+		if ((size != (uint64_t)-1) && (size > 0x10000000)) return;
+		std::ostringstream detail;
+		if (size != (uint64_t)-1) detail << "unpacks to " << size;
+		this->add(FirmwarePart::LZMA, pos, 0, detail.str());
+		return;
+	}
+
+	/// Check a position where one of the prefixes matched.
+	void check(size_t pos)
+	{
+		const unsigned char *p = this->data + pos;
+		if (p[0] == 'U') {
+			if (this->len - pos > 7 && memcmp(p, "U-Boot ", 7) == 0) this->addVersion(pos, 7);
+			return;
+		}
+		if (p[0] == 'L') {
+			if (this->len - pos > 14 && memcmp(p, "Linux version ", 14) == 0) this->addVersion(pos, 14);
+			return;
+		}
+		if (pos < this->skipUntil) return;
+		switch (p[0]) {
+			case 0x27: this->checkUImage(pos); break;
+			case 'h': this->checkSquashFS(pos, false); break;
+			case 's': this->checkSquashFS(pos, true); break;
+			case 0x85: this->checkJFFS2(pos, false); break;
+			case 0x19: this->checkJFFS2(pos, true); break;
+			case 0x1f: this->checkGzip(pos); break;
+			case 0x5d: this->checkLZMA(pos); break;
+		}
+		return;
+	}
+};
+
+/// Call Scanner::check() for every position where a prefix matches.
+static void scan(Scanner& s)
+{
+	const unsigned char *data = s.data;
+	size_t i = 0;
+#ifdef __SSE2__
+	// Compare sixteen positions against every prefix at once, using a second
+	// load one byte further on for the second byte of each prefix.
+	__m128i first[NUM_PREFIXES], second[NUM_PREFIXES];
+	for (unsigned int k = 0; k < NUM_PREFIXES; k++) {
+		first[k] = _mm_set1_epi8(prefixes[k][0]);
+		second[k] = _mm_set1_epi8(prefixes[k][1]);
+	}
+	for (; i + 17 <= s.len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(data + i + 1));
+		__m128i hit = _mm_setzero_si128();
+		for (unsigned int k = 0; k < NUM_PREFIXES; k++) {
+			hit = _mm_or_si128(hit, _mm_and_si128(_mm_cmpeq_epi8(a, first[k]),
+				_mm_cmpeq_epi8(b, second[k])));
+		}
+		unsigned int mask = _mm_movemask_epi8(hit);
+		while (mask) {
+			s.check(i + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i + 1 < s.len; i++) {
+		for (unsigned int k = 0; k < NUM_PREFIXES; k++) {
+			if ((data[i] == prefixes[k][0]) && (data[i + 1] == prefixes[k][1])) {
+				s.check(i);
+				break;
+			}
+		}
+	}
+	return;
+}
+
+/// Get the size of a U-Boot environment starting here.
+/**
+ * @param redundant
+ *   On return, true if the environment has the flag byte used when there are
+ *   two copies.
+ *
+ * @return The size whose CRC matches, or 0 if this is not an environment.
+ */
+static size_t ubootEnvSize(const unsigned char *p, size_t avail, bool *redundant)
+{
+	const unsigned char *end = p + std::min<size_t>(avail, UBOOT_ENV_MAX);
+	// CRC, then variables, or CRC, flag byte, then variables
+	for (unsigned int start = 4; start <= 5; start++) {
+		// Walk the NUL-terminated "name=value" strings to the empty one at the
+		// end, so only blocks that look right are checksummed
+		const unsigned char *q = p + start;
+		bool valid = *q != 0;
+		while (valid && (q < end) && *q) {
+			bool equals = false;
+			for (; (q < end) && *q; q++) {
+				if ((*q < 0x20) || (*q >= 0x7F)) break;
+				if (*q == '=') equals = true;
+			}
+			valid = equals && (q < end) && (*q == 0);
+			q++;
+		}
+		if (!valid || (q >= end)) continue;
+
+		size_t used = q + 1 - p;
+		for (size_t size = UBOOT_ENV_MIN; (size <= UBOOT_ENV_MAX) && (size <= avail);
+			size <<= 1
+		) {
+			if (size < used) continue;
+			if (crc32(0, p + start, size - start) == get32le(p)) {
+				*redundant = start == 5;
+				return size;
+			}
+		}
+	}
+	return 0;
+}
+
+/// Look for U-Boot environments at the start of each 4 kB block.
+static void findUBootEnv(const unsigned char *data, size_t len,
+	std::vector<FirmwarePart> *found)
+{
+	for (size_t pos = 0; pos + UBOOT_ENV_MIN <= len; pos += UBOOT_ENV_MIN) {
+		bool redundant;
+		size_t size = ubootEnvSize(data + pos, len - pos, &redundant);
+		if (!size) continue;
+		FirmwarePart part;
+		part.type = FirmwarePart::UBootEnv;
+		part.offset = pos;
+		part.length = size;
+		if (redundant) part.detail = "redundant";
+		found->push_back(part);
+		pos += size - UBOOT_ENV_MIN;
+	}
+	return;
+}
+
+static bool partBefore(const FirmwarePart& a, const FirmwarePart& b)
+{
+	return a.offset < b.offset;
+}
+
+/// Work out the entropy of each block.
+static void measureEntropy(const unsigned char *data, size_t len,
+	FirmwareLayout *layout)
+{
+	for (size_t pos = 0; pos < len; pos += ANALYSE_BLOCK_SIZE) {
+		size_t n = std::min<size_t>(ANALYSE_BLOCK_SIZE, len - pos);
+		const unsigned char *p = data + pos;
+
+		// Four tables so consecutive equal bytes don't wait on each other
+		uint32_t count[4][256];
+		memset(count, 0, sizeof(count));
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			count[0][p[i]]++;
+			count[1][p[i + 1]]++;
+			count[2][p[i + 2]]++;
+			count[3][p[i + 3]]++;
+		}
+		for (; i < n; i++) count[0][p[i]]++;
+
+		double bits = 0;
+		for (unsigned int b = 0; b < 256; b++) {
+			uint32_t c = count[0][b] + count[1][b] + count[2][b] + count[3][b];
+			if (c) {
+				double prob = (double)c / n;
+				bits -= prob * log2(prob);
+			}
+		}
+		bool erased = count[0][0xFF] + count[1][0xFF] + count[2][0xFF]
+			+ count[3][0xFF] == n;
+		layout->entropy.push_back(bits);
+		layout->erased.push_back(erased);
+		if (erased) layout->erasedBlocks++;
+	}
+	return;
+}
+
+void analyseFirmware(const char *data, size_t len, FirmwareLayout *layout)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	layout->size = len;
+	layout->parts.clear();
+	layout->versions.clear();
+	layout->entropy.clear();
+	layout->erased.clear();
+	layout->erasedBlocks = 0;
+
+	Scanner s;
+	s.data = p;
+	s.len = len;
+	s.layout = layout;
+	s.skipUntil = 0;
+	s.inJFFS2 = false;
+	scan(s);
+
+	std::vector<FirmwarePart> env;
+	findUBootEnv(p, len, &env);
+	if (!env.empty()) {
+		layout->parts.insert(layout->parts.end(), env.begin(), env.end());
+		std::stable_sort(layout->parts.begin(), layout->parts.end(), partBefore);
+	}
+
+	measureEntropy(p, len, layout);
+	return;
+}
+
+FirmwareImage::FirmwareImage(const std::string& filename)
+	: map(NULL),
+	  len(0)
+{
+	{
+		std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+		if (!file.is_open()) throw "unable to open " + filename;
+		if (isSparseDump(file)) {
+			SparseReader sparse(file);
+			std::stringstream image;
+			sparse.expand(image);
+			this->expanded = image.str();
+			this->len = this->expanded.length();
+			return;
+		}
+	}
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) throw "unable to open " + filename + ": " + strerror(errno);
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		std::string err = strerror(errno);
+		close(fd);
+		throw "unable to read " + filename + ": " + err;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) throw "unable to read " + filename + ": " + strerror(errno);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	this->map = map;
+	this->len = st.st_size;
+}
+
+FirmwareImage::~FirmwareImage()
+{
+	if (this->map) munmap(this->map, this->len);
+}
+
+const char *FirmwareImage::data() const
+{
+	if (this->map) return (const char *)this->map;
+	return this->expanded.data();
+}
+
+size_t FirmwareImage::size() const
+{
+	return this->len;
+}
+
+void analyseFile(const std::string& filename, FirmwareLayout *layout)
+{
+	FirmwareImage image(filename);
+	analyseFirmware(image.data(), image.size(), layout);
+	return;
+}
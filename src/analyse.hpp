@@ -0,0 +1,122 @@
+/**
+ * @file   analyse.hpp
+ * @brief  Find the parts of a firmware image without a device to ask.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANALYSE_HPP
+#define ANALYSE_HPP
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Size of each block in the entropy map.
+#define ANALYSE_BLOCK_SIZE 65536
+
+/// Something recognised in a firmware image.
+struct FirmwarePart
+{
+	enum Type {
+		UImage,     ///< U-Boot image, usually the kernel
+		SquashFS,
+		JFFS2,      ///< One run of JFFS2 nodes
+		Gzip,
+		LZMA,
+		UBootEnv    ///< U-Boot environment with a valid CRC
+	};
+
+	Type type;
+	uint64_t offset;
+	uint64_t length;       ///< 0 if the header doesn't say
+	std::string detail;    ///< Name, version or compression, where known
+};
+
+/// Everything found in a firmware image.
+struct FirmwareLayout
+{
+	uint64_t size;
+	std::vector<FirmwarePart> parts;    ///< In order of offset
+	std::vector<std::string> versions;  ///< e.g. "U-Boot 1.1.3 (Jun  5 2012)"
+	std::vector<double> entropy;        ///< Bits per byte of each block
+	std::vector<bool> erased;           ///< Whether every byte of each block is 0xFF
+	unsigned long erasedBlocks;
+};
+
+/// Get the name of a part type, as printed by --analyse-dump.
+const char *firmwarePartName(FirmwarePart::Type type);
+
+/// Get a name for one part of an image, e.g. "squashfs-0x00120000".
+/**
+ * Used for the folders files are extracted to and overlaid from.
+ */
+std::string firmwarePartLabel(const FirmwarePart& part);
+
+/// Find the parts of a firmware image.
+/**
+ * The image is scanned once for the start of every known header, checking
+ * sixteen positions at a time where the CPU allows, and each candidate is
+ * then checked properly.  Anything inside a part whose length is known is
+ * skipped, so compressed data doesn't turn up false matches.
+ *
+ * @param data
+ *   Image content.
+ *
+ * @param len
+ *   Size of the image.
+ *
+ * @param layout
+ *   On return, what was found.
+ */
+void analyseFirmware(const char *data, size_t len, FirmwareLayout *layout);
+
+/// A firmware dump in memory.
+/**
+ * The file is mapped into memory rather than read, so large dumps don't
+ * need to fit in RAM.  Sparse dumps are expanded first.
+ */
+class FirmwareImage
+{
+	public:
+		/// Open a dump.
+		/**
+		 * @throw std::string if the file could not be read.
+		 */
+		FirmwareImage(const std::string& filename);
+
+		~FirmwareImage();
+
+		const char *data() const;
+		size_t size() const;
+
+	private:
+		void *map;             ///< Mapped file, or NULL if expanded or empty
+		size_t len;
+		std::string expanded;  ///< Content of a sparse dump
+
+		FirmwareImage(const FirmwareImage&);
+		FirmwareImage& operator=(const FirmwareImage&);
+};
+
+/// Find the parts of a firmware image saved in a file.
+/**
+ * @throw std::string if the file could not be read.
+ */
+void analyseFile(const std::string& filename, FirmwareLayout *layout);
+
+#endif // ANALYSE_HPP
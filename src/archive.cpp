@@ -0,0 +1,386 @@
+/**
+ * @file   archive.cpp
+ * @brief  Firmware archive that stores content shared between cameras once.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <boost/bind.hpp>
+#include "archive.hpp"
+#include "fileutil.hpp"
+
+/// Format version written on the first line of each manifest.
+#define ARCHIVE_SIGNATURE "camtickler-archive 1"
+
+/// Rolling hash bits that must be zero to cut a chunk, about one in 32 kB.
+#define ARCHIVE_CUT_MASK 0xFFFE0000UL
+
+/// Random value for each byte, mixed into the rolling hash.
+static uint32_t gear[256];
+
+/// Fills gear[] from a fixed seed, so every build cuts chunks in the same place.
+static struct GearInit
+{
+	GearInit()
+	{
+		uint32_t x = 0x6a09e667;
+		for (int i = 0; i < 256; i++) {
+			// xorshift32
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			gear[i] = x;
+		}
+	}
+} gearInit; // runs before main(), so before any thread can use gear[]
+
+static std::string toHex(const unsigned char *hash)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (int i = 0; i < SHA256_DIGEST_LEN; i++) {
+		hex += digits[hash[i] >> 4];
+		hex += digits[hash[i] & 0x0F];
+	}
+	return hex;
+}
+
+static bool fromHex(const std::string& hex, unsigned char *hash)
+{
+	if (hex.length() != SHA256_DIGEST_LEN * 2) return false;
+	for (int i = 0; i < SHA256_DIGEST_LEN; i++) {
+		char *end;
+		std::string byte = hex.substr(i * 2, 2);
+		hash[i] = strtoul(byte.c_str(), &end, 16);
+		if (*end) return false;
+	}
+	return true;
+}
+
+ChunkArchive::ChunkArchive(const std::string& dir)
+	: dir(dir.empty() ? defaultDir() : dir)
+{
+	if (this->dir.empty()) {
+		throw std::string("no archive folder, set --archive-dir or $HOME");
+	}
+}
+
+std::string ChunkArchive::defaultDir()
+{
+	const char *xdg = getenv("XDG_DATA_HOME");
+	if (xdg && xdg[0]) return std::string(xdg) + "/camtickler/archive";
+	const char *home = getenv("HOME");
+	if (home && home[0]) return std::string(home) + "/.local/share/camtickler/archive";
+	return std::string();
+}
+
+bool ChunkArchive::putChunk(const unsigned char *hash, const std::string& data)
+{
+	std::string path = this->chunkPath(hash);
+	if (access(path.c_str(), F_OK) == 0) return false;
+
+	uLongf len = compressBound(data.length());
+	std::string stored(len, '\0');
+	if (compress2((Bytef *)&stored[0], &len, (const Bytef *)data.data(),
+		data.length(), Z_DEFAULT_COMPRESSION) != Z_OK
+	) {
+		throw "unable to compress archive chunk " + toHex(hash);
+	}
+	stored.resize(len);
+	replaceFile(path, stored);
+	return true;
+}
+
+void ChunkArchive::getChunk(const ArchiveChunk& chunk, std::string *out)
+{
+	std::string path = this->chunkPath(chunk.hash);
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) throw "archive chunk " + toHex(chunk.hash) + " is missing";
+	std::stringstream stored;
+	stored << file.rdbuf();
+	std::string data = stored.str();
+
+	out->resize(chunk.length);
+	uLongf len = chunk.length;
+	unsigned char hash[SHA256_DIGEST_LEN];
+	bool ok = (uncompress((Bytef *)&(*out)[0], &len, (const Bytef *)data.data(),
+		data.length()) == Z_OK) && (len == chunk.length);
+	if (ok) {
+		sha256(out->data(), out->length(), hash);
+		ok = memcmp(hash, chunk.hash, SHA256_DIGEST_LEN) == 0;
+	}
+	if (!ok) throw "archive chunk " + toHex(chunk.hash) + " is damaged";
+	return;
+}
+
+void ChunkArchive::saveManifest(const std::string& host,
+	const std::vector<ArchiveChunk>& chunks)
+{
+	std::stringstream ss;
+	ss << ARCHIVE_SIGNATURE << "\n";
+	for (std::vector<ArchiveChunk>::const_iterator i = chunks.begin();
+		i != chunks.end(); i++
+	) {
+		ss << toHex(i->hash) << "\t" << i->length << "\n";
+	}
+	replaceFile(this->manifestPath(host), ss.str());
+	return;
+}
+
+bool ChunkArchive::loadManifest(const std::string& host,
+	std::vector<ArchiveChunk> *chunks)
+{
+	std::string path = this->manifestPath(host);
+	std::ifstream file(path.c_str());
+	if (!file.is_open()) return false;
+
+	std::string line;
+	std::getline(file, line);
+	if (line.compare(ARCHIVE_SIGNATURE) != 0) {
+		throw "unrecognised archive manifest " + path;
+	}
+	while (std::getline(file, line)) {
+		std::string::size_type tab = line.find('\t');
+		ArchiveChunk chunk;
+		char *end;
+		if (
+			(tab == std::string::npos)
+			|| !fromHex(line.substr(0, tab), chunk.hash)
+		) {
+			throw "archive manifest " + path + " is damaged";
+		}
+		unsigned long length = strtoul(line.c_str() + tab + 1, &end, 10);
+		if (*end || (length == 0) || (length > ARCHIVE_MAX_CHUNK)) {
+			throw "archive manifest " + path + " is damaged";
+		}
+		chunk.length = length;
+		chunks->push_back(chunk);
+	}
+	return true;
+}
+
+void ChunkArchive::restore(const std::string& host, std::ostream& target)
+{
+	std::vector<ArchiveChunk> chunks;
+	if (!this->loadManifest(host, &chunks)) {
+		throw host + " is not in the archive at " + this->dir;
+	}
+	std::string data;
+	for (std::vector<ArchiveChunk>::const_iterator i = chunks.begin();
+		i != chunks.end(); i++
+	) {
+		this->getChunk(*i, &data);
+		target.write(data.data(), data.length());
+		if (!target) throw std::string("unable to write restored image");
+	}
+	return;
+}
+
+std::string ChunkArchive::chunkPath(const unsigned char *hash)
+{
+	// Spread over 256 folders so none gets too big
+	std::string hex = toHex(hash);
+	return this->dir + "/chunks/" + hex.substr(0, 2) + "/" + hex;
+}
+
+std::string ChunkArchive::manifestPath(const std::string& host)
+{
+	// Hostnames can't contain slashes, but don't let one escape the folder
+	std::string name = host;
+	for (std::string::iterator i = name.begin(); i != name.end(); i++) {
+		if (*i == '/') *i = '_';
+	}
+	if (name.empty() || (name[0] == '.')) name = "_" + name;
+	return this->dir + "/manifests/" + name;
+}
+
+/// A chunk waiting to be stored or added to the manifest.
+struct ArchiveWriter::Chunk
+{
+	Chunk()
+		: isNew(false),
+		  done(false)
+	{
+	}
+
+	std::string data;
+	ArchiveChunk entry;
+	bool isNew;         ///< Wasn't already in the archive
+	bool done;          ///< Hashed and stored
+};
+
+ArchiveWriter::ArchiveWriter(ChunkArchive& archive, const std::string& host,
+	unsigned int threads)
+	: archive(archive),
+	  host(host),
+	  scanned(0),
+	  rolling(0),
+	  work(new boost::asio::io_service::work(io_service))
+{
+	memset(&this->stats, 0, sizeof(this->stats));
+	if (threads < 1) threads = 1;
+	this->maxPending = threads * 4;
+	for (unsigned int i = 0; i < threads; i++) {
+		this->threads.create_thread(boost::bind(&boost::asio::io_service::run,
+			&this->io_service));
+	}
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+	this->stop();
+}
+
+std::streamsize ArchiveWriter::xsputn(const char *s, std::streamsize n)
+{
+	this->current.append(s, n);
+	std::string::size_type len = this->current.length();
+	while (this->scanned < len) {
+		// The hash only depends on the last 32 bytes, so skip ahead to just
+		// before the smallest chunk size
+		if (this->scanned < ARCHIVE_MIN_CHUNK - 32) {
+			this->scanned = std::min<std::string::size_type>(len,
+				ARCHIVE_MIN_CHUNK - 32);
+			continue;
+		}
+		const unsigned char *data = (const unsigned char *)this->current.data();
+		std::string::size_type end = std::min<std::string::size_type>(len,
+			ARCHIVE_MAX_CHUNK);
+		uint32_t h = this->rolling;
+		std::string::size_type i = this->scanned;
+		bool cut = false;
+		while (i < end) {
+			h = (h << 1) + gear[data[i++]];
+			if ((i >= ARCHIVE_MIN_CHUNK) && ((h & ARCHIVE_CUT_MASK) == 0)) {
+				cut = true;
+				break;
+			}
+		}
+		this->rolling = h;
+		this->scanned = i;
+		if (cut || (i == ARCHIVE_MAX_CHUNK)) {
+			this->submit(i);
+			len = this->current.length();
+		}
+	}
+	return n;
+}
+
+ArchiveWriter::int_type ArchiveWriter::overflow(int_type c)
+{
+	if (traits_type::eq_int_type(c, traits_type::eof())) {
+		return traits_type::not_eof(c);
+	}
+	char ch = traits_type::to_char_type(c);
+	this->xsputn(&ch, 1);
+	return c;
+}
+
+void ArchiveWriter::finish(ArchiveStats *stats)
+{
+	if (!this->current.empty()) this->submit(this->current.length());
+	this->collect(0);
+	this->stop();
+	if (!this->error.empty()) throw this->error;
+
+	// Only now are all the chunks in place for the manifest to refer to
+	this->archive.saveManifest(this->host, this->manifest);
+	*stats = this->stats;
+	return;
+}
+
+void ArchiveWriter::submit(std::string::size_type len)
+{
+	boost::shared_ptr<Chunk> chunk(new Chunk());
+	if (len == this->current.length()) {
+		chunk->data.swap(this->current);
+	} else {
+		chunk->data.assign(this->current, 0, len);
+		this->current.erase(0, len);
+	}
+	this->scanned = 0;
+	this->rolling = 0;
+	{
+		boost::mutex::scoped_lock guard(this->mutex);
+		this->pending.push_back(chunk);
+	}
+	this->io_service.post(boost::bind(&ArchiveWriter::store, this, chunk));
+
+	// Don't let the download get too far ahead of the workers
+	this->collect(this->maxPending);
+	return;
+}
+
+void ArchiveWriter::store(boost::shared_ptr<Chunk> chunk)
+{
+	std::string failed;
+	ArchiveChunk& entry = chunk->entry;
+	entry.length = chunk->data.length();
+	sha256(chunk->data.data(), chunk->data.length(), entry.hash);
+	try {
+		chunk->isNew = this->archive.putChunk(entry.hash, chunk->data);
+	} catch (const std::string& err) {
+		failed = err;
+	}
+	std::string().swap(chunk->data);
+
+	boost::mutex::scoped_lock guard(this->mutex);
+	if (!failed.empty() && this->error.empty()) this->error = failed;
+	chunk->done = true;
+	this->done.notify_all();
+	return;
+}
+
+void ArchiveWriter::collect(unsigned int keep)
+{
+	boost::mutex::scoped_lock guard(this->mutex);
+	while (!this->pending.empty()) {
+		boost::shared_ptr<Chunk> chunk = this->pending.front();
+		if (!chunk->done) {
+			if (this->pending.size() <= keep) break;
+			this->done.wait(guard);
+			continue;
+		}
+		this->pending.pop_front();
+		this->manifest.push_back(chunk->entry);
+		this->stats.chunks++;
+		this->stats.size += chunk->entry.length;
+		if (chunk->isNew) {
+			this->stats.newChunks++;
+			this->stats.newBytes += chunk->entry.length;
+		}
+	}
+	return;
+}
+
+void ArchiveWriter::stop()
+{
+	// Let any chunks already queued finish, so none are left using this
+	this->work.reset();
+	this->threads.join_all();
+	return;
+}
@@ -0,0 +1,223 @@
+/**
+ * @file   archive.hpp
+ * @brief  Firmware archive that stores content shared between cameras once.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARCHIVE_HPP
+#define ARCHIVE_HPP
+
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/asio.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "checksum.hpp"
+
+/// Smallest chunk cut from a dump, unless it is the last one.
+#define ARCHIVE_MIN_CHUNK 8192
+
+/// Largest chunk cut from a dump, if no boundary is found before then.
+#define ARCHIVE_MAX_CHUNK 131072
+
+/// One piece of an archived image.
+struct ArchiveChunk
+{
+	unsigned char hash[SHA256_DIGEST_LEN]; ///< SHA-256 of the content, and its name
+	uint32_t length;                       ///< Bytes of original content
+};
+
+/// What was stored when a dump was added to the archive.
+struct ArchiveStats
+{
+	unsigned long chunks;     ///< Chunks in the image
+	unsigned long newChunks;  ///< Chunks not already in the archive
+	uint64_t size;            ///< Size of the image
+	uint64_t newBytes;        ///< Original size of the new chunks
+};
+
+/// A folder of firmware images, split into chunks and stored by hash.
+/**
+ * Each chunk is compressed and saved under its SHA-256, so content that is
+ * the same in many images (such as the same model's kernel and root
+ * filesystem) is kept once.  Each host has a manifest listing its chunks in
+ * order.  Chunks are never removed, so a manifest can be replaced at any time
+ * without disturbing another process reading an older one.
+ */
+class ChunkArchive
+{
+	public:
+		/// Open the archive.
+		/**
+		 * @param dir
+		 *   Folder to keep the archive in.  It need not exist yet.  If empty,
+		 *   the default location returned by defaultDir() is used.
+		 *
+		 * @throw std::string if dir is empty and there is no default.
+		 */
+		ChunkArchive(const std::string& dir);
+
+		/// Get the default archive location.
+		/**
+		 * @return $XDG_DATA_HOME/camtickler/archive, falling back to
+		 *   $HOME/.local/share/camtickler/archive.  Empty if neither is set.
+		 */
+		static std::string defaultDir();
+
+		/// Store a chunk unless it is already in the archive.
+		/**
+		 * Safe to call from several threads and processes at once.
+		 *
+		 * @return true if the chunk was new.
+		 *
+		 * @throw std::string if the chunk could not be written.
+		 */
+		bool putChunk(const unsigned char *hash, const std::string& data);
+
+		/// Get the content of a chunk, checking it against its hash.
+		/**
+		 * @param chunk
+		 *   Chunk to read.
+		 *
+		 * @param out
+		 *   The content replaces whatever this held.
+		 *
+		 * @throw std::string if the chunk is missing or damaged.
+		 */
+		void getChunk(const ArchiveChunk& chunk, std::string *out);
+
+		/// Replace the manifest for a host.
+		/**
+		 * @throw std::string if the manifest could not be written.
+		 */
+		void saveManifest(const std::string& host,
+			const std::vector<ArchiveChunk>& chunks);
+
+		/// Get the manifest for a host.
+		/**
+		 * @return true if one was found, false if this host has not been
+		 *   archived.
+		 *
+		 * @throw std::string if the manifest is damaged.
+		 */
+		bool loadManifest(const std::string& host, std::vector<ArchiveChunk> *chunks);
+
+		/// Write out a host's image.
+		/**
+		 * @throw std::string if the host has not been archived, a chunk is
+		 *   missing or damaged, or the target can't be written.
+		 */
+		void restore(const std::string& host, std::ostream& target);
+
+	private:
+		std::string dir;
+
+		/// Get the filename a chunk is stored under.
+		std::string chunkPath(const unsigned char *hash);
+
+		/// Get the filename of a host's manifest.
+		std::string manifestPath(const std::string& host);
+};
+
+/// Adds a firmware dump to a ChunkArchive as it is downloaded.
+/**
+ * Data written to this stream buffer is split into chunks at points chosen
+ * by a rolling hash of the content, so a change in one part of an image only
+ * alters the chunks around it and the rest still match other images.  Each
+ * chunk is hashed, compressed and stored on a worker thread while more data
+ * arrives.
+ */
+class ArchiveWriter: public std::streambuf
+{
+	public:
+		/// Start adding a dump.
+		/**
+		 * @param archive
+		 *   Archive to store the chunks in.  It must remain valid until this
+		 *   object is destroyed.
+		 *
+		 * @param host
+		 *   Name the manifest is saved under.
+		 *
+		 * @param threads
+		 *   Number of chunks to hash and store at once.
+		 */
+		ArchiveWriter(ChunkArchive& archive, const std::string& host,
+			unsigned int threads);
+
+		~ArchiveWriter();
+
+		/// Store the last chunk and save the manifest.
+		/**
+		 * The host's previous manifest is kept until this has been called.
+		 *
+		 * @param stats
+		 *   On return, what was stored.
+		 *
+		 * @throw std::string if a chunk or the manifest could not be written.
+		 */
+		void finish(ArchiveStats *stats);
+
+	protected:
+		virtual std::streamsize xsputn(const char *s, std::streamsize n);
+		virtual int_type overflow(int_type c);
+
+	private:
+		struct Chunk;
+
+		ChunkArchive& archive;
+		std::string host;
+		std::string current;             ///< Data not yet cut into a chunk
+		std::string::size_type scanned;  ///< Bytes of current already hashed
+		uint32_t rolling;                ///< Rolling hash at the end of scanned
+		std::vector<ArchiveChunk> manifest;
+		unsigned int maxPending;         ///< Most chunks waiting at once
+
+		boost::asio::io_service io_service;
+		boost::scoped_ptr<boost::asio::io_service::work> work;
+		boost::thread_group threads;
+
+		boost::mutex mutex;              ///< Protects everything below
+		boost::condition_variable done;  ///< Signalled when a chunk is stored
+		std::deque<boost::shared_ptr<Chunk> > pending; ///< In image order
+		ArchiveStats stats;
+		std::string error;               ///< First failure, empty if none
+
+		/// Hand the first len bytes of current to a worker.
+		void submit(std::string::size_type len);
+
+		/// Hash and store a chunk.  Runs on a worker thread.
+		void store(boost::shared_ptr<Chunk> chunk);
+
+		/// Add stored chunks from the front of the queue to the manifest.
+		/**
+		 * @param keep
+		 *   Wait until no more than this many chunks are still pending.
+		 */
+		void collect(unsigned int keep);
+
+		/// Stop the worker threads.
+		void stop();
+};
+
+#endif // ARCHIVE_HPP
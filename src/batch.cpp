@@ -0,0 +1,461 @@
+/**
+ * @file   batch.cpp
+ * @brief  Run a manifest of actions against many devices at once.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "batch.hpp"
+#include "fileutil.hpp"
+#include "identify.hpp"
+#include "main.hpp"
+
+/// First line of the state file.
+#define STATE_SIGNATURE "camtickler-fwid v1"
+
+/// Parse one action from a manifest, e.g. "dump=fw.bin?changed".
+/**
+ * @throw std::string if the action is invalid.
+ */
+static BatchAction parseAction(const std::string& word)
+{
+	BatchAction action;
+	action.ifChanged = false;
+
+	std::string::size_type q = word.find('?');
+	std::string name = word.substr(0, q);
+	std::string arg;
+	std::string::size_type eq = name.find('=');
+	if (eq != std::string::npos) {
+		arg = name.substr(eq + 1);
+		name.erase(eq);
+	}
+
+	if (name.compare("identify") == 0) {
+		action.type = BatchAction::Identify;
+	} else if (name.compare("query") == 0) {
+		action.type = BatchAction::Query;
+	} else if (name.compare("dump") == 0) {
+		action.type = BatchAction::Dump;
+		if (arg.empty()) throw std::string("dump needs a filename, e.g. dump=%h.bin");
+		action.filename = arg;
+		arg.clear();
+	} else {
+		throw "unknown action \"" + name + "\"";
+	}
+	if (!arg.empty()) throw "\"" + name + "\" does not take a value";
+
+	while (q != std::string::npos) {
+		std::string::size_type end = word.find('?', q + 1);
+		std::string cond = word.substr(q + 1,
+			end == std::string::npos ? std::string::npos : end - q - 1);
+		if (cond.compare("changed") == 0) {
+			action.ifChanged = true;
+		} else if ((cond.length() > 5) && (cond.compare(0, 5, "type=") == 0)) {
+			action.ifType = cond.substr(5);
+		} else {
+			throw "unknown condition \"" + cond + "\"";
+		}
+		q = end;
+	}
+	return action;
+}
+
+/// Parse the actions listed on a manifest line.
+/**
+ * @throw std::string if any action is invalid.
+ */
+static std::vector<BatchAction> parseActions(std::istream& words)
+{
+	std::vector<BatchAction> actions;
+	bool queried = false;
+	std::string word;
+	while (words >> word) {
+		BatchAction action = parseAction(word);
+		if (action.ifChanged && !queried) {
+			throw std::string("?changed needs a query earlier on the same line");
+		}
+		if (action.type == BatchAction::Query) queried = true;
+		actions.push_back(action);
+	}
+	return actions;
+}
+
+void readManifest(std::istream& in, std::vector<BatchJob> *jobs)
+{
+	std::vector<BatchAction> defaults;
+	std::string line;
+	unsigned int lineNum = 0;
+	while (std::getline(in, line)) {
+		lineNum++;
+		std::string::size_type hash = line.find('#');
+		if (hash != std::string::npos) line.erase(hash);
+
+		std::istringstream words(line);
+		std::string host;
+		if (!(words >> host)) continue; // blank line
+
+		try {
+			if (host.compare("default") == 0) {
+				defaults = parseActions(words);
+				continue;
+			}
+			BatchJob job;
+			job.host = host;
+			job.actions = parseActions(words);
+			if (job.actions.empty()) {
+				if (defaults.empty()) {
+					throw "no actions for " + host + " and no default line before it";
+				}
+				job.actions = defaults;
+			}
+			jobs->push_back(job);
+		} catch (const std::string& err) {
+			std::stringstream ss;
+			ss << "manifest line " << lineNum << ": " << err;
+			throw ss.str();
+		}
+	}
+	return;
+}
+
+BatchConfig::BatchConfig()
+	: threads(8),
+	  cache(NULL),
+	  inventory(NULL),
+	  record(NULL),
+	  replay(NULL),
+	  progress(NULL),
+	  breaker(NULL)
+{
+}
+
+/// Progress through the actions for one host.
+struct Batch::HostRun
+{
+	HostRun(const BatchJob& job, const std::string& type)
+		: job(job),
+		  network(job.host),
+		  type(type),
+		  next(0),
+		  failed(false)
+	{
+	}
+
+	const BatchJob& job;
+	Network network;
+	std::string type;      ///< Device type, empty if unknown
+	std::string fwid;      ///< From the last query, empty if none yet
+	unsigned int next;     ///< Index of the next action to run
+	bool failed;           ///< An action has failed
+};
+
+/// Append a string field to a JSON object being built.
+static void addField(std::ostream& out, const char *key, const std::string& value)
+{
+	out << ",\"" << key << "\":";
+	write_json_string(out, value);
+	return;
+}
+
+/// Format a number in hex, zero padded.
+static std::string hex(unsigned int value, int width)
+{
+	std::ostringstream ss;
+	ss << std::hex << std::setw(width) << std::setfill('0') << value;
+	return ss.str();
+}
+
+Batch::Batch(const BatchConfig& config, std::ostream& out)
+	: config(config),
+	  writer(out),
+	  pool(config.threads),
+	  failures(0)
+{
+}
+
+unsigned long Batch::run(const std::vector<BatchJob>& jobs)
+{
+	this->loadState();
+	for (std::vector<BatchJob>::const_iterator i = jobs.begin(); i != jobs.end(); i++) {
+		boost::shared_ptr<HostRun> run(new HostRun(*i, this->config.type));
+		run->network.record(this->config.record);
+		run->network.replay(this->config.replay);
+		run->network.set_throttle(this->config.throttle);
+		run->network.set_retry(this->config.retry, this->config.breaker);
+		run->network.set_login(this->config.username, this->config.password);
+		for (std::map<std::string, unsigned short>::const_iterator p = this->config.ports.begin();
+			p != this->config.ports.end(); p++
+		) {
+			run->network.set_port(p->first, p->second);
+		}
+		this->pool.submit(boost::bind(&Batch::step, this, run));
+	}
+	this->pool.run();
+	this->saveState();
+	return this->failures;
+}
+
+void Batch::step(boost::shared_ptr<HostRun> run)
+{
+	const BatchAction& action = run->job.actions[run->next];
+	const std::string& host = run->job.host;
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+	static const char *names[] = {"identify", "query", "dump"};
+	std::ostringstream fields; // everything after the common fields
+	std::string skip, error;
+
+	if (run->failed) {
+		skip = "an earlier action failed";
+	} else if ((action.type != BatchAction::Identify) && run->type.empty()) {
+		skip = "device type not known, use identify or --type";
+	} else if (!action.ifType.empty() && (run->type.compare(action.ifType) != 0)) {
+		skip = "device is not " + action.ifType;
+	} else if (action.ifChanged) {
+		if (run->fwid.empty()) {
+			skip = "no fwid, query was skipped";
+		} else {
+			std::map<std::string, std::string>::const_iterator i
+				= this->previous.find(host);
+			if ((i != this->previous.end()) && (i->second.compare(run->fwid) == 0)) {
+				skip = "fwid unchanged";
+			}
+		}
+	}
+
+	if (skip.empty()) {
+		try {
+			this->perform(run.get(), action, &fields);
+		} catch (const std::string& err) {
+			error = err;
+		} catch (const boost::system::system_error& e) {
+			error = e.what();
+		} catch (const std::exception& e) {
+			error = e.what();
+		}
+	}
+
+	boost::posix_time::time_duration elapsed
+		= boost::posix_time::microsec_clock::universal_time() - start;
+	std::ostringstream record;
+	record << "{\"host\":";
+	write_json_string(record, host);
+	record << ",\"action\":\"" << names[action.type] << "\",\"status\":\"";
+	if (!skip.empty()) {
+		record << "skipped\"";
+		addField(record, "reason", skip);
+	} else if (!error.empty()) {
+		record << "error\"";
+		addField(record, "error", error);
+	} else {
+		record << "ok\"";
+	}
+	record << ",\"elapsed_ms\":" << elapsed.total_milliseconds()
+		<< fields.str() << "}";
+	this->writer.write(record.str());
+
+	if (!error.empty()) {
+		run->failed = true;
+		this->failures++;
+	}
+
+	run->next++;
+	if (run->next < run->job.actions.size()) {
+		// Queued on this worker, so it will normally run next on this thread
+		this->pool.submit(boost::bind(&Batch::step, this, run));
+		return;
+	}
+
+	// Only remember the fwid once everything depending on it has worked, so a
+	// failed dump is tried again next time.
+	if (!run->failed && !run->fwid.empty()) {
+		boost::mutex::scoped_lock guard(this->stateMutex);
+		this->fwids[host] = run->fwid;
+	}
+	try {
+		run->network.ftp_close();
+	} catch (const boost::system::system_error&) {
+		// Finished with it anyway
+	}
+	return;
+}
+
+void Batch::perform(HostRun *run, const BatchAction& action,
+	std::ostream *fields)
+{
+	const std::string& host = run->job.host;
+	switch (action.type) {
+		case BatchAction::Identify: {
+			Identify id(&run->network, NULL, this->config.cache,
+				this->config.progress->start("Retrieving config", host));
+			std::string type = id.getType();
+			if (id.getHTTPPort() != 0) {
+				(*fields) << ",\"http_port\":" << id.getHTTPPort();
+			}
+			if (!id.getUsername().empty() && !id.getPassword().empty()) {
+				addField(*fields, "admin_username", id.getUsername());
+				addField(*fields, "admin_password", id.getPassword());
+			}
+			addField(*fields, "device_type", type);
+			if (type.compare("unknown") == 0) {
+				throw std::string("Unable to identify device");
+			}
+			run->type = type;
+			InventoryRecord entry;
+			entry.host = host;
+			entry.learned = INVENTORY_IDENTIFIED;
+			entry.type = run->type;
+			entry.httpPort = id.getHTTPPort();
+			this->addToInventory(entry);
+			break;
+		}
+
+		case BatchAction::Query: {
+			boost::scoped_ptr<Device> dev(openDevice(run->type, &run->network, NULL));
+			if (!dev) throw "unknown device type " + run->type;
+			unsigned long lenFlash;
+			unsigned short idVendor, idProduct;
+			unsigned char bInterfaceClass;
+			Retry retry(this->config.retry, host);
+			for (;;) {
+				try {
+					dev->getFlashInfo(&lenFlash);
+					dev->getCameraInfo(&idVendor, &idProduct, &bInterfaceClass);
+					break;
+				} catch (const boost::system::system_error& e) {
+					if (!retry.again(e.code())) throw;
+				}
+			}
+			bool known;
+			std::string model = modelName(run->type, lenFlash, idVendor, idProduct, &known);
+			run->fwid = firmwareId(run->type, lenFlash, bInterfaceClass);
+			(*fields) << ",\"flash_size\":" << lenFlash;
+			addField(*fields, "camera_usb_vendor", hex(idVendor, 4));
+			addField(*fields, "camera_usb_product", hex(idProduct, 4));
+			addField(*fields, "camera_usb_class", hex(bInterfaceClass, 2));
+			addField(*fields, "model", model);
+			(*fields) << ",\"known_model\":" << (known ? "true" : "false");
+			addField(*fields, "fwid", run->fwid);
+			InventoryRecord entry;
+			entry.host = host;
+			entry.learned = INVENTORY_QUERIED;
+			entry.type = run->type;
+			entry.flashSize = lenFlash;
+			entry.idVendor = idVendor;
+			entry.idProduct = idProduct;
+			entry.usbClass = bInterfaceClass;
+			entry.model = model;
+			entry.knownModel = known;
+			entry.fwid = run->fwid;
+			this->addToInventory(entry);
+			break;
+		}
+
+		case BatchAction::Dump: {
+			boost::scoped_ptr<Device> dev(openDevice(run->type, &run->network, NULL));
+			if (!dev) throw "unknown device type " + run->type;
+			std::string filename = action.filename;
+			std::string::size_type pos = filename.find("%h");
+			if (pos != std::string::npos) filename.replace(pos, 2, host);
+			unsigned long length = 0;
+			Retry retry(this->config.retry, host);
+			for (;;) {
+				// Start the file again on each attempt
+				std::ofstream outfile(filename.c_str(),
+					std::ios::out | std::ios::trunc | std::ios::binary);
+				if (!outfile.is_open()) throw "unable to open " + filename;
+				fn_progress fnProg = this->config.progress->start(
+					"Downloading firmware", host);
+				try {
+					dev->getFirmware(outfile, fnProg);
+					length = outfile.tellp();
+					break;
+				} catch (const boost::system::system_error& e) {
+					fnProg.clear();
+					if (!retry.again(e.code())) throw;
+				}
+			}
+			addField(*fields, "file", filename);
+			(*fields) << ",\"bytes\":" << length;
+			break;
+		}
+	}
+	return;
+}
+
+void Batch::addToInventory(const InventoryRecord& entry)
+{
+	if (!this->config.inventory) return;
+	try {
+		this->config.inventory->update(entry);
+	} catch (const std::string& err) {
+		// Doesn't affect the device, so the action still succeeded
+		std::cerr << "Unable to update the inventory: " << err << std::endl;
+	}
+	return;
+}
+
+void Batch::loadState()
+{
+	if (this->config.stateFile.empty()) return;
+	std::ifstream file(this->config.stateFile.c_str());
+	if (!file.is_open()) return; // first run
+
+	std::string line;
+	std::getline(file, line);
+	if (line.compare(STATE_SIGNATURE) != 0) {
+		std::cerr << "Ignoring unrecognised state file " << this->config.stateFile
+			<< std::endl;
+		return;
+	}
+	while (std::getline(file, line)) {
+		std::string::size_type tab = line.find('\t');
+		if (tab == std::string::npos) continue;
+		this->previous[line.substr(0, tab)] = line.substr(tab + 1);
+	}
+	this->fwids = this->previous;
+	return;
+}
+
+void Batch::saveState()
+{
+	if (this->config.stateFile.empty()) return;
+
+	// Replace the file in one go so an interrupted run can't truncate it
+	std::stringstream ss;
+	ss << STATE_SIGNATURE << "\n";
+	for (std::map<std::string, std::string>::const_iterator i = this->fwids.begin();
+		i != this->fwids.end(); i++
+	) {
+		ss << i->first << '\t' << i->second << "\n";
+	}
+	try {
+		replaceFile(this->config.stateFile, ss.str());
+	} catch (const std::string& err) {
+		std::cerr << "Unable to save the batch state: " << err << std::endl;
+	}
+	return;
+}
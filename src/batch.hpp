@@ -0,0 +1,188 @@
+/**
+ * @file   batch.hpp
+ * @brief  Run a manifest of actions against many devices at once.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "cache.hpp"
+#include "capture.hpp"
+#include "inventory.hpp"
+#include "json.hpp"
+#include "progress.hpp"
+#include "retry.hpp"
+#include "scheduler.hpp"
+#include "throttle.hpp"
+
+/// One action to perform on a device in a batch.
+struct BatchAction
+{
+	/// What to do.
+	enum Type {
+		Identify, ///< Work out the device type
+		Query,    ///< Read the flash size and camera IDs
+		Dump      ///< Download the firmware
+	};
+
+	Type type;
+	std::string filename;  ///< Dump: file to save to, %h is the hostname
+	std::string ifType;    ///< Only run if the device is of this type
+	bool ifChanged;        ///< Only run if the fwid differs from the last run
+};
+
+/// Actions to perform on one device.
+struct BatchJob
+{
+	std::string host;
+	std::vector<BatchAction> actions;
+};
+
+/// Read a batch manifest.
+/**
+ * Each line is a hostname followed by the actions to perform on it, in
+ * order:
+ *
+ *   identify            work out the device type
+ *   query               read the flash size, camera IDs and fwid
+ *   dump=FILE           download the firmware, %h in FILE is the hostname
+ *
+ * Any action may be followed by a condition:
+ *
+ *   ?type=TYPE          only if the device is of this type
+ *   ?changed            only if the fwid from an earlier query differs from
+ *                       the one recorded by the last run
+ *
+ * A line starting with "default" instead of a hostname sets the actions for
+ * following hosts listed without any.  Blank lines and anything after a #
+ * are ignored.  For example:
+ *
+ *   default identify query?type=maygion-mips dump=fw/%h.bin?changed
+ *   192.168.0.20
+ *   192.168.0.21
+ *   192.168.0.22 query dump=special.bin
+ *
+ * @param in
+ *   Stream to read from.
+ *
+ * @param jobs
+ *   The jobs are appended to this list.
+ *
+ * @throw std::string if the manifest is invalid, content is error message.
+ */
+void readManifest(std::istream& in, std::vector<BatchJob> *jobs);
+
+/// Settings shared by every job in a batch.
+struct BatchConfig
+{
+	/// Set everything to defaults.
+	BatchConfig();
+
+	unsigned int threads;           ///< Worker threads
+	std::string type;               ///< Device type for hosts not identified
+	std::map<std::string, unsigned short> ports; ///< Non-standard service ports
+	std::string username, password; ///< Web interface login, empty for default
+	IdentifyCache *cache;           ///< Identification cache, or NULL
+	InventoryStore *inventory;      ///< Where to record results, or NULL
+	CaptureWriter *record;          ///< Capture traffic to here, or NULL
+	CaptureReader *replay;          ///< Replay traffic from here, or NULL
+	ProgressMonitor *progress;      ///< Progress display, must not be NULL
+	ThrottleConfig throttle;
+	RetryPolicy retry;
+	CircuitBreaker *breaker;        ///< Shared by every host, or NULL
+	std::string stateFile;          ///< Where fwids are kept between runs, or empty
+};
+
+/// Runs batch jobs on a pool of worker threads.
+/**
+ * Each action produces one JSON object on its own line with at least the
+ * host, the action, a status of "ok", "skipped" or "error", and the time
+ * taken.  Successful actions add what they found, using the same keys as the
+ * normal output.
+ *
+ * The actions for one host run in order on one connection, and later actions
+ * depend on earlier ones: the device type comes from identify (or --type),
+ * and ?changed needs the fwid from a query.  Once an action fails, the rest
+ * for that host are skipped.
+ */
+class Batch
+{
+	public:
+		/// Prepare to run jobs.
+		/**
+		 * @param config
+		 *   Settings for every job.
+		 *
+		 * @param out
+		 *   Stream to write JSON Lines results to.
+		 */
+		Batch(const BatchConfig& config, std::ostream& out);
+
+		/// Run every job and wait for them all to finish.
+		/**
+		 * @return Number of actions that failed.
+		 */
+		unsigned long run(const std::vector<BatchJob>& jobs);
+
+	private:
+		struct HostRun;
+
+		BatchConfig config;
+		JsonLinesWriter writer;
+		WorkStealingPool pool;
+		boost::atomic<unsigned long> failures;
+
+		/// fwid of each host from the last run, not changed while running.
+		std::map<std::string, std::string> previous;
+
+		boost::mutex stateMutex;                  ///< Protects everything below
+		std::map<std::string, std::string> fwids; ///< Latest fwid of each host
+
+		/// Run the next action for a host, write out the result, then queue
+		/// the one after.
+		void step(boost::shared_ptr<HostRun> run);
+
+		/// Perform one action.
+		/**
+		 * @param fields
+		 *   Results are appended to this as JSON fields, each starting with
+		 *   a comma.
+		 *
+		 * @throw std::string or boost::system::system_error on failure.
+		 */
+		void perform(HostRun *run, const BatchAction& action,
+			std::ostream *fields);
+
+		/// Record an identify or query result in the inventory, if there is
+		/// one.
+		void addToInventory(const InventoryRecord& entry);
+
+		/// Load the fwids saved by the last run.
+		void loadState();
+
+		/// Save the fwids for the next run.
+		void saveState();
+};
+
+#endif // BATCH_HPP
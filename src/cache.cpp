@@ -0,0 +1,155 @@
+/**
+ * @file   cache.cpp
+ * @brief  On-disk cache of device identification results.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fileutil.hpp"
+#include "main.hpp"
+#include "cache.hpp"
+
+/// Format version written on the first line of the cache file.
+#define CACHE_SIGNATURE "camtickler-identify-cache 1"
+
+IdentifyCache::IdentifyCache(const std::string& filename, unsigned long ttl)
+	: filename(filename.empty() ? defaultFilename() : filename),
+	  ttl(ttl),
+	  loaded(false)
+{
+}
+
+std::string IdentifyCache::defaultFilename()
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	if (xdg && xdg[0]) return std::string(xdg) + "/camtickler/identify";
+	const char *home = getenv("HOME");
+	if (home && home[0]) return std::string(home) + "/.cache/camtickler/identify";
+	return std::string();
+}
+
+bool IdentifyCache::lookup(const std::string& host, CacheEntry *entry)
+{
+	boost::mutex::scoped_lock guard(this->mutex);
+	this->load();
+	std::map<std::string, CacheEntry>::const_iterator i = this->entries.find(host);
+	if (i == this->entries.end()) return false;
+	if (i->second.expires < time(NULL)) {
+		if (verbose) std::cerr << "[cache] Entry for " << host << " has expired"
+			<< std::endl;
+		return false;
+	}
+	*entry = i->second;
+	return true;
+}
+
+void IdentifyCache::store(const std::string& host, CacheEntry entry)
+{
+	boost::mutex::scoped_lock guard(this->mutex);
+	this->load();
+	entry.expires = time(NULL) + this->ttl;
+	this->entries[host] = entry;
+	this->save();
+	return;
+}
+
+void IdentifyCache::remove(const std::string& host)
+{
+	boost::mutex::scoped_lock guard(this->mutex);
+	this->load();
+	if (this->entries.erase(host)) this->save();
+	return;
+}
+
+void IdentifyCache::load()
+{
+	if (this->loaded) return;
+	this->loaded = true;
+	if (this->filename.empty()) return;
+
+	std::ifstream file(this->filename.c_str());
+	if (!file.is_open()) return; // no cache yet
+
+	std::string line;
+	std::getline(file, line);
+	if (line.compare(CACHE_SIGNATURE) != 0) {
+		if (verbose) std::cerr << "[cache] Ignoring unrecognised cache file "
+			<< this->filename << std::endl;
+		return;
+	}
+
+	time_t now = time(NULL);
+	while (std::getline(file, line)) {
+		std::vector<std::string> fields;
+		std::string::size_type start = 0, end;
+		do {
+			end = line.find('\t', start);
+			std::string::size_type len
+				= ((end == std::string::npos) ? line.length() : end) - start;
+			fields.push_back(unescape(line.data() + start, len));
+			start = end + 1;
+		} while (end != std::string::npos);
+		if (fields.size() != 7) continue; // corrupted line
+
+		CacheEntry entry;
+		entry.expires = strtoul(fields[1].c_str(), NULL, 10);
+		if (entry.expires < now) continue; // drop expired entries on next save
+		entry.validator = fields[2];
+		entry.type = fields[3];
+		entry.http_port = strtoul(fields[4].c_str(), NULL, 10);
+		entry.user = fields[5];
+		entry.pass = fields[6];
+		this->entries[fields[0]] = entry;
+	}
+	return;
+}
+
+void IdentifyCache::save()
+{
+	if (this->filename.empty()) return;
+
+	std::stringstream ss;
+	ss << CACHE_SIGNATURE << "\n";
+	for (std::map<std::string, CacheEntry>::const_iterator i = this->entries.begin();
+		i != this->entries.end(); i++
+	) {
+		ss << escape(i->first)
+			<< '\t' << (unsigned long)i->second.expires
+			<< '\t' << escape(i->second.validator)
+			<< '\t' << escape(i->second.type)
+			<< '\t' << i->second.http_port
+			<< '\t' << escape(i->second.user)
+			<< '\t' << escape(i->second.pass)
+			<< "\n";
+	}
+	try {
+		replaceFile(this->filename, ss.str());
+	} catch (const std::string& err) {
+		if (verbose) std::cerr << "[cache] " << err << std::endl;
+	}
+	return;
+}
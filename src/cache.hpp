@@ -0,0 +1,112 @@
+/**
+ * @file   cache.hpp
+ * @brief  On-disk cache of device identification results.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <map>
+#include <string>
+#include <time.h>
+#include <boost/thread/mutex.hpp>
+
+/// Everything learned about a device during a full identification.
+struct CacheEntry
+{
+	/// Value that must still match for the entry to be trusted, e.g.
+	/// "http:WebServer(IPCamera_Logo)" or "ftp:220 ...".
+	std::string validator;
+
+	/// Device type, as returned by Identify::getType().
+	std::string type;
+
+	/// HTTP port, or 0 if the default port is in use.
+	unsigned short http_port;
+
+	/// Web interface credentials, if they were recovered.
+	std::string user, pass;
+
+	/// Time after which this entry is ignored.
+	time_t expires;
+};
+
+/// Persistent store of identification results, keyed by hostname.
+/**
+ * The cache file contains device credentials, so it is always written with
+ * mode 0600 inside a directory with mode 0700.  One cache may be shared by
+ * several threads.
+ */
+class IdentifyCache
+{
+	public:
+		/// Open the cache.
+		/**
+		 * @param filename
+		 *   Path to the cache file.  It need not exist yet.  If empty, the
+		 *   default location returned by defaultFilename() is used.
+		 *
+		 * @param ttl
+		 *   Number of seconds new entries remain valid for.
+		 */
+		IdentifyCache(const std::string& filename, unsigned long ttl);
+
+		/// Get the default cache location.
+		/**
+		 * @return $XDG_CACHE_HOME/camtickler/identify, falling back to
+		 *   $HOME/.cache/camtickler/identify.  Empty if neither is set.
+		 */
+		static std::string defaultFilename();
+
+		/// Find an unexpired entry for the given host.
+		/**
+		 * @param host
+		 *   Hostname or IP address, as passed on the command line.
+		 *
+		 * @param entry
+		 *   On return, the cached details if true is returned.
+		 *
+		 * @return true if an entry was found, false if not or it had expired.
+		 */
+		bool lookup(const std::string& host, CacheEntry *entry);
+
+		/// Add or replace the entry for a host and save the cache to disk.
+		/**
+		 * @param host
+		 *   Hostname or IP address.
+		 *
+		 * @param entry
+		 *   Details to store.  The expires field is set by this function.
+		 */
+		void store(const std::string& host, CacheEntry entry);
+
+		/// Remove the entry for a host, e.g. because it failed validation.
+		void remove(const std::string& host);
+
+	private:
+		std::string filename;
+		unsigned long ttl;
+		boost::mutex mutex;  ///< Protects everything below
+		bool loaded;
+		std::map<std::string, CacheEntry> entries;
+
+		void load();
+		void save();
+};
+
+#endif // CACHE_HPP
@@ -0,0 +1,307 @@
+/**
+ * @file   camtickler.cpp
+ * @brief  C interface to libcamtickler.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sstream>
+#include <iomanip>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "camtickler.h"
+#include "identify.hpp"
+#include "main.hpp"
+
+struct camtickler
+{
+	camtickler(const std::string& host)
+		: host(host),
+		  network(this->host)
+	{
+	}
+
+	std::string host;  ///< Network keeps a reference to this
+	Network network;
+	std::string type;
+	std::string error;
+};
+
+/// Passes everything written to it on to a camtickler_data_fn.
+class CallbackBuffer: public std::streambuf
+{
+	public:
+		CallbackBuffer(camtickler_data_fn fn, void *user)
+			: aborted(false),
+			  fn(fn),
+			  user(user)
+		{
+		}
+
+		/// true if the callback asked to stop.
+		bool aborted;
+
+	protected:
+		virtual std::streamsize xsputn(const char *s, std::streamsize n)
+		{
+			if (this->aborted) return 0;
+			if (this->fn(this->user, s, n) != 0) {
+				this->aborted = true;
+				return 0;
+			}
+			return n;
+		}
+
+		virtual int_type overflow(int_type c)
+		{
+			if (traits_type::eq_int_type(c, traits_type::eof())) {
+				return traits_type::not_eof(c);
+			}
+			char ch = traits_type::to_char_type(c);
+			if (this->xsputn(&ch, 1) != 1) return traits_type::eof();
+			return c;
+		}
+
+	private:
+		camtickler_data_fn fn;
+		void *user;
+};
+
+/// Thrown when a camtickler_value_fn asks to stop.
+struct Aborted
+{
+};
+
+/// Pass a progress update on to the caller's callback, if there is one.
+static void callProgress(camtickler_progress_fn fn, void *user,
+	unsigned long done, unsigned long total)
+{
+	if (fn) fn(user, done, total);
+	return;
+}
+
+/// Wrap a caller's progress callback, which may be NULL.
+static fn_progress wrapProgress(camtickler_progress_fn fn, void *user)
+{
+	return boost::bind(callProgress, fn, user, _1, _2);
+}
+
+/// Pass a value to the caller, stopping if they ask to.
+static void sendValue(camtickler_value_fn fn, void *user, const char *key,
+	const std::string& value)
+{
+	if (fn(user, key, value.c_str()) != 0) throw Aborted();
+	return;
+}
+
+/// Format a number in hex, zero padded.
+static std::string hex(unsigned int value, int width)
+{
+	std::ostringstream ss;
+	ss << std::hex << std::setw(width) << std::setfill('0') << value;
+	return ss.str();
+}
+
+/// Run an action, turning any exception into a status code.
+/**
+ * This must be expanded inside a function with a camtickler *cam, after
+ * the action has been run in a try block.
+ */
+#define CATCH_ERRORS \
+	catch (const Aborted&) { \
+		cam->error = "Stopped by callback"; \
+		return CAMTICKLER_ERR_ABORTED; \
+	} catch (const std::string& err) { \
+		cam->error = err; \
+		return CAMTICKLER_ERR_DEVICE; \
+	} catch (const boost::system::system_error& e) { \
+		cam->error = e.what(); \
+		return CAMTICKLER_ERR_NETWORK; \
+	} catch (const std::exception& e) { \
+		cam->error = e.what(); \
+		return CAMTICKLER_ERR_INTERNAL; \
+	} catch (...) { \
+		cam->error = "Unknown error"; \
+		return CAMTICKLER_ERR_INTERNAL; \
+	}
+
+/// Create the driver for the handle's device type, or fail with an error.
+static Device *openTyped(camtickler *cam)
+{
+	if (cam->type.empty()) {
+		cam->error = "Device type has not been set or identified";
+		return NULL;
+	}
+	Device *dev = openDevice(cam->type, &cam->network, NULL);
+	if (!dev) cam->error = "Unknown device type: " + cam->type;
+	return dev;
+}
+
+int camtickler_api_version(void)
+{
+	return CAMTICKLER_API_VERSION;
+}
+
+void camtickler_set_verbose(int level)
+{
+	verbose = level;
+	return;
+}
+
+camtickler *camtickler_open(const char *host)
+{
+	if (!host) return NULL;
+	try {
+		return new camtickler(host);
+	} catch (...) {
+		return NULL;
+	}
+}
+
+void camtickler_close(camtickler *cam)
+{
+	if (!cam) return;
+	try {
+		cam->network.ftp_close();
+	} catch (...) {
+		// The connection is going away anyway
+	}
+	delete cam;
+	return;
+}
+
+int camtickler_set_port(camtickler *cam, const char *service,
+	unsigned short port)
+{
+	if (!cam || !service) return CAMTICKLER_ERR_ARGS;
+	cam->network.set_port(service, port);
+	return CAMTICKLER_OK;
+}
+
+int camtickler_set_login(camtickler *cam, const char *username,
+	const char *password)
+{
+	if (!cam || !username || !password) return CAMTICKLER_ERR_ARGS;
+	cam->network.set_login(username, password);
+	return CAMTICKLER_OK;
+}
+
+int camtickler_set_type(camtickler *cam, const char *type)
+{
+	if (!cam || !type) return CAMTICKLER_ERR_ARGS;
+	cam->type = type;
+	return CAMTICKLER_OK;
+}
+
+const char *camtickler_type(const camtickler *cam)
+{
+	if (!cam || cam->type.empty()) return NULL;
+	return cam->type.c_str();
+}
+
+const char *camtickler_error(const camtickler *cam)
+{
+	if (!cam) return "";
+	return cam->error.c_str();
+}
+
+int camtickler_identify(camtickler *cam, camtickler_value_fn fn,
+	camtickler_progress_fn progress, void *user)
+{
+	if (!cam || !fn) return CAMTICKLER_ERR_ARGS;
+	cam->error.clear();
+	try {
+		Identify id(&cam->network, NULL, NULL, wrapProgress(progress, user));
+		std::string type = id.getType();
+		if (id.getHTTPPort() != 0) {
+			std::ostringstream port;
+			port << id.getHTTPPort();
+			sendValue(fn, user, "http_port", port.str());
+		}
+		if (!id.getUsername().empty() && !id.getPassword().empty()) {
+			sendValue(fn, user, "admin_username", id.getUsername());
+			sendValue(fn, user, "admin_password", id.getPassword());
+		}
+		if (type.compare("unknown") == 0) {
+			sendValue(fn, user, "device_type", "unknown");
+			cam->error = "Unable to identify device";
+			return CAMTICKLER_ERR_UNKNOWN;
+		}
+		cam->type = type;
+		sendValue(fn, user, "device_type", type);
+	} CATCH_ERRORS
+	return CAMTICKLER_OK;
+}
+
+int camtickler_query(camtickler *cam, camtickler_value_fn fn, void *user)
+{
+	if (!cam || !fn) return CAMTICKLER_ERR_ARGS;
+	cam->error.clear();
+	boost::scoped_ptr<Device> dev(openTyped(cam));
+	if (!dev) return CAMTICKLER_ERR_ARGS;
+	try {
+		unsigned long lenFlash;
+		dev->getFlashInfo(&lenFlash);
+		std::ostringstream flash;
+		flash << lenFlash;
+		sendValue(fn, user, "flash_size", flash.str());
+
+		std::string version = dev->getFirmwareVersion();
+		if (!version.empty()) sendValue(fn, user, "firmware_version", version);
+
+		unsigned short idVendor, idProduct;
+		unsigned char bInterfaceClass;
+		dev->getCameraInfo(&idVendor, &idProduct, &bInterfaceClass);
+		sendValue(fn, user, "camera_usb_vendor", hex(idVendor, 4));
+		sendValue(fn, user, "camera_usb_product", hex(idProduct, 4));
+		sendValue(fn, user, "camera_usb_class", hex(bInterfaceClass, 2));
+	} CATCH_ERRORS
+	return CAMTICKLER_OK;
+}
+
+int camtickler_dump(camtickler *cam, camtickler_data_fn fn,
+	camtickler_progress_fn progress, void *user)
+{
+	if (!cam || !fn) return CAMTICKLER_ERR_ARGS;
+	cam->error.clear();
+	boost::scoped_ptr<Device> dev(openTyped(cam));
+	if (!dev) return CAMTICKLER_ERR_ARGS;
+	CallbackBuffer buffer(fn, user);
+	std::ostream target(&buffer);
+	// Stop the download as soon as the callback refuses data
+	target.exceptions(std::ios::badbit | std::ios::failbit);
+	int ret = CAMTICKLER_OK;
+	try {
+		dev->getFirmware(target, wrapProgress(progress, user));
+	} catch (const std::ios_base::failure& e) {
+		if (buffer.aborted) {
+			cam->error = "Stopped by callback";
+			ret = CAMTICKLER_ERR_ABORTED;
+		} else {
+			cam->error = e.what();
+			ret = CAMTICKLER_ERR_INTERNAL;
+		}
+	} CATCH_ERRORS
+	if (ret != CAMTICKLER_OK) {
+		// The FTP session is part way through a transfer, so start a new one
+		// next time
+		try {
+			cam->network.ftp_close();
+		} catch (...) {
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,183 @@
+/**
+ * @file   camtickler.h
+ * @brief  C interface to libcamtickler.
+ *
+ * This is the only public interface to the library.  It lets a program
+ * identify, query and dump cameras without running the camtickler executable
+ * for each one.  Results are passed back through callbacks as they arrive.
+ *
+ * Each camtickler handle talks to one device and must only be used by one
+ * thread at a time, but any number of handles may be in use at once from
+ * different threads.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAMTICKLER_H
+#define CAMTICKLER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Version of this interface, increased whenever it changes. */
+#define CAMTICKLER_API_VERSION 2
+
+/** Return values. */
+enum camtickler_status {
+	CAMTICKLER_OK = 0,      /**< Success */
+	CAMTICKLER_ERR_ARGS,    /**< Invalid argument, or device type not known */
+	CAMTICKLER_ERR_UNKNOWN, /**< Device could not be identified */
+	CAMTICKLER_ERR_DEVICE,  /**< Device did not respond as expected */
+	CAMTICKLER_ERR_NETWORK, /**< Connection failed, timed out or dropped */
+	CAMTICKLER_ERR_ABORTED, /**< A callback asked to stop */
+	CAMTICKLER_ERR_INTERNAL /**< Anything else */
+};
+
+/** A connection to one device. */
+typedef struct camtickler camtickler;
+
+/** Receives one result, such as "device_type" = "maygion-mips".
+ *
+ * The keys are the same as the camtickler executable prints on stdout.  The
+ * strings are only valid until the callback returns.
+ *
+ * @return 0 to continue, anything else to stop with CAMTICKLER_ERR_ABORTED.
+ */
+typedef int (*camtickler_value_fn)(void *user, const char *key,
+	const char *value);
+
+/** Receives the next block of a firmware dump.
+ *
+ * @return 0 to continue, anything else to stop with CAMTICKLER_ERR_ABORTED.
+ */
+typedef int (*camtickler_data_fn)(void *user, const void *data, size_t len);
+
+/** Receives the progress of a transfer.
+ *
+ * @param done
+ *   Bytes transferred so far.
+ *
+ * @param total
+ *   Total bytes expected, 0 if unknown, or (unsigned long)-1 once the
+ *   transfer has finished.
+ */
+typedef void (*camtickler_progress_fn)(void *user, unsigned long done,
+	unsigned long total);
+
+/** Get the CAMTICKLER_API_VERSION the library was built with. */
+int camtickler_api_version(void);
+
+/** Set how much is written to stderr, 0 for nothing (the default).
+ *
+ * This affects every handle.
+ */
+void camtickler_set_verbose(int level);
+
+/** Create a handle for a device.
+ *
+ * No connection is made until one of the actions is called.
+ *
+ * @param host
+ *   Hostname or IP address of the device.
+ *
+ * @return New handle to free with camtickler_close(), or NULL if out of
+ *   memory or host is NULL.
+ */
+camtickler *camtickler_open(const char *host);
+
+/** Close any connections and free a handle. */
+void camtickler_close(camtickler *cam);
+
+/** Use a non-standard port for a service.
+ *
+ * @param service
+ *   "http", "ftp" or "telnet".
+ *
+ * @param port
+ *   Port number to connect to.
+ */
+int camtickler_set_port(camtickler *cam, const char *service,
+	unsigned short port);
+
+/** Log in to the device's web interface with a different account.
+ *
+ * Only needed if the admin login has been changed from the factory default.
+ *
+ * @param username
+ *   Admin username, or an empty string to go back to the factory login.
+ *
+ * @param password
+ *   Password for username.
+ */
+int camtickler_set_login(camtickler *cam, const char *username,
+	const char *password);
+
+/** Set the device type instead of identifying it.
+ *
+ * @param type
+ *   Device type, as reported in device_type by camtickler_identify().
+ */
+int camtickler_set_type(camtickler *cam, const char *type);
+
+/** Get the device type, or NULL if it has not been set or identified. */
+const char *camtickler_type(const camtickler *cam);
+
+/** Get a description of the last error, or an empty string if none.
+ *
+ * The string is valid until the next call using the same handle.
+ */
+const char *camtickler_error(const camtickler *cam);
+
+/** Work out what type of device this is.
+ *
+ * Reports http_port, admin_username and admin_password if they could be
+ * found, then device_type.  On success the type is used by later calls.
+ *
+ * @param progress
+ *   Called while any config files are downloaded, or NULL.
+ */
+int camtickler_identify(camtickler *cam, camtickler_value_fn fn,
+	camtickler_progress_fn progress, void *user);
+
+/** Read the device's flash size and camera IDs.
+ *
+ * Reports flash_size (decimal), camera_usb_vendor, camera_usb_product and
+ * camera_usb_class (hex), then firmware_version if the device reports one.
+ * The type must have been set or identified first.
+ */
+int camtickler_query(camtickler *cam, camtickler_value_fn fn, void *user);
+
+/** Download the device's firmware.
+ *
+ * The type must have been set or identified first.
+ *
+ * @param fn
+ *   Called with each block of data as it arrives.
+ *
+ * @param progress
+ *   Called as the download progresses, or NULL.
+ */
+int camtickler_dump(camtickler *cam, camtickler_data_fn fn,
+	camtickler_progress_fn progress, void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAMTICKLER_H */
@@ -0,0 +1,454 @@
+/**
+ * @file   capture.cpp
+ * @brief  Recording and replaying of device sessions.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <boost/thread/thread.hpp>
+#include "main.hpp"
+#include "capture.hpp"
+
+#define CAPTURE_SIGNATURE     "CTCAP001"
+#define CAPTURE_SIGNATURE_LEN 8
+
+/// Error categories as stored in the file.
+enum {
+	CATEGORY_SYSTEM = 0,
+	CATEGORY_MISC = 1,     ///< boost::asio::error::eof and friends
+	CATEGORY_NETDB = 2,    ///< boost::asio::error::host_not_found and friends
+	CATEGORY_ADDRINFO = 3  ///< boost::asio::error::service_not_found
+};
+
+static void put_varint(std::string *out, uint64_t v)
+{
+	while (v >= 0x80) {
+		*out += (char)((v & 0x7F) | 0x80);
+		v >>= 7;
+	}
+	*out += (char)v;
+	return;
+}
+
+static bool get_varint(const std::string& in, std::string::size_type *pos,
+	uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*pos >= in.length()) return false;
+		uint8_t c = in[(*pos)++];
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) return true;
+	}
+	return false;
+}
+
+/// Connection that logs everything passing through it to a capture file.
+class RecordingConnection: virtual public Connection
+{
+	public:
+		RecordingConnection(CaptureWriter *capture, unsigned long id,
+			boost::shared_ptr<Connection> conn)
+			: capture(capture),
+			  id(id),
+			  conn(conn),
+			  closed(false)
+		{
+		}
+
+		virtual ~RecordingConnection()
+		{
+			if (!this->closed) this->capture->write(this->id, CaptureEvent::Closed, NULL, 0);
+		}
+
+		virtual std::size_t read(void *data, std::size_t len,
+			boost::system::error_code& error)
+		{
+			std::size_t lenRead = this->conn->read(data, len, error);
+			if (lenRead) this->capture->write(this->id, CaptureEvent::Received, data, lenRead);
+			if (error) this->capture->write(this->id, CaptureEvent::Error, error);
+			return lenRead;
+		}
+
+		virtual std::size_t write(const void *data, std::size_t len,
+			boost::system::error_code& error)
+		{
+			std::size_t lenWritten = this->conn->write(data, len, error);
+			if (lenWritten) this->capture->write(this->id, CaptureEvent::Sent, data, lenWritten);
+			return lenWritten;
+		}
+
+		virtual void close()
+		{
+			this->conn->close();
+			if (!this->closed) this->capture->write(this->id, CaptureEvent::Closed, NULL, 0);
+			this->closed = true;
+			return;
+		}
+
+	private:
+		CaptureWriter *capture;
+		unsigned long id;
+		boost::shared_ptr<Connection> conn;
+		bool closed;
+};
+
+CaptureWriter::CaptureWriter(const std::string& filename)
+	: file(filename.c_str(), std::ios::out | std::ios::trunc | std::ios::binary),
+	  nextId(0),
+	  last(boost::posix_time::microsec_clock::universal_time())
+{
+	if (!this->file.is_open()) {
+		throw std::string("Unable to create capture file " + filename);
+	}
+	this->file.write(CAPTURE_SIGNATURE, CAPTURE_SIGNATURE_LEN);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+}
+
+boost::shared_ptr<Connection> CaptureWriter::connect(const std::string& host,
+	const std::string& service, const std::string& port, unsigned int timeout)
+{
+	unsigned long id;
+	{
+		boost::mutex::scoped_lock lock(this->mutex);
+		id = this->nextId++;
+	}
+	std::string target = host;
+	target += '\0';
+	target += service;
+	this->write(id, CaptureEvent::Open, target.data(), target.length());
+
+	boost::shared_ptr<Connection> conn;
+	try {
+		conn.reset(new TcpConnection(host, port, timeout));
+	} catch (const boost::system::system_error& e) {
+		this->write(id, CaptureEvent::Failed, e.code());
+		throw;
+	}
+	this->write(id, CaptureEvent::Connected, NULL, 0);
+	return boost::shared_ptr<Connection>(new RecordingConnection(this, id, conn));
+}
+
+void CaptureWriter::write(unsigned long id, char type, const void *data,
+	std::size_t len)
+{
+	boost::mutex::scoped_lock lock(this->mutex);
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+	std::string header;
+	header += type;
+	put_varint(&header, id);
+	put_varint(&header, (now - this->last).total_microseconds());
+	put_varint(&header, len);
+	this->file.write(header.data(), header.length());
+	if (len) this->file.write((const char *)data, len);
+	this->last = now;
+
+	// Keep the file usable if we are killed part way through
+	if (type == CaptureEvent::Closed) this->file.flush();
+	return;
+}
+
+void CaptureWriter::write(unsigned long id, char type,
+	const boost::system::error_code& error)
+{
+	std::string data;
+	if (error.category() == boost::asio::error::get_misc_category()) {
+		data += (char)CATEGORY_MISC;
+	} else if (error.category() == boost::asio::error::get_netdb_category()) {
+		data += (char)CATEGORY_NETDB;
+	} else if (error.category() == boost::asio::error::get_addrinfo_category()) {
+		data += (char)CATEGORY_ADDRINFO;
+	} else {
+		data += (char)CATEGORY_SYSTEM;
+	}
+	put_varint(&data, error.value());
+	this->write(id, type, data.data(), data.length());
+	return;
+}
+
+/// Connection that plays back a recorded one.
+class ReplayConnection: virtual public Connection
+{
+	public:
+		/// Replay a connection.
+		/**
+		 * @throw boost::system::system_error if the recorded connection attempt
+		 *   failed.
+		 */
+		ReplayConnection(const CapturedConnection *conn, double speed)
+			: conn(conn),
+			  speed(speed),
+			  pos(0),
+			  offset(0),
+			  lastReal(boost::posix_time::microsec_clock::universal_time()),
+			  lastRec(conn->events.empty() ? 0 : conn->events[0].time)
+		{
+			// Reproduce the time taken to connect
+			for (this->pos = 1; this->pos < this->conn->events.size(); this->pos++) {
+				const CaptureEvent& ev = this->conn->events[this->pos];
+				if (ev.type == CaptureEvent::Connected) {
+					this->wait(ev);
+					this->pos++;
+					break;
+				} else if (ev.type == CaptureEvent::Failed) {
+					this->wait(ev);
+					throw boost::system::system_error(ev.error);
+				}
+			}
+		}
+
+		virtual std::size_t read(void *data, std::size_t len,
+			boost::system::error_code& error)
+		{
+			// Anything we didn't send ourselves was presumably sent differently
+			this->skip(CaptureEvent::Sent);
+			if (this->pos >= this->conn->events.size()) {
+				error = boost::asio::error::eof;
+				return 0;
+			}
+			const CaptureEvent& ev = this->conn->events[this->pos];
+			if (ev.type == CaptureEvent::Received) {
+				if (this->offset == 0) this->wait(ev);
+				std::size_t lenRead = std::min(len, ev.data.length() - this->offset);
+				memcpy(data, ev.data.data() + this->offset, lenRead);
+				this->offset += lenRead;
+				if (this->offset >= ev.data.length()) {
+					this->pos++;
+					this->offset = 0;
+				}
+				return lenRead;
+			}
+			this->wait(ev);
+			if (ev.type == CaptureEvent::Error) {
+				error = ev.error;
+				this->pos++;
+			} else {
+				error = boost::asio::error::eof;
+			}
+			return 0;
+		}
+
+		virtual std::size_t write(const void *data, std::size_t len,
+			boost::system::error_code& error)
+		{
+			// Match the data against what was originally sent, so the read that
+			// follows is timed from the right point.
+			std::size_t matched = 0;
+			while ((matched < len) && (this->pos < this->conn->events.size())) {
+				const CaptureEvent& ev = this->conn->events[this->pos];
+				if (ev.type != CaptureEvent::Sent) break;
+				std::size_t lenEvent = std::min(len - matched, ev.data.length() - this->offset);
+				if (
+					(verbose > 1)
+					&& (ev.data.compare(this->offset, lenEvent,
+						(const char *)data + matched, lenEvent) != 0)
+				) {
+					std::cerr << "[replay] Data sent to " << this->conn->service
+						<< " differs from capture" << std::endl;
+				}
+				matched += lenEvent;
+				this->offset += lenEvent;
+				if (this->offset >= ev.data.length()) {
+					this->lastRec = ev.time;
+					this->pos++;
+					this->offset = 0;
+				}
+			}
+			this->lastReal = boost::posix_time::microsec_clock::universal_time();
+			return len;
+		}
+
+		virtual void close()
+		{
+			return;
+		}
+
+	private:
+		const CapturedConnection *conn;
+		double speed;
+		std::size_t pos;     ///< Index of next event in conn->events
+		std::size_t offset;  ///< Bytes of current event already consumed
+		boost::posix_time::ptime lastReal; ///< Wall time of last event
+		uint64_t lastRec;    ///< Capture time of last event
+
+		/// Skip over any events of the given type.
+		void skip(char type)
+		{
+			while (
+				(this->pos < this->conn->events.size())
+				&& (this->conn->events[this->pos].type == type)
+			) {
+				this->lastRec = this->conn->events[this->pos].time;
+				this->pos++;
+				this->offset = 0;
+			}
+			return;
+		}
+
+		/// Wait until it is time for the given event to happen.
+		/**
+		 * The delay is relative to the previous event on this connection, so
+		 * time spent by the caller between calls is not counted twice.
+		 */
+		void wait(const CaptureEvent& ev)
+		{
+			if ((this->speed > 0) && (ev.time > this->lastRec)) {
+				boost::posix_time::ptime due = this->lastReal
+					+ boost::posix_time::microseconds((long)((ev.time - this->lastRec) / this->speed));
+				boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+				if (due > now) {
+					boost::this_thread::sleep(due - now);
+					this->lastReal = due;
+				} else {
+					this->lastReal = now;
+				}
+			} else {
+				this->lastReal = boost::posix_time::microsec_clock::universal_time();
+			}
+			this->lastRec = ev.time;
+			return;
+		}
+};
+
+CaptureReader::CaptureReader(const std::string& filename, double speed)
+	: speed(speed)
+{
+	std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		throw std::string("Unable to open capture file " + filename);
+	}
+	std::string content((std::istreambuf_iterator<char>(file)),
+		std::istreambuf_iterator<char>());
+	if (content.compare(0, CAPTURE_SIGNATURE_LEN, CAPTURE_SIGNATURE) != 0) {
+		throw std::string(filename + " is not a capture file");
+	}
+
+	std::map<uint64_t, std::size_t> index; // connection number -> conns[]
+	std::string::size_type pos = CAPTURE_SIGNATURE_LEN;
+	uint64_t time = 0;
+	while (pos < content.length()) {
+		CaptureEvent ev;
+		ev.type = content[pos++];
+		uint64_t id, delta, len;
+		if (
+			!get_varint(content, &pos, &id)
+			|| !get_varint(content, &pos, &delta)
+			|| !get_varint(content, &pos, &len)
+			|| (len > content.length() - pos)
+		) {
+			// Most likely the program recording was killed
+			if (verbose) std::cerr << "[replay] Capture file is truncated" << std::endl;
+			break;
+		}
+		time += delta;
+		ev.time = time;
+		ev.data = content.substr(pos, len);
+		pos += len;
+
+		if (ev.type == CaptureEvent::Open) {
+			std::string::size_type sep = ev.data.find('\0');
+			if (sep == std::string::npos) {
+				throw std::string(filename + " is corrupted (bad open record)");
+			}
+			CapturedConnection conn;
+			conn.host = ev.data.substr(0, sep);
+			conn.service = ev.data.substr(sep + 1);
+			conn.used = false;
+			index[id] = this->conns.size();
+			this->conns.push_back(conn);
+		}
+		std::map<uint64_t, std::size_t>::const_iterator c = index.find(id);
+		if (c == index.end()) {
+			throw std::string(filename + " is corrupted (unknown connection)");
+		}
+
+		if ((ev.type == CaptureEvent::Failed) || (ev.type == CaptureEvent::Error)) {
+			std::string::size_type p = 1;
+			uint64_t value;
+			if (ev.data.empty() || !get_varint(ev.data, &p, &value)) {
+				throw std::string(filename + " is corrupted (bad error record)");
+			}
+			switch (ev.data[0]) {
+				case CATEGORY_MISC:
+					ev.error.assign(value, boost::asio::error::get_misc_category());
+					break;
+				case CATEGORY_NETDB:
+					ev.error.assign(value, boost::asio::error::get_netdb_category());
+					break;
+				case CATEGORY_ADDRINFO:
+					ev.error.assign(value, boost::asio::error::get_addrinfo_category());
+					break;
+				default:
+					ev.error.assign(value, boost::system::system_category());
+					break;
+			}
+			ev.data.clear();
+		}
+		this->conns[c->second].events.push_back(ev);
+	}
+	if (verbose) std::cerr << "[replay] Loaded " << this->conns.size()
+		<< " connections from " << filename << std::endl;
+}
+
+std::vector<std::string> CaptureReader::hosts() const
+{
+	std::vector<std::string> hosts;
+	for (std::vector<CapturedConnection>::const_iterator i = this->conns.begin();
+		i != this->conns.end(); i++
+	) {
+		if (std::find(hosts.begin(), hosts.end(), i->host) == hosts.end()) {
+			hosts.push_back(i->host);
+		}
+	}
+	return hosts;
+}
+
+boost::shared_ptr<Connection> CaptureReader::connect(const std::string& host,
+	const std::string& service)
+{
+	CapturedConnection *conn = NULL;
+	{
+		boost::mutex::scoped_lock lock(this->mutex);
+		for (std::vector<CapturedConnection>::iterator i = this->conns.begin();
+			i != this->conns.end(); i++
+		) {
+			if (
+				!i->used
+				&& (i->host.compare(host) == 0)
+				&& (i->service.compare(service) == 0)
+			) {
+				i->used = true;
+				conn = &*i;
+				break;
+			}
+		}
+	}
+	if (!conn) {
+		if (verbose) std::cerr << "[replay] No more connections to " << service
+			<< " on " << host << " in capture" << std::endl;
+		throw boost::system::system_error(boost::asio::error::connection_refused);
+	}
+	if (verbose) std::cerr << "[replay] Replaying connection to " << service
+		<< " on " << host << std::endl;
+	return boost::shared_ptr<Connection>(new ReplayConnection(conn, this->speed));
+}
@@ -0,0 +1,177 @@
+/**
+ * @file   capture.hpp
+ * @brief  Recording and replaying of device sessions.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "connection.hpp"
+
+/// Writes every connection made and every byte exchanged to a capture file.
+/**
+ * The file starts with the signature "CTCAP001", followed by one record per
+ * event:
+ *
+ *   - event type (one byte, see CaptureEvent::Type)
+ *   - connection number (varint)
+ *   - microseconds since the previous record (varint)
+ *   - length of data (varint)
+ *   - data
+ *
+ * Varints are little-endian base-128, as used by protobuf.  For open events
+ * the data is the hostname and service name separated by a NUL, and for
+ * errors it is the error category (one byte) followed by the error value
+ * (varint).
+ */
+class CaptureWriter
+{
+	public:
+		/// Create a new capture file.
+		/**
+		 * @param filename
+		 *   File to write.  Any existing file is overwritten.
+		 *
+		 * @throw std::string if the file could not be created.
+		 */
+		CaptureWriter(const std::string& filename);
+		~CaptureWriter();
+
+		/// Connect to a device service, recording the connection.
+		/**
+		 * @param host
+		 *   Hostname or IP address.
+		 *
+		 * @param service
+		 *   Service name, e.g. "ftp".  This is what is matched on replay.
+		 *
+		 * @param port
+		 *   Service name or port number to actually connect to.
+		 *
+		 * @param timeout
+		 *   Seconds to wait for the device, as for TcpConnection.
+		 *
+		 * @throw boost::system::system_error if the connection could not be
+		 *   established.  The failure is recorded too.
+		 */
+		boost::shared_ptr<Connection> connect(const std::string& host,
+			const std::string& service, const std::string& port,
+			unsigned int timeout);
+
+		/// Add a record to the file.
+		/**
+		 * @param id
+		 *   Connection number.
+		 *
+		 * @param type
+		 *   Event type.
+		 *
+		 * @param data
+		 *   Record data.
+		 *
+		 * @param len
+		 *   Length of data.
+		 */
+		void write(unsigned long id, char type, const void *data, std::size_t len);
+
+		/// Add an error record to the file.
+		void write(unsigned long id, char type, const boost::system::error_code& error);
+
+	private:
+		std::ofstream file;
+		boost::mutex mutex;  ///< Protects everything below
+		unsigned long nextId;
+		boost::posix_time::ptime last; ///< Time of last record
+};
+
+/// One record from a capture file.
+struct CaptureEvent
+{
+	enum Type {
+		Open = 'O',      ///< Connection attempt started
+		Connected = 'K', ///< Connection established
+		Failed = 'F',    ///< Connection attempt failed
+		Received = 'R',  ///< Data received from device
+		Sent = 'W',      ///< Data sent to device
+		Error = 'E',     ///< Read failed (including end of stream)
+		Closed = 'C'     ///< Connection closed
+	};
+	char type;
+	uint64_t time;  ///< Microseconds since start of capture
+	std::string data;
+	boost::system::error_code error;
+};
+
+/// Everything that happened on a single recorded connection.
+struct CapturedConnection
+{
+	std::string host;
+	std::string service;
+	std::vector<CaptureEvent> events;
+	bool used;       ///< true once handed out by CaptureReader::connect()
+};
+
+/// Serves connections from a capture file in place of real devices.
+class CaptureReader
+{
+	public:
+		/// Load a capture file.
+		/**
+		 * @param filename
+		 *   File written by CaptureWriter.
+		 *
+		 * @param speed
+		 *   Playback speed.  1 reproduces the original timing, 2 runs twice as
+		 *   fast and so on.  0 returns data as soon as it is asked for.
+		 *
+		 * @throw std::string if the file could not be read.
+		 */
+		CaptureReader(const std::string& filename, double speed);
+
+		/// Get the hosts connected to in the capture.
+		/**
+		 * @return A list of hostnames, in the order they were first used.
+		 */
+		std::vector<std::string> hosts() const;
+
+		/// Replay the next recorded connection to the given service.
+		/**
+		 * Connections to each host and service are returned in the order they
+		 * were originally made.
+		 *
+		 * @throw boost::system::system_error if the original connection failed,
+		 *   or if there are no more recorded connections to this service.
+		 */
+		boost::shared_ptr<Connection> connect(const std::string& host,
+			const std::string& service);
+
+	private:
+		std::vector<CapturedConnection> conns;
+		double speed;
+		boost::mutex mutex;  ///< Protects CapturedConnection::used
+};
+
+#endif // CAPTURE_HPP
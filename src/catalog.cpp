@@ -0,0 +1,405 @@
+/**
+ * @file   catalog.cpp
+ * @brief  Catalog of known firmware, searched by content similarity.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <utility>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "catalog.hpp"
+#include "checksum.hpp"
+#include "fileutil.hpp"
+#include "main.hpp"
+
+/// Identifies a catalog file.
+#define CATALOG_SIGNATURE "CTCATLOG"
+
+/// Format version, changed whenever the file or the hashing changes.
+#define CATALOG_VERSION 1
+
+#define CATALOG_HEADER_LEN 32
+
+/// Bytes in each record of the band table.
+#define CATALOG_BAND_LEN 12
+
+#define CATALOG_BANDS (CATALOG_SIGNATURE_LEN / CATALOG_BAND_ROWS)
+
+// The file is laid out as:
+//
+//   header      signature, version, block size, image count, band count
+//   offsets     u64 position of each image's entry
+//   bands       u64 band hash, u32 image number; sorted by band hash
+//   entries     u32 name length, name, u32 block count, u32 signature[],
+//               u32 blocks[] (sorted)
+//
+// All numbers in the file are little-endian.
+
+/// Scramble a 64-bit value (the splitmix64 finaliser).
+static uint64_t mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/// Check whether a block hash is that of an erased or zeroed block, which
+/// says nothing about which firmware an image holds.
+static bool isBlank(uint32_t hash)
+{
+	// Worked out on first use, as the cksum table may not be ready before main()
+	static const std::string erased(CATALOG_BLOCK_SIZE, '\xFF');
+	static const std::string zeroed(CATALOG_BLOCK_SIZE, '\0');
+	static const uint32_t blankErased = posix_cksum(erased.data(), erased.length());
+	static const uint32_t blankZeroed = posix_cksum(zeroed.data(), zeroed.length());
+	return (hash == blankErased) || (hash == blankZeroed);
+}
+
+/// Turn block hashes into a sorted set, without the blank blocks.
+static void blockSet(const std::vector<uint32_t>& hashes, std::vector<uint32_t> *set)
+{
+	set->clear();
+	for (std::vector<uint32_t>::const_iterator i = hashes.begin();
+		i != hashes.end(); i++
+	) {
+		if (!isBlank(*i)) set->push_back(*i);
+	}
+	std::sort(set->begin(), set->end());
+	set->erase(std::unique(set->begin(), set->end()), set->end());
+	return;
+}
+
+/// Work out the MinHash signature of a set of blocks.
+/**
+ * Each value is the smallest of a different hash of every block, so two sets
+ * have the same value in a given position about as often as a block chosen
+ * from both sets at random is in each of them.
+ */
+static void signature(const std::vector<uint32_t>& blocks, uint32_t *sig)
+{
+	for (int k = 0; k < CATALOG_SIGNATURE_LEN; k++) sig[k] = 0xFFFFFFFF;
+	for (std::vector<uint32_t>::const_iterator i = blocks.begin();
+		i != blocks.end(); i++
+	) {
+		uint64_t h = mix64(*i);
+		for (int k = 0; k < CATALOG_SIGNATURE_LEN; k++) {
+			uint32_t v = mix64(h + (k + 1) * 0x9E3779B97F4A7C15ULL) >> 32;
+			if (v < sig[k]) sig[k] = v;
+		}
+	}
+	return;
+}
+
+/// Hash one band of a signature, together with which band it is.
+static uint64_t bandKey(const uint32_t *sig, unsigned int band)
+{
+	uint64_t key = band + 1;
+	for (int r = 0; r < CATALOG_BAND_ROWS; r++) {
+		key = mix64(key * 0x9E3779B97F4A7C15ULL + sig[band * CATALOG_BAND_ROWS + r]);
+	}
+	return key;
+}
+
+/// Order matches most similar first, then by name.
+static bool moreSimilar(const CatalogMatch& a, const CatalogMatch& b)
+{
+	if (a.similarity != b.similarity) return a.similarity > b.similarity;
+	return a.name.compare(b.name) < 0;
+}
+
+FirmwareCatalog::FirmwareCatalog(const std::string& filename)
+	: filename(filename.empty() ? defaultPath() : filename),
+	  map(NULL),
+	  len(0),
+	  count(0),
+	  bandCount(0),
+	  loaded(false)
+{
+	if (this->filename.empty()) {
+		throw std::string("no catalog file, set --catalog or $HOME");
+	}
+	this->mapFile();
+}
+
+FirmwareCatalog::~FirmwareCatalog()
+{
+	this->unmap();
+}
+
+std::string FirmwareCatalog::defaultPath()
+{
+	const char *xdg = getenv("XDG_DATA_HOME");
+	if (xdg && xdg[0]) return std::string(xdg) + "/camtickler/catalog";
+	const char *home = getenv("HOME");
+	if (home && home[0]) return std::string(home) + "/.local/share/camtickler/catalog";
+	return std::string();
+}
+
+void FirmwareCatalog::blockHashes(const char *data, size_t len,
+	std::vector<uint32_t> *hashes)
+{
+	hashes->clear();
+	for (size_t pos = 0; pos + CATALOG_BLOCK_SIZE <= len; pos += CATALOG_BLOCK_SIZE) {
+		hashes->push_back(posix_cksum(data + pos, CATALOG_BLOCK_SIZE));
+	}
+	return;
+}
+
+unsigned long FirmwareCatalog::size() const
+{
+	return this->loaded ? this->entries.size() : this->count;
+}
+
+void FirmwareCatalog::add(const std::string& name,
+	const std::vector<uint32_t>& hashes)
+{
+	if (!this->loaded) {
+		this->entries.resize(this->count);
+		for (unsigned long i = 0; i < this->count; i++) {
+			this->readEntry(i, &this->entries[i]);
+		}
+		this->loaded = true;
+	}
+
+	Entry entry;
+	entry.name = name;
+	blockSet(hashes, &entry.blocks);
+	signature(entry.blocks, entry.signature);
+	for (std::vector<Entry>::iterator i = this->entries.begin();
+		i != this->entries.end(); i++
+	) {
+		if (i->name.compare(name) == 0) {
+			*i = entry;
+			return;
+		}
+	}
+	this->entries.push_back(entry);
+	return;
+}
+
+void FirmwareCatalog::save()
+{
+	if (!this->loaded) return; // nothing added
+
+	// Images with no blocks worth comparing can never match, so have no bands
+	std::vector<std::pair<uint64_t, uint32_t> > bands;
+	for (unsigned long i = 0; i < this->entries.size(); i++) {
+		if (this->entries[i].blocks.empty()) continue;
+		for (unsigned int b = 0; b < CATALOG_BANDS; b++) {
+			bands.push_back(std::make_pair(bandKey(this->entries[i].signature, b),
+				(uint32_t)i));
+		}
+	}
+	std::sort(bands.begin(), bands.end());
+
+	std::string out(CATALOG_SIGNATURE);
+	append32le(&out, CATALOG_VERSION);
+	append32le(&out, CATALOG_BLOCK_SIZE);
+	append32le(&out, this->entries.size());
+	append32le(&out, bands.size());
+	out.resize(CATALOG_HEADER_LEN, '\0');
+
+	uint64_t pos = CATALOG_HEADER_LEN + this->entries.size() * 8
+		+ bands.size() * CATALOG_BAND_LEN;
+	for (std::vector<Entry>::const_iterator i = this->entries.begin();
+		i != this->entries.end(); i++
+	) {
+		append64le(&out, pos);
+		pos += 8 + i->name.length() + (CATALOG_SIGNATURE_LEN + i->blocks.size()) * 4;
+	}
+	for (std::vector<std::pair<uint64_t, uint32_t> >::const_iterator i = bands.begin();
+		i != bands.end(); i++
+	) {
+		append64le(&out, i->first);
+		append32le(&out, i->second);
+	}
+	for (std::vector<Entry>::const_iterator i = this->entries.begin();
+		i != this->entries.end(); i++
+	) {
+		append32le(&out, i->name.length());
+		out.append(i->name);
+		append32le(&out, i->blocks.size());
+		for (int k = 0; k < CATALOG_SIGNATURE_LEN; k++) append32le(&out, i->signature[k]);
+		for (std::vector<uint32_t>::const_iterator b = i->blocks.begin();
+			b != i->blocks.end(); b++
+		) {
+			append32le(&out, *b);
+		}
+	}
+
+	replaceFile(this->filename, out);
+	this->unmap();
+	this->mapFile();
+	return;
+}
+
+void FirmwareCatalog::match(const std::vector<uint32_t>& hashes,
+	unsigned int count, std::vector<CatalogMatch> *matches) const
+{
+	matches->clear();
+	std::vector<uint32_t> blocks;
+	blockSet(hashes, &blocks);
+	if (blocks.empty() || !this->map) return;
+	uint32_t sig[CATALOG_SIGNATURE_LEN];
+	signature(blocks, sig);
+
+	// Any image sharing a whole band with this one is a candidate
+	const unsigned char *table = (const unsigned char *)this->map
+		+ CATALOG_HEADER_LEN + this->count * 8;
+	std::vector<uint32_t> candidates;
+	for (unsigned int b = 0; b < CATALOG_BANDS; b++) {
+		uint64_t key = bandKey(sig, b);
+		unsigned long lo = 0, hi = this->bandCount;
+		while (lo < hi) {
+			unsigned long mid = lo + (hi - lo) / 2;
+			if (get64le(table + mid * CATALOG_BAND_LEN) < key) lo = mid + 1;
+			else hi = mid;
+		}
+		for (; lo < this->bandCount; lo++) {
+			const unsigned char *rec = table + lo * CATALOG_BAND_LEN;
+			if (get64le(rec) != key) break;
+			candidates.push_back(get32le(rec + 8));
+		}
+	}
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()),
+		candidates.end());
+	if (verbose) std::cerr << "[catalog] comparing " << candidates.size()
+		<< " of " << this->count << " images" << std::endl;
+
+	// Then compare the candidates properly
+	Entry entry;
+	for (std::vector<uint32_t>::const_iterator i = candidates.begin();
+		i != candidates.end(); i++
+	) {
+		this->readEntry(*i, &entry);
+		unsigned long shared = 0;
+		std::vector<uint32_t>::const_iterator a = blocks.begin(), b = entry.blocks.begin();
+		while ((a != blocks.end()) && (b != entry.blocks.end())) {
+			if (*a < *b) a++;
+			else if (*b < *a) b++;
+			else {
+				shared++;
+				a++;
+				b++;
+			}
+		}
+		if (shared == 0) continue;
+		CatalogMatch m;
+		m.name = entry.name;
+		m.sharedBlocks = shared;
+		m.similarity = (double)shared / (blocks.size() + entry.blocks.size() - shared);
+		matches->push_back(m);
+	}
+	std::sort(matches->begin(), matches->end(), moreSimilar);
+	if (matches->size() > count) matches->resize(count);
+	return;
+}
+
+void FirmwareCatalog::mapFile()
+{
+	int fd = open(this->filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return; // empty catalog
+		throw "unable to open " + this->filename + ": " + strerror(errno);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		std::string err = strerror(errno);
+		close(fd);
+		throw "unable to read " + this->filename + ": " + err;
+	}
+	if (st.st_size < CATALOG_HEADER_LEN) {
+		close(fd);
+		throw "catalog " + this->filename + " is damaged";
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		throw "unable to read " + this->filename + ": " + strerror(errno);
+	}
+	this->map = map;
+	this->len = st.st_size;
+
+	const unsigned char *header = (const unsigned char *)map;
+	if (memcmp(header, CATALOG_SIGNATURE, 8) != 0) {
+		this->unmap();
+		throw this->filename + " is not a firmware catalog";
+	}
+	if ((get32le(header + 8) != CATALOG_VERSION)
+		|| (get32le(header + 12) != CATALOG_BLOCK_SIZE)
+	) {
+		this->unmap();
+		throw "catalog " + this->filename + " was made by a different version, "
+			"add the images to a new one";
+	}
+	this->count = get32le(header + 16);
+	this->bandCount = get32le(header + 20);
+	if ((uint64_t)CATALOG_HEADER_LEN + (uint64_t)this->count * 8
+		+ (uint64_t)this->bandCount * CATALOG_BAND_LEN > this->len
+	) {
+		this->unmap();
+		throw "catalog " + this->filename + " is damaged";
+	}
+	return;
+}
+
+void FirmwareCatalog::unmap()
+{
+	if (this->map) munmap(this->map, this->len);
+	this->map = NULL;
+	this->len = 0;
+	this->count = 0;
+	this->bandCount = 0;
+	return;
+}
+
+void FirmwareCatalog::readEntry(unsigned long index, Entry *entry) const
+{
+	const unsigned char *base = (const unsigned char *)this->map;
+	uint64_t pos = (index < this->count)
+		? get64le(base + CATALOG_HEADER_LEN + index * 8) : this->len;
+
+	uint64_t nameLen = (pos + 4 <= this->len) ? get32le(base + pos) : this->len;
+	if (pos + 8 + nameLen > this->len) {
+		throw "catalog " + this->filename + " is damaged";
+	}
+	entry->name.assign((const char *)base + pos + 4, nameLen);
+	pos += 4 + nameLen;
+	uint64_t blocks = get32le(base + pos);
+	pos += 4;
+	if (pos + (CATALOG_SIGNATURE_LEN + blocks) * 4 > this->len) {
+		throw "catalog " + this->filename + " is damaged";
+	}
+	for (int k = 0; k < CATALOG_SIGNATURE_LEN; k++) {
+		entry->signature[k] = get32le(base + pos);
+		pos += 4;
+	}
+	entry->blocks.resize(blocks);
+	for (uint64_t b = 0; b < blocks; b++) {
+		entry->blocks[b] = get32le(base + pos);
+		pos += 4;
+	}
+	return;
+}
@@ -0,0 +1,173 @@
+/**
+ * @file   catalog.hpp
+ * @brief  Catalog of known firmware, searched by content similarity.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CATALOG_HPP
+#define CATALOG_HPP
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Bytes covered by each block hash, small enough to match a typical erase
+/// block so the device can hash it with dd and cksum.
+#define CATALOG_BLOCK_SIZE 65536
+
+/// Number of minimum hashes kept for each image.
+#define CATALOG_SIGNATURE_LEN 64
+
+/// Minimum hashes combined into each LSH band.  Two gives a good chance of
+/// finding images with as little as a fifth of their blocks in common.
+#define CATALOG_BAND_ROWS 2
+
+/// A catalog entry similar to the image being looked up.
+struct CatalogMatch
+{
+	std::string name;
+	double similarity;         ///< Jaccard index of the two sets of blocks
+	unsigned long sharedBlocks; ///< Distinct blocks found in both
+};
+
+/// A file of reference firmware images, indexed for finding similar ones.
+/**
+ * Each image is reduced to the set of cksum values of its 64 kB blocks,
+ * leaving out erased and zeroed blocks as every image has those.  A MinHash
+ * signature of the set is split into bands, and a sorted table of band hashes
+ * leads from an image to those catalog entries likely to share many blocks
+ * with it.  Only those candidates are then compared block by block.
+ *
+ * The file is memory-mapped and searched in place, so a lookup only reads
+ * the parts it needs no matter how many images the catalog holds.
+ */
+class FirmwareCatalog
+{
+	public:
+		/// Open the catalog.
+		/**
+		 * @param filename
+		 *   Catalog file.  It need not exist yet.  If empty, the default
+		 *   location returned by defaultPath() is used.
+		 *
+		 * @throw std::string if the file is damaged, or filename is empty and
+		 *   there is no default.
+		 */
+		FirmwareCatalog(const std::string& filename);
+
+		~FirmwareCatalog();
+
+		/// Get the default catalog location.
+		/**
+		 * @return $XDG_DATA_HOME/camtickler/catalog, falling back to
+		 *   $HOME/.local/share/camtickler/catalog.  Empty if neither is set.
+		 */
+		static std::string defaultPath();
+
+		/// Get the hash of each block of an image, as the catalog uses them.
+		/**
+		 * These are the same values the POSIX cksum command prints for each
+		 * CATALOG_BLOCK_SIZE block, so they can be worked out on a device
+		 * instead.  A partial block at the end is left out.
+		 *
+		 * @param hashes
+		 *   On return, one value per block in image order.
+		 */
+		static void blockHashes(const char *data, size_t len,
+			std::vector<uint32_t> *hashes);
+
+		/// Number of images in the catalog.
+		unsigned long size() const;
+
+		/// Add an image, replacing any already stored under the same name.
+		/**
+		 * Nothing is written until save() is called.
+		 *
+		 * @param name
+		 *   Name of the firmware build, e.g. "maygion-mips 2.4.1 (2012-06-05)".
+		 *
+		 * @param hashes
+		 *   Block hashes from blockHashes().
+		 *
+		 * @throw std::string if the catalog could not be read.
+		 */
+		void add(const std::string& name, const std::vector<uint32_t>& hashes);
+
+		/// Write out the images added since the catalog was opened.
+		/**
+		 * @throw std::string if the file could not be written.
+		 */
+		void save();
+
+		/// Find the catalog images most like an image.
+		/**
+		 * Images added since the catalog was last saved are not searched.
+		 *
+		 * @param hashes
+		 *   Block hashes from blockHashes() or a device.
+		 *
+		 * @param count
+		 *   Most matches to return.
+		 *
+		 * @param matches
+		 *   On return, the closest images, most similar first.  Images sharing
+		 *   only a few blocks may not be found.
+		 *
+		 * @throw std::string if the catalog is damaged.
+		 */
+		void match(const std::vector<uint32_t>& hashes, unsigned int count,
+			std::vector<CatalogMatch> *matches) const;
+
+	private:
+		/// One image in the catalog.
+		struct Entry
+		{
+			std::string name;
+			uint32_t signature[CATALOG_SIGNATURE_LEN]; ///< MinHash of blocks
+			std::vector<uint32_t> blocks; ///< Distinct block hashes, sorted
+		};
+
+		std::string filename;
+		void *map;                  ///< Mapped catalog file, or NULL if none
+		size_t len;
+		unsigned long count;        ///< Images in the mapped file
+		unsigned long bandCount;    ///< Records in the band table
+
+		bool loaded;                ///< Whether entries holds the mapped images
+		std::vector<Entry> entries; ///< Everything to save, once loaded
+
+		/// Map the catalog file into memory, if there is one.
+		/**
+		 * @throw std::string if the file is damaged.
+		 */
+		void mapFile();
+
+		/// Unmap the file.
+		void unmap();
+
+		/// Read one image from the mapped file.
+		/**
+		 * @throw std::string if the entry is damaged.
+		 */
+		void readEntry(unsigned long index, Entry *entry) const;
+
+		FirmwareCatalog(const FirmwareCatalog&);
+		FirmwareCatalog& operator=(const FirmwareCatalog&);
+};
+
+#endif // CATALOG_HPP
@@ -0,0 +1,150 @@
+/**
+ * @file   checksum.cpp
+ * @brief  Checksums matching the tools available on the devices.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "checksum.hpp"
+
+/// CRC-32 lookup table for the polynomial 0x04C11DB7, most significant bit first.
+class CksumTable
+{
+	public:
+		CksumTable()
+		{
+			for (unsigned int i = 0; i < 256; i++) {
+				unsigned long crc = (unsigned long)i << 24;
+				for (int bit = 0; bit < 8; bit++) {
+					crc = (crc & 0x80000000UL) ? (crc << 1) ^ 0x04C11DB7UL : crc << 1;
+				}
+				this->entry[i] = crc & 0xFFFFFFFFUL;
+			}
+		}
+
+		unsigned long entry[256];
+};
+
+static const CksumTable cksum_table;
+
+/// Add one byte to a running CRC.
+static inline unsigned long cksum_byte(unsigned long crc, unsigned char c)
+{
+	return ((crc << 8) ^ cksum_table.entry[((crc >> 24) ^ c) & 0xFF]) & 0xFFFFFFFFUL;
+}
+
+unsigned long posix_cksum(const char *data, size_t len)
+{
+	unsigned long crc = 0;
+	for (size_t i = 0; i < len; i++) crc = cksum_byte(crc, data[i]);
+
+	// The length goes in least significant byte first, without any zero bytes
+	// past the last significant one.
+	for (size_t n = len; n; n >>= 8) crc = cksum_byte(crc, n & 0xFF);
+	return ~crc & 0xFFFFFFFFUL;
+}
+
+/// SHA-256 round constants.
+static const unsigned long sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline unsigned long ror32(unsigned long x, int n)
+{
+	return ((x >> n) | (x << (32 - n))) & 0xFFFFFFFFUL;
+}
+
+/// Add one 64-byte block to the hash state.
+static void sha256_block(unsigned long *h, const unsigned char *p)
+{
+	unsigned long w[64];
+	for (int i = 0; i < 16; i++) {
+		w[i] = ((unsigned long)p[i * 4] << 24) | ((unsigned long)p[i * 4 + 1] << 16)
+			| ((unsigned long)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		unsigned long s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		unsigned long s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = (w[i - 16] + s0 + w[i - 7] + s1) & 0xFFFFFFFFUL;
+	}
+
+	unsigned long a = h[0], b = h[1], c = h[2], d = h[3];
+	unsigned long e = h[4], f = h[5], g = h[6], hh = h[7];
+	for (int i = 0; i < 64; i++) {
+		unsigned long s1 = ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25);
+		unsigned long ch = (e & f) ^ (~e & g);
+		unsigned long t1 = (hh + s1 + ch + sha256_k[i] + w[i]) & 0xFFFFFFFFUL;
+		unsigned long s0 = ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22);
+		unsigned long maj = (a & b) ^ (a & c) ^ (b & c);
+		unsigned long t2 = (s0 + maj) & 0xFFFFFFFFUL;
+		hh = g;
+		g = f;
+		f = e;
+		e = (d + t1) & 0xFFFFFFFFUL;
+		d = c;
+		c = b;
+		b = a;
+		a = (t1 + t2) & 0xFFFFFFFFUL;
+	}
+	h[0] = (h[0] + a) & 0xFFFFFFFFUL;
+	h[1] = (h[1] + b) & 0xFFFFFFFFUL;
+	h[2] = (h[2] + c) & 0xFFFFFFFFUL;
+	h[3] = (h[3] + d) & 0xFFFFFFFFUL;
+	h[4] = (h[4] + e) & 0xFFFFFFFFUL;
+	h[5] = (h[5] + f) & 0xFFFFFFFFUL;
+	h[6] = (h[6] + g) & 0xFFFFFFFFUL;
+	h[7] = (h[7] + hh) & 0xFFFFFFFFUL;
+	return;
+}
+
+void sha256(const char *data, size_t len, unsigned char *digest)
+{
+	unsigned long h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	const unsigned char *p = (const unsigned char *)data;
+	size_t i;
+	for (i = 0; i + 64 <= len; i += 64) sha256_block(h, p + i);
+
+	// Pad the rest with a 1 bit, zeros, then the length in bits
+	unsigned char tail[128];
+	size_t rest = len - i;
+	memcpy(tail, p + i, rest);
+	tail[rest] = 0x80;
+	size_t tailLen = (rest < 56) ? 64 : 128;
+	memset(tail + rest + 1, 0, tailLen - rest - 1);
+	unsigned long long bits = (unsigned long long)len * 8;
+	for (int b = 0; b < 8; b++) tail[tailLen - 1 - b] = (bits >> (b * 8)) & 0xFF;
+	sha256_block(h, tail);
+	if (tailLen == 128) sha256_block(h, tail + 64);
+
+	for (int n = 0; n < 8; n++) {
+		digest[n * 4] = (h[n] >> 24) & 0xFF;
+		digest[n * 4 + 1] = (h[n] >> 16) & 0xFF;
+		digest[n * 4 + 2] = (h[n] >> 8) & 0xFF;
+		digest[n * 4 + 3] = h[n] & 0xFF;
+	}
+	return;
+}
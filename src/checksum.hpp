@@ -0,0 +1,58 @@
+/**
+ * @file   checksum.hpp
+ * @brief  Checksums matching the tools available on the devices.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include <stddef.h>
+
+/// Calculate the checksum printed by the POSIX cksum command.
+/**
+ * This is a CRC-32 over the data followed by its length, so it can be
+ * compared with the output of cksum on the device without transferring the
+ * data back.
+ *
+ * @param data
+ *   Data to checksum.
+ *
+ * @param len
+ *   Number of bytes in data.
+ *
+ * @return The checksum, as the first number cksum prints.
+ */
+unsigned long posix_cksum(const char *data, size_t len);
+
+/// Number of bytes in a SHA-256 digest.
+#define SHA256_DIGEST_LEN 32
+
+/// Calculate the SHA-256 digest of some data.
+/**
+ * @param data
+ *   Data to hash.
+ *
+ * @param len
+ *   Number of bytes in data.
+ *
+ * @param digest
+ *   On return, the SHA256_DIGEST_LEN byte digest.
+ */
+void sha256(const char *data, size_t len, unsigned char *digest);
+
+#endif // CHECKSUM_HPP
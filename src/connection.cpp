@@ -0,0 +1,148 @@
+/**
+ * @file   connection.cpp
+ * @brief  Byte stream to a device service.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <boost/bind.hpp>
+#include "main.hpp"
+#include "connection.hpp"
+#include "trace.hpp"
+
+/// An asynchronous operation being waited on by TcpConnection::wait().
+struct TcpConnection::Pending
+{
+	Pending() : done(false), len(0) { }
+	bool done;
+	boost::system::error_code error;
+	std::size_t len;
+};
+
+Connection::~Connection()
+{
+}
+
+static void ioDone(TcpConnection::Pending *op,
+	const boost::system::error_code& error, std::size_t len)
+{
+	op->done = true;
+	op->error = error;
+	op->len = len;
+	return;
+}
+
+static void connectDone(TcpConnection::Pending *op,
+	const boost::system::error_code& error,
+	boost::asio::ip::tcp::resolver::iterator)
+{
+	op->done = true;
+	op->error = error;
+	return;
+}
+
+static void deadlineExpired(boost::asio::ip::tcp::socket *socket,
+	bool *expired, const boost::system::error_code& error)
+{
+	if (error) return; // cancelled because the operation finished
+	*expired = true;
+	boost::system::error_code ignored;
+	socket->cancel(ignored);
+	return;
+}
+
+TcpConnection::TcpConnection(const std::string& host,
+	const std::string& service, unsigned int timeout)
+	: socket(io_service),
+	  deadline(io_service),
+	  timeout(timeout)
+{
+	Span spanDNS("tcp", "dns", host);
+	boost::asio::ip::tcp::resolver resolver(this->io_service);
+	boost::asio::ip::tcp::resolver::query query(host, service);
+	boost::asio::ip::tcp::resolver::iterator it = resolver.resolve(query);
+	spanDNS.finish();
+
+	if (verbose) std::cerr << "[tcp] Connecting to " << host << " on port "
+		<< it->endpoint().port() << "..." << std::endl;
+	Span spanConnect("tcp", "connect", host);
+	Pending op;
+	boost::asio::async_connect(this->socket, it,
+		boost::bind(connectDone, &op, boost::asio::placeholders::error,
+			boost::asio::placeholders::iterator));
+	this->wait(&op);
+	if (op.error) {
+		this->close();
+		throw boost::system::system_error(op.error);
+	}
+}
+
+TcpConnection::~TcpConnection()
+{
+}
+
+std::size_t TcpConnection::read(void *data, std::size_t len,
+	boost::system::error_code& error)
+{
+	Pending op;
+	this->socket.async_read_some(boost::asio::buffer(data, len),
+		boost::bind(ioDone, &op, boost::asio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred));
+	this->wait(&op);
+	error = op.error;
+	return op.len;
+}
+
+std::size_t TcpConnection::write(const void *data, std::size_t len,
+	boost::system::error_code& error)
+{
+	Pending op;
+	this->socket.async_write_some(boost::asio::buffer(data, len),
+		boost::bind(ioDone, &op, boost::asio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred));
+	this->wait(&op);
+	error = op.error;
+	return op.len;
+}
+
+void TcpConnection::close()
+{
+	boost::system::error_code error;
+	this->socket.close(error);
+	return;
+}
+
+void TcpConnection::wait(Pending *op)
+{
+	bool expired = false;
+	if (this->timeout) {
+		this->deadline.expires_from_now(boost::posix_time::seconds(this->timeout));
+		this->deadline.async_wait(boost::bind(deadlineExpired, &this->socket,
+			&expired, boost::asio::placeholders::error));
+	}
+	while (!op->done) this->io_service.run_one();
+
+	// Let the timer's handler run before its flag goes out of scope
+	this->deadline.cancel();
+	this->io_service.run();
+	this->io_service.reset();
+
+	if (expired && (op->error == boost::asio::error::operation_aborted)) {
+		op->error = boost::asio::error::timed_out;
+	}
+	return;
+}
@@ -0,0 +1,184 @@
+/**
+ * @file   connection.hpp
+ * @brief  Byte stream to a device service.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONNECTION_HPP
+#define CONNECTION_HPP
+
+#include <string>
+#include <boost/asio.hpp>
+
+/// An open connection to a service on a device.
+/**
+ * This satisfies the boost::asio SyncReadStream and SyncWriteStream
+ * requirements, so boost::asio::read_until() and friends can be used on it
+ * just as with a socket.  Subclasses only need to implement read(), write()
+ * and close(), which allows the data to come from somewhere other than the
+ * network, such as a previously recorded session.
+ */
+class Connection
+{
+	public:
+		virtual ~Connection();
+
+		/// Read up to len bytes.
+		/**
+		 * @param data
+		 *   Buffer to read into.
+		 *
+		 * @param len
+		 *   Size of buffer.  Will not be zero.
+		 *
+		 * @param error
+		 *   On return, set if no data could be read.  At the end of the stream
+		 *   this is boost::asio::error::eof.
+		 *
+		 * @return Number of bytes read.
+		 */
+		virtual std::size_t read(void *data, std::size_t len,
+			boost::system::error_code& error) = 0;
+
+		/// Write up to len bytes.
+		/**
+		 * @param data
+		 *   Data to send.
+		 *
+		 * @param len
+		 *   Number of bytes in data.  Will not be zero.
+		 *
+		 * @param error
+		 *   On return, set if no data could be written.
+		 *
+		 * @return Number of bytes written.
+		 */
+		virtual std::size_t write(const void *data, std::size_t len,
+			boost::system::error_code& error) = 0;
+
+		/// Close the connection.
+		virtual void close() = 0;
+
+		template <typename MutableBufferSequence>
+		std::size_t read_some(const MutableBufferSequence& buffers,
+			boost::system::error_code& error)
+		{
+			error = boost::system::error_code();
+			boost::asio::mutable_buffer b = first_buffer<boost::asio::mutable_buffer>(
+				boost::asio::buffer_sequence_begin(buffers),
+				boost::asio::buffer_sequence_end(buffers));
+			if (b.size() == 0) return 0;
+			return this->read(b.data(), b.size(), error);
+		}
+
+		template <typename MutableBufferSequence>
+		std::size_t read_some(const MutableBufferSequence& buffers)
+		{
+			boost::system::error_code error;
+			std::size_t len = this->read_some(buffers, error);
+			if (error) throw boost::system::system_error(error);
+			return len;
+		}
+
+		template <typename ConstBufferSequence>
+		std::size_t write_some(const ConstBufferSequence& buffers,
+			boost::system::error_code& error)
+		{
+			error = boost::system::error_code();
+			boost::asio::const_buffer b = first_buffer<boost::asio::const_buffer>(
+				boost::asio::buffer_sequence_begin(buffers),
+				boost::asio::buffer_sequence_end(buffers));
+			if (b.size() == 0) return 0;
+			return this->write(b.data(), b.size(), error);
+		}
+
+		template <typename ConstBufferSequence>
+		std::size_t write_some(const ConstBufferSequence& buffers)
+		{
+			boost::system::error_code error;
+			std::size_t len = this->write_some(buffers, error);
+			if (error) throw boost::system::system_error(error);
+			return len;
+		}
+
+	private:
+		/// Find the first non-empty buffer in a buffer sequence.
+		/**
+		 * Like a socket, only this buffer is transferred by a single call to
+		 * read_some() or write_some().
+		 */
+		template <typename Buffer, typename Iterator>
+		static Buffer first_buffer(Iterator begin, Iterator end)
+		{
+			for (; begin != end; begin++) {
+				Buffer b(*begin);
+				if (b.size() > 0) return b;
+			}
+			return Buffer();
+		}
+};
+
+/// Connection over a TCP socket.
+/**
+ * Connecting, and each read and write, give up with
+ * boost::asio::error::timed_out if the device doesn't respond in time, so a
+ * stalled device can be retried or skipped instead of waiting forever.
+ */
+class TcpConnection: virtual public Connection
+{
+	public:
+		/// Connect to a service.
+		/**
+		 * @param host
+		 *   Hostname or IP address.
+		 *
+		 * @param service
+		 *   Service name (e.g. "ftp") or port number.
+		 *
+		 * @param timeout
+		 *   Seconds to wait for the connection and for each read or write, or
+		 *   0 to wait forever.
+		 *
+		 * @throw boost::system::system_error if the connection could not be
+		 *   established.
+		 */
+		TcpConnection(const std::string& host, const std::string& service,
+			unsigned int timeout);
+		virtual ~TcpConnection();
+
+		virtual std::size_t read(void *data, std::size_t len,
+			boost::system::error_code& error);
+		virtual std::size_t write(const void *data, std::size_t len,
+			boost::system::error_code& error);
+		virtual void close();
+
+		/// Outcome of an operation being waited on.
+		struct Pending;
+
+	private:
+
+		boost::asio::io_service io_service;
+		boost::asio::ip::tcp::socket socket;
+		boost::asio::deadline_timer deadline;
+		unsigned int timeout;
+
+		/// Run the io_service until an operation completes or the timeout
+		/// expires, in which case the operation is cancelled.
+		void wait(Pending *op);
+};
+
+#endif // CONNECTION_HPP
@@ -0,0 +1,341 @@
+/**
+ * @file   daemon.cpp
+ * @brief  Keep polling a list of devices and serve their latest state.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <iomanip>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "daemon.hpp"
+#include "identify.hpp"
+#include "json.hpp"
+#include "main.hpp"
+#include "metrics.hpp"
+
+void readRegistry(std::istream& in, std::vector<RegistryEntry> *entries)
+{
+	std::string line;
+	unsigned int lineNum = 0;
+	while (std::getline(in, line)) {
+		lineNum++;
+		std::string::size_type hash = line.find('#');
+		if (hash != std::string::npos) line.erase(hash);
+
+		std::istringstream words(line);
+		RegistryEntry entry;
+		if (!(words >> entry.host)) continue; // blank line
+		words >> entry.type;
+		std::string extra;
+		if (words >> extra) {
+			std::stringstream ss;
+			ss << "registry line " << lineNum << ": unexpected \"" << extra
+				<< "\" after the device type";
+			throw ss.str();
+		}
+		entries->push_back(entry);
+	}
+	return;
+}
+
+DaemonConfig::DaemonConfig()
+	: threads(8),
+	  interval(300),
+	  jitter(10),
+	  cache(NULL),
+	  breaker(NULL)
+{
+}
+
+/// Everything known about one device.
+struct Daemon::Camera
+{
+	Camera(boost::asio::io_service& io_service, const RegistryEntry& entry)
+		: host(entry.host),
+		  network(this->host),
+		  timer(io_service),
+		  seed((unsigned long)this
+			^ boost::posix_time::microsec_clock::universal_time().time_of_day().total_microseconds()),
+		  type(entry.type),
+		  polls(0),
+		  failures(0),
+		  pollTime(0),
+		  lenFlash(0),
+		  idVendor(0),
+		  idProduct(0),
+		  bInterfaceClass(0),
+		  known(false)
+	{
+	}
+
+	// Only used by the poll, which never runs twice at once for one device
+	const std::string host;
+	Network network;
+	boost::asio::deadline_timer timer;
+	boost::scoped_ptr<Device> dev;   ///< Kept between polls to reuse the session
+	unsigned int seed;               ///< For rand_r()
+
+	boost::mutex mutex;              ///< Protects everything below
+	std::string type;                ///< Device type, empty until identified
+	std::string error;               ///< Why the last poll failed, empty if it worked
+	unsigned long polls;             ///< Polls finished
+	unsigned long failures;          ///< Polls failed in a row
+	long pollTime;                   ///< Milliseconds the last poll took
+	boost::posix_time::ptime lastPoll, lastSuccess, nextPoll;
+
+	unsigned long lenFlash;
+	unsigned short idVendor, idProduct;
+	unsigned char bInterfaceClass;
+	std::string model;
+	bool known;
+	std::string fwid;
+};
+
+Daemon::Daemon(const DaemonConfig& config)
+	: config(config),
+	  signals(io_service, SIGINT, SIGTERM)
+{
+}
+
+Daemon::~Daemon()
+{
+}
+
+void Daemon::add(const RegistryEntry& entry)
+{
+	boost::shared_ptr<Camera> cam(new Camera(this->io_service, entry));
+	if (cam->type.empty()) cam->type = this->config.type;
+	cam->network.set_retry(this->config.retry, this->config.breaker);
+	cam->network.set_login(this->config.username, this->config.password);
+	for (std::map<std::string, unsigned short>::const_iterator p = this->config.ports.begin();
+		p != this->config.ports.end(); p++
+	) {
+		cam->network.set_port(p->first, p->second);
+	}
+	this->cameras.push_back(cam);
+	return;
+}
+
+void Daemon::run()
+{
+	for (std::vector<boost::shared_ptr<Camera> >::iterator i = this->cameras.begin();
+		i != this->cameras.end(); i++
+	) {
+		this->schedule(*i, true);
+	}
+	this->signals.async_wait(boost::bind(&boost::asio::io_service::stop,
+		&this->io_service));
+
+	// Polls block while they talk to the device, so each thread runs one at
+	// a time and the rest wait on their timers.
+	boost::thread_group threads;
+	for (unsigned int i = 1; i < this->config.threads; i++) {
+		threads.create_thread(boost::bind(&boost::asio::io_service::run,
+			&this->io_service));
+	}
+	this->io_service.run();
+	threads.join_all();
+	if (verbose) std::cerr << "[daemon] Stopped" << std::endl;
+	return;
+}
+
+void Daemon::serve(const std::string& path, HttpResponse *response)
+{
+	std::ostringstream out;
+	if (path.compare("/cameras") == 0) {
+		out << "[";
+		for (std::vector<boost::shared_ptr<Camera> >::iterator i = this->cameras.begin();
+			i != this->cameras.end(); i++
+		) {
+			if (i != this->cameras.begin()) out << ",\n";
+			this->writeCamera(out, **i);
+		}
+		out << "]\n";
+	} else if (path.compare(0, 9, "/cameras/") == 0) {
+		std::string host = path.substr(9);
+		std::vector<boost::shared_ptr<Camera> >::iterator i = this->cameras.begin();
+		while ((i != this->cameras.end()) && ((*i)->host.compare(host) != 0)) i++;
+		if (i == this->cameras.end()) return;
+		this->writeCamera(out, **i);
+		out << "\n";
+	} else {
+		return;
+	}
+	response->status = 200;
+	response->contentType = "application/json";
+	response->body = out.str();
+	return;
+}
+
+void Daemon::schedule(boost::shared_ptr<Camera> cam, bool first)
+{
+	// Pick a delay in milliseconds, within the jitter either side of the
+	// interval, or between zero and the jitter for the first poll.
+	unsigned long interval = this->config.interval * 1000UL;
+	unsigned long spread = interval * this->config.jitter / 100;
+	unsigned long delay = spread ? rand_r(&cam->seed) % (spread + 1) : 0;
+	if (!first) delay += interval - spread / 2;
+
+	boost::posix_time::ptime next = boost::posix_time::microsec_clock::universal_time()
+		+ boost::posix_time::milliseconds(delay);
+	{
+		boost::mutex::scoped_lock guard(cam->mutex);
+		cam->nextPoll = next;
+	}
+	cam->timer.expires_at(next);
+	cam->timer.async_wait(boost::bind(&Daemon::poll, this, cam,
+		boost::asio::placeholders::error));
+	return;
+}
+
+void Daemon::poll(boost::shared_ptr<Camera> cam,
+	const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) return;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	std::string type;
+	{
+		boost::mutex::scoped_lock guard(cam->mutex);
+		type = cam->type;
+	}
+	std::string failed;
+	unsigned long lenFlash = 0;
+	unsigned short idVendor = 0, idProduct = 0;
+	unsigned char bInterfaceClass = 0;
+	try {
+		if (type.empty()) {
+			Identify id(&cam->network, NULL, this->config.cache, fn_progress());
+			type = id.getType();
+			if (type.compare("unknown") == 0) {
+				// Leave the type unset so the next poll tries again
+				throw std::string("unable to identify device");
+			}
+			boost::mutex::scoped_lock guard(cam->mutex);
+			cam->type = type;
+		}
+		if (!cam->dev) {
+			cam->dev.reset(openDevice(type, &cam->network, NULL));
+			if (!cam->dev) throw "unknown device type " + type;
+		}
+		Retry retry(this->config.retry, cam->host);
+		for (;;) {
+			try {
+				cam->dev->getFlashInfo(&lenFlash);
+				cam->dev->getCameraInfo(&idVendor, &idProduct, &bInterfaceClass);
+				break;
+			} catch (const boost::system::system_error& e) {
+				if (!retry.again(e.code())) throw;
+			}
+		}
+	} catch (const std::string& err) {
+		failed = err;
+	} catch (const boost::system::system_error& e) {
+		failed = e.what();
+	} catch (const std::exception& e) {
+		failed = e.what();
+	}
+
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+	metrics.polls.add();
+	metrics.pollTime.observeSince(start);
+	{
+		boost::mutex::scoped_lock guard(cam->mutex);
+		cam->polls++;
+		cam->lastPoll = now;
+		cam->pollTime = (now - start).total_milliseconds();
+		cam->error = failed;
+		if (failed.empty()) {
+			cam->failures = 0;
+			cam->lastSuccess = now;
+			cam->lenFlash = lenFlash;
+			cam->idVendor = idVendor;
+			cam->idProduct = idProduct;
+			cam->bInterfaceClass = bInterfaceClass;
+			cam->model = modelName(type, lenFlash, idVendor, idProduct, &cam->known);
+			cam->fwid = firmwareId(type, lenFlash, bInterfaceClass);
+		} else {
+			cam->failures++;
+		}
+	}
+	if (!failed.empty()) {
+		// Don't reuse a session that may have been left part way through a
+		// command; the next poll connects afresh.
+		cam->dev.reset();
+		metrics.pollFailures.add();
+		if (verbose) std::cerr << "[daemon] " << cam->host << ": " << failed
+			<< std::endl;
+	}
+
+	this->schedule(cam, false);
+	return;
+}
+
+/// Write a time as seconds since the Unix epoch, or null if it is not set.
+static void writeTime(std::ostream& out, const boost::posix_time::ptime& t)
+{
+	if (t.is_not_a_date_time()) {
+		out << "null";
+	} else {
+		static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+		out << (t - epoch).total_seconds();
+	}
+	return;
+}
+
+void Daemon::writeCamera(std::ostream& out, Camera& cam)
+{
+	boost::mutex::scoped_lock guard(cam.mutex);
+	out << "{\"host\":";
+	write_json_string(out, cam.host);
+	out << ",\"device_type\":";
+	write_json_string(out, cam.type.empty() ? "unknown" : cam.type);
+	out << ",\"status\":\"" << (cam.polls == 0 ? "pending"
+		: cam.error.empty() ? "ok" : "error") << "\"";
+	if (!cam.error.empty()) {
+		out << ",\"error\":";
+		write_json_string(out, cam.error);
+	}
+	out << ",\"polls\":" << cam.polls
+		<< ",\"consecutive_failures\":" << cam.failures
+		<< ",\"poll_ms\":" << cam.pollTime
+		<< ",\"last_poll\":";
+	writeTime(out, cam.lastPoll);
+	out << ",\"last_success\":";
+	writeTime(out, cam.lastSuccess);
+	out << ",\"next_poll\":";
+	writeTime(out, cam.nextPoll);
+	if (!cam.lastSuccess.is_not_a_date_time()) {
+		// Results of the last poll that worked, even if later ones have failed
+		out << ",\"flash_size\":" << cam.lenFlash << std::hex << std::setfill('0')
+			<< ",\"camera_usb_vendor\":\"" << std::setw(4) << cam.idVendor
+			<< "\",\"camera_usb_product\":\"" << std::setw(4) << cam.idProduct
+			<< "\",\"camera_usb_class\":\"" << std::setw(2) << (int)cam.bInterfaceClass
+			<< "\"" << std::dec << ",\"model\":";
+		write_json_string(out, cam.model);
+		out << ",\"known_model\":" << (cam.known ? "true" : "false")
+			<< ",\"fwid\":";
+		write_json_string(out, cam.fwid);
+	}
+	out << "}";
+	return;
+}
@@ -0,0 +1,142 @@
+/**
+ * @file   daemon.hpp
+ * @brief  Keep polling a list of devices and serve their latest state.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DAEMON_HPP
+#define DAEMON_HPP
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include "cache.hpp"
+#include "httpd.hpp"
+#include "retry.hpp"
+
+/// A device listed in the daemon's registry.
+struct RegistryEntry
+{
+	std::string host;
+	std::string type;  ///< Device type, or empty to identify it on the first poll
+};
+
+/// Read the list of devices for the daemon to poll.
+/**
+ * Each line is a hostname, optionally followed by the device type.  Devices
+ * without a type are identified before their first poll.  Blank lines and
+ * anything after a # are ignored.
+ *
+ * @param in
+ *   Stream to read from.
+ *
+ * @param entries
+ *   The devices are appended to this list.
+ *
+ * @throw std::string if the registry is invalid, content is error message.
+ */
+void readRegistry(std::istream& in, std::vector<RegistryEntry> *entries);
+
+/// Settings for every device polled by the daemon.
+struct DaemonConfig
+{
+	/// Set everything to defaults.
+	DaemonConfig();
+
+	unsigned int threads;           ///< Polls that may run at once
+	unsigned int interval;          ///< Average seconds between polls of a device
+	unsigned int jitter;            ///< Percentage each interval varies by
+	std::string type;               ///< Device type for entries without one
+	std::map<std::string, unsigned short> ports; ///< Non-standard service ports
+	std::string username, password; ///< Web interface login, empty for default
+	IdentifyCache *cache;           ///< Identification cache, or NULL
+	RetryPolicy retry;
+	CircuitBreaker *breaker;        ///< Shared by every device, or NULL
+};
+
+/// Polls devices on a schedule and keeps the latest result for each.
+/**
+ * Each poll reads the flash size and camera IDs, the same as --query.  The
+ * connection to each device is kept open between polls, so a poll normally
+ * costs one command over an existing telnet session rather than a new login.
+ *
+ * Polls are spaced by the interval plus or minus a random amount, and the
+ * first polls are spread over the jitter period, so a large number of devices
+ * are not all polled in the same instant.
+ */
+class Daemon
+{
+	public:
+		/// Prepare to poll devices.
+		/**
+		 * @param config
+		 *   Settings for every device.
+		 */
+		Daemon(const DaemonConfig& config);
+
+		~Daemon();
+
+		/// Add a device to poll.
+		/**
+		 * Must be called before run().
+		 */
+		void add(const RegistryEntry& entry);
+
+		/// Poll devices until SIGINT or SIGTERM is received.
+		/**
+		 * Polls in progress are allowed to finish before this returns.
+		 */
+		void run();
+
+		/// Answer a request for the state of the devices.
+		/**
+		 * "/cameras" returns a JSON array with one object per device, and
+		 * "/cameras/HOST" returns the object for a single device.  Anything
+		 * else is left as a 404, so other handlers can be tried.
+		 *
+		 * This may be called from any thread.
+		 */
+		void serve(const std::string& path, HttpResponse *response);
+
+	private:
+		struct Camera;
+
+		DaemonConfig config;
+		boost::asio::io_service io_service;
+		boost::asio::signal_set signals;
+		std::vector<boost::shared_ptr<Camera> > cameras;
+
+		/// Set the timer for a device's next poll.
+		/**
+		 * @param first
+		 *   true to pick a time within the jitter period instead of a full
+		 *   interval.
+		 */
+		void schedule(boost::shared_ptr<Camera> cam, bool first);
+
+		/// Poll a device when its timer expires, then schedule the next poll.
+		void poll(boost::shared_ptr<Camera> cam,
+			const boost::system::error_code& error);
+
+		/// Write a device's latest state as a JSON object.
+		void writeCamera(std::ostream& out, Camera& cam);
+};
+
+#endif // DAEMON_HPP
@@ -22,6 +22,8 @@
 #define DEVICE_HPP
 
 #include <iostream>
+#include <vector>
+#include <stdint.h>
 #include <boost/function.hpp>
 
 /// Callback function for reporting progress.
@@ -34,6 +36,11 @@ typedef boost::function<void(unsigned long, unsigned long)> fn_progress;
 class Device
 {
 	public:
+		/// Close any connections the device kept open.
+		virtual ~Device()
+		{
+		}
+
 		/// Download the device's firmware.
 		/**
 		 * @param target
@@ -46,6 +53,43 @@ class Device
 		 */
 		virtual void getFirmware(std::ostream& target, fn_progress fnProgress) = 0;
 
+		/// Replace the device's firmware.
+		/**
+		 * The image is checked against the flash layout before anything is
+		 * written, and each part of the flash is read back to confirm it was
+		 * written correctly.
+		 *
+		 * @param source
+		 *   Complete flash image, as saved by getFirmware().
+		 *
+		 * @param onlyChanged
+		 *   true to compare the image with the flash first, and only send and
+		 *   write the erase blocks that differ.  false to write everything.
+		 *
+		 * @param fnProgress
+		 *   Callback function for displaying progress, covering both sending
+		 *   the image to the device and writing it.  May be empty.
+		 *
+		 * @return Number of erase blocks written.
+		 *
+		 * @throw std::string on error, content is error message.
+		 */
+		virtual unsigned long putFirmware(std::istream& source, bool onlyChanged,
+			fn_progress fnProgress) = 0;
+
+		/// Checksum each block of the device's flash without downloading it.
+		/**
+		 * @param blockSize
+		 *   Bytes in each block.  A partial block at the end is left out.
+		 *
+		 * @param sums
+		 *   On return, the POSIX cksum CRC of each block, in flash order.
+		 *
+		 * @throw std::string on error, content is error message.
+		 */
+		virtual void getBlockChecksums(unsigned long blockSize,
+			std::vector<uint32_t> *sums) = 0;
+
 		/// Get information about the device's flash.
 		/**
 		 * @param length
@@ -68,6 +112,37 @@ class Device
 		 */
 		virtual void getCameraInfo(unsigned short *idVendor,
 			unsigned short *idProduct, unsigned char *bInterfaceClass) = 0;
+
+		/// Get the version of the firmware the device is running.
+		/**
+		 * @return The version as reported by the device, or empty if it
+		 *   doesn't say.
+		 *
+		 * @throw std::string on error, content is error message.
+		 */
+		virtual std::string getFirmwareVersion() = 0;
+
+		/// Get a value that changes whenever the device's configuration does.
+		/**
+		 * This is cheap compared to getConfig(), so it can be used to avoid
+		 * downloading a configuration that has already been seen.
+		 *
+		 * @return A string such as the size and modification time of the
+		 *   configuration file, or empty if the device can't provide one.
+		 *
+		 * @throw std::string on error, content is error message.
+		 */
+		virtual std::string getConfigStamp() = 0;
+
+		/// Download the device's configuration file.
+		/**
+		 * @param target
+		 *   On return, the file's content will have been written to this
+		 *   stream.
+		 *
+		 * @throw std::string on error, content is error message.
+		 */
+		virtual void getConfig(std::ostream& target) = 0;
 };
 
 #endif // DEVICE_HPP
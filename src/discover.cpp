@@ -0,0 +1,238 @@
+/**
+ * @file   discover.cpp
+ * @brief  Scan address ranges for hosts that may be supported cameras.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <boost/bind.hpp>
+#include "main.hpp"
+#include "discover.hpp"
+
+/// How often the rate limiter releases more connection attempts.
+#define TICK_MS 10
+
+/// A single connection attempt to one port on one host.
+struct Discover::Probe
+{
+	Probe(boost::asio::io_service& io_service, unsigned long addr,
+		unsigned short port)
+		: socket(io_service),
+		  timer(io_service),
+		  addr(addr),
+		  port(port),
+		  done(false)
+	{
+	}
+
+	boost::asio::ip::tcp::socket socket;
+	boost::asio::deadline_timer timer;
+	unsigned long addr;
+	unsigned short port;
+	bool done; ///< true once connected, refused or timed out
+};
+
+Discover::Discover(unsigned long pps, unsigned int maxPending,
+	unsigned int timeout)
+	: pps(pps ? pps : 1),
+	  maxPending(maxPending ? maxPending : 1),
+	  timeout(timeout),
+	  tick(io_service),
+	  tokens(0),
+	  pending(0),
+	  scanned(0)
+{
+	// The ports Identify and the Device implementations connect to
+	this->ports.push_back(21);
+	this->ports.push_back(23);
+	this->ports.push_back(80);
+	this->ports.push_back(81);
+	this->ports.push_back(8080);
+}
+
+void Discover::addRange(const std::string& cidr)
+{
+	std::string::size_type slash = cidr.find('/');
+	unsigned int prefix = 32;
+	if (slash != std::string::npos) {
+		char *end;
+		prefix = strtoul(cidr.c_str() + slash + 1, &end, 10);
+		if ((*end != '\0') || (prefix > 32) || (slash + 1 == cidr.length())) {
+			throw std::string("Invalid prefix length in range: " + cidr);
+		}
+	}
+
+	boost::system::error_code error;
+	boost::asio::ip::address_v4 addr
+		= boost::asio::ip::address_v4::from_string(cidr.substr(0, slash), error);
+	if (error) throw std::string("Invalid IPv4 address in range: " + cidr);
+
+	unsigned long mask = prefix ? (0xFFFFFFFFUL << (32 - prefix)) & 0xFFFFFFFFUL : 0;
+	Range r;
+	r.first = addr.to_ulong() & mask;
+	r.last = r.first | (~mask & 0xFFFFFFFFUL);
+	if (prefix <= 30) {
+		// Skip the network and broadcast addresses
+		r.first++;
+		r.last--;
+	}
+	this->ranges.push_back(r);
+	return;
+}
+
+void Discover::setPorts(const std::vector<unsigned short>& ports)
+{
+	this->ports = ports;
+	return;
+}
+
+unsigned long Discover::run(fn_found fnFound)
+{
+	this->fnFound = fnFound;
+	this->nextRange = this->ranges.begin();
+	if (this->nextRange != this->ranges.end()) {
+		this->nextAddr = this->nextRange->first;
+	}
+	this->nextPort = this->ports.begin();
+	if (this->ports.empty()) return 0;
+
+	if (verbose) std::cerr << "[discover] Scanning at up to " << this->pps
+		<< " connections/sec, " << this->maxPending << " at once" << std::endl;
+
+	this->lastRefill = boost::posix_time::microsec_clock::universal_time();
+	this->tokens = 1;
+	this->onTick(boost::system::error_code());
+	this->io_service.run();
+
+	if (verbose) std::cerr << "[discover] Scanned " << this->scanned
+		<< " addresses" << std::endl;
+	return this->scanned;
+}
+
+void Discover::startProbes()
+{
+	while (
+		(this->tokens >= 1)
+		&& (this->pending < this->maxPending)
+		&& (this->nextRange != this->ranges.end())
+	) {
+		if (this->nextPort == this->ports.begin()) {
+			// First probe for this host
+			HostState& state = this->hosts[this->nextAddr];
+			state.pending = this->ports.size();
+			this->scanned++;
+			if (verbose > 1) std::cerr << "[discover] Probing "
+				<< boost::asio::ip::address_v4(this->nextAddr).to_string() << std::endl;
+		}
+
+		boost::shared_ptr<Probe> probe(
+			new Probe(this->io_service, this->nextAddr, *this->nextPort));
+		boost::asio::ip::tcp::endpoint endpoint(
+			boost::asio::ip::address_v4(this->nextAddr), *this->nextPort);
+		probe->socket.async_connect(endpoint,
+			boost::bind(&Discover::onConnect, this, probe,
+				boost::asio::placeholders::error));
+		probe->timer.expires_from_now(boost::posix_time::milliseconds(this->timeout));
+		probe->timer.async_wait(
+			boost::bind(&Discover::onTimeout, this, probe,
+				boost::asio::placeholders::error));
+		this->pending++;
+		this->tokens--;
+
+		// Advance to the next port, then the next address, then the next range
+		if (++this->nextPort == this->ports.end()) {
+			this->nextPort = this->ports.begin();
+			if (this->nextAddr++ >= this->nextRange->last) {
+				if (++this->nextRange != this->ranges.end()) {
+					this->nextAddr = this->nextRange->first;
+				}
+			}
+		}
+	}
+	return;
+}
+
+void Discover::onTick(const boost::system::error_code& error)
+{
+	if (error) return;
+
+	// Refill the token bucket.  Limit bursts to one tick's worth so a stall
+	// doesn't result in a flood of packets afterwards.
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+	double elapsed = (now - this->lastRefill).total_microseconds() / 1000000.0;
+	this->lastRefill = now;
+	double burst = std::max(1.0, this->pps * TICK_MS / 1000.0);
+	this->tokens = std::min(burst, this->tokens + elapsed * this->pps);
+
+	this->startProbes();
+
+	// Keep ticking until every probe has been started.  Probes already in
+	// progress keep the io_service running until they finish.
+	if (this->nextRange != this->ranges.end()) {
+		this->tick.expires_from_now(boost::posix_time::milliseconds(TICK_MS));
+		this->tick.async_wait(boost::bind(&Discover::onTick, this,
+			boost::asio::placeholders::error));
+	}
+	return;
+}
+
+void Discover::onConnect(boost::shared_ptr<Probe> probe,
+	const boost::system::error_code& error)
+{
+	if (probe->done) return; // already timed out
+	probe->done = true;
+	probe->timer.cancel();
+	boost::system::error_code ignored;
+	probe->socket.close(ignored);
+	this->finishProbe(probe, !error);
+	return;
+}
+
+void Discover::onTimeout(boost::shared_ptr<Probe> probe,
+	const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) return;
+	if (probe->done) return; // connect completed first
+	probe->done = true;
+	boost::system::error_code ignored;
+	probe->socket.close(ignored); // onConnect will see done and ignore it
+	this->finishProbe(probe, false);
+	return;
+}
+
+void Discover::finishProbe(boost::shared_ptr<Probe> probe, bool open)
+{
+	this->pending--;
+
+	std::map<unsigned long, HostState>::iterator i = this->hosts.find(probe->addr);
+	assert(i != this->hosts.end());
+	if (open) i->second.open.push_back(probe->port);
+	if (--i->second.pending == 0) {
+		if (!i->second.open.empty()) {
+			std::sort(i->second.open.begin(), i->second.open.end());
+			std::string host = boost::asio::ip::address_v4(probe->addr).to_string();
+			if (verbose) std::cerr << "[discover] Found " << host << std::endl;
+			this->fnFound(host, i->second.open);
+		}
+		this->hosts.erase(i);
+	}
+
+	// Use up any tokens left over from the last tick now a slot is free
+	this->startProbes();
+	return;
+}
@@ -0,0 +1,130 @@
+/**
+ * @file   discover.hpp
+ * @brief  Scan address ranges for hosts that may be supported cameras.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISCOVER_HPP
+#define DISCOVER_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+/// Callback function for reporting a host with at least one open port.
+/**
+ * First param is the host's IP address, second param is the list of ports
+ * that accepted a connection, in ascending order.
+ */
+typedef boost::function<void(const std::string&,
+	const std::vector<unsigned short>&)> fn_found;
+
+/// Asynchronous TCP connect scanner.
+/**
+ * Addresses are generated lazily from the CIDR ranges and only a bounded
+ * number of connection attempts are ever outstanding, so memory use does not
+ * depend on the size of the ranges being scanned.
+ */
+class Discover
+{
+	public:
+		/// Prepare a scan.
+		/**
+		 * @param pps
+		 *   Maximum number of connection attempts (i.e. SYN packets) to start
+		 *   per second.
+		 *
+		 * @param maxPending
+		 *   Maximum number of connection attempts in progress at any one time.
+		 *
+		 * @param timeout
+		 *   Milliseconds to wait for a connection before treating the port as
+		 *   closed.
+		 */
+		Discover(unsigned long pps, unsigned int maxPending, unsigned int timeout);
+
+		/// Add an address range to scan.
+		/**
+		 * @param cidr
+		 *   IPv4 range such as "192.168.1.0/24", or a single address.
+		 *
+		 * @throw std::string if the range could not be parsed.
+		 */
+		void addRange(const std::string& cidr);
+
+		/// Change the ports probed on each host.
+		/**
+		 * @param ports
+		 *   New list of ports.  Defaults to the ones Identify examines.
+		 */
+		void setPorts(const std::vector<unsigned short>& ports);
+
+		/// Scan all the ranges, blocking until complete.
+		/**
+		 * @param fnFound
+		 *   Called once for each host with one or more open ports, as soon as
+		 *   all ports on that host have been probed.
+		 *
+		 * @return Number of addresses scanned.
+		 */
+		unsigned long run(fn_found fnFound);
+
+	private:
+		struct Range {
+			unsigned long first;
+			unsigned long last;
+		};
+		struct HostState {
+			unsigned int pending;
+			std::vector<unsigned short> open;
+		};
+		struct Probe;
+
+		unsigned long pps;
+		unsigned int maxPending;
+		unsigned int timeout;
+		std::vector<unsigned short> ports;
+		std::vector<Range> ranges;
+
+		boost::asio::io_service io_service;
+		boost::asio::deadline_timer tick;
+		fn_found fnFound;
+
+		// Position of the next probe to start
+		std::vector<Range>::const_iterator nextRange;
+		unsigned long nextAddr;
+		std::vector<unsigned short>::const_iterator nextPort;
+
+		boost::posix_time::ptime lastRefill;
+		double tokens;              ///< connection attempts allowed right now
+		unsigned int pending;       ///< connection attempts in progress
+		unsigned long scanned;      ///< number of addresses started
+		std::map<unsigned long, HostState> hosts; ///< hosts with probes active
+
+		void startProbes();
+		void onTick(const boost::system::error_code& error);
+		void onConnect(boost::shared_ptr<Probe> probe,
+			const boost::system::error_code& error);
+		void onTimeout(boost::shared_ptr<Probe> probe,
+			const boost::system::error_code& error);
+		void finishProbe(boost::shared_ptr<Probe> probe, bool open);
+};
+
+#endif // DISCOVER_HPP
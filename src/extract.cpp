@@ -0,0 +1,1187 @@
+/**
+ * @file   extract.cpp
+ * @brief  Read files out of the filesystems inside a firmware image.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#include <boost/bind.hpp>
+#include "extract.hpp"
+#include "fileutil.hpp"
+#include "main.hpp"
+
+/// Largest uncompressed squashfs metadata block.
+#define SQUASHFS_METADATA_SIZE 8192
+
+/// Largest squashfs data block.
+#define SQUASHFS_MAX_BLOCK 1048576
+
+/// Marks a squashfs block or metadata stored without compression.
+#define SQUASHFS_BLOCK_RAW (1 << 24)
+#define SQUASHFS_META_RAW 0x8000
+
+/// Fragment index meaning a squashfs file has no tail fragment.
+#define SQUASHFS_NO_FRAGMENT 0xFFFFFFFF
+
+/// Type bits for each squashfs inode type, basic and extended.
+static const unsigned int squashTypeBits[] = {
+	0, S_IFDIR, S_IFREG, S_IFLNK, S_IFBLK, S_IFCHR, S_IFIFO, S_IFSOCK,
+	S_IFDIR, S_IFREG, S_IFLNK, S_IFBLK, S_IFCHR, S_IFIFO, S_IFSOCK
+};
+
+/// Deepest folder followed, so a damaged image can't recurse forever.
+#define EXTRACT_MAX_DEPTH 64
+
+/// Largest file read, so a damaged size can't use up all the memory.
+#define EXTRACT_MAX_FILE (256 * 1048576)
+
+/// Most file content held in memory at once while extracting.
+#define EXTRACT_BATCH_SIZE (32 * 1048576)
+
+/// squashfs compression types.
+enum {
+	SquashGzip = 1,
+	SquashLZMA = 2,
+	SquashLZO = 3,
+	SquashXZ = 4,
+	SquashLZ4 = 5,
+	SquashZstd = 6
+};
+
+/// JFFS2 node types and compression methods used here.
+#define JFFS2_NODETYPE_DIRENT 0xE001
+#define JFFS2_NODETYPE_INODE 0xE002
+#define JFFS2_COMPR_NONE 0x00
+#define JFFS2_COMPR_ZERO 0x01
+#define JFFS2_COMPR_RTIME 0x02
+#define JFFS2_COMPR_ZLIB 0x06
+
+/// JFFS2 inode number of the root folder.
+#define JFFS2_ROOT_INO 1
+
+/// Check a name from a folder can't be used to escape it.
+static bool validName(const std::string& name)
+{
+	return !name.empty() && (name.compare(".") != 0) && (name.compare("..") != 0)
+		&& (name.find('/') == std::string::npos)
+		&& (name.find('\0') == std::string::npos);
+}
+
+TaskPool::TaskPool(unsigned int threads)
+	: work(new boost::asio::io_service::work(io_service)),
+	  outstanding(0)
+{
+	if (threads < 1) threads = 1;
+	for (unsigned int i = 0; i < threads; i++) {
+		this->threads.create_thread(boost::bind(&boost::asio::io_service::run,
+			&this->io_service));
+	}
+}
+
+TaskPool::~TaskPool()
+{
+	this->work.reset();
+	this->threads.join_all();
+}
+
+void TaskPool::post(const boost::function<void()>& task)
+{
+	{
+		boost::mutex::scoped_lock guard(this->mutex);
+		this->outstanding++;
+	}
+	this->io_service.post(boost::bind(&TaskPool::run, this, task));
+	return;
+}
+
+void TaskPool::wait()
+{
+	boost::mutex::scoped_lock guard(this->mutex);
+	while (this->outstanding) this->idle.wait(guard);
+	if (!this->error.empty()) {
+		std::string err;
+		err.swap(this->error);
+		throw err;
+	}
+	return;
+}
+
+void TaskPool::run(boost::function<void()> task)
+{
+	std::string failed;
+	try {
+		task();
+	} catch (const std::string& err) {
+		failed = err;
+	} catch (const std::exception& e) {
+		failed = e.what();
+	}
+	boost::mutex::scoped_lock guard(this->mutex);
+	if (!failed.empty() && this->error.empty()) this->error = failed;
+	if (--this->outstanding == 0) this->idle.notify_all();
+	return;
+}
+
+FirmwareFS::~FirmwareFS()
+{
+}
+
+/// Check whether a squashfs compression type can be read.
+/**
+ * @throw std::string if not.
+ */
+static void squashCheckCompression(unsigned int comp)
+{
+	switch (comp) {
+		case SquashGzip:
+#ifdef HAVE_LIBLZMA
+		case SquashLZMA:
+		case SquashXZ:
+#endif
+			return;
+	}
+	static const char *names[] = {"", "gzip", "lzma", "lzo", "xz", "lz4", "zstd"};
+	std::ostringstream ss;
+	ss << "squashfs ";
+	if ((comp > 0) && (comp < sizeof(names) / sizeof(names[0]))) {
+		ss << names[comp];
+	} else {
+		ss << "type " << comp;
+	}
+	ss << " compression is not supported";
+	throw ss.str();
+}
+
+/// Decompress a squashfs block.
+/**
+ * Called from worker threads, so it only touches its arguments.
+ *
+ * @return Number of bytes written to out.
+ *
+ * @throw std::string if the data is damaged.
+ */
+static size_t squashDecompress(unsigned int comp, const unsigned char *in,
+	size_t inLen, char *out, size_t outMax)
+{
+	switch (comp) {
+		case SquashGzip: {
+			uLongf len = outMax;
+			if (uncompress((Bytef *)out, &len, in, inLen) != Z_OK) break;
+			return len;
+		}
+#ifdef HAVE_LIBLZMA
+		case SquashXZ: {
+			uint64_t memlimit = UINT64_MAX;
+			size_t inPos = 0, outPos = 0;
+			if (lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &inPos, inLen,
+				(uint8_t *)out, &outPos, outMax) != LZMA_OK
+			) {
+				break;
+			}
+			return outPos;
+		}
+		case SquashLZMA: {
+			lzma_stream strm = LZMA_STREAM_INIT;
+			if (lzma_alone_decoder(&strm, UINT64_MAX) != LZMA_OK) break;
+			strm.next_in = in;
+			strm.avail_in = inLen;
+			strm.next_out = (uint8_t *)out;
+			strm.avail_out = outMax;
+			lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+			size_t len = outMax - strm.avail_out;
+			lzma_end(&strm);
+			if ((ret != LZMA_STREAM_END) && (ret != LZMA_OK)) break;
+			return len;
+		}
+#endif
+		default:
+			squashCheckCompression(comp);
+			break;
+	}
+	throw std::string("squashfs block is damaged");
+}
+
+/// Decompress a squashfs block that must fill the output exactly.
+static void squashBlockTask(unsigned int comp, const unsigned char *in,
+	size_t inLen, bool raw, char *out, size_t outLen)
+{
+	if (raw) {
+		if (inLen != outLen) throw std::string("squashfs block is damaged");
+		memcpy(out, in, inLen);
+		return;
+	}
+	if (squashDecompress(comp, in, inLen, out, outLen) != outLen) {
+		throw std::string("squashfs block is damaged");
+	}
+	return;
+}
+
+/// Decompress a squashfs fragment block, whose size is only known roughly.
+static void squashFragmentTask(unsigned int comp, const unsigned char *in,
+	size_t inLen, bool raw, size_t outMax, std::string *out)
+{
+	if (raw) {
+		out->assign((const char *)in, inLen);
+		return;
+	}
+	out->resize(outMax);
+	out->resize(squashDecompress(comp, in, inLen, &(*out)[0], outMax));
+	return;
+}
+
+/// squashfs 4, as made by mksquashfs.
+class SquashFS: public FirmwareFS
+{
+	public:
+		SquashFS(const unsigned char *data, size_t len, TaskPool *pool)
+			: data(data),
+			  len(len),
+			  pool(pool)
+		{
+			if (len < 96) throw std::string("squashfs superblock is cut off");
+			const unsigned char *p = data;
+			this->blockSize = get32le(p + 12);
+			this->fragments = get32le(p + 16);
+			this->comp = get16le(p + 20);
+			this->rootInode = get64le(p + 32);
+			uint16_t idCount = get16le(p + 26);
+			uint64_t idTable = get64le(p + 48);
+			this->inodeTable = get64le(p + 64);
+			this->dirTable = get64le(p + 72);
+			this->fragmentTable = get64le(p + 80);
+			if (get16le(p + 28) != 4) {
+				std::ostringstream ss;
+				ss << "squashfs version " << get16le(p + 28) << " is not supported";
+				throw ss.str();
+			}
+			if (
+				(this->blockSize < 4096) || (this->blockSize > SQUASHFS_MAX_BLOCK)
+				|| (this->inodeTable >= len) || (this->dirTable >= len)
+			) {
+				throw std::string("squashfs superblock is damaged");
+			}
+			// Fail now rather than on the first file
+			squashCheckCompression(this->comp);
+
+			// Owners are stored as indexes into a table of IDs, which follow
+			// on from each other in metadata blocks
+			if ((idTable > len) || (len - idTable < 8)) {
+				throw std::string("squashfs ID table is cut off");
+			}
+			MetaPos pos;
+			pos.block = get64le(p + idTable);
+			pos.offset = 0;
+			std::string b;
+			this->readMeta(&pos, idCount * 4, &b);
+			for (unsigned int i = 0; i < idCount; i++) {
+				this->ids.push_back(get32le((const unsigned char *)b.data() + i * 4));
+			}
+		}
+
+		virtual void list(std::vector<FirmwareFile> *files)
+		{
+			Inode root;
+			this->readInode(this->rootInode, &root);
+			if (!root.isDir) throw std::string("squashfs root is not a folder");
+			FirmwareFile dir;
+			this->fileDetails(root, this->rootInode, &dir);
+			dir.path = "/";
+			files->push_back(dir);
+			std::set<uint64_t> seen;
+			seen.insert(this->rootInode);
+			this->listDir(root, "/", 0, &seen, files);
+			return;
+		}
+
+		virtual void format(FirmwareFSFormat *fmt)
+		{
+			fmt->type = FirmwarePart::SquashFS;
+			fmt->compression = this->comp;
+			fmt->blockSize = this->blockSize;
+			fmt->bigEndian = false;
+			return;
+		}
+
+		virtual void read(const std::vector<FirmwareFile>& files,
+			std::vector<std::string> *contents)
+		{
+			contents->clear();
+			contents->resize(files.size());
+
+			// Each fragment block is decompressed once, however many files
+			// have their tail in it
+			std::map<uint32_t, std::string> fragments;
+			std::vector<Inode> inodes(files.size());
+			for (unsigned int f = 0; f < files.size(); f++) {
+				if (files[f].type != FirmwareFile::File) continue;
+				Inode& inode = inodes[f];
+				this->readInode(files[f].ref, &inode);
+				std::string& out = (*contents)[f];
+				out.resize(inode.size);
+
+				uint64_t pos = inode.startBlock;
+				uint64_t offset = 0;
+				for (std::vector<uint32_t>::const_iterator b = inode.blocks.begin();
+					b != inode.blocks.end(); b++
+				) {
+					size_t outLen = std::min<uint64_t>(this->blockSize, inode.size - offset);
+					size_t inLen = *b & ~SQUASHFS_BLOCK_RAW;
+					if (inLen == 0) {
+						// Sparse block, already zero
+						offset += outLen;
+						continue;
+					}
+					if ((pos > this->len) || (inLen > this->len - pos)) {
+						throw "squashfs data for " + files[f].path + " is cut off";
+					}
+					this->pool->post(boost::bind(squashBlockTask, this->comp,
+						this->data + pos, inLen, (*b & SQUASHFS_BLOCK_RAW) != 0,
+						&out[offset], outLen));
+					pos += inLen;
+					offset += outLen;
+				}
+				if (
+					(inode.fragment != SQUASHFS_NO_FRAGMENT)
+					&& (fragments.find(inode.fragment) == fragments.end())
+				) {
+					this->queueFragment(inode.fragment, &fragments[inode.fragment]);
+				}
+			}
+			this->pool->wait();
+
+			// Copy the tail of each file out of its fragment
+			for (unsigned int f = 0; f < files.size(); f++) {
+				const Inode& inode = inodes[f];
+				if ((files[f].type != FirmwareFile::File)
+					|| (inode.fragment == SQUASHFS_NO_FRAGMENT)
+				) {
+					continue;
+				}
+				uint64_t tail = inode.size % this->blockSize;
+				const std::string& frag = fragments[inode.fragment];
+				if ((inode.fragOffset > frag.length()) || (tail > frag.length() - inode.fragOffset)) {
+					throw "squashfs fragment for " + files[f].path + " is damaged";
+				}
+				memcpy(&(*contents)[f][inode.size - tail], frag.data() + inode.fragOffset, tail);
+			}
+			return;
+		}
+
+	private:
+		/// Position in a metadata table.
+		struct MetaPos
+		{
+			uint64_t block;   ///< Start of the metadata block in the image
+			size_t offset;    ///< Offset into its uncompressed content
+		};
+
+		/// A decompressed metadata block.
+		struct MetaBlock
+		{
+			std::string content;
+			uint64_t next;    ///< Start of the following block
+		};
+
+		/// The parts of an inode used here.
+		struct Inode
+		{
+			bool isDir;
+			uint16_t type;
+			uint16_t mode;
+			uint16_t uid;         ///< Index into the ID table
+			uint16_t gid;
+			uint32_t mtime;
+			uint32_t rdev;
+			uint64_t size;
+			uint64_t startBlock;
+			uint32_t fragment;
+			uint32_t fragOffset;
+			std::vector<uint32_t> blocks;
+			MetaPos dir;          ///< Where a folder's entries start
+			uint32_t dirSize;
+			std::string target;
+		};
+
+		const unsigned char *data;
+		size_t len;
+		TaskPool *pool;
+		uint32_t blockSize;
+		uint32_t fragments;
+		unsigned int comp;
+		uint64_t rootInode;
+		uint64_t inodeTable;
+		uint64_t dirTable;
+		uint64_t fragmentTable;
+		std::vector<uint32_t> ids;               ///< Owner and group IDs
+		std::map<uint64_t, MetaBlock> metadata;  ///< Cache, by position
+
+		/// Get a metadata block, decompressing it the first time.
+		const MetaBlock& metaBlock(uint64_t pos)
+		{
+			std::map<uint64_t, MetaBlock>::iterator i = this->metadata.find(pos);
+			if (i != this->metadata.end()) return i->second;
+
+			if ((pos > this->len) || (this->len - pos < 2)) {
+				throw std::string("squashfs metadata is cut off");
+			}
+			uint16_t header = get16le(this->data + pos);
+			size_t inLen = header & ~SQUASHFS_META_RAW;
+			if (inLen > this->len - pos - 2) throw std::string("squashfs metadata is cut off");
+			MetaBlock& block = this->metadata[pos];
+			block.next = pos + 2 + inLen;
+			if (header & SQUASHFS_META_RAW) {
+				block.content.assign((const char *)this->data + pos + 2, inLen);
+			} else {
+				squashFragmentTask(this->comp, this->data + pos + 2, inLen, false,
+					SQUASHFS_METADATA_SIZE, &block.content);
+			}
+			return block;
+		}
+
+		/// Read bytes from a metadata table, moving on to the next block as needed.
+		void readMeta(MetaPos *pos, size_t n, std::string *out)
+		{
+			out->clear();
+			while (n) {
+				const MetaBlock& block = this->metaBlock(pos->block);
+				if (pos->offset >= block.content.length()) {
+					throw std::string("squashfs metadata is damaged");
+				}
+				size_t take = std::min(n, block.content.length() - pos->offset);
+				out->append(block.content, pos->offset, take);
+				pos->offset += take;
+				n -= take;
+				if (pos->offset == block.content.length()) {
+					pos->block = block.next;
+					pos->offset = 0;
+				}
+			}
+			return;
+		}
+
+		void readInode(uint64_t ref, Inode *inode)
+		{
+			MetaPos pos;
+			pos.block = this->inodeTable + (ref >> 16);
+			pos.offset = ref & 0xFFFF;
+			std::string b;
+			this->readMeta(&pos, 16, &b);
+			const unsigned char *p = (const unsigned char *)b.data();
+			inode->type = get16le(p);
+			inode->mode = get16le(p + 2);
+			inode->uid = get16le(p + 4);
+			inode->gid = get16le(p + 6);
+			inode->mtime = get32le(p + 8);
+			inode->rdev = 0;
+			inode->isDir = false;
+			inode->size = 0;
+			inode->fragment = SQUASHFS_NO_FRAGMENT;
+			inode->blocks.clear();
+			inode->target.clear();
+
+			switch (inode->type) {
+				case 1: // folder
+					this->readMeta(&pos, 16, &b);
+					p = (const unsigned char *)b.data();
+					inode->isDir = true;
+					inode->dir.block = this->dirTable + get32le(p);
+					inode->dirSize = get16le(p + 8);
+					inode->dir.offset = get16le(p + 10);
+					break;
+				case 8: // folder with an index
+					this->readMeta(&pos, 24, &b);
+					p = (const unsigned char *)b.data();
+					inode->isDir = true;
+					inode->dirSize = get32le(p + 4);
+					inode->dir.block = this->dirTable + get32le(p + 8);
+					inode->dir.offset = get16le(p + 18);
+					break;
+				case 2: // file
+					this->readMeta(&pos, 16, &b);
+					p = (const unsigned char *)b.data();
+					inode->startBlock = get32le(p);
+					inode->fragment = get32le(p + 4);
+					inode->fragOffset = get32le(p + 8);
+					inode->size = get32le(p + 12);
+					this->readBlockList(&pos, inode);
+					break;
+				case 9: // large file
+					this->readMeta(&pos, 40, &b);
+					p = (const unsigned char *)b.data();
+					inode->startBlock = get64le(p);
+					inode->size = get64le(p + 8);
+					inode->fragment = get32le(p + 28);
+					inode->fragOffset = get32le(p + 32);
+					this->readBlockList(&pos, inode);
+					break;
+				case 3: // symlink
+				case 10: {
+					this->readMeta(&pos, 8, &b);
+					uint32_t targetLen = get32le((const unsigned char *)b.data() + 4);
+					if (targetLen > 4096) throw std::string("squashfs symlink is damaged");
+					this->readMeta(&pos, targetLen, &inode->target);
+					break;
+				}
+				case 4: // block and character devices
+				case 5:
+				case 11:
+				case 12:
+					this->readMeta(&pos, 8, &b);
+					inode->rdev = get32le((const unsigned char *)b.data() + 4);
+					break;
+				case 6: // FIFOs and sockets have nothing more of interest
+				case 7:
+				case 13:
+				case 14:
+					break;
+				default:
+					throw std::string("squashfs inode is damaged");
+			}
+			return;
+		}
+
+		/// Fill in everything but the path of a file from its inode.
+		void fileDetails(const Inode& inode, uint64_t ref, FirmwareFile *file)
+		{
+			if ((inode.uid >= this->ids.size()) || (inode.gid >= this->ids.size())) {
+				throw std::string("squashfs inode is damaged");
+			}
+			file->size = 0;
+			file->mode = squashTypeBits[inode.type] | (inode.mode & 07777);
+			file->uid = this->ids[inode.uid];
+			file->gid = this->ids[inode.gid];
+			file->mtime = inode.mtime;
+			file->rdev = inode.rdev;
+			file->ref = ref;
+			if (inode.isDir) {
+				file->type = FirmwareFile::Directory;
+			} else if ((inode.type == 2) || (inode.type == 9)) {
+				file->type = FirmwareFile::File;
+				file->size = inode.size;
+			} else if ((inode.type == 3) || (inode.type == 10)) {
+				file->type = FirmwareFile::Symlink;
+				file->target = inode.target;
+			} else {
+				file->type = FirmwareFile::Other;
+			}
+			return;
+		}
+
+		/// Read the compressed size of each block of a file.
+		void readBlockList(MetaPos *pos, Inode *inode)
+		{
+			if (inode->size > EXTRACT_MAX_FILE) {
+				throw std::string("squashfs file is too large, or damaged");
+			}
+			uint64_t count = inode->size / this->blockSize;
+			if ((inode->fragment == SQUASHFS_NO_FRAGMENT) && (inode->size % this->blockSize)) {
+				count++;
+			}
+			std::string b;
+			this->readMeta(pos, count * 4, &b);
+			const unsigned char *p = (const unsigned char *)b.data();
+			for (uint64_t i = 0; i < count; i++) inode->blocks.push_back(get32le(p + i * 4));
+			return;
+		}
+
+		void listDir(const Inode& dir, const std::string& path, unsigned int depth,
+			std::set<uint64_t> *seen, std::vector<FirmwareFile> *files)
+		{
+			if (depth > EXTRACT_MAX_DEPTH) throw std::string("squashfs folders are too deep");
+			if (dir.dirSize <= 3) return; // empty
+			MetaPos pos = dir.dir;
+			size_t left = dir.dirSize - 3;
+			std::string b;
+			while (left >= 12) {
+				this->readMeta(&pos, 12, &b);
+				left -= 12;
+				const unsigned char *p = (const unsigned char *)b.data();
+				uint32_t count = get32le(p) + 1;
+				uint32_t start = get32le(p + 4);
+				if (count > 256) throw std::string("squashfs folder is damaged");
+
+				for (uint32_t e = 0; e < count; e++) {
+					if (left < 8) throw std::string("squashfs folder is damaged");
+					this->readMeta(&pos, 8, &b);
+					p = (const unsigned char *)b.data();
+					uint64_t ref = ((uint64_t)start << 16) | get16le(p);
+					size_t nameLen = get16le(p + 6) + 1;
+					if (left - 8 < nameLen) throw std::string("squashfs folder is damaged");
+					left -= 8 + nameLen;
+					std::string name;
+					this->readMeta(&pos, nameLen, &name);
+					if (!validName(name)) throw std::string("squashfs file name is invalid");
+
+					Inode inode;
+					this->readInode(ref, &inode);
+					FirmwareFile file;
+					this->fileDetails(inode, ref, &file);
+					file.path = path + name;
+					files->push_back(file);
+					if (inode.isDir) {
+						// A folder can only be in one place, and a damaged image
+						// could otherwise list the same few many times over
+						if (!seen->insert(ref).second) {
+							throw "squashfs folder " + file.path + " is linked more than once";
+						}
+						this->listDir(inode, file.path + "/", depth + 1, seen, files);
+					}
+				}
+			}
+			return;
+		}
+
+		/// Queue the decompression of a fragment block.
+		void queueFragment(uint32_t index, std::string *out)
+		{
+			if (index >= this->fragments) throw std::string("squashfs fragment is damaged");
+			// The table is a list of metadata blocks of 512 entries each
+			uint64_t indexPos = this->fragmentTable + (uint64_t)(index / 512) * 8;
+			if ((indexPos > this->len) || (this->len - indexPos < 8)) {
+				throw std::string("squashfs fragment table is cut off");
+			}
+			MetaPos pos;
+			pos.block = get64le(this->data + indexPos);
+			pos.offset = (index % 512) * 16;
+			std::string b;
+			this->readMeta(&pos, 16, &b);
+			const unsigned char *p = (const unsigned char *)b.data();
+			uint64_t start = get64le(p);
+			uint32_t size = get32le(p + 8);
+			size_t inLen = size & ~SQUASHFS_BLOCK_RAW;
+			if ((start > this->len) || (inLen > this->len - start)) {
+				throw std::string("squashfs fragment is cut off");
+			}
+			this->pool->post(boost::bind(squashFragmentTask, this->comp,
+				this->data + start, inLen, (size & SQUASHFS_BLOCK_RAW) != 0,
+				(size_t)this->blockSize, out));
+			return;
+		}
+};
+
+/// Undo the JFFS2 "rtime" compression.
+static void rtimeDecompress(const unsigned char *in, size_t inLen, char *out,
+	size_t outLen)
+{
+	size_t positions[256];
+	memset(positions, 0, sizeof(positions));
+	size_t inPos = 0, outPos = 0;
+	while (outPos < outLen) {
+		if (inPos + 2 > inLen) throw std::string("jffs2 rtime data is damaged");
+		unsigned char value = in[inPos++];
+		size_t repeat = in[inPos++];
+		out[outPos++] = value;
+		size_t back = positions[value];
+		positions[value] = outPos;
+		if (repeat > outLen - outPos) throw std::string("jffs2 rtime data is damaged");
+		// May overlap, so copy a byte at a time
+		while (repeat--) out[outPos++] = out[back++];
+	}
+	return;
+}
+
+/// One version of part of a JFFS2 file.
+struct JFFS2Node
+{
+	uint32_t version;
+	uint32_t offset;       ///< Where the data goes in the file
+	uint32_t dataLen;      ///< Uncompressed size
+	uint32_t compLen;
+	unsigned char compr;
+	uint32_t dataCRC;
+	const unsigned char *data;
+};
+
+static bool nodeBefore(const JFFS2Node& a, const JFFS2Node& b)
+{
+	return a.version < b.version;
+}
+
+/// Decompress the data in a JFFS2 node.
+static void jffs2NodeTask(const JFFS2Node *node, std::string *out)
+{
+	if ((~crc32(0xFFFFFFFF, node->data, node->compLen) & 0xFFFFFFFF) != node->dataCRC) {
+		throw std::string("jffs2 node data is damaged");
+	}
+	out->resize(node->dataLen);
+	if (node->dataLen == 0) return;
+	switch (node->compr) {
+		case JFFS2_COMPR_NONE:
+			if (node->compLen != node->dataLen) throw std::string("jffs2 node is damaged");
+			memcpy(&(*out)[0], node->data, node->dataLen);
+			break;
+		case JFFS2_COMPR_ZERO:
+			break;
+		case JFFS2_COMPR_RTIME:
+			rtimeDecompress(node->data, node->compLen, &(*out)[0], node->dataLen);
+			break;
+		case JFFS2_COMPR_ZLIB: {
+			uLongf len = node->dataLen;
+			if (
+				(uncompress((Bytef *)&(*out)[0], &len, node->data, node->compLen) != Z_OK)
+				|| (len != node->dataLen)
+			) {
+				throw std::string("jffs2 node data is damaged");
+			}
+			break;
+		}
+		default: {
+			std::ostringstream ss;
+			ss << "jffs2 compression type " << (int)node->compr << " is not supported";
+			throw ss.str();
+		}
+	}
+	return;
+}
+
+/// A run of JFFS2 nodes, as found by analyseFirmware().
+class JFFS2FS: public FirmwareFS
+{
+	public:
+		JFFS2FS(const unsigned char *data, size_t len, TaskPool *pool)
+			: pool(pool),
+			  compressions(0)
+		{
+			if (len < 12) throw std::string("jffs2 filesystem is cut off");
+			this->bigEndian = get16be(data) == 0x1985;
+			uint16_t (*get16)(const unsigned char *) = this->bigEndian ? get16be : get16le;
+			uint32_t (*get32)(const unsigned char *) = this->bigEndian ? get32be : get32le;
+
+			// Nodes are on 4-byte boundaries, with padding and erased space
+			// between them
+			size_t pos = 0;
+			while (pos + 12 <= len) {
+				const unsigned char *p = data + pos;
+				uint32_t totlen = get32(p + 4);
+				if (
+					(get16(p) != 0x1985)
+					|| ((~crc32(0xFFFFFFFF, p, 8) & 0xFFFFFFFF) != get32(p + 8))
+					|| (totlen < 12) || (totlen > len - pos)
+				) {
+					pos += 4;
+					continue;
+				}
+				uint16_t type = get16(p + 2);
+				if ((type == JFFS2_NODETYPE_DIRENT) && (totlen >= 40)) {
+					uint8_t nameLen = p[28];
+					if (40u + nameLen <= totlen) {
+						std::string name((const char *)p + 40, nameLen);
+						Dirent& d = this->dirents[std::make_pair(get32(p + 12), name)];
+						uint32_t version = get32(p + 16);
+						if (version >= d.version) {
+							d.version = version;
+							d.ino = get32(p + 20);
+							d.type = p[29];
+						}
+					}
+				} else if ((type == JFFS2_NODETYPE_INODE) && (totlen >= 68)) {
+					uint32_t ino = get32(p + 12);
+					JFFS2Node node;
+					node.version = get32(p + 16);
+					node.offset = get32(p + 44);
+					node.compLen = get32(p + 48);
+					node.dataLen = get32(p + 52);
+					node.compr = p[56];
+					node.dataCRC = get32(p + 60);
+					node.data = p + 68;
+					if ((68 + (uint64_t)node.compLen <= totlen) && (node.dataLen <= 65536 * 4)) {
+						Inode& inode = this->inodes[ino];
+						inode.nodes.push_back(node);
+						if (node.version >= inode.version) {
+							inode.version = node.version;
+							inode.mode = get32(p + 20);
+							inode.uid = get16(p + 24);
+							inode.gid = get16(p + 26);
+							inode.size = get32(p + 28);
+							inode.mtime = get32(p + 36);
+						}
+						if (node.compr < 32) this->compressions |= 1 << node.compr;
+					}
+				}
+				pos += (totlen + 3) & ~3;
+			}
+			for (std::map<uint32_t, Inode>::iterator i = this->inodes.begin();
+				i != this->inodes.end(); i++
+			) {
+				std::sort(i->second.nodes.begin(), i->second.nodes.end(), nodeBefore);
+			}
+		}
+
+		virtual void list(std::vector<FirmwareFile> *files)
+		{
+			// Latest entry for each name in each folder, unless it was deleted
+			std::multimap<uint32_t, std::pair<std::string, const Dirent *> > children;
+			for (std::map<std::pair<uint32_t, std::string>, Dirent>::const_iterator i =
+				this->dirents.begin(); i != this->dirents.end(); i++
+			) {
+				if (i->second.ino == 0) continue;
+				children.insert(std::make_pair(i->first.first,
+					std::make_pair(i->first.second, &i->second)));
+			}
+			// The root folder usually has no inode, so gets the kernel's defaults
+			FirmwareFile root;
+			root.type = FirmwareFile::Directory;
+			root.path = "/";
+			root.size = 0;
+			root.mode = S_IFDIR | 0755;
+			root.uid = 0;
+			root.gid = 0;
+			root.mtime = 0;
+			root.rdev = 0;
+			root.ref = JFFS2_ROOT_INO;
+			std::map<uint32_t, Inode>::const_iterator rootInode =
+				this->inodes.find(JFFS2_ROOT_INO);
+			if (rootInode != this->inodes.end()) {
+				root.mode = S_IFDIR | (rootInode->second.mode & 07777);
+				root.uid = rootInode->second.uid;
+				root.gid = rootInode->second.gid;
+				root.mtime = rootInode->second.mtime;
+			}
+			files->push_back(root);
+			std::set<uint32_t> seen;
+			seen.insert(JFFS2_ROOT_INO);
+			this->listDir(children, JFFS2_ROOT_INO, "/", &seen, files);
+			return;
+		}
+
+		virtual void read(const std::vector<FirmwareFile>& files,
+			std::vector<std::string> *contents)
+		{
+			contents->clear();
+			contents->resize(files.size());
+
+			// Decompress every node of every file at once, then apply them to
+			// each file in version order
+			std::vector<std::vector<std::string> > data(files.size());
+			for (unsigned int f = 0; f < files.size(); f++) {
+				if (files[f].type != FirmwareFile::File) continue;
+				const Inode& inode = this->inode(files[f]);
+				data[f].resize(inode.nodes.size());
+				for (unsigned int n = 0; n < inode.nodes.size(); n++) {
+					this->pool->post(boost::bind(jffs2NodeTask, &inode.nodes[n],
+						&data[f][n]));
+				}
+			}
+			this->pool->wait();
+
+			for (unsigned int f = 0; f < files.size(); f++) {
+				if (files[f].type != FirmwareFile::File) continue;
+				this->assemble(this->inode(files[f]), data[f], &(*contents)[f]);
+			}
+			return;
+		}
+
+		virtual void format(FirmwareFSFormat *fmt)
+		{
+			// Rebuild with zlib if the original used it anywhere
+			fmt->type = FirmwarePart::JFFS2;
+			fmt->compression = (this->compressions & (1 << JFFS2_COMPR_ZLIB))
+				? JFFS2_COMPR_ZLIB : JFFS2_COMPR_NONE;
+			fmt->blockSize = 0;
+			fmt->bigEndian = this->bigEndian;
+			return;
+		}
+
+	private:
+		struct Dirent
+		{
+			Dirent()
+				: version(0),
+				  ino(0),
+				  type(0)
+			{
+			}
+
+			uint32_t version;
+			uint32_t ino;      ///< 0 if the name was deleted
+			uint8_t type;      ///< DT_* value
+		};
+
+		struct Inode
+		{
+			Inode()
+				: version(0),
+				  mode(0),
+				  uid(0),
+				  gid(0),
+				  size(0),
+				  mtime(0)
+			{
+			}
+
+			uint32_t version;  ///< Of the latest node, which has the details below
+			uint32_t mode;
+			uint16_t uid;
+			uint16_t gid;
+			uint32_t size;
+			uint32_t mtime;
+			std::vector<JFFS2Node> nodes;
+		};
+
+		TaskPool *pool;
+		bool bigEndian;
+		uint32_t compressions;  ///< Bit set for each compression method seen
+		std::map<std::pair<uint32_t, std::string>, Dirent> dirents; ///< By folder and name
+		std::map<uint32_t, Inode> inodes;
+
+		const Inode& inode(const FirmwareFile& file)
+		{
+			std::map<uint32_t, Inode>::const_iterator i = this->inodes.find(file.ref);
+			if (i == this->inodes.end()) throw "jffs2 has no data for " + file.path;
+			return i->second;
+		}
+
+		/// Build a file's content from its nodes, oldest first.
+		void assemble(const Inode& inode, const std::vector<std::string>& data,
+			std::string *out)
+		{
+			if (inode.size > EXTRACT_MAX_FILE) {
+				throw std::string("jffs2 file is too large, or damaged");
+			}
+			out->assign(inode.size, '\0');
+			for (unsigned int n = 0; n < inode.nodes.size(); n++) {
+				uint32_t offset = inode.nodes[n].offset;
+				if (offset >= inode.size) continue;
+				size_t len = std::min<size_t>(data[n].length(), inode.size - offset);
+				memcpy(&(*out)[offset], data[n].data(), len);
+			}
+			return;
+		}
+
+		void listDir(
+			const std::multimap<uint32_t, std::pair<std::string, const Dirent *> >& children,
+			uint32_t ino, const std::string& path, std::set<uint32_t> *seen,
+			std::vector<FirmwareFile> *files)
+		{
+			if (path.length() > 4096) throw std::string("jffs2 folders are too deep");
+			typedef std::multimap<uint32_t, std::pair<std::string, const Dirent *> > Children;
+			std::pair<Children::const_iterator, Children::const_iterator> range =
+				children.equal_range(ino);
+			for (Children::const_iterator i = range.first; i != range.second; i++) {
+				const std::string& name = i->second.first;
+				const Dirent& d = *i->second.second;
+				if (!validName(name)) throw std::string("jffs2 file name is invalid");
+				std::map<uint32_t, Inode>::const_iterator inode = this->inodes.find(d.ino);
+
+				FirmwareFile file;
+				file.path = path + name;
+				file.size = 0;
+				file.mode = (d.type << 12) & S_IFMT;
+				file.uid = 0;
+				file.gid = 0;
+				file.mtime = 0;
+				file.rdev = 0;
+				file.ref = d.ino;
+				if (inode != this->inodes.end()) {
+					file.mode |= inode->second.mode & 07777;
+					file.uid = inode->second.uid;
+					file.gid = inode->second.gid;
+					file.mtime = inode->second.mtime;
+				}
+				switch (d.type) {
+					case 4: file.type = FirmwareFile::Directory; break;
+					case 8: file.type = FirmwareFile::File; break;
+					case 10: file.type = FirmwareFile::Symlink; break;
+					default: file.type = FirmwareFile::Other; break;
+				}
+				if ((file.type == FirmwareFile::File) || (file.type == FirmwareFile::Symlink)) {
+					if (inode == this->inodes.end()) {
+						throw "jffs2 has no data for " + file.path;
+					}
+					file.size = inode->second.size;
+				}
+				if (file.type == FirmwareFile::Symlink) {
+					// Small enough to read now rather than on the pool
+					std::vector<FirmwareFile> one(1, file);
+					one[0].type = FirmwareFile::File;
+					std::vector<std::string> target;
+					this->read(one, &target);
+					file.target = target[0];
+					file.size = 0;
+				} else if (
+					(file.type == FirmwareFile::Other) && (inode != this->inodes.end())
+					&& !inode->second.nodes.empty()
+					&& (S_ISCHR(file.mode) || S_ISBLK(file.mode))
+				) {
+					// A device's number is the data of its latest node, in the old
+					// 16-bit form or the new 32-bit one
+					std::string dev;
+					jffs2NodeTask(&inode->second.nodes.back(), &dev);
+					const unsigned char *p = (const unsigned char *)dev.data();
+					if (dev.length() == 2) {
+						file.rdev = this->bigEndian ? get16be(p) : get16le(p);
+					} else if (dev.length() == 4) {
+						file.rdev = this->bigEndian ? get32be(p) : get32le(p);
+					}
+				}
+				files->push_back(file);
+				if (file.type == FirmwareFile::Directory) {
+					// A folder can only be in one place
+					if (!seen->insert(d.ino).second) {
+						throw "jffs2 folder " + file.path + " is linked more than once";
+					}
+					this->listDir(children, d.ino, file.path + "/", seen, files);
+				}
+			}
+			return;
+		}
+};
+
+FirmwareFS *openFirmwareFS(const char *data, size_t len,
+	const FirmwarePart& part, TaskPool *pool)
+{
+	if (part.offset >= len) return NULL;
+	const unsigned char *p = (const unsigned char *)data + part.offset;
+	size_t avail = len - part.offset;
+	if (part.length && (part.length < avail)) avail = part.length;
+	switch (part.type) {
+		case FirmwarePart::SquashFS:
+			return new SquashFS(p, avail, pool);
+		case FirmwarePart::JFFS2:
+			return new JFFS2FS(p, avail, pool);
+		default:
+			return NULL;
+	}
+}
+
+bool pathSelected(const std::string& path, const std::vector<std::string>& wanted)
+{
+	if (wanted.empty()) return true;
+	for (std::vector<std::string>::const_iterator i = wanted.begin();
+		i != wanted.end(); i++
+	) {
+		std::string w = *i;
+		if (w.empty() || (w[0] != '/')) w = "/" + w;
+		while ((w.length() > 1) && (w[w.length() - 1] == '/')) w.erase(w.length() - 1);
+		if (path.compare(w) == 0) return true;
+		if (w.compare("/") == 0) return true;
+		if ((path.compare(0, w.length(), w) == 0) && (path[w.length()] == '/')) return true;
+	}
+	return false;
+}
+
+/// Create the folders along a path inside the output folder.
+/**
+ * @throw std::string if a folder is already a link, which could lead outside
+ *   the output folder.
+ */
+static void makeDirs(const std::string& dir, const std::string& path)
+{
+	std::string::size_type pos = 0;
+	do {
+		pos = path.find('/', pos + 1);
+		std::string name = dir + path.substr(0, pos);
+		struct stat st;
+		if (lstat(name.c_str(), &st) != 0) {
+			if (mkdir(name.c_str(), 0755) != 0) {
+				throw "unable to create " + name + ": " + strerror(errno);
+			}
+		} else if (!S_ISDIR(st.st_mode)) {
+			throw "not writing through " + name + ", which is not a folder";
+		}
+	} while (pos != std::string::npos);
+	return;
+}
+
+/// Write out one batch of files.
+static void writeBatch(FirmwareFS *fs, const std::vector<FirmwareFile>& batch,
+	const std::string& dir)
+{
+	std::vector<std::string> contents;
+	fs->read(batch, &contents);
+	for (unsigned int i = 0; i < batch.size(); i++) {
+		std::string filename = dir + batch[i].path;
+		makeDirs(dir, batch[i].path.substr(0, batch[i].path.rfind('/')));
+		int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+			(batch[i].mode & 0777) | 0600);
+		if (fd < 0) throw "unable to write " + filename + ": " + strerror(errno);
+		bool ok = write(fd, contents[i].data(), contents[i].length())
+			== (ssize_t)contents[i].length();
+		ok = (close(fd) == 0) && ok;
+		if (!ok) throw "unable to write " + filename + ": " + strerror(errno);
+	}
+	return;
+}
+
+unsigned long extractFiles(FirmwareFS *fs, const std::vector<FirmwareFile>& files,
+	const std::vector<std::string>& wanted, const std::string& dir)
+{
+	unsigned long count = 0;
+	mkdirs(dir + "/", 0755);
+	std::vector<FirmwareFile> batch, links;
+	uint64_t batchSize = 0;
+	for (std::vector<FirmwareFile>::const_iterator i = files.begin();
+		i != files.end(); i++
+	) {
+		if (!pathSelected(i->path, wanted)) continue;
+		switch (i->type) {
+			case FirmwareFile::Directory:
+				if (i->path.compare("/") != 0) makeDirs(dir, i->path);
+				count++;
+				break;
+			case FirmwareFile::File:
+				if (batchSize + i->size > EXTRACT_BATCH_SIZE) {
+					writeBatch(fs, batch, dir);
+					batch.clear();
+					batchSize = 0;
+				}
+				batch.push_back(*i);
+				batchSize += i->size;
+				count++;
+				break;
+			case FirmwareFile::Symlink:
+				links.push_back(*i);
+				break;
+			case FirmwareFile::Other:
+				if (verbose) std::cerr << "[extract] Skipping special file "
+					<< i->path << std::endl;
+				break;
+		}
+	}
+	if (!batch.empty()) writeBatch(fs, batch, dir);
+
+	for (std::vector<FirmwareFile>::const_iterator i = links.begin();
+		i != links.end(); i++
+	) {
+		std::string filename = dir + i->path;
+		makeDirs(dir, i->path.substr(0, i->path.rfind('/')));
+		if (symlink(i->target.c_str(), filename.c_str()) != 0) {
+			if (verbose) std::cerr << "[extract] Unable to create link " << filename
+				<< ": " << strerror(errno) << std::endl;
+			continue;
+		}
+		count++;
+	}
+	return count;
+}
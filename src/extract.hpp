@@ -0,0 +1,198 @@
+/**
+ * @file   extract.hpp
+ * @brief  Read files out of the filesystems inside a firmware image.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXTRACT_HPP
+#define EXTRACT_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "analyse.hpp"
+
+/// One file, folder or link in a filesystem inside a firmware image.
+struct FirmwareFile
+{
+	enum Type {
+		File,
+		Directory,
+		Symlink,
+		Other       ///< Device, FIFO or socket, which has no content
+	};
+
+	Type type;
+	std::string path;     ///< Full path, starting with '/'
+	uint64_t size;        ///< Bytes of content, 0 unless a file
+	unsigned int mode;    ///< Type and permission bits, as in st_mode
+	unsigned int uid;
+	unsigned int gid;
+	uint32_t mtime;       ///< Modification time, in seconds since 1970
+	uint32_t rdev;        ///< Device number of a device, as the kernel encodes it
+	std::string target;   ///< Where a symlink points
+	uint64_t ref;         ///< Where the filesystem keeps the details
+};
+
+/// How a filesystem was made, so it can be rebuilt the same way.
+struct FirmwareFSFormat
+{
+	FirmwarePart::Type type;    ///< SquashFS or JFFS2
+	unsigned int compression;   ///< squashfs compressor ID, or JFFS2 method
+	uint32_t blockSize;         ///< squashfs data block size
+	bool bigEndian;             ///< JFFS2 byte order
+};
+
+/// Runs decompression tasks on a pool of threads.
+class TaskPool
+{
+	public:
+		/// Start the threads.
+		/**
+		 * @param threads
+		 *   Number of tasks to run at once.
+		 */
+		TaskPool(unsigned int threads);
+
+		~TaskPool();
+
+		/// Queue a task.
+		/**
+		 * @param task
+		 *   Function to run.  It may throw std::string to report a problem.
+		 */
+		void post(const boost::function<void()>& task);
+
+		/// Wait for every task queued so far to finish.
+		/**
+		 * @throw std::string the first error thrown by a task.
+		 */
+		void wait();
+
+	private:
+		boost::asio::io_service io_service;
+		boost::scoped_ptr<boost::asio::io_service::work> work;
+		boost::thread_group threads;
+
+		boost::mutex mutex;              ///< Protects everything below
+		boost::condition_variable idle;  ///< Signalled when no tasks are left
+		unsigned long outstanding;       ///< Tasks queued or running
+		std::string error;               ///< First failure, empty if none
+
+		/// Run one task.  Runs on a worker thread.
+		void run(boost::function<void()> task);
+};
+
+/// Reads files from a filesystem inside a firmware image.
+class FirmwareFS
+{
+	public:
+		virtual ~FirmwareFS();
+
+		/// List every file, folder and link, each folder before its content.
+		/**
+		 * @throw std::string if the filesystem is damaged.
+		 */
+		virtual void list(std::vector<FirmwareFile> *files) = 0;
+
+		/// Get the content of some files.
+		/**
+		 * Each compressed block of every file is a separate task on the pool,
+		 * so reading many files at once keeps all the threads busy.
+		 *
+		 * @param files
+		 *   Files to read, as returned by list().
+		 *
+		 * @param contents
+		 *   On return, the content of each file in the same order.
+		 *
+		 * @throw std::string if a file is damaged or uses compression that
+		 *   isn't supported.
+		 */
+		virtual void read(const std::vector<FirmwareFile>& files,
+			std::vector<std::string> *contents) = 0;
+
+		/// Get the settings the filesystem was made with.
+		virtual void format(FirmwareFSFormat *fmt) = 0;
+};
+
+/// Open a filesystem found by analyseFirmware().
+/**
+ * Supports squashfs 4 (gzip, plus lzma and xz if built with liblzma) and
+ * JFFS2 (uncompressed, zero, rtime and zlib nodes).
+ *
+ * @param data
+ *   Image content, which must remain valid until the filesystem is closed.
+ *
+ * @param len
+ *   Size of the image.
+ *
+ * @param part
+ *   Where the filesystem is.
+ *
+ * @param pool
+ *   Threads to decompress on.  It must remain valid until the filesystem is
+ *   closed.
+ *
+ * @return The filesystem, or NULL if this kind of part doesn't hold files.
+ *
+ * @throw std::string if the filesystem is damaged or can't be read.
+ */
+FirmwareFS *openFirmwareFS(const char *data, size_t len,
+	const FirmwarePart& part, TaskPool *pool);
+
+/// Check whether a path is one of those asked for, or inside one of them.
+/**
+ * @param path
+ *   Path to check, starting with '/'.
+ *
+ * @param wanted
+ *   Paths asked for.  If empty, every path is selected.
+ */
+bool pathSelected(const std::string& path, const std::vector<std::string>& wanted);
+
+/// Write the selected files from a filesystem into a folder.
+/**
+ * Links are created last, so nothing is written through a link that points
+ * outside the folder.
+ *
+ * @param fs
+ *   Filesystem to read from.
+ *
+ * @param files
+ *   Everything in the filesystem, as returned by FirmwareFS::list().
+ *
+ * @param wanted
+ *   Paths to extract, as for pathSelected().
+ *
+ * @param dir
+ *   Folder to write to.  It is created if needed.
+ *
+ * @return Number of files, folders and links written.
+ *
+ * @throw std::string if something could not be read or written.
+ */
+unsigned long extractFiles(FirmwareFS *fs, const std::vector<FirmwareFile>& files,
+	const std::vector<std::string>& wanted, const std::string& dir);
+
+#endif // EXTRACT_HPP
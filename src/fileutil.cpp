@@ -0,0 +1,151 @@
+/**
+ * @file   fileutil.cpp
+ * @brief  Helpers shared by the code that reads and writes local files.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fileutil.hpp"
+
+uint16_t get16le(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+uint16_t get16be(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+uint32_t get32le(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t get32be(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint64_t get64le(const unsigned char *p)
+{
+	return get32le(p) | ((uint64_t)get32le(p + 4) << 32);
+}
+
+uint64_t get64be(const unsigned char *p)
+{
+	return ((uint64_t)get32be(p) << 32) | get32be(p + 4);
+}
+
+void put32le(unsigned char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++) p[i] = (v >> (i * 8)) & 0xFF;
+	return;
+}
+
+void put64le(unsigned char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++) p[i] = (v >> (i * 8)) & 0xFF;
+	return;
+}
+
+void append16le(std::string *out, uint16_t v)
+{
+	out->push_back(v & 0xFF);
+	out->push_back(v >> 8);
+	return;
+}
+
+void append32le(std::string *out, uint32_t v)
+{
+	unsigned char buf[4];
+	put32le(buf, v);
+	out->append((const char *)buf, 4);
+	return;
+}
+
+void append64le(std::string *out, uint64_t v)
+{
+	unsigned char buf[8];
+	put64le(buf, v);
+	out->append((const char *)buf, 8);
+	return;
+}
+
+std::string escape(const std::string& in)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	std::string out;
+	for (std::string::const_iterator i = in.begin(); i != in.end(); i++) {
+		unsigned char c = *i;
+		if ((c == '%') || (c < 0x20)) {
+			out += '%';
+			out += hex[c >> 4];
+			out += hex[c & 0x0F];
+		} else {
+			out += c;
+		}
+	}
+	return out;
+}
+
+std::string unescape(const char *in, size_t len)
+{
+	std::string out;
+	for (size_t i = 0; i < len; i++) {
+		if ((in[i] == '%') && (i + 2 < len)) {
+			char hex[3] = {in[i + 1], in[i + 2], '\0'};
+			out += (char)strtoul(hex, NULL, 16);
+			i += 2;
+		} else {
+			out += in[i];
+		}
+	}
+	return out;
+}
+
+void mkdirs(const std::string& path, mode_t mode)
+{
+	std::string::size_type pos = 0;
+	while ((pos = path.find('/', pos + 1)) != std::string::npos) {
+		mkdir(path.substr(0, pos).c_str(), mode);
+	}
+	return;
+}
+
+uint64_t replaceFile(const std::string& filename, const std::string& content)
+{
+	mkdirs(filename, 0700);
+	std::string tmpname = filename + ".XXXXXX";
+	int fd = mkstemp(&tmpname[0]);
+	if (fd < 0) throw "unable to write " + filename + ": " + strerror(errno);
+	struct stat st;
+	bool ok = write(fd, content.data(), content.length()) == (ssize_t)content.length();
+	ok = (fstat(fd, &st) == 0) && ok;
+	ok = (close(fd) == 0) && ok;
+	if (!ok || (rename(tmpname.c_str(), filename.c_str()) != 0)) {
+		std::string err = strerror(errno);
+		unlink(tmpname.c_str());
+		throw "unable to save " + filename + ": " + err;
+	}
+	return st.st_ino;
+}
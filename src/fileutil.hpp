@@ -0,0 +1,95 @@
+/**
+ * @file   fileutil.hpp
+ * @brief  Helpers shared by the code that reads and writes local files.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILEUTIL_HPP
+#define FILEUTIL_HPP
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// Read a 16-bit little-endian number.
+uint16_t get16le(const unsigned char *p);
+
+/// Read a 16-bit big-endian number.
+uint16_t get16be(const unsigned char *p);
+
+/// Read a 32-bit little-endian number.
+uint32_t get32le(const unsigned char *p);
+
+/// Read a 32-bit big-endian number.
+uint32_t get32be(const unsigned char *p);
+
+/// Read a 64-bit little-endian number.
+uint64_t get64le(const unsigned char *p);
+
+/// Read a 64-bit big-endian number.
+uint64_t get64be(const unsigned char *p);
+
+/// Write a 32-bit little-endian number.
+void put32le(unsigned char *p, uint32_t v);
+
+/// Write a 64-bit little-endian number.
+void put64le(unsigned char *p, uint64_t v);
+
+/// Add a 16-bit little-endian number to the end of a string.
+void append16le(std::string *out, uint16_t v);
+
+/// Add a 32-bit little-endian number to the end of a string.
+void append32le(std::string *out, uint32_t v);
+
+/// Add a 64-bit little-endian number to the end of a string.
+void append64le(std::string *out, uint64_t v);
+
+/// Escape characters that would break a tab-separated file.
+/**
+ * Control characters and '%' are written as '%' and two hex digits.
+ */
+std::string escape(const std::string& in);
+
+/// Reverse escape().
+std::string unescape(const char *in, size_t len);
+
+/// Create the folders leading to a path, ignoring any that already exist.
+/**
+ * @param path
+ *   File or folder whose parent folders are created.  The last part of the
+ *   path is only created too if it ends in a slash.
+ *
+ * @param mode
+ *   Permissions for the new folders, before the umask is applied.
+ */
+void mkdirs(const std::string& path, mode_t mode);
+
+/// Replace a file in one go, so a reader never sees half of it.
+/**
+ * The content is written under a unique temporary name then renamed over
+ * the file, so several threads or processes can write the same file at once
+ * and the last one wins.  Missing folders are created, and the file and
+ * folders are readable only by the owner.
+ *
+ * @return Inode of the new file.
+ *
+ * @throw std::string if the file could not be written.
+ */
+uint64_t replaceFile(const std::string& filename, const std::string& content);
+
+#endif // FILEUTIL_HPP
@@ -0,0 +1,158 @@
+/**
+ * @file   httpd.cpp
+ * @brief  Minimal HTTP server for exposing status locally.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <boost/bind.hpp>
+#include "main.hpp"
+#include "httpd.hpp"
+
+/// Seconds a client has to send its request before being disconnected.
+#define REQUEST_TIMEOUT 5
+
+/// Largest request accepted, in bytes.
+#define MAX_REQUEST 8192
+
+struct HttpServer::Session
+{
+	Session(boost::asio::io_service& io_service)
+		: socket(io_service),
+		  timer(io_service),
+		  request(MAX_REQUEST)
+	{
+	}
+
+	boost::asio::ip::tcp::socket socket;
+	boost::asio::deadline_timer timer;
+	boost::asio::streambuf request;
+	std::string response;
+};
+
+HttpServer::HttpServer(const std::string& address, unsigned short port,
+	fn_http_handler handler)
+	: acceptor(io_service),
+	  handler(handler)
+{
+	boost::asio::ip::tcp::endpoint endpoint(
+		boost::asio::ip::address::from_string(address), port);
+	this->acceptor.open(endpoint.protocol());
+	this->acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+	this->acceptor.bind(endpoint);
+	this->acceptor.listen();
+	if (verbose) std::cerr << "[httpd] Listening on " << address << " port "
+		<< this->port() << std::endl;
+
+	this->accept();
+	this->thread = boost::thread(boost::bind(&boost::asio::io_service::run,
+		&this->io_service));
+}
+
+HttpServer::~HttpServer()
+{
+	this->io_service.stop();
+	this->thread.join();
+}
+
+unsigned short HttpServer::port() const
+{
+	return this->acceptor.local_endpoint().port();
+}
+
+void HttpServer::accept()
+{
+	boost::shared_ptr<Session> session(new Session(this->io_service));
+	this->acceptor.async_accept(session->socket,
+		boost::bind(&HttpServer::onAccept, this, session,
+			boost::asio::placeholders::error));
+	return;
+}
+
+void HttpServer::onAccept(boost::shared_ptr<Session> session,
+	const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) return;
+	this->accept();
+	if (error) return;
+
+	session->timer.expires_from_now(boost::posix_time::seconds(REQUEST_TIMEOUT));
+	session->timer.async_wait(boost::bind(&HttpServer::onClose, this, session,
+		boost::asio::placeholders::error));
+	boost::asio::async_read_until(session->socket, session->request, "\r\n\r\n",
+		boost::bind(&HttpServer::onRequest, this, session,
+			boost::asio::placeholders::error));
+	return;
+}
+
+void HttpServer::onRequest(boost::shared_ptr<Session> session,
+	const boost::system::error_code& error)
+{
+	session->timer.cancel();
+	if (error) return;
+
+	std::istream request_stream(&session->request);
+	std::string method, path;
+	request_stream >> method >> path;
+
+	HttpResponse response;
+	response.status = 404;
+	response.contentType = "text/plain";
+	if (method.compare("GET") != 0) {
+		response.status = 405;
+		response.body = "Only GET is supported\n";
+	} else {
+		try {
+			this->handler(path, &response);
+		} catch (const std::exception& e) {
+			response.status = 500;
+			response.body = std::string(e.what()) + "\n";
+		} catch (const std::string& e) {
+			response.status = 500;
+			response.body = e + "\n";
+		}
+	}
+	if ((response.status == 404) && response.body.empty()) {
+		response.body = "Not found\n";
+	}
+
+	std::stringstream out;
+	out << "HTTP/1.0 " << response.status << " "
+		<< (response.status == 200 ? "OK" : "Error") << "\r\n"
+		<< "Content-Type: " << response.contentType << "\r\n"
+		<< "Content-Length: " << response.body.length() << "\r\n"
+		<< "Connection: close\r\n\r\n"
+		<< response.body;
+	session->response = out.str();
+
+	// The session is kept alive by being bound to the handler until the write
+	// finishes, at which point the socket is closed by its destructor.
+	boost::asio::async_write(session->socket, boost::asio::buffer(session->response),
+		boost::bind(&HttpServer::onClose, this, session,
+			boost::asio::placeholders::error));
+	return;
+}
+
+void HttpServer::onClose(boost::shared_ptr<Session> session,
+	const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) return;
+	boost::system::error_code ignored;
+	session->socket.close(ignored);
+	return;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file   httpd.hpp
+ * @brief  Minimal HTTP server for exposing status locally.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HTTPD_HPP
+#define HTTPD_HPP
+
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+/// Response to an HTTP request.
+struct HttpResponse
+{
+	unsigned int status;      ///< e.g. 200
+	std::string contentType;  ///< e.g. "text/plain"
+	std::string body;
+};
+
+/// Callback to produce the response for a GET request.
+/**
+ * @param path
+ *   Requested path, including any query string.
+ *
+ * @param response
+ *   Response to fill in.  Defaults to status 404 with an empty body.
+ */
+typedef boost::function<void(const std::string& path, HttpResponse *response)>
+	fn_http_handler;
+
+/// HTTP/1.0 server running in a background thread.
+/**
+ * Only GET requests are supported, and each connection handles a single
+ * request.  This is intended for status pages and metrics scrapes on a
+ * trusted network, so by default it only listens on the loopback interface.
+ */
+class HttpServer
+{
+	public:
+		/// Start listening.
+		/**
+		 * @param address
+		 *   Address to listen on, e.g. "127.0.0.1".
+		 *
+		 * @param port
+		 *   Port to listen on, or 0 to pick a free one.
+		 *
+		 * @param handler
+		 *   Called from the server thread for each request.
+		 *
+		 * @throw boost::system::system_error if the port could not be opened.
+		 */
+		HttpServer(const std::string& address, unsigned short port,
+			fn_http_handler handler);
+
+		/// Stop the server and wait for the thread to finish.
+		~HttpServer();
+
+		/// Get the port being listened on.
+		unsigned short port() const;
+
+	private:
+		struct Session;
+
+		boost::asio::io_service io_service;
+		boost::asio::ip::tcp::acceptor acceptor;
+		fn_http_handler handler;
+		boost::thread thread;
+
+		void accept();
+		void onAccept(boost::shared_ptr<Session> session,
+			const boost::system::error_code& error);
+		void onRequest(boost::shared_ptr<Session> session,
+			const boost::system::error_code& error);
+		/// Close the connection once the response is sent or the client has
+		/// taken too long to send a request.
+		void onClose(boost::shared_ptr<Session> session,
+			const boost::system::error_code& error);
+};
+
+#endif // HTTPD_HPP
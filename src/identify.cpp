@@ -0,0 +1,378 @@
+/**
+ * @file   identify.cpp
+ * @brief  Automatic identification of supported devices.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sstream>
+#include <boost/regex.hpp>
+#include "main.hpp"
+#include "identify.hpp"
+#include "maygion-mips.hpp"
+#include "wansview.hpp"
+#include "metrics.hpp"
+#include "parse.hpp"
+
+#define possible_match(conf, tname) \
+	if (verbose) std::cerr << "Possible match: " << tname \
+		<< " (confidence: " << conf; \
+	if (confidence < conf) { \
+		if (verbose) std::cerr << ")\n"; \
+		type = tname; \
+		confidence = conf; \
+	} else { \
+		if (verbose) std::cerr << "; too low, ignoring)\n"; \
+	}
+
+Identify::Identify(Network *network, boost::asio::serial_port *serial,
+	IdentifyCache *cache, fn_progress fnProgress)
+	: network(network),
+	  serial(serial),
+	  cache(cache),
+	  fnProgress(fnProgress),
+	  httpPort(0) // auto
+{
+}
+
+std::string Identify::getType()
+{
+	metrics.identifyAttempts.add();
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+	std::string cachedType;
+	if (this->cache && this->tryCache(&cachedType)) {
+		metrics.identifyCacheHits.add();
+		metrics.identifySuccess.add();
+		metrics.identifyTime.observeSince(start);
+		return cachedType;
+	}
+
+	bool okHTTP = this->tryHTTP();
+	bool okFTP = this->tryFTP();
+	if (okFTP && !okHTTP && !this->dev_pass.empty()) {
+		// Try HTTP again now we have some credentials
+		okHTTP = this->tryHTTP();
+	}
+
+	// If we don't know what port HTTP is and the default didn't work, try a
+	// few alternatives.
+	if ((!okHTTP) && (this->httpPort == 0)) {
+		this->httpPort = 81;
+		okHTTP = this->tryHTTP();
+		if (!okHTTP) {
+			this->httpPort = 8080;
+			okHTTP = this->tryHTTP();
+			if (!okHTTP) {
+				this->httpPort = 0; // couldn't find it
+			}
+		}
+	}
+
+	int maxConfidence = 49; // must be more confident than this for a result
+	std::string bestType = "unknown";
+	if (verbose) std::cerr << "Confidence levels:\n";
+	for (std::map<std::string, int>::const_iterator i = confidence.begin(); i != confidence.end(); i++) {
+		if (verbose) std::cerr << "  " << i->first << ": " << i->second << "%\n";
+		if (i->second > maxConfidence) {
+			maxConfidence = i->second;
+			bestType = i->first;
+		}
+	}
+	if (this->cache && (bestType.compare("unknown") != 0)) {
+		CacheEntry entry;
+		if (!this->server.empty()) {
+			entry.validator = "http:" + this->server;
+		} else if (!this->network->ftp_greeting().empty()) {
+			entry.validator = "ftp:" + this->network->ftp_greeting();
+		}
+		if (!entry.validator.empty()) {
+			entry.type = bestType;
+			entry.http_port = this->httpPort;
+			entry.user = this->dev_user;
+			entry.pass = this->dev_pass;
+			this->cache->store(this->network->hostname(), entry);
+		}
+	}
+	if (bestType.compare("unknown") != 0) metrics.identifySuccess.add();
+	metrics.identifyTime.observeSince(start);
+	return bestType;
+}
+
+bool Identify::tryCache(std::string *type)
+{
+	const std::string& host = this->network->hostname();
+	CacheEntry entry;
+	if (!this->cache->lookup(host, &entry)) return false;
+
+	std::string current;
+	if (entry.validator.substr(0, 5).compare("http:") == 0) {
+		this->network->set_http_port(entry.http_port);
+		try {
+			std::vector<std::string> headers = this->network->http_headers();
+			for (std::vector<std::string>::iterator i = headers.begin(); i != headers.end(); i++) {
+				if (i->substr(0, 7).compare("Server:") == 0) {
+					current = "http:" + i->substr(8);
+				}
+			}
+		} catch (const boost::system::system_error& e) {
+			// Treat as a mismatch
+		}
+	} else if (entry.validator.substr(0, 4).compare("ftp:") == 0) {
+		std::string banner = this->network->ftp_banner();
+		if (!banner.empty()) current = "ftp:" + banner;
+	}
+
+	if (current.compare(entry.validator) != 0) {
+		if (verbose) std::cerr << "[cache] Device at " << host
+			<< " no longer matches cached details, re-identifying" << std::endl;
+		this->cache->remove(host);
+		this->network->set_http_port(0);
+		return false;
+	}
+
+	if (verbose) std::cerr << "[cache] Using cached identification for "
+		<< host << std::endl;
+	this->httpPort = entry.http_port;
+	this->dev_user = entry.user;
+	this->dev_pass = entry.pass;
+	*type = entry.type;
+	return true;
+}
+
+bool Identify::tryHTTP()
+{
+	this->network->set_http_port(this->httpPort);
+	std::cerr << "[http] Attempting to connect to " << network->hostname()
+		<< " port " << network->get_http_port() << std::endl;
+	std::vector<std::string> headers;
+	try {
+		headers = network->http_headers();
+	} catch (const boost::system::system_error& e) {
+		// Assume HTTP is unavailable on this port
+		std::cerr << "[http] Connection failed." << std::endl;
+		return false;
+	}
+
+	for (std::vector<std::string>::iterator i = headers.begin(); i != headers.end(); i++) {
+		if (i->substr(0, 7).compare("Server:") == 0) {
+			// This is the Server: header
+			std::string server = i->substr(8);
+			if (verbose) std::cerr << "[http] Server is \"" << server << "\"\n";
+			this->server = server;
+			if (server.compare("WebServer(IPCamera_Logo)") == 0) {
+				confidence["maygion-mips"] += 10;
+			} else if (server.compare("Netwave IP Camera") == 0) {
+				confidence["wansview"] += 10;
+			}
+		}
+	}
+
+	// Use the discovered credentials if present, otherwise fall back to the
+	// default ones.
+	std::string url = "/sysinfo.xml?user=";
+	if (this->dev_user.empty()) url += "admin"; else url += this->dev_user;
+	url += "&password=";
+	if (this->dev_pass.empty()) url += "admin"; else url += this->dev_pass;
+
+	std::string httpData = network->http_get(url);
+	if (!httpData.empty()) {
+		// Got data from the MayGion info URL
+		if (this->processMayGionInfo(httpData)) {
+			// Done, sure this is the model
+			return true;
+		}
+	}
+
+	// Not MayGion, keep examining
+
+	url = "/get_status.cgi";
+	httpData = network->http_get(url);
+	if (!httpData.empty()) {
+		if (this->processWansview(httpData)) {
+			// Done, sure this is the model
+			return true;
+		}
+	}
+
+	return true;
+}
+
+bool Identify::processMayGionInfo(const std::string& httpData)
+{
+	boost::regex result_regex("<Success>(.*)</Success>");
+	boost::match_results<std::string::const_iterator> result_matches;
+	std::string::const_iterator start = httpData.begin();
+	std::string::const_iterator end = httpData.end();
+	boost::regex_search(start, end, result_matches, result_regex, boost::match_default);
+	std::string result(result_matches[1].first, result_matches[1].second);
+	if (result.compare("0") == 0) {
+		if (verbose) std::cerr << "[http] Possible MayGion MIPS with non-default admin password\n";
+		confidence["maygion-mips"] += 20;
+
+		boost::regex error_regex("<ErrorCode>(.*)</ErrorCode>");
+		boost::match_results<std::string::const_iterator> error_matches;
+		std::string::const_iterator start = httpData.begin();
+		std::string::const_iterator end = httpData.end();
+		boost::regex_search(start, end, error_matches, error_regex, boost::match_default);
+		std::string error_code(error_matches[1].first, error_matches[1].second);
+		if (error_code.compare("eHttpError_No_Auth") == 0) {
+			// Newer firmware
+			confidence["maygion-mips"] += 20;
+		} else if (error_code.compare("5") == 0) {
+			// Older firmware
+			confidence["maygion-mips"] += 20;
+		} else {
+			if (verbose) std::cerr << "[http] Unknown error trying to get "
+				"device info: " << error_code << std::endl;
+		}
+		return false;
+	} else if (result.compare("1") != 0) {
+		// Unknown response
+		confidence["maygion-mips"] -= 10;
+		return false;
+	}
+
+	// Got acceptable HTTP response
+	if (verbose) std::cerr << "[http] Appears to be a MayGion MIPS\n";
+	confidence["maygion-mips"] += 10;
+
+	if (this->dev_user.empty() && this->dev_pass.empty()) {
+		if (verbose) std::cerr << "[http] Default user/pass works\n";
+		this->dev_user = "admin";
+		this->dev_pass = "admin";
+	}
+
+	boost::regex board_regex("<Board>(.*)</Board>");
+	boost::match_results<std::string::const_iterator> matches;
+	start = httpData.begin();
+	end = httpData.end();
+	boost::regex_search(start, end, matches, board_regex, boost::match_default);
+	std::string board(matches[1].first, matches[1].second);
+	if (verbose) std::cerr << "[http] MayGion board ID: " << board << std::endl;
+	if (board.compare("MIPS") == 0) {
+		confidence["maygion-mips"] = 100;
+	} // else could be MIPS with old firmware
+
+	return true;
+}
+
+bool Identify::processWansview(const std::string& httpData)
+{
+	boost::regex result_regex("var sys_ver='([^']*)';");
+	boost::match_results<std::string::const_iterator> result_matches;
+	std::string::const_iterator start = httpData.begin();
+	std::string::const_iterator end = httpData.end();
+	boost::regex_search(start, end, result_matches, result_regex, boost::match_default);
+	std::string result(result_matches[1].first, result_matches[1].second);
+	if (result.empty()) return false;
+
+	if (verbose) std::cerr << "[http] Possible Wansview device with "
+		"firmware " << result << "\n";
+	confidence["wansview"] += 20;
+
+	boost::regex app_regex("var app_ver='([^']*)';");
+	boost::match_results<std::string::const_iterator> app_matches;
+	start = httpData.begin();
+	end = httpData.end();
+	boost::regex_search(start, end, app_matches, app_regex, boost::match_default);
+	std::string app_code(app_matches[1].first, app_matches[1].second);
+	if (!app_code.empty()) {
+		if (verbose) std::cerr << "[http] App version " << app_code << "\n";
+		confidence["wansview"] += 20;
+	} else {
+		return false; // not sure
+	}
+
+	return true; // sure
+}
+
+bool Identify::tryFTP()
+{
+	if (!network->ftp_login("MayGion", "maygion.com")) {
+		// FTP unavailable, try telnet
+		return false;
+	}
+	this->confidence["maygion-mips"] = 100;
+
+	std::stringstream config;
+	network->ftp_get(config, "/tmp/eye/app", "cs.ini", this->fnProgress);
+	if (verbose > 1) std::cerr << "[config] " << config.str() << std::endl;
+
+	unsigned int port;
+	std::string user, pass;
+	parse_cs_ini(config.str(), &port, &user, &pass);
+	if ((port != 80) && (port != 0)) {
+		if (verbose) std::cerr << "[ftp] Web interface is operating on port "
+			<< port << std::endl;
+		this->httpPort = port;
+	}
+	if (!user.empty() || !pass.empty()) {
+		if (verbose) std::cerr << "[ftp] Found credentials for web user \""
+			<< user << "\"" << std::endl;
+		this->dev_user = user;
+		this->dev_pass = pass;
+	}
+
+	return true;
+}
+
+unsigned int Identify::getHTTPPort()
+{
+	return this->httpPort;
+}
+
+const std::string& Identify::getUsername()
+{
+	return this->dev_user;
+}
+
+const std::string& Identify::getPassword()
+{
+	return this->dev_pass;
+}
+
+Device *openDevice(const std::string& type, Network *network,
+	boost::asio::serial_port *serial)
+{
+	if (type.compare("maygion-mips") == 0) {
+		return new maygion_mips(network);
+	} else if (type.compare("wansview") == 0) {
+		return new wansview(network);
+	}
+	return NULL;
+}
+
+std::string modelName(const std::string& type, unsigned long lenFlash,
+	unsigned short idVendor, unsigned short idProduct, bool *known)
+{
+	*known = false;
+	if ((lenFlash == 0x400000) && (idVendor == 0x0c45) && (idProduct == 0x6360)) {
+		*known = true;
+		return type + "-1.0";
+	}
+	return type + "-ver_unknown";
+}
+
+std::string firmwareId(const std::string& type, unsigned long lenFlash,
+	unsigned char bInterfaceClass)
+{
+	std::stringstream ss;
+	ss << type << "-" << (lenFlash >> 20) << "mb-";
+	if (bInterfaceClass == 0x0e) ss << "uvc";
+	else ss << "unknown_image_sensor";
+	return ss.str();
+}
@@ -0,0 +1,143 @@
+/**
+ * @file   identify.hpp
+ * @brief  Automatic identification of supported devices.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IDENTIFY_HPP
+#define IDENTIFY_HPP
+
+#include <map>
+#include <string>
+#include <boost/asio.hpp>
+#include "network.hpp"
+#include "cache.hpp"
+#include "device-interface.hpp"
+
+class Identify
+{
+	public:
+		/// Prepare to identify a device.
+		/**
+		 * @param network
+		 *   Connection to the device.
+		 *
+		 * @param serial
+		 *   Serial port the device is attached to.  May not be open.
+		 *
+		 * @param cache
+		 *   Cache of previous results, or NULL to always probe the device.
+		 *
+		 * @param fnProgress
+		 *   Callback function for displaying the progress of any downloads
+		 *   needed to identify the device.
+		 */
+		Identify(Network *network, boost::asio::serial_port *serial,
+			IdentifyCache *cache, fn_progress fnProgress);
+
+		/// Probe the device.
+		/**
+		 * @return The device type, or "unknown".
+		 */
+		std::string getType();
+
+		/// Get the port the web interface was found on.
+		/**
+		 * @return Port number, or 0 if it is the default or was not found.
+		 *   Only valid after getType() has been called.
+		 */
+		unsigned int getHTTPPort();
+
+		/// Get the web interface username recovered from the device.
+		/**
+		 * @return Username, or an empty string if it is unknown.  Only valid
+		 *   after getType() has been called.
+		 */
+		const std::string& getUsername();
+
+		/// Get the web interface password recovered from the device.
+		/**
+		 * @return Password, or an empty string if it is unknown.  Only valid
+		 *   after getType() has been called.
+		 */
+		const std::string& getPassword();
+
+	private:
+		Network *network;
+		boost::asio::serial_port *serial;
+		IdentifyCache *cache;
+		fn_progress fnProgress;
+		std::map<std::string, int> confidence;
+		std::string dev_user, dev_pass;
+		std::string server; ///< HTTP Server: header, if one was seen
+		unsigned int httpPort;
+
+		/// Use a previous identification result if the device still matches it.
+		/**
+		 * Only a single probe is made: the HTTP Server: header or the FTP
+		 * greeting, whichever was recorded when the device was first identified.
+		 *
+		 * @param type
+		 *   On return, the cached device type if true is returned.
+		 *
+		 * @return true if the cached result is valid, false if a full
+		 *   identification is required.
+		 */
+		bool tryCache(std::string *type);
+
+		bool tryHTTP();
+		bool processMayGionInfo(const std::string& httpData);
+		bool processWansview(const std::string& httpData);
+		bool tryFTP();
+};
+
+/// Create the driver for a device type.
+/**
+ * @param type
+ *   Device type, as returned by Identify::getType().
+ *
+ * @param network
+ *   Connection to the device.
+ *
+ * @param serial
+ *   Serial console of the device, or NULL if none.
+ *
+ * @return New Device to delete when finished, or NULL if the type is not
+ *   known.
+ */
+Device *openDevice(const std::string& type, Network *network,
+	boost::asio::serial_port *serial);
+
+/// Work out the model name from the details reported by a device.
+/**
+ * @param known
+ *   On return, true if this is a model that has been seen before.
+ *
+ * @return Model name, e.g. "maygion-mips-1.0".
+ */
+std::string modelName(const std::string& type, unsigned long lenFlash,
+	unsigned short idVendor, unsigned short idProduct, bool *known);
+
+/// Work out which firmware images suit a device.
+/**
+ * @return Firmware ID, e.g. "maygion-mips-4mb-uvc".  Devices with the same
+ *   ID can run the same firmware.
+ */
+std::string firmwareId(const std::string& type, unsigned long lenFlash,
+	unsigned char bInterfaceClass);
+
+#endif // IDENTIFY_HPP
@@ -0,0 +1,762 @@
+/**
+ * @file   inventory.cpp
+ * @brief  Indexed store of everything identify and query have found.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fileutil.hpp"
+#include "inventory.hpp"
+#include "main.hpp"
+
+/// First line of the log file.
+#define INVENTORY_SIGNATURE "camtickler-inventory 1"
+
+/// Identifies an index file.
+#define INDEX_SIGNATURE "CTINVIDX"
+
+/// Index format version.
+#define INDEX_VERSION 1
+
+#define INDEX_HEADER_LEN 64
+
+/// Bytes in each entry of the record table.
+#define INDEX_RECORD_LEN 16
+
+/// Bytes in each entry of a key table.
+#define INDEX_KEY_LEN 12
+
+/// Unindexed records after which the index is rebuilt.  Also the fewest
+/// superseded records worth compacting the log for.
+#define INVENTORY_REINDEX 256
+
+/// Fields on each line of the log.
+#define INVENTORY_FIELDS 13
+
+// The log is a signature line followed by one line per update:
+//
+//   host, seen, learned, type, http_port, flash_size, usb vendor, usb
+//   product, usb class (all hex), model, known_model, fwid, version
+//
+// separated by tabs and escaped as in the identify cache.  The index is laid
+// out as:
+//
+//   header      signature, u32 version, u32 record count, u64 log bytes
+//               covered, u64 log inode, u32 log lines covered
+//   records     u64 log offset, u64 seen; one per host, in host order
+//   tables      one per IndexTable, each u64 key, u32 record number for
+//               every record, sorted by key
+//
+// All numbers in the index are little-endian.
+
+/// Key tables in the index, in file order.
+enum IndexTable {
+	IndexHost,
+	IndexType,
+	IndexFwid,
+	IndexModel,
+	IndexUSB,    ///< vendor << 16 | product
+	IndexPort,
+	IndexSeen,
+	IndexTables
+};
+
+/// Hash a string field for the index (64-bit FNV-1a).
+static uint64_t keyOf(const std::string& s)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (std::string::const_iterator i = s.begin(); i != s.end(); i++) {
+		h = (h ^ (unsigned char)*i) * 0x100000001B3ULL;
+	}
+	return h;
+}
+
+/// Turn a record into a line for the log.
+static std::string formatRecord(const InventoryRecord& r)
+{
+	char usb[32];
+	snprintf(usb, sizeof(usb), "%04x\t%04x\t%02x", r.idVendor, r.idProduct,
+		(unsigned int)r.usbClass);
+	std::stringstream ss;
+	ss << escape(r.host)
+		<< '\t' << (unsigned long)r.seen
+		<< '\t' << r.learned
+		<< '\t' << escape(r.type)
+		<< '\t' << r.httpPort
+		<< '\t' << r.flashSize
+		<< '\t' << usb
+		<< '\t' << escape(r.model)
+		<< '\t' << (r.knownModel ? 1 : 0)
+		<< '\t' << escape(r.fwid)
+		<< '\t' << escape(r.firmwareVersion)
+		<< '\n';
+	return ss.str();
+}
+
+/// Read a line of the log, without the newline.
+/**
+ * @return false if the line is damaged.
+ */
+static bool parseRecord(const char *line, size_t len, InventoryRecord *r)
+{
+	const char *field[INVENTORY_FIELDS];
+	size_t flen[INVENTORY_FIELDS];
+	unsigned int n = 0;
+	const char *start = line, *end = line + len;
+	for (const char *p = line; p <= end; p++) {
+		if ((p == end) || (*p == '\t')) {
+			if (n == INVENTORY_FIELDS) return false;
+			field[n] = start;
+			flen[n] = p - start;
+			n++;
+			start = p + 1;
+		}
+	}
+	if (n != INVENTORY_FIELDS) return false;
+
+	r->host = unescape(field[0], flen[0]);
+	r->seen = strtoul(field[1], NULL, 10);
+	r->learned = strtoul(field[2], NULL, 10);
+	r->type = unescape(field[3], flen[3]);
+	r->httpPort = strtoul(field[4], NULL, 10);
+	r->flashSize = strtoul(field[5], NULL, 10);
+	r->idVendor = strtoul(field[6], NULL, 16);
+	r->idProduct = strtoul(field[7], NULL, 16);
+	r->usbClass = strtoul(field[8], NULL, 16);
+	r->model = unescape(field[9], flen[9]);
+	r->knownModel = (flen[10] == 1) && (field[10][0] == '1');
+	r->fwid = unescape(field[11], flen[11]);
+	r->firmwareVersion = unescape(field[12], flen[12]);
+	return !r->host.empty();
+}
+
+/// Get the value a record is indexed under in one table.
+static uint64_t indexKey(const InventoryRecord& r, int table)
+{
+	switch (table) {
+		case IndexHost: return keyOf(r.host);
+		case IndexType: return keyOf(r.type);
+		case IndexFwid: return keyOf(r.fwid);
+		case IndexModel: return keyOf(r.model);
+		case IndexUSB: return ((uint64_t)r.idVendor << 16) | r.idProduct;
+		case IndexPort: return r.httpPort;
+		case IndexSeen: return (uint64_t)r.seen;
+	}
+	return 0;
+}
+
+/// Closes a file, and so releases any lock on it, when it goes out of scope.
+struct FileCloser
+{
+	int fd;
+	FileCloser(int fd) : fd(fd) { }
+	~FileCloser() { if (this->fd >= 0) close(this->fd); }
+};
+
+/// One term of a query.
+struct Condition
+{
+	enum Field {
+		Host, Type, Fwid, Model, Version, USB, HTTPPort, KnownModel, Seen
+	} field;
+	char op;            ///< '=', '<' or '>'
+	std::string text;   ///< Value of a string field
+	uint64_t value;     ///< Value of a numeric field
+};
+
+/// Parse a duration such as "90", "15m" or "7d" into seconds.
+static bool parseAge(const std::string& s, uint64_t *seconds)
+{
+	char *end;
+	*seconds = strtoul(s.c_str(), &end, 10);
+	if (end == s.c_str()) return false;
+	switch (*end) {
+		case '\0': return true;
+		case 's': break;
+		case 'm': *seconds *= 60; break;
+		case 'h': *seconds *= 3600; break;
+		case 'd': *seconds *= 86400; break;
+		default: return false;
+	}
+	return end[1] == '\0';
+}
+
+/// Parse a query into its conditions.
+/**
+ * @throw std::string if a condition is invalid.
+ */
+static void parseConditions(const std::string& query, time_t now,
+	std::vector<Condition> *conditions)
+{
+	static const struct {
+		const char *name;
+		Condition::Field field;
+	} fields[] = {
+		{"host", Condition::Host},
+		{"type", Condition::Type},
+		{"fwid", Condition::Fwid},
+		{"model", Condition::Model},
+		{"version", Condition::Version},
+		{"usb", Condition::USB},
+		{"http_port", Condition::HTTPPort},
+		{"known_model", Condition::KnownModel},
+		{"seen", Condition::Seen},
+	};
+
+	std::istringstream in(query);
+	std::string term;
+	while (in >> term) {
+		std::string::size_type pos = term.find_first_of("=<>");
+		if ((pos == std::string::npos) || (pos == 0)) {
+			throw "invalid inventory condition \"" + term + "\"";
+		}
+		std::string name = term.substr(0, pos);
+		Condition c;
+		c.op = term[pos];
+		c.text = term.substr(pos + 1);
+		c.value = 0;
+		unsigned int f;
+		for (f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+			if (name.compare(fields[f].name) == 0) break;
+		}
+		if (f == sizeof(fields) / sizeof(fields[0])) {
+			throw "unknown inventory field \"" + name + "\"";
+		}
+		c.field = fields[f].field;
+		if ((c.field == Condition::Seen) != (c.op != '=')) {
+			throw "invalid inventory condition \"" + term + "\", use = except "
+				"for seen< and seen>";
+		}
+
+		bool valid = true;
+		char *end;
+		switch (c.field) {
+			case Condition::USB: {
+				unsigned long vendor = strtoul(c.text.c_str(), &end, 16);
+				valid = (end - c.text.c_str() == 4) && (*end == ':');
+				if (!valid) break;
+				const char *product = end + 1;
+				c.value = (vendor << 16) | strtoul(product, &end, 16);
+				valid = (end - product == 4) && !*end;
+				break;
+			}
+			case Condition::HTTPPort:
+				c.value = strtoul(c.text.c_str(), &end, 10);
+				valid = !c.text.empty() && !*end;
+				break;
+			case Condition::KnownModel:
+				c.value = (c.text.compare("true") == 0);
+				valid = c.value || (c.text.compare("false") == 0);
+				break;
+			case Condition::Seen:
+				valid = parseAge(c.text, &c.value);
+				// Compare against the time a device was seen
+				c.value = (c.value > (uint64_t)now) ? 0 : now - c.value;
+				break;
+			default:
+				break;
+		}
+		if (!valid) {
+			throw "invalid value in inventory condition \"" + term + "\"";
+		}
+		conditions->push_back(c);
+	}
+	return;
+}
+
+/// Check whether a record meets every condition.
+static bool meetsAll(const InventoryRecord& r,
+	const std::vector<Condition>& conditions)
+{
+	for (std::vector<Condition>::const_iterator c = conditions.begin();
+		c != conditions.end(); c++
+	) {
+		bool queried = r.learned & INVENTORY_QUERIED;
+		bool ok = false;
+		switch (c->field) {
+			case Condition::Host: ok = r.host.compare(c->text) == 0; break;
+			case Condition::Type: ok = r.type.compare(c->text) == 0; break;
+			case Condition::Fwid: ok = queried && (r.fwid.compare(c->text) == 0); break;
+			case Condition::Model: ok = queried && (r.model.compare(c->text) == 0); break;
+			case Condition::Version:
+				ok = queried && (r.firmwareVersion.compare(c->text) == 0);
+				break;
+			case Condition::USB:
+				ok = queried && (indexKey(r, IndexUSB) == c->value);
+				break;
+			case Condition::HTTPPort:
+				ok = (r.learned & INVENTORY_IDENTIFIED) && (r.httpPort == c->value);
+				break;
+			case Condition::KnownModel:
+				ok = queried && (r.knownModel == (c->value != 0));
+				break;
+			case Condition::Seen:
+				if (c->op == '<') ok = (uint64_t)r.seen > c->value;
+				else ok = (uint64_t)r.seen < c->value;
+				break;
+		}
+		if (!ok) return false;
+	}
+	return true;
+}
+
+static bool byHost(const InventoryRecord& a, const InventoryRecord& b)
+{
+	return a.host.compare(b.host) < 0;
+}
+
+InventoryRecord::InventoryRecord()
+	: seen(0),
+	  learned(0),
+	  httpPort(0),
+	  flashSize(0),
+	  idVendor(0),
+	  idProduct(0),
+	  usbClass(0),
+	  knownModel(false)
+{
+}
+
+InventoryStore::InventoryStore(const std::string& filename)
+	: filename(filename.empty() ? defaultPath() : filename),
+	  logMap(NULL),
+	  logLen(0),
+	  logInode(0),
+	  indexMap(NULL),
+	  indexLen(0),
+	  count(0),
+	  indexedLen(0),
+	  tailRecords(0)
+{
+	if (this->filename.empty()) {
+		throw std::string("no inventory file, set --inventory or $HOME");
+	}
+	this->indexFilename = this->filename + ".idx";
+}
+
+InventoryStore::~InventoryStore()
+{
+	this->unload();
+}
+
+std::string InventoryStore::defaultPath()
+{
+	const char *xdg = getenv("XDG_DATA_HOME");
+	if (xdg && xdg[0]) return std::string(xdg) + "/camtickler/inventory";
+	const char *home = getenv("HOME");
+	if (home && home[0]) return std::string(home) + "/.local/share/camtickler/inventory";
+	return std::string();
+}
+
+void InventoryStore::update(InventoryRecord record)
+{
+	boost::mutex::scoped_lock guard(this->mutex);
+	mkdirs(this->filename, 0700);
+
+	// Lock the log, making sure it wasn't replaced while waiting for the lock
+	int fd;
+	for (;;) {
+		fd = open(this->filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+		if (fd < 0) {
+			throw "unable to open " + this->filename + ": " + strerror(errno);
+		}
+		struct stat locked, current;
+		if ((flock(fd, LOCK_EX) == 0)
+			&& (fstat(fd, &locked) == 0)
+			&& (stat(this->filename.c_str(), &current) == 0)
+			&& (locked.st_ino == current.st_ino)
+		) {
+			break;
+		}
+		close(fd);
+	}
+	FileCloser closer(fd);
+	this->load();
+
+	InventoryRecord prev;
+	if (this->find(record.host, &prev)) {
+		if (!(record.learned & INVENTORY_IDENTIFIED)
+			&& (prev.learned & INVENTORY_IDENTIFIED)
+		) {
+			record.httpPort = prev.httpPort;
+		}
+		if (!(record.learned & INVENTORY_QUERIED)
+			&& (prev.learned & INVENTORY_QUERIED)
+		) {
+			record.flashSize = prev.flashSize;
+			record.idVendor = prev.idVendor;
+			record.idProduct = prev.idProduct;
+			record.usbClass = prev.usbClass;
+			record.model = prev.model;
+			record.knownModel = prev.knownModel;
+			record.fwid = prev.fwid;
+			record.firmwareVersion = prev.firmwareVersion;
+		}
+		record.learned |= prev.learned;
+		if (record.type.empty()) record.type = prev.type;
+	}
+	record.seen = time(NULL);
+
+	// One write, so a reader never sees part of a line from this process
+	std::string line = formatRecord(record);
+	if (this->logLen == 0) line = INVENTORY_SIGNATURE "\n" + line;
+	if (write(fd, line.data(), line.length()) != (ssize_t)line.length()) {
+		throw "unable to write " + this->filename + ": " + strerror(errno);
+	}
+
+	if (this->tailRecords + 1 >= INVENTORY_REINDEX) {
+		this->load();
+		this->reindex();
+	}
+	return;
+}
+
+void InventoryStore::query(const std::string& conditions,
+	std::vector<InventoryRecord> *matches)
+{
+	std::vector<Condition> terms;
+	parseConditions(conditions, time(NULL), &terms);
+
+	boost::mutex::scoped_lock guard(this->mutex);
+	this->load();
+	matches->clear();
+
+	// Start from whichever indexed condition leaves the fewest records
+	const unsigned char *tables = NULL;
+	if (this->indexMap) {
+		tables = (const unsigned char *)this->indexMap + INDEX_HEADER_LEN
+			+ this->count * INDEX_RECORD_LEN;
+	}
+	unsigned long first = 0, last = this->count;
+	int bestTable = -1;
+	for (std::vector<Condition>::const_iterator c = terms.begin();
+		tables && (c != terms.end()); c++
+	) {
+		int t;
+		uint64_t lowKey, highKey; // inclusive
+		switch (c->field) {
+			case Condition::Host: t = IndexHost; lowKey = keyOf(c->text); break;
+			case Condition::Type: t = IndexType; lowKey = keyOf(c->text); break;
+			case Condition::Fwid: t = IndexFwid; lowKey = keyOf(c->text); break;
+			case Condition::Model: t = IndexModel; lowKey = keyOf(c->text); break;
+			case Condition::USB: t = IndexUSB; lowKey = c->value; break;
+			case Condition::HTTPPort: t = IndexPort; lowKey = c->value; break;
+			case Condition::Seen: t = IndexSeen; lowKey = c->value; break;
+			default: continue;
+		}
+		highKey = lowKey;
+		if (c->op == '<') {
+			if (lowKey == (uint64_t)-1) { first = last = 0; break; }
+			lowKey++;
+			highKey = (uint64_t)-1;
+		} else if (c->op == '>') {
+			if (highKey == 0) { first = last = 0; break; }
+			lowKey = 0;
+			highKey--;
+		}
+
+		const unsigned char *table = tables + t * this->count * INDEX_KEY_LEN;
+		unsigned long lo = 0, hi = this->count;
+		while (lo < hi) {
+			unsigned long mid = lo + (hi - lo) / 2;
+			if (get64le(table + mid * INDEX_KEY_LEN) < lowKey) lo = mid + 1;
+			else hi = mid;
+		}
+		unsigned long end = lo;
+		hi = this->count;
+		while (end < hi) {
+			unsigned long mid = end + (hi - end) / 2;
+			if (get64le(table + mid * INDEX_KEY_LEN) <= highKey) end = mid + 1;
+			else hi = mid;
+		}
+		if ((bestTable < 0) || (end - lo < last - first)) {
+			bestTable = t;
+			first = lo;
+			last = end;
+		}
+	}
+
+	std::vector<uint32_t> candidates;
+	if (bestTable < 0) {
+		for (unsigned long i = first; i < last; i++) candidates.push_back(i);
+	} else {
+		const unsigned char *table = tables + bestTable * this->count * INDEX_KEY_LEN;
+		for (unsigned long i = first; i < last; i++) {
+			candidates.push_back(get32le(table + i * INDEX_KEY_LEN + 8));
+		}
+	}
+	if (verbose) std::cerr << "[inventory] Checking " << candidates.size()
+		<< " of " << this->count << " indexed records and " << this->tail.size()
+		<< " recent ones" << std::endl;
+
+	InventoryRecord r;
+	for (std::vector<uint32_t>::const_iterator i = candidates.begin();
+		i != candidates.end(); i++
+	) {
+		this->indexRecord(*i, &r);
+		// A newer record in the tail replaces this one
+		if (this->tail.find(r.host) != this->tail.end()) continue;
+		if (meetsAll(r, terms)) matches->push_back(r);
+	}
+	for (std::map<std::string, TailEntry>::const_iterator i = this->tail.begin();
+		i != this->tail.end(); i++
+	) {
+		if (meetsAll(i->second.record, terms)) matches->push_back(i->second.record);
+	}
+	std::sort(matches->begin(), matches->end(), byHost);
+	return;
+}
+
+void InventoryStore::load()
+{
+	this->unload();
+
+	int fd = open(this->filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return; // empty inventory
+		throw "unable to open " + this->filename + ": " + strerror(errno);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		std::string err = strerror(errno);
+		close(fd);
+		throw "unable to read " + this->filename + ": " + err;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		throw "unable to read " + this->filename + ": " + strerror(errno);
+	}
+	this->logMap = map;
+	this->logLen = st.st_size;
+	this->logInode = st.st_ino;
+
+	const char *log = (const char *)this->logMap;
+	const size_t sigLen = strlen(INVENTORY_SIGNATURE) + 1;
+	if ((this->logLen < sigLen)
+		|| (memcmp(log, INVENTORY_SIGNATURE "\n", sigLen) != 0)
+	) {
+		this->unload();
+		throw this->filename + " is not a camtickler inventory";
+	}
+	this->indexedLen = sigLen;
+
+	// Use the index if it was made from this log
+	fd = open(this->indexFilename.c_str(), O_RDONLY);
+	if ((fd >= 0) && (fstat(fd, &st) == 0) && (st.st_size >= INDEX_HEADER_LEN)) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			this->indexMap = map;
+			this->indexLen = st.st_size;
+		}
+	}
+	if (fd >= 0) close(fd);
+	if (this->indexMap) {
+		const unsigned char *header = (const unsigned char *)this->indexMap;
+		unsigned long count = get32le(header + 12);
+		uint64_t covered = get64le(header + 16);
+		if ((memcmp(header, INDEX_SIGNATURE, 8) == 0)
+			&& (get32le(header + 8) == INDEX_VERSION)
+			&& (get64le(header + 24) == this->logInode)
+			&& (covered >= sigLen) && (covered <= this->logLen)
+			&& ((uint64_t)INDEX_HEADER_LEN + (uint64_t)count
+				* (INDEX_RECORD_LEN + IndexTables * INDEX_KEY_LEN) == this->indexLen)
+		) {
+			this->count = count;
+			this->indexedLen = covered;
+		} else {
+			if (verbose) std::cerr << "[inventory] Index " << this->indexFilename
+				<< " is out of date, ignoring it" << std::endl;
+			munmap(this->indexMap, this->indexLen);
+			this->indexMap = NULL;
+			this->indexLen = 0;
+		}
+	}
+
+	// Anything after the index, up to the last complete line (a line still
+	// being written by another process is picked up next time)
+	for (size_t pos = this->indexedLen; pos < this->logLen; ) {
+		const char *eol = (const char *)memchr(log + pos, '\n', this->logLen - pos);
+		if (!eol) break;
+		TailEntry entry;
+		entry.offset = pos;
+		if (parseRecord(log + pos, eol - (log + pos), &entry.record)) {
+			this->tail[entry.record.host] = entry;
+			this->tailRecords++;
+		}
+		pos = eol + 1 - log;
+	}
+	return;
+}
+
+void InventoryStore::unload()
+{
+	if (this->logMap) munmap(this->logMap, this->logLen);
+	if (this->indexMap) munmap(this->indexMap, this->indexLen);
+	this->logMap = NULL;
+	this->logLen = 0;
+	this->logInode = 0;
+	this->indexMap = NULL;
+	this->indexLen = 0;
+	this->count = 0;
+	this->indexedLen = 0;
+	this->tail.clear();
+	this->tailRecords = 0;
+	return;
+}
+
+bool InventoryStore::find(const std::string& host, InventoryRecord *record) const
+{
+	std::map<std::string, TailEntry>::const_iterator t = this->tail.find(host);
+	if (t != this->tail.end()) {
+		*record = t->second.record;
+		return true;
+	}
+	if (!this->indexMap) return false;
+
+	const unsigned char *table = (const unsigned char *)this->indexMap
+		+ INDEX_HEADER_LEN + this->count * INDEX_RECORD_LEN
+		+ IndexHost * this->count * INDEX_KEY_LEN;
+	uint64_t key = keyOf(host);
+	unsigned long lo = 0, hi = this->count;
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+		if (get64le(table + mid * INDEX_KEY_LEN) < key) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < this->count; lo++) {
+		const unsigned char *entry = table + lo * INDEX_KEY_LEN;
+		if (get64le(entry) != key) break;
+		this->indexRecord(get32le(entry + 8), record);
+		if (record->host.compare(host) == 0) return true;
+	}
+	return false;
+}
+
+void InventoryStore::indexRecord(uint32_t index, InventoryRecord *record) const
+{
+	if (index >= this->count) {
+		throw "inventory index " + this->indexFilename + " is damaged";
+	}
+	const unsigned char *entry = (const unsigned char *)this->indexMap
+		+ INDEX_HEADER_LEN + (size_t)index * INDEX_RECORD_LEN;
+	uint64_t offset = get64le(entry);
+	const char *log = (const char *)this->logMap;
+	const char *eol = NULL;
+	if (offset < this->indexedLen) {
+		eol = (const char *)memchr(log + offset, '\n', this->indexedLen - offset);
+	}
+	if (!eol || !parseRecord(log + offset, eol - (log + offset), record)) {
+		throw "inventory index " + this->indexFilename + " is damaged";
+	}
+	return;
+}
+
+void InventoryStore::reindex()
+{
+	// Find the latest record of every host
+	const char *log = (const char *)this->logMap;
+	size_t pos = strlen(INVENTORY_SIGNATURE) + 1;
+	std::map<std::string, TailEntry> latest;
+	unsigned long lines = 0;
+	while (pos < this->logLen) {
+		const char *eol = (const char *)memchr(log + pos, '\n', this->logLen - pos);
+		if (!eol) break;
+		TailEntry entry;
+		entry.offset = pos;
+		if (parseRecord(log + pos, eol - (log + pos), &entry.record)) {
+			latest[entry.record.host] = entry;
+			lines++;
+		}
+		pos = eol + 1 - log;
+	}
+	uint64_t covered = pos;
+	uint64_t inode = this->logInode;
+
+	// Drop the superseded records once they are most of the log.  The lock
+	// is on the old file, so anyone waiting for it will notice the change.
+	unsigned long superseded = lines - latest.size();
+	if ((superseded >= INVENTORY_REINDEX) && (superseded > 2 * latest.size())) {
+		std::string content(INVENTORY_SIGNATURE "\n");
+		for (std::map<std::string, TailEntry>::iterator i = latest.begin();
+			i != latest.end(); i++
+		) {
+			const char *line = log + i->second.offset;
+			const char *eol = (const char *)memchr(line, '\n', this->logLen - i->second.offset);
+			i->second.offset = content.length();
+			content.append(line, eol + 1 - line);
+		}
+		if (verbose) std::cerr << "[inventory] Compacting " << this->filename
+			<< " from " << lines << " to " << latest.size() << " records"
+			<< std::endl;
+		inode = replaceFile(this->filename, content);
+		covered = content.length();
+		lines = latest.size();
+	}
+
+	std::vector<std::pair<uint64_t, uint32_t> > keys[IndexTables];
+	std::string records;
+	uint32_t index = 0;
+	for (std::map<std::string, TailEntry>::const_iterator i = latest.begin();
+		i != latest.end(); i++, index++
+	) {
+		append64le(&records, i->second.offset);
+		append64le(&records, i->second.record.seen);
+		for (int t = 0; t < IndexTables; t++) {
+			keys[t].push_back(std::make_pair(indexKey(i->second.record, t), index));
+		}
+	}
+
+	std::string out(INDEX_SIGNATURE);
+	append32le(&out, INDEX_VERSION);
+	append32le(&out, latest.size());
+	append64le(&out, covered);
+	append64le(&out, inode);
+	append32le(&out, lines);
+	out.resize(INDEX_HEADER_LEN, '\0');
+	out.append(records);
+	for (int t = 0; t < IndexTables; t++) {
+		std::sort(keys[t].begin(), keys[t].end());
+		for (std::vector<std::pair<uint64_t, uint32_t> >::const_iterator i = keys[t].begin();
+			i != keys[t].end(); i++
+		) {
+			append64le(&out, i->first);
+			append32le(&out, i->second);
+		}
+	}
+	if (verbose) std::cerr << "[inventory] Indexed " << latest.size()
+		<< " hosts" << std::endl;
+	replaceFile(this->indexFilename, out);
+	this->load();
+	return;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file   inventory.hpp
+ * @brief  Indexed store of everything identify and query have found.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INVENTORY_HPP
+#define INVENTORY_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <boost/thread/mutex.hpp>
+
+/// Set in InventoryRecord::learned when the identify fields are valid.
+#define INVENTORY_IDENTIFIED 1
+
+/// Set in InventoryRecord::learned when the query fields are valid.
+#define INVENTORY_QUERIED    2
+
+/// The latest details known about one device.
+struct InventoryRecord
+{
+	/// Set everything to unknown.
+	InventoryRecord();
+
+	std::string host;
+	time_t seen;                ///< When the device last answered
+	unsigned int learned;       ///< INVENTORY_* flags for the fields below
+	std::string type;           ///< As from Identify::getType() or --type
+
+	// Identify
+	unsigned int httpPort;      ///< 0 if the default port is in use
+
+	// Query
+	unsigned long flashSize;
+	unsigned short idVendor, idProduct;
+	unsigned char usbClass;
+	std::string model;
+	bool knownModel;
+	std::string fwid;
+	std::string firmwareVersion; ///< Empty if the device doesn't report it
+};
+
+/// Append-only record of devices, with indexes for finding them again.
+/**
+ * Every update is appended to a log file as one tab-separated line, so
+ * recording a result costs a single write no matter how big the inventory
+ * is.  A separate index file, memory-mapped when searched, holds sorted
+ * tables of the latest record for each host keyed on host, type, fwid,
+ * model, USB IDs, HTTP port and last-seen time, so a query only reads the
+ * records that can match.  Records appended since the index was written are
+ * read from the end of the log; once there are enough of them the index is
+ * rebuilt, and the log is rewritten without the records superseded since.
+ *
+ * The log is locked while it is appended to or rebuilt, so several
+ * processes can share an inventory, and one store may be used by several
+ * threads.
+ */
+class InventoryStore
+{
+	public:
+		/// Open the inventory.
+		/**
+		 * @param filename
+		 *   Log file.  The index is kept beside it with ".idx" added.  Neither
+		 *   need exist yet.  If empty, the default location returned by
+		 *   defaultPath() is used.
+		 *
+		 * @throw std::string if filename is empty and there is no default.
+		 */
+		InventoryStore(const std::string& filename);
+
+		~InventoryStore();
+
+		/// Get the default inventory location.
+		/**
+		 * @return $XDG_DATA_HOME/camtickler/inventory, falling back to
+		 *   $HOME/.local/share/camtickler/inventory.  Empty if neither is set.
+		 */
+		static std::string defaultPath();
+
+		/// Record what was just found out about a device.
+		/**
+		 * Fields not covered by record.learned keep the values from the
+		 * device's previous record, so a query without an identify doesn't
+		 * forget the HTTP port.
+		 *
+		 * @param record
+		 *   Details found.  The seen time is set by this function.
+		 *
+		 * @throw std::string if the inventory could not be written.
+		 */
+		void update(InventoryRecord record);
+
+		/// Find the devices matching a list of conditions.
+		/**
+		 * @param conditions
+		 *   Space-separated conditions that must all hold, each "field=value"
+		 *   with field one of host, type, fwid, model, version, usb (as
+		 *   "vvvv:pppp" in hex), http_port or known_model ("true" or "false"),
+		 *   or "seen<AGE" or "seen>AGE" for devices seen more or less recently
+		 *   than AGE ago, in seconds or with an s, m, h or d suffix.  Empty
+		 *   matches every device.
+		 *
+		 * @param matches
+		 *   On return, the matching devices in order of hostname.
+		 *
+		 * @throw std::string if a condition is invalid or the inventory is
+		 *   damaged.
+		 */
+		void query(const std::string& conditions,
+			std::vector<InventoryRecord> *matches);
+
+	private:
+		/// Position of a host's latest record in the log.
+		struct TailEntry
+		{
+			uint64_t offset;
+			InventoryRecord record;
+		};
+
+		std::string filename;
+		std::string indexFilename;
+		boost::mutex mutex;   ///< Protects everything below
+
+		void *logMap;         ///< Mapped log file, or NULL if none
+		size_t logLen;
+		uint64_t logInode;
+
+		void *indexMap;       ///< Mapped index, or NULL if none or out of date
+		size_t indexLen;
+		unsigned long count;  ///< Records in the index
+		uint64_t indexedLen;  ///< Bytes of the log covered by the index
+
+		/// Latest record of each host appended since the index was written.
+		std::map<std::string, TailEntry> tail;
+		unsigned long tailRecords; ///< Lines after the indexed part
+
+		/// Map the log and index and read the unindexed part of the log.
+		/**
+		 * @throw std::string if the log is damaged.
+		 */
+		void load();
+
+		/// Unmap everything.
+		void unload();
+
+		/// Find the latest record for a host.
+		/**
+		 * @return true if the host is in the inventory.
+		 */
+		bool find(const std::string& host, InventoryRecord *record) const;
+
+		/// Read the indexed record at a position in the record table.
+		void indexRecord(uint32_t index, InventoryRecord *record) const;
+
+		/// Write a new index for the log, compacting the log first if most of
+		/// it has been superseded.  The log must be locked.
+		/**
+		 * @throw std::string if a file could not be written.
+		 */
+		void reindex();
+
+		InventoryStore(const InventoryStore&);
+		InventoryStore& operator=(const InventoryStore&);
+};
+
+#endif // INVENTORY_HPP
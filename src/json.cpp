@@ -0,0 +1,117 @@
+/**
+ * @file   json.cpp
+ * @brief  Helpers for writing JSON.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <boost/bind.hpp>
+#include "json.hpp"
+
+void write_json_string(std::ostream& out, const std::string& s)
+{
+	out << '"';
+	for (std::string::const_iterator i = s.begin(); i != s.end(); i++) {
+		unsigned char c = *i;
+		if ((c == '"') || (c == '\\')) {
+			out << '\\' << c;
+		} else if (c < 0x20) {
+			char hex[8];
+			snprintf(hex, sizeof(hex), "\\u%04x", c);
+			out << hex;
+		} else {
+			out << c;
+		}
+	}
+	out << '"';
+	return;
+}
+
+JsonLinesWriter::JsonLinesWriter(std::ostream& out)
+	: out(out),
+	  head((Node *)NULL),
+	  stopping(false),
+	  thread(boost::bind(&JsonLinesWriter::run, this))
+{
+}
+
+JsonLinesWriter::~JsonLinesWriter()
+{
+	{
+		boost::mutex::scoped_lock guard(this->mutex);
+		this->stopping = true;
+		this->wake.notify_one();
+	}
+	this->thread.join();
+}
+
+void JsonLinesWriter::write(const std::string& record)
+{
+	Node *node = new Node();
+	node->record = record;
+	node->next = this->head.load(boost::memory_order_relaxed);
+	while (!this->head.compare_exchange_weak(node->next, node,
+		boost::memory_order_release, boost::memory_order_relaxed));
+
+	// Only the record that makes the list non-empty needs to wake the thread,
+	// so the lock is rarely touched while records are arriving quickly.
+	if (node->next == NULL) {
+		boost::mutex::scoped_lock guard(this->mutex);
+		this->wake.notify_one();
+	}
+	return;
+}
+
+void JsonLinesWriter::run()
+{
+	for (;;) {
+		{
+			boost::mutex::scoped_lock guard(this->mutex);
+			while (!this->head.load(boost::memory_order_relaxed) && !this->stopping) {
+				this->wake.wait(guard);
+			}
+		}
+		this->drain();
+		if (this->stopping) break;
+	}
+	// Records written just before stopping
+	this->drain();
+	return;
+}
+
+void JsonLinesWriter::drain()
+{
+	Node *node = this->head.exchange(NULL, boost::memory_order_acquire);
+	if (!node) return;
+
+	// The list is newest first, so reverse it
+	Node *oldest = NULL;
+	while (node) {
+		Node *next = node->next;
+		node->next = oldest;
+		oldest = node;
+		node = next;
+	}
+	while (oldest) {
+		this->out << oldest->record << '\n';
+		Node *next = oldest->next;
+		delete oldest;
+		oldest = next;
+	}
+	this->out << std::flush;
+	return;
+}
@@ -0,0 +1,90 @@
+/**
+ * @file   json.hpp
+ * @brief  Helpers for writing JSON.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JSON_HPP
+#define JSON_HPP
+
+#include <iostream>
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/// Write a string as a quoted JSON string.
+/**
+ * @param out
+ *   Stream to write to.
+ *
+ * @param s
+ *   String to quote.  Control characters, quotes and backslashes are escaped,
+ *   all other bytes are written as-is.
+ */
+void write_json_string(std::ostream& out, const std::string& s);
+
+/// Writes JSON Lines output from many threads without making them wait.
+/**
+ * write() pushes the record onto a lock-free list and returns, and a
+ * background thread takes everything queued so far in one go and writes it
+ * out.  A slow reader on the other end of the output therefore never holds
+ * up the threads producing records, and records from one thread appear in
+ * the order they were written.
+ */
+class JsonLinesWriter
+{
+	public:
+		/// Start the background thread.
+		/**
+		 * @param out
+		 *   Stream to write to.  It is flushed after each batch of records.
+		 */
+		JsonLinesWriter(std::ostream& out);
+
+		/// Write out anything still queued and stop the thread.
+		~JsonLinesWriter();
+
+		/// Queue a record.
+		/**
+		 * @param record
+		 *   A complete JSON object, without a trailing newline.
+		 */
+		void write(const std::string& record);
+
+	private:
+		struct Node
+		{
+			std::string record;
+			Node *next;
+		};
+
+		std::ostream& out;
+		boost::atomic<Node *> head;     ///< Newest record first
+		boost::atomic<bool> stopping;
+		boost::mutex mutex;             ///< Only used to sleep and wake the thread
+		boost::condition_variable wake;
+		boost::thread thread;
+
+		void run();
+
+		/// Write out and free every queued record, oldest first.
+		void drain();
+};
+
+#endif // JSON_HPP
@@ -20,13 +20,37 @@
 
 #include <fstream>
 #include <iomanip>
+#include <sstream>
+#include <stdio.h>
+#include <time.h>
 #include <boost/program_options.hpp>
 #include <boost/asio.hpp>
-#include <boost/regex.hpp>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "device-interface.hpp"
-#include "maygion-mips.hpp"
+#include "analyse.hpp"
+#include "archive.hpp"
+#include "batch.hpp"
+#include "cache.hpp"
+#include "catalog.hpp"
+#include "capture.hpp"
+#include "daemon.hpp"
+#include "discover.hpp"
+#include "extract.hpp"
+#include "httpd.hpp"
+#include "identify.hpp"
+#include "inventory.hpp"
+#include "main.hpp"
+#include "metrics.hpp"
+#include "progress.hpp"
+#include "repack.hpp"
+#include "retry.hpp"
+#include "snapshot.hpp"
+#include "sparse.hpp"
+#include "throttle.hpp"
+#include "trace.hpp"
 
 namespace po = boost::program_options;
 
@@ -36,328 +60,723 @@ namespace po = boost::program_options;
 #define RET_BADARGS            1 ///< Return value: bad/missing arguments
 #define RET_SHOWSTOPPER        2 ///< Return value: failure of the single action requested
 
-int verbose = 0; ///< Verbosity level of stdout messages
+/// Collects spans while in scope, and writes them out when destroyed.
+class TraceOutput
+{
+	public:
+		/// Start tracing if any output was requested.
+		/**
+		 * @param filename
+		 *   File to write Chrome trace JSON to, or empty for none.
+		 *
+		 * @param summary
+		 *   true to write per-phase latency statistics to stderr.
+		 */
+		TraceOutput(const std::string& filename, bool summary)
+			: filename(filename),
+			  summary(summary)
+		{
+			if (!filename.empty() || summary) tracer = &this->spans;
+		}
+
+		~TraceOutput()
+		{
+			if (tracer != &this->spans) return;
+			tracer = NULL;
+			if (!this->filename.empty()) {
+				std::ofstream out(this->filename.c_str(), std::ios::out | std::ios::trunc);
+				this->spans.writeChromeTrace(out);
+				if (!out) {
+					std::cerr << PROGNAME ": unable to write " << this->filename
+						<< std::endl;
+				}
+			}
+			if (this->summary) this->spans.writeSummary(std::cerr);
+		}
+
+	private:
+		Tracer spans;
+		std::string filename;
+		bool summary;
+};
+
+/// Serve the metrics over HTTP.
+void serveMetrics(const std::string& path, HttpResponse *response)
+{
+	if (path.compare("/metrics") != 0) return;
+	std::stringstream out;
+	metrics.writePrometheus(out);
+	response->status = 200;
+	response->contentType = "text/plain; version=0.0.4";
+	response->body = out.str();
+	return;
+}
+
+/// Serve the daemon's device states, falling back to the metrics.
+void serveDaemon(Daemon *daemon, const std::string& path, HttpResponse *response)
+{
+	daemon->serve(path, response);
+	if (response->status == 404) serveMetrics(path, response);
+	return;
+}
+
+/// Start an HTTP server on an [address:]port, where address defaults to
+/// 127.0.0.1.
+HttpServer *startServer(const std::string& listen, fn_http_handler handler)
+{
+	std::string address = "127.0.0.1";
+	std::string::size_type colon = listen.rfind(':');
+	if (colon != std::string::npos) address = listen.substr(0, colon);
+	unsigned short port = strtoul(listen.c_str()
+		+ (colon == std::string::npos ? 0 : colon + 1), NULL, 10);
+	return new HttpServer(address, port, handler);
+}
 
-Device *openDevice(std::string strType, Network *network,
-	boost::asio::serial_port *serial)
+/// Write the metrics to a file, if one was given.
+void writeMetrics(const std::string& filename)
 {
-	if (strType.compare("maygion-mips") == 0) {
-		return new maygion_mips(network);
+	if (filename.empty()) return;
+	if (!metrics.writeTextfile(filename)) {
+		std::cerr << PROGNAME ": unable to write metrics to " << filename
+			<< std::endl;
 	}
-	return NULL;
+	return;
 }
 
-void showProgress(const std::string& msg, unsigned long amount, unsigned long total)
+/// Print what analyseFirmware() found.
+void printLayout(const FirmwareLayout& layout)
 {
-	if (total == (unsigned long)-1) {
-		// complete
-		std::cerr << std::endl;
-		return;
+	std::cout << "image_size=" << layout.size << "\n";
+	for (std::vector<FirmwarePart>::const_iterator i = layout.parts.begin();
+		i != layout.parts.end(); i++
+	) {
+		// part=offset type length [detail], with a length of 0 if not known
+		std::cout << "part=0x" << std::hex << std::setw(8) << std::setfill('0')
+			<< i->offset << " " << firmwarePartName(i->type) << " 0x" << std::setw(8)
+			<< i->length << std::dec;
+		if (!i->detail.empty()) std::cout << " " << i->detail;
+		std::cout << "\n";
+	}
+	for (std::vector<std::string>::const_iterator i = layout.versions.begin();
+		i != layout.versions.end(); i++
+	) {
+		std::cout << "version=" << *i << "\n";
 	}
-	std::cerr << "\r" << msg << ": " << amount << " bytes read";
-	if (total) {
-		std::cerr << " (" << (amount * 100 / total) << "%)";
+
+	// One character per block: '.' if erased, otherwise bits per byte
+	std::string map;
+	for (unsigned int i = 0; i < layout.entropy.size(); i++) {
+		map += layout.erased[i] ? '.' : (char)('0' + (int)(layout.entropy[i] + 0.5));
 	}
-	std::cerr << std::flush;
+	std::cout << "erased_blocks=" << layout.erasedBlocks
+		<< "\nentropy_map=" << map << std::endl;
 	return;
 }
 
-#define possible_match(conf, tname) \
-	if (verbose) std::cerr << "Possible match: " << tname \
-		<< " (confidence: " << conf; \
-	if (confidence < conf) { \
-		if (verbose) std::cerr << ")\n"; \
-		type = tname; \
-		confidence = conf; \
-	} else { \
-		if (verbose) std::cerr << "; too low, ignoring)\n"; \
+/// Open each filesystem in a dump and list its files or extract them.
+/**
+ * @param paths
+ *   Files to extract, or NULL to list everything instead.
+ *
+ * @return RET_OK, or RET_SHOWSTOPPER if a filesystem could not be read.
+ */
+int readFilesystems(const std::string& filename,
+	const std::vector<std::string> *paths, const std::string& dir)
+{
+	int ret = RET_OK;
+	try {
+		FirmwareImage image(filename);
+		FirmwareLayout layout;
+		analyseFirmware(image.data(), image.size(), &layout);
+		TaskPool pool(boost::thread::hardware_concurrency());
+		unsigned long extracted = 0;
+		for (std::vector<FirmwarePart>::const_iterator i = layout.parts.begin();
+			i != layout.parts.end(); i++
+		) {
+			std::string name = firmwarePartLabel(*i);
+			try {
+				boost::scoped_ptr<FirmwareFS> fs(openFirmwareFS(image.data(),
+					image.size(), *i, &pool));
+				if (!fs) continue;
+				std::vector<FirmwareFile> files;
+				fs->list(&files);
+				if (paths) {
+					extracted += extractFiles(fs.get(), files, *paths,
+						dir + "/" + name);
+					continue;
+				}
+				static const char typeChars[] = "fdlo";
+				for (std::vector<FirmwareFile>::const_iterator f = files.begin();
+					f != files.end(); f++
+				) {
+					// file=filesystem type size path[ -> target]
+					std::cout << "file=" << name << " " << typeChars[f->type]
+						<< " " << f->size << " " << f->path;
+					if (f->type == FirmwareFile::Symlink) std::cout << " -> " << f->target;
+					std::cout << "\n";
+				}
+			} catch (const std::string& err) {
+				std::cerr << PROGNAME ": " << name << ": " << err << std::endl;
+				ret = RET_SHOWSTOPPER;
+			}
+		}
+		if (paths) std::cout << "extracted_files=" << extracted << "\n";
+		std::cout << std::flush;
+	} catch (const std::string& err) {
+		std::cerr << PROGNAME ": " << err << std::endl;
+		return RET_SHOWSTOPPER;
 	}
+	return ret;
+}
 
-class Identify
+/// Print what FirmwareCatalog::match() found.
+void printMatches(const std::vector<CatalogMatch>& matches)
 {
-	public:
-		Identify(Network *network, boost::asio::serial_port *serial)
-			: network(network),
-			  serial(serial),
-			  httpPort(0) // auto
-		{
+	for (std::vector<CatalogMatch>::const_iterator i = matches.begin();
+		i != matches.end(); i++
+	) {
+		// match=similarity shared_blocks name
+		std::cout << "match=" << std::fixed << std::setprecision(4) << i->similarity
+			<< " " << i->sharedBlocks << " " << i->name << "\n";
+	}
+	std::cout.unsetf(std::ios::floatfield);
+	std::cout << std::flush;
+	if (matches.empty()) {
+		std::cerr << "No similar firmware in the catalog." << std::endl;
+	}
+	return;
+}
+
+/// Add firmware dumps to the catalog.
+/**
+ * @param name
+ *   Name for the one dump, or empty to name each after its file.
+ *
+ * @return RET_OK, or RET_SHOWSTOPPER if a dump could not be read or the
+ *   catalog could not be written.
+ */
+int addToCatalog(const std::string& catalogFile,
+	const std::vector<std::string>& dumps, const std::string& name)
+{
+	try {
+		FirmwareCatalog catalog(catalogFile);
+		for (std::vector<std::string>::const_iterator i = dumps.begin();
+			i != dumps.end(); i++
+		) {
+			std::string entry = name;
+			if (entry.empty()) {
+				std::string::size_type slash = i->rfind('/');
+				entry = (slash == std::string::npos) ? *i : i->substr(slash + 1);
+			}
+			FirmwareImage image(*i);
+			std::vector<uint32_t> hashes;
+			FirmwareCatalog::blockHashes(image.data(), image.size(), &hashes);
+			catalog.add(entry, hashes);
+			std::cout << "catalog_added=" << entry << "\n";
 		}
+		catalog.save();
+		std::cout << "catalog_entries=" << catalog.size() << std::endl;
+	} catch (const std::string& err) {
+		std::cerr << PROGNAME ": " << err << std::endl;
+		return RET_SHOWSTOPPER;
+	}
+	return RET_OK;
+}
 
-		std::string getType()
-		{
-			bool okHTTP = this->tryHTTP();
-			bool okFTP = this->tryFTP();
-			if (okFTP && !okHTTP && !this->dev_pass.empty()) {
-				// Try HTTP again now we have some credentials
-				okHTTP = this->tryHTTP();
-			}
-
-			// If we don't know what port HTTP is and the default didn't work, try a
-			// few alternatives.
-			if ((!okHTTP) && (this->httpPort == 0)) {
-				this->httpPort = 81;
-				okHTTP = this->tryHTTP();
-				if (!okHTTP) {
-					this->httpPort = 8080;
-					okHTTP = this->tryHTTP();
-					if (!okHTTP) {
-						this->httpPort = 0; // couldn't find it
-					}
-				}
+/// List the catalog entries most like a firmware dump.
+/**
+ * @return RET_OK, or RET_SHOWSTOPPER if the dump or catalog could not be read.
+ */
+int matchDump(const std::string& catalogFile, const std::string& filename,
+	unsigned int count)
+{
+	std::vector<CatalogMatch> matches;
+	try {
+		FirmwareCatalog catalog(catalogFile);
+		if (catalog.size() == 0) {
+			throw std::string("the catalog is empty, add firmware with --catalog-add");
+		}
+		FirmwareImage image(filename);
+		std::vector<uint32_t> hashes;
+		FirmwareCatalog::blockHashes(image.data(), image.size(), &hashes);
+		catalog.match(hashes, count, &matches);
+	} catch (const std::string& err) {
+		std::cerr << PROGNAME ": " << err << std::endl;
+		return RET_SHOWSTOPPER;
+	}
+	printMatches(matches);
+	return RET_OK;
+}
+
+/// Apply an overlay to a firmware dump and save the result.
+/**
+ * @param mtdFile
+ *   Saved output of "cat /proc/mtd" from the device, or empty to go by the
+ *   parts found in the dump instead.
+ *
+ * @return RET_OK, or RET_SHOWSTOPPER if the dump could not be read or
+ *   rebuilt, or the result could not be saved.
+ */
+int repackDump(const std::string& filename, const std::string& overlay,
+	const std::string& mtdFile, const std::string& outFile)
+{
+	try {
+		std::vector<MTDPartition> mtd;
+		if (!mtdFile.empty()) {
+			std::ifstream file(mtdFile.c_str());
+			if (!file.is_open()) throw "unable to open " + mtdFile;
+			std::stringstream content;
+			content << file.rdbuf();
+			if (!parse_proc_mtd(content.str(), &mtd)) {
+				throw mtdFile + " is not the output of \"cat /proc/mtd\"";
 			}
+		}
+		FirmwareImage image(filename);
+		TaskPool pool(boost::thread::hardware_concurrency());
+		std::string repacked;
+		std::vector<RepackResult> results;
+		repackFirmware(image.data(), image.size(), mtd, overlay, &pool, &repacked,
+			&results);
+		for (std::vector<RepackResult>::const_iterator i = results.begin();
+			i != results.end(); i++
+		) {
+			// repacked=filesystem changes size space, with a size of 0 if unchanged
+			std::cout << "repacked=" << i->label << " " << i->changed << " "
+				<< i->size << " " << i->space << "\n";
+		}
+		if (results.empty()) {
+			std::cerr << "No filesystem in the dump has a folder in " << overlay
+				<< std::endl;
+		}
+		std::ofstream out(outFile.c_str(), std::ios::out | std::ios::binary
+			| std::ios::trunc);
+		out.write(repacked.data(), repacked.length());
+		out.close();
+		if (!out) throw "unable to write " + outFile;
+		std::cout << "Saved to " << outFile << std::endl;
+	} catch (const std::string& err) {
+		std::cerr << PROGNAME ": " << err << std::endl;
+		return RET_SHOWSTOPPER;
+	}
+	return RET_OK;
+}
 
-			int maxConfidence = 49; // must be more confident than this for a result
-			std::string bestType = "unknown";
-			if (verbose) std::cerr << "Confidence levels:\n";
-			for (std::map<std::string, int>::const_iterator i = confidence.begin(); i != confidence.end(); i++) {
-				if (verbose) std::cerr << "  " << i->first << ": " << i->second << "%\n";
-				if (i->second > maxConfidence) {
-					maxConfidence = i->second;
-					bestType = i->first;
-				}
+/// List the devices in the inventory matching some conditions.
+/**
+ * @return RET_OK, or RET_SHOWSTOPPER if a condition is invalid or the
+ *   inventory could not be read.
+ */
+int queryInventory(const std::string& inventoryFile,
+	const std::string& conditions)
+{
+	std::vector<InventoryRecord> matches;
+	try {
+		InventoryStore inventory(inventoryFile);
+		inventory.query(conditions, &matches);
+	} catch (const std::string& err) {
+		std::cerr << PROGNAME ": " << err << std::endl;
+		return RET_SHOWSTOPPER;
+	}
+	for (std::vector<InventoryRecord>::const_iterator i = matches.begin();
+		i != matches.end(); i++
+	) {
+		// inventory=host seen type http_port flash_size vendor:product:class fwid
+		// model [version], with - for anything not found out yet
+		char seen[32], usb[32];
+		struct tm tm;
+		time_t t = i->seen;
+		strftime(seen, sizeof(seen), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+		snprintf(usb, sizeof(usb), "%04x:%04x:%02x", i->idVendor, i->idProduct,
+			(unsigned int)i->usbClass);
+		bool queried = i->learned & INVENTORY_QUERIED;
+		std::cout << "inventory=" << i->host << " " << seen << " " << i->type << " ";
+		if (i->learned & INVENTORY_IDENTIFIED) std::cout << i->httpPort;
+		else std::cout << "-";
+		if (queried) {
+			std::cout << " " << i->flashSize << " " << usb << " " << i->fwid << " "
+				<< i->model;
+			if (!i->firmwareVersion.empty()) std::cout << " " << i->firmwareVersion;
+		} else {
+			std::cout << " - - - -";
+		}
+		std::cout << "\n";
+	}
+	std::cout << "inventory_matches=" << matches.size() << std::endl;
+	return RET_OK;
+}
+
+/// Add what was found out about a device to the inventory, if there is one.
+/**
+ * A failure is only reported, as it doesn't affect the device.
+ */
+void updateInventory(InventoryStore *inventory, const InventoryRecord& record)
+{
+	if (!inventory || record.host.empty()) return;
+	try {
+		inventory->update(record);
+	} catch (const std::string& err) {
+		std::cerr << PROGNAME ": unable to update the inventory: " << err
+			<< std::endl;
+	}
+	return;
+}
+
+/// Perform each action given on the command line against one device.
+/**
+ * @return RET_OK, RET_BADARGS if an action was missing required options, or
+ *   RET_SHOWSTOPPER if writing firmware failed.
+ */
+int runActions(const std::vector<po::option>& options,
+	const std::string& strHost, std::string strType,
+	const std::map<std::string, unsigned short>& ports,
+	const std::string& username, const std::string& password,
+	boost::asio::serial_port *serial, IdentifyCache *cache,
+	CaptureWriter *record, CaptureReader *replay, ProgressMonitor *progress,
+	const ThrottleConfig& throttle, const RetryPolicy& retryPolicy,
+	CircuitBreaker *breaker, const std::string& snapshotDir, bool sparseDumps,
+	const std::string& archiveDir, const std::string& catalogFile,
+	unsigned int matchCount, InventoryStore *inventory)
+{
+	Network network(strHost);
+	for (std::map<std::string, unsigned short>::const_iterator i = ports.begin();
+		i != ports.end(); i++
+	) {
+		network.set_port(i->first, i->second);
+	}
+	network.record(record);
+	network.replay(replay);
+	network.set_throttle(throttle);
+	network.set_retry(retryPolicy, breaker);
+	network.set_login(username, password);
+
+	// Run through the actions on the command line
+	for (std::vector<po::option>::const_iterator i = options.begin(); i != options.end(); i++) {
+		if (i->string_key.compare("identify") == 0) {
+			Span spanOp("op", "identify", strHost);
+			Identify id(&network, serial, cache,
+				progress->start("Retrieving config", strHost));
+			strType = id.getType();
+			progress->sync();
+			if (id.getHTTPPort() != 0) {
+				std::cout << "http_port=" << id.getHTTPPort() << "\n";
 			}
-			if (!this->dev_user.empty() && !this->dev_pass.empty()) {
-				std::cout << "admin_username=" << this->dev_user
-					<< "\nadmin_password=" << this->dev_pass << std::endl;
+			if (!id.getUsername().empty() && !id.getPassword().empty()) {
+				std::cout << "admin_username=" << id.getUsername()
+					<< "\nadmin_password=" << id.getPassword() << std::endl;
+			}
+			std::cout << "device_type=";
+			if (strType.empty()) {
+				std::cout << "unknown" << std::endl;
+				std::cerr << "Unable to identify device!" << std::endl;
+			} else {
+				std::cout << strType << std::endl;
+			}
+			if (!strType.empty() && (strType.compare("unknown") != 0)) {
+				InventoryRecord entry;
+				entry.host = strHost;
+				entry.learned = INVENTORY_IDENTIFIED;
+				entry.type = strType;
+				entry.httpPort = id.getHTTPPort();
+				updateInventory(inventory, entry);
 			}
-			return bestType;
-		}
 
-		bool tryHTTP()
-		{
-			this->network->set_http_port(this->httpPort);
-			std::cerr << "[http] Attempting to connect to " << network->hostname()
-				<< " port " << network->get_http_port() << std::endl;
-			std::vector<std::string> headers;
-			try {
-				headers = network->http_headers();
-			} catch (const boost::system::system_error& e) {
-				// Assume HTTP is unavailable on this port
-				std::cerr << "[http] Connection failed." << std::endl;
-				return false;
-			}
-
-			for (std::vector<std::string>::iterator i = headers.begin(); i != headers.end(); i++) {
-				if (i->substr(0, 7).compare("Server:") == 0) {
-					// This is the Server: header
-					std::string server = i->substr(8);
-					if (verbose) std::cerr << "[http] Server is \"" << server << "\"\n";
-					if (server.compare("WebServer(IPCamera_Logo)") == 0) {
-						confidence["maygion-mips"] += 10;
-					} else if (server.compare("Netwave IP Camera") == 0) {
-						confidence["wansview"] += 10;
+		} else if (i->string_key.compare("dump-firmware") == 0) {
+			Span spanOp("op", "dump", strHost);
+			boost::scoped_ptr<Device> dev(openDevice(strType, &network, serial));
+			if (!dev) {
+				std::cerr << PROGNAME ": --type missing or invalid." << std::endl;
+				return RET_BADARGS;
+			}
+			// Allow a different file per host when scanning a range
+			std::string strFilename = i->value[0];
+			std::string::size_type pos = strFilename.find("%h");
+			if (pos != std::string::npos) strFilename.replace(pos, 2, strHost);
+
+			Retry retry(retryPolicy, strHost);
+			for (;;) {
+				// Start the file again on each attempt
+				std::ofstream outfile(strFilename.c_str(),
+					std::ios::out | std::ios::trunc | std::ios::binary);
+				fn_progress fnProg = progress->start("Downloading firmware", strHost);
+				try {
+					if (sparseDumps) {
+						// Compress blocks on every core while the rest arrives
+						SparseWriter sparse(outfile, boost::thread::hardware_concurrency());
+						std::ostream target(&sparse);
+						dev->getFirmware(target, fnProg);
+						sparse.finish();
+					} else {
+						dev->getFirmware(outfile, fnProg);
 					}
+				} catch (const std::string& err) {
+					// Drop the last reference so the transfer shows as failed
+					fnProg.clear();
+					progress->sync();
+					std::cerr << "Download failed: " << err
+						<< std::endl;
+				} catch (const boost::system::system_error& e) {
+					fnProg.clear();
+					progress->sync();
+					if (retry.again(e.code())) continue;
+					std::cerr << "Download failed: " << e.what()
+						<< std::endl;
 				}
+				progress->sync();
+				break;
 			}
+			std::cout << "Saved to " << strFilename << std::endl;
 
-			// Use the discovered credentials if present, otherwise fall back to the
-			// default ones.
-			std::string url = "/sysinfo.xml?user=";
-			if (this->dev_user.empty()) url += "admin"; else url += this->dev_user;
-			url += "&password=";
-			if (this->dev_pass.empty()) url += "admin"; else url += this->dev_pass;
-
-			std::string httpData = network->http_get(url);
-			if (!httpData.empty()) {
-				// Got data from the MayGion info URL
-				if (this->processMayGionInfo(httpData)) {
-					// Done, sure this is the model
-					return true;
+		} else if (i->string_key.compare("archive-firmware") == 0) {
+			Span spanOp("op", "archive", strHost);
+			boost::scoped_ptr<Device> dev(openDevice(strType, &network, serial));
+			if (!dev) {
+				std::cerr << PROGNAME ": --type missing or invalid." << std::endl;
+				return RET_BADARGS;
+			}
+			ArchiveStats stats;
+			try {
+				ChunkArchive archive(archiveDir);
+				Retry retry(retryPolicy, strHost);
+				for (;;) {
+					// Chunks already stored by a failed attempt are reused
+					fn_progress fnProg = progress->start("Archiving firmware", strHost);
+					try {
+						ArchiveWriter writer(archive, strHost,
+							boost::thread::hardware_concurrency());
+						std::ostream target(&writer);
+						dev->getFirmware(target, fnProg);
+						writer.finish(&stats);
+						break;
+					} catch (const boost::system::system_error& e) {
+						fnProg.clear();
+						progress->sync();
+						if (!retry.again(e.code())) throw std::string(e.what());
+					} catch (...) {
+						fnProg.clear();
+						progress->sync();
+						throw;
+					}
 				}
+			} catch (const std::string& err) {
+				std::cerr << "Archive failed: " << err << std::endl;
+				continue;
 			}
-
-			// Not MayGion, keep examining
-
-			url = "/get_status.cgi";
-			httpData = network->http_get(url);
-			if (!httpData.empty()) {
-				if (this->processWansview(httpData)) {
-					// Done, sure this is the model
-					return true;
+			progress->sync();
+			std::cout << "archive_chunks=" << stats.chunks
+				<< "\narchive_new_chunks=" << stats.newChunks
+				<< "\narchive_size=" << stats.size
+				<< "\narchive_new_bytes=" << stats.newBytes << std::endl;
+
+		} else if (i->string_key.compare("match-firmware") == 0) {
+			Span spanOp("op", "match", strHost);
+			boost::scoped_ptr<Device> dev(openDevice(strType, &network, serial));
+			if (!dev) {
+				std::cerr << PROGNAME ": --type missing or invalid." << std::endl;
+				return RET_BADARGS;
+			}
+			std::vector<CatalogMatch> matches;
+			try {
+				FirmwareCatalog catalog(catalogFile);
+				if (catalog.size() == 0) {
+					throw std::string("the catalog is empty, add firmware with "
+						"--catalog-add");
+				}
+				// Only the checksums are sent back, not the flash content
+				std::vector<uint32_t> hashes;
+				Retry retry(retryPolicy, strHost);
+				for (;;) {
+					try {
+						dev->getBlockChecksums(CATALOG_BLOCK_SIZE, &hashes);
+						break;
+					} catch (const boost::system::system_error& e) {
+						if (!retry.again(e.code())) throw std::string(e.what());
+					}
 				}
+				catalog.match(hashes, matchCount, &matches);
+			} catch (const std::string& err) {
+				std::cerr << "Match failed: " << err << std::endl;
+				continue;
 			}
-
-			return true;
-		}
-
-		bool processMayGionInfo(const std::string& httpData)
-		{
-			boost::regex result_regex("<Success>(.*)</Success>");
-			boost::match_results<std::string::const_iterator> result_matches;
-			std::string::const_iterator start = httpData.begin();
-			std::string::const_iterator end = httpData.end();
-			boost::regex_search(start, end, result_matches, result_regex, boost::match_default);
-			std::string result(result_matches[1].first, result_matches[1].second);
-			if (result.compare("0") == 0) {
-				if (verbose) std::cerr << "[http] Possible MayGion MIPS with non-default admin password\n";
-				confidence["maygion-mips"] += 20;
-
-				boost::regex error_regex("<ErrorCode>(.*)</ErrorCode>");
-				boost::match_results<std::string::const_iterator> error_matches;
-				std::string::const_iterator start = httpData.begin();
-				std::string::const_iterator end = httpData.end();
-				boost::regex_search(start, end, error_matches, error_regex, boost::match_default);
-				std::string error_code(error_matches[1].first, error_matches[1].second);
-				if (error_code.compare("eHttpError_No_Auth") == 0) {
-					// Newer firmware
-					confidence["maygion-mips"] += 20;
-				} else if (error_code.compare("5") == 0) {
-					// Older firmware
-					confidence["maygion-mips"] += 20;
+			printMatches(matches);
+
+		} else if ((i->string_key.compare("flash-firmware") == 0)
+			|| (i->string_key.compare("flash-diff") == 0)
+		) {
+			Span spanOp("op", "flash", strHost);
+			boost::scoped_ptr<Device> dev(openDevice(strType, &network, serial));
+			if (!dev) {
+				std::cerr << PROGNAME ": --type missing or invalid." << std::endl;
+				return RET_BADARGS;
+			}
+			std::ifstream infile(i->value[0].c_str(), std::ios::in | std::ios::binary);
+			if (!infile.is_open()) {
+				std::cerr << PROGNAME ": unable to open " << i->value[0] << std::endl;
+				return RET_BADARGS;
+			}
+			// Not retried, as a half-written flash needs a person to look at it
+			bool onlyChanged = i->string_key.compare("flash-diff") == 0;
+			fn_progress fnProg = progress->start("Writing firmware", strHost);
+			unsigned long written;
+			try {
+				if (isSparseDump(infile)) {
+					SparseReader sparse(infile);
+					std::stringstream image;
+					sparse.expand(image);
+					written = dev->putFirmware(image, onlyChanged, fnProg);
 				} else {
-					if (verbose) std::cerr << "[http] Unknown error trying to get "
-						"device info: " << error_code << std::endl;
+					written = dev->putFirmware(infile, onlyChanged, fnProg);
 				}
-				return false;
-			} else if (result.compare("1") != 0) {
-				// Unknown response
-				confidence["maygion-mips"] -= 10;
-				return false;
-			}
-
-			// Got acceptable HTTP response
-			if (verbose) std::cerr << "[http] Appears to be a MayGion MIPS\n";
-			confidence["maygion-mips"] += 10;
-
-			if (this->dev_user.empty() && this->dev_pass.empty()) {
-				if (verbose) std::cerr << "[http] Default user/pass works\n";
-				this->dev_user = "admin";
-				this->dev_pass = "admin";
-			}
-
-			boost::regex board_regex("<Board>(.*)</Board>");
-			boost::match_results<std::string::const_iterator> matches;
-			start = httpData.begin();
-			end = httpData.end();
-			boost::regex_search(start, end, matches, board_regex, boost::match_default);
-			std::string board(matches[1].first, matches[1].second);
-			if (verbose) std::cerr << "[http] MayGion board ID: " << board << std::endl;
-			if (board.compare("MIPS") == 0) {
-				confidence["maygion-mips"] = 100;
-			} // else could be MIPS with old firmware
-
-			return true;
-		}
-
-		bool processWansview(const std::string& httpData)
-		{
-			boost::regex result_regex("var sys_ver='([^']*)';");
-			boost::match_results<std::string::const_iterator> result_matches;
-			std::string::const_iterator start = httpData.begin();
-			std::string::const_iterator end = httpData.end();
-			boost::regex_search(start, end, result_matches, result_regex, boost::match_default);
-			std::string result(result_matches[1].first, result_matches[1].second);
-			if (result.empty()) return false;
-
-			if (verbose) std::cerr << "[http] Possible Wansview device with "
-				"firmware " << result << "\n";
-			confidence["wansview"] += 20;
-
-			boost::regex app_regex("var app_ver='([^']*)';");
-			boost::match_results<std::string::const_iterator> app_matches;
-			start = httpData.begin();
-			end = httpData.end();
-			boost::regex_search(start, end, app_matches, app_regex, boost::match_default);
-			std::string app_code(app_matches[1].first, app_matches[1].second);
-			if (!app_code.empty()) {
-				if (verbose) std::cerr << "[http] App version " << app_code << "\n";
-				confidence["wansview"] += 20;
-			} else {
-				return false; // not sure
+			} catch (const std::string& err) {
+				fnProg.clear();
+				progress->sync();
+				std::cerr << "Flash failed: " << err << std::endl;
+				return RET_SHOWSTOPPER;
+			} catch (const boost::system::system_error& e) {
+				fnProg.clear();
+				progress->sync();
+				std::cerr << "Flash failed: " << e.what() << std::endl;
+				return RET_SHOWSTOPPER;
 			}
+			progress->sync();
+			std::cout << "flashed=" << i->value[0]
+				<< "\nflash_blocks_written=" << written << std::endl;
+
+		} else if (i->string_key.compare("query") == 0) {
+			Span spanOp("op", "query", strHost);
+			boost::scoped_ptr<Device> dev(openDevice(strType, &network, serial));
+			if (!dev) {
+				std::cerr << PROGNAME ": --type missing or invalid." << std::endl;
+				return RET_BADARGS;
+			}
+			bool known_model = false;
+			try {
+				unsigned long lenFlash;
+				unsigned short idVendor, idProduct;
+				unsigned char bInterfaceClass;
+				std::string version;
+				Retry retry(retryPolicy, strHost);
+				for (;;) {
+					try {
+						dev->getFlashInfo(&lenFlash);
+						dev->getCameraInfo(&idVendor, &idProduct, &bInterfaceClass);
+						version = dev->getFirmwareVersion();
+						break;
+					} catch (const boost::system::system_error& e) {
+						if (!retry.again(e.code())) throw std::string(e.what());
+					}
+				}
+				std::cout << "flash_size=" << lenFlash << std::endl;
+				if (!version.empty()) {
+					std::cout << "firmware_version=" << version << std::endl;
+				}
 
-			return true; // sure
-		}
+				std::cout << std::hex
+					<< "camera_usb_vendor=" << std::setw(4) << std::setfill('0') << idVendor
+					<< "\ncamera_usb_product=" << std::setw(4) << std::setfill('0') << idProduct
+					<< "\ncamera_usb_class=" << std::setw(2) << std::setfill('0') << (unsigned int)bInterfaceClass
+					<< std::dec << std::endl;
+
+				InventoryRecord entry;
+				entry.host = strHost;
+				entry.learned = INVENTORY_QUERIED;
+				entry.type = strType;
+				entry.flashSize = lenFlash;
+				entry.idVendor = idVendor;
+				entry.idProduct = idProduct;
+				entry.usbClass = bInterfaceClass;
+				entry.model = modelName(strType, lenFlash, idVendor, idProduct,
+					&known_model);
+				entry.knownModel = known_model;
+				entry.fwid = firmwareId(strType, lenFlash, bInterfaceClass);
+				entry.firmwareVersion = version;
+				std::cout << "model=" << entry.model
+					<< "\nfwid=" << entry.fwid
+					<< "\n";
+				updateInventory(inventory, entry);
+
+				if (!known_model) {
+					std::cerr << "\n\n >>> This camera is an unknown model!  Please get in "
+						"touch!\nhttp://www.openipcam.com/forum/\n" << std::endl;
+				}
+			} catch (const std::string& err) {
+				std::cerr << "Device query failed: " << err
+					<< std::endl;
+			}
 
-		bool tryFTP()
-		{
-			// Get password
-			std::string cred_enc;
-			if (network->ftp_login("MayGion", "maygion.com")) {
-				this->confidence["maygion-mips"] = 100;
-
-				std::stringstream config;
-				network->ftp_get(config, "/tmp/eye/app", "cs.ini",
-					boost::bind(showProgress, "Retrieving config", _1, _2));
-				config.seekg(0);
-				enum section {SECTION_NONE, SECTION_HTTP, SECTION_USR};
-				enum section curSection = SECTION_NONE;
-				while (!config.eof()) {
-					std::string line;
-					std::getline(config, line);
-					if (verbose > 1) std::cerr << "[config] " << line << std::endl;
-					const char *cline = line.c_str();
-					if (strncmp(cline, "[http]", 6) == 0) {
-						curSection = SECTION_HTTP;
-					} else if (strncmp(cline, "[usr]", 5) == 0) {
-						curSection = SECTION_USR;
-					} else if (cline[0] == '[') {
-						// some other section we don't care about
-						curSection = SECTION_NONE;
-						// If we don't do this, a "port=" in "[smtp]" or similar can
-						// override the HTTP port.
-					} else if ((curSection == SECTION_USR) && (strncmp(cline, "ui=", 3) == 0)) {
-						// This is the UI line
-
-						// From http://base64.sourceforge.net/b64.c
-						static const char cd64[]="|$$$}rstuvwxyz{$$$$$$$>?@ABCDEFGHIJKLMNOPQRSTUVW$$$$$$XYZ[\\]^_`abcdefghijklmnopq";
-						for (std::string::const_iterator i = line.begin() + 3; i != line.end(); i++) {
-							unsigned char v = ((*i < 43 || *i > 122) ? 0 : (int) cd64[ *i - 43 ]);
-							if (v != 0) {
-								v = ((v == '$') ? 0 : v - 61);
-							}
-							cred_enc += v-1;
-						}
-					} else if ((curSection == SECTION_HTTP) && (strncmp(cline, "port=", 5) == 0)) {
-						unsigned int port = strtoul(line.c_str() + 5, NULL, 10);
-						if ((port != 80) && (port != 0)) {
-							if (verbose) std::cerr << "[ftp] Web interface is operating on port "
-								<< port << std::endl;
-							this->httpPort = port;
-							std::cout << "http_port=" << this->httpPort << "\n";
-						}
+		} else if (i->string_key.compare("config-snapshot") == 0) {
+			Span spanOp("op", "config_snapshot", strHost);
+			boost::scoped_ptr<Device> dev(openDevice(strType, &network, serial));
+			if (!dev) {
+				std::cerr << PROGNAME ": --type missing or invalid." << std::endl;
+				return RET_BADARGS;
+			}
+			SnapshotStore store(snapshotDir);
+			unsigned int version;
+			std::vector<ConfigChange> changes;
+			SnapshotStatus status = SnapshotUnchanged;
+			try {
+				Retry retry(retryPolicy, strHost);
+				for (;;) {
+					try {
+						status = snapshotConfig(dev.get(), &store, strHost, &version,
+							&changes);
+						break;
+					} catch (const boost::system::system_error& e) {
+						if (!retry.again(e.code())) throw std::string(e.what());
 					}
 				}
-			} else {
-				// FTP unavailable, try telnet
-				return false;
-			}
-
-			if (!cred_enc.empty()) {
-				std::string cred_dec;
-
-				// From http://base64.sourceforge.net/b64.c
-				for (std::string::const_iterator i = cred_enc.begin(); i != cred_enc.end(); i++) {
-					unsigned char a = *i;
-					if (++i == cred_enc.end()) break;
-					unsigned char b = *i;
-					cred_dec += (char)(a << 2 | b >> 4);
-					if (++i == cred_enc.end()) break;
-					unsigned char c = *i;
-					cred_dec += (char)(b << 4 | c >> 2);
-					if (++i == cred_enc.end()) break;
-					unsigned char d = *i;
-					cred_dec += (char)(((c << 6) & 0xc0) | d);
+			} catch (const std::string& err) {
+				std::cerr << "Config snapshot failed: " << err << std::endl;
+				continue;
+			}
+			static const char *statusNames[] = {"new", "changed", "unchanged"};
+			std::cout << "config_status=" << statusNames[status]
+				<< "\nconfig_version=" << version << "\n";
+			for (std::vector<ConfigChange>::const_iterator c = changes.begin();
+				c != changes.end(); c++
+			) {
+				switch (c->type) {
+					case ConfigChange::SectionAdded:
+						std::cout << "config_section_added=[" << c->section << "]\n";
+						break;
+					case ConfigChange::SectionRemoved:
+						std::cout << "config_section_removed=[" << c->section << "]\n";
+						break;
+					case ConfigChange::KeyAdded:
+						std::cout << "config_key_added=[" << c->section << "] "
+							<< c->key << "=" << c->newValue << "\n";
+						break;
+					case ConfigChange::KeyRemoved:
+						std::cout << "config_key_removed=[" << c->section << "] "
+							<< c->key << "=" << c->oldValue << "\n";
+						break;
+					case ConfigChange::KeyChanged:
+						std::cout << "config_key_changed=[" << c->section << "] "
+							<< c->key << "=" << c->oldValue << " -> " << c->newValue << "\n";
+						break;
 				}
-				if (verbose > 1) std::cout << "base64 decoded data: " << cred_dec << std::endl;
-				std::string::size_type usr_start = cred_dec.find("usr=") + 4;
-				std::string::size_type usr_end = cred_dec.find("\r\n", usr_start);
-				this->dev_user = cred_dec.substr(usr_start, usr_end - usr_start);
-
-				std::string::size_type pwd_start = cred_dec.find("pwd=") + 4;
-				std::string::size_type pwd_end = cred_dec.find("\r\n", pwd_start);
-				this->dev_pass = cred_dec.substr(pwd_start, pwd_end - pwd_start);
+			}
+			std::cout << std::flush;
 
-			return true;
 		}
+	} // for (all command line elements)
 
-	private:
-		Network *network;
-		boost::asio::serial_port *serial;
-		std::map<std::string, int> confidence;
-		std::string dev_user, dev_pass;
-		unsigned int httpPort;
-};
+	return RET_OK;
+}
+
+/// Report a host found by --discover and remember it for later actions.
+void foundHost(std::vector<std::string> *hosts, const std::string& host,
+	const std::vector<unsigned short>& ports)
+{
+	std::cout << "discovered_host=" << host << "\nopen_ports=";
+	for (std::vector<unsigned short>::const_iterator i = ports.begin(); i != ports.end(); i++) {
+		if (i != ports.begin()) std::cout << ',';
+		std::cout << *i;
+	}
+	std::cout << std::endl;
+	hosts->push_back(host);
+	return;
+}
 
 int main(int argc, char *argv[])
 {
@@ -379,7 +798,79 @@ int main(int argc, char *argv[])
 			"query details about a known device")
 
 		("dump-firmware,d", po::value<std::string>(),
-			"copy firmware from device's flash into this file")
+			"copy firmware from device's flash into this file (%h is replaced "
+			"with the hostname)")
+
+		("expand-dump", po::value<std::string>(),
+			"write out the full image held in a --dump-format sparse file to "
+			"stdout")
+
+		("analyse-dump", po::value<std::string>(),
+			"list the headers, filesystems and versions found in a firmware "
+			"dump, and how random each 64 kB block is")
+
+		("list-files", po::value<std::string>(),
+			"list the files in the squashfs and JFFS2 filesystems in a firmware "
+			"dump")
+
+		("extract-files", po::value<std::string>(),
+			"copy files out of the squashfs and JFFS2 filesystems in a firmware "
+			"dump (see --extract-path and --extract-dir)")
+
+		("archive-firmware",
+			"copy firmware from device's flash into the archive (see "
+			"--archive-dir), storing only the parts no other archived device "
+			"already has")
+
+		("restore-archive", po::value<std::string>(),
+			"write out this host's latest archived firmware to stdout")
+
+		("inventory-query", po::value<std::string>(),
+			"list the devices in the inventory matching all of some conditions, "
+			"e.g. \"type=maygion-mips known_model=false\" (fields are host, type, "
+			"fwid, model, version, usb=vvvv:pppp, http_port, known_model and "
+			"seen<AGE or seen>AGE, e.g. seen>7d), or \"\" for every device")
+
+		("catalog-add", po::value<std::string>(),
+			"add a firmware dump to the catalog of known firmware (see --catalog "
+			"and --catalog-name).  May be given more than once.")
+
+		("match-dump", po::value<std::string>(),
+			"list the firmware in the catalog most like a dump")
+
+		("match-firmware",
+			"list the firmware in the catalog most like what is in the device's "
+			"flash, by checksumming each block on the device rather than "
+			"downloading it")
+
+		("repack", po::value<std::string>(),
+			"rebuild the filesystems in a firmware dump with the changes in "
+			"--overlay, and save the image to --repack-out")
+
+		("flash-firmware", po::value<std::string>(),
+			"write this image to the device's flash, checking each erase block "
+			"as it is written.  The image must be the same size as the flash, or "
+			"a sparse dump of it.")
+
+		("flash-diff", po::value<std::string>(),
+			"same as --flash-firmware, but only send and write the erase blocks "
+			"that differ from what is already in the flash")
+
+		("config-snapshot",
+			"save a copy of the device's configuration if it has changed since "
+			"the last one, and list the sections and keys that differ")
+
+		("discover", po::value<std::string>(),
+			"scan an IPv4 range (e.g. 192.168.0.0/16) for devices, then perform "
+			"the other actions on each one found.  May be given more than once.")
+
+		("batch", po::value<std::string>(),
+			"run the actions listed in this manifest file (- for stdin) on many "
+			"devices at once, writing the results as JSON Lines")
+
+		("daemon", po::value<std::string>(),
+			"keep polling the devices listed in this file (one \"host [type]\" per "
+			"line) and serve their latest state as JSON over HTTP (see --listen)")
 	;
 
 	po::options_description poOptions("Options");
@@ -392,6 +883,125 @@ int main(int argc, char *argv[])
 			"serial port device is connected to (COM1, /dev/ttyUSB0, etc.)")
 		("verbose,v",
 			"show more detail (can specify twice for even more detail)")
+		("port", po::value<std::string>(),
+			"connect to a service on a non-standard port, e.g. telnet=2323 "
+			"(may be given more than once)")
+		("username", po::value<std::string>(),
+			"admin username for devices whose web interface needs one, if it "
+			"has been changed from the factory default")
+		("password", po::value<std::string>(),
+			"password for --username")
+		("cache", po::value<std::string>(),
+			"file to cache --identify results in (default ~/.cache/camtickler/identify)")
+		("cache-ttl", po::value<unsigned long>(),
+			"seconds a cached --identify result remains valid (default 86400)")
+		("no-cache",
+			"always perform a full --identify, ignoring any cached result")
+		("inventory", po::value<std::string>(),
+			"file to record every --identify and --query result in (default "
+			"~/.local/share/camtickler/inventory)")
+		("no-inventory",
+			"don't record --identify and --query results in the inventory")
+		("rate", po::value<unsigned long>(),
+			"maximum connection attempts per second for --discover (default 2000)")
+		("max-pending", po::value<unsigned int>(),
+			"maximum simultaneous connection attempts for --discover (default 512)")
+		("connect-timeout", po::value<unsigned int>(),
+			"milliseconds before --discover gives up on a port (default 1000)")
+		("record", po::value<std::string>(),
+			"save all network traffic with timings to this file (implies --no-cache)")
+		("replay", po::value<std::string>(),
+			"use traffic saved with --record instead of the network (implies "
+			"--no-cache).  Without --host, every host in the file is replayed.")
+		("replay-speed", po::value<double>(),
+			"speed multiplier for --replay, or 0 for no delays (default 1)")
+		("trace-out", po::value<std::string>(),
+			"write the timing of each connection phase to this file, in Chrome "
+			"trace event format")
+		("trace-summary",
+			"print latency statistics for each connection phase when finished")
+		("metrics-file", po::value<std::string>(),
+			"write counters in Prometheus text format to this file after each "
+			"device, e.g. for the node_exporter textfile collector")
+		("metrics-listen", po::value<std::string>(),
+			"serve counters in Prometheus text format at /metrics on this "
+			"[address:]port (address defaults to 127.0.0.1)")
+		("max-rate", po::value<unsigned long>(),
+			"limit firmware downloads to this many bytes per second")
+		("adaptive-rate",
+			"slow firmware downloads while the device is busy, judged by its load "
+			"average and how much other traffic it is sending (checked over telnet)")
+		("max-load", po::value<double>(),
+			"load average above which --adaptive-rate treats the device as busy "
+			"(default 1.5)")
+		("retries", po::value<unsigned int>(),
+			"number of times to retry a connection or dump after a timeout or "
+			"dropped connection (default 2)")
+		("retry-delay", po::value<unsigned int>(),
+			"milliseconds to wait before the first retry, doubling each time "
+			"(default 500)")
+		("retry-max-delay", po::value<unsigned int>(),
+			"longest wait between retries in milliseconds (default 10000)")
+		("timeout", po::value<unsigned int>(),
+			"seconds to wait for a device to accept a connection or send or "
+			"accept data before giving up, 0 to wait forever (default 30)")
+		("breaker-threshold", po::value<unsigned int>(),
+			"skip a host after this many failed connections in a row, 0 to never "
+			"skip (default 3)")
+		("breaker-cooldown", po::value<unsigned int>(),
+			"seconds to skip a failing host for before trying it again "
+			"(default 300)")
+		("progress", po::value<std::string>(),
+			"how to show transfer progress: bar, json (one object per line), none, "
+			"or auto for a bar only when stderr is a terminal (default auto)")
+		("progress-interval", po::value<unsigned int>(),
+			"milliseconds between progress updates (default 250)")
+		("snapshot-dir", po::value<std::string>(),
+			"folder to keep --config-snapshot copies in (default "
+			"~/.local/share/camtickler/snapshots)")
+		("archive-dir", po::value<std::string>(),
+			"folder to keep the --archive-firmware archive in (default "
+			"~/.local/share/camtickler/archive)")
+		("catalog", po::value<std::string>(),
+			"file to keep the --catalog-add catalog of known firmware in (default "
+			"~/.local/share/camtickler/catalog)")
+		("catalog-name", po::value<std::string>(),
+			"name to give the firmware added by --catalog-add, such as its model "
+			"and version (default is the dump's filename)")
+		("match-count", po::value<unsigned int>(),
+			"most --match-dump and --match-firmware results to list (default 5)")
+		("extract-path", po::value<std::string>(),
+			"file or folder for --extract-files to copy, instead of everything "
+			"(may be given more than once)")
+		("extract-dir", po::value<std::string>(),
+			"folder for --extract-files to write to, with one folder inside for "
+			"each filesystem (default is the current folder)")
+		("overlay", po::value<std::string>(),
+			"folder of changes for --repack, laid out like --extract-dir, where "
+			"an empty .wh.NAME file removes NAME")
+		("mtd-layout", po::value<std::string>(),
+			"file holding the output of \"cat /proc/mtd\" on the device, so "
+			"--repack keeps each filesystem inside its partition")
+		("repack-out", po::value<std::string>(),
+			"file to save the --repack image to")
+		("dump-format", po::value<std::string>(),
+			"raw (default) or sparse, to compress --dump-firmware and leave out "
+			"erased blocks")
+		("jobs,j", po::value<unsigned int>(),
+			"number of devices --batch or --daemon works on at once (default 8)")
+		("batch-out", po::value<std::string>(),
+			"file to write --batch results to (default stdout)")
+		("batch-state", po::value<std::string>(),
+			"file to remember each device's fwid in between --batch runs, for "
+			"the ?changed condition")
+		("poll-interval", po::value<unsigned int>(),
+			"average seconds between --daemon polls of each device (default 300)")
+		("poll-jitter", po::value<unsigned int>(),
+			"percentage each --daemon poll interval varies by, so devices aren't "
+			"all polled at once (default 10)")
+		("listen", po::value<std::string>(),
+			"[address:]port for --daemon to serve /cameras and /metrics on "
+			"(default 127.0.0.1:8090)")
 	;
 
 	po::options_description poHidden("Hidden parameters");
@@ -407,6 +1017,42 @@ int main(int argc, char *argv[])
 	po::variables_map mpArgs;
 
 	std::string strType, strHost, strSerial;
+	std::string strCache;
+	unsigned long cacheTTL = 86400;
+	bool useCache = true;
+	std::string strInventory, strInventoryQuery;
+	bool useInventory = true, inventoryQuery = false;
+	std::map<std::string, unsigned short> ports;
+	std::string strUsername, strPassword;
+	std::vector<std::string> discoverRanges;
+	unsigned long discoverRate = 2000;
+	unsigned int discoverPending = 512;
+	unsigned int discoverTimeout = 1000;
+	std::string strRecord, strReplay;
+	double replaySpeed = 1;
+	std::string strTraceOut;
+	bool traceSummary = false;
+	std::string strMetricsFile, strMetricsListen;
+	ProgressMonitor::Mode progressMode;
+	ProgressMonitor::parseMode("auto", &progressMode);
+	unsigned int progressInterval = 250;
+	ThrottleConfig throttle;
+	RetryPolicy retryPolicy;
+	unsigned int breakerThreshold = 3;
+	unsigned int breakerCooldown = 300;
+	std::string strSnapshotDir;
+	bool sparseDumps = false;
+	std::string strArchiveDir, strRestore;
+	std::string strListFiles, strExtractFiles, strExtractDir = ".";
+	std::vector<std::string> extractPaths;
+	std::string strCatalog, strCatalogName, strMatchDump;
+	std::string strRepack, strOverlay, strMtdLayout, strRepackOut;
+	std::vector<std::string> catalogAdd;
+	unsigned int matchCount = 5;
+	std::string strBatch, strBatchOut;
+	BatchConfig batchConfig;
+	std::string strDaemon, strListen = "127.0.0.1:8090";
+	DaemonConfig daemonConfig;
 
 	try {
 		po::parsed_options pa = po::parse_command_line(argc, argv, poComplete);
@@ -431,6 +1077,9 @@ int main(int argc, char *argv[])
 					"Example:\n"
 					"  " PROGNAME " --host 1.2.3.4 --identify  # Get value to use in --type\n"
 					"  " PROGNAME " --host 1.2.3.4 --type device-type --query\n"
+				"  " PROGNAME " --discover 10.0.0.0/16 --rate 500 --identify\n"
+					"  " PROGNAME " --batch cameras.txt --jobs 16 --batch-out results.jsonl\n"
+					"  " PROGNAME " --daemon cameras.txt --poll-interval 60 --listen 8090\n"
 					<< std::endl;
 				return RET_OK;
 
@@ -439,6 +1088,7 @@ int main(int argc, char *argv[])
 			) {
 				std::cout
 					<< "maygion-mips\tMayGion MIPS camera\n"
+					<< "wansview\tWansview and other Netwave cameras\n"
 					<< std::flush;
 				return RET_OK;
 
@@ -469,11 +1119,353 @@ int main(int argc, char *argv[])
 			) {
 				verbose++;
 
+			} else if (i->string_key.compare("port") == 0) {
+				assert(i->value.size() != 0);
+				std::string::size_type eq = i->value[0].find('=');
+				if (eq == std::string::npos) {
+					std::cerr << PROGNAME ": --port must be of the form service=port"
+						<< std::endl;
+					return RET_BADARGS;
+				}
+				ports[i->value[0].substr(0, eq)]
+					= strtoul(i->value[0].c_str() + eq + 1, NULL, 10);
+
+			} else if (i->string_key.compare("username") == 0) {
+				assert(i->value.size() != 0);
+				strUsername = i->value[0];
+
+			} else if (i->string_key.compare("password") == 0) {
+				assert(i->value.size() != 0);
+				strPassword = i->value[0];
+
+			} else if (i->string_key.compare("cache") == 0) {
+				assert(i->value.size() != 0);
+				strCache = i->value[0];
+
+			} else if (i->string_key.compare("cache-ttl") == 0) {
+				assert(i->value.size() != 0);
+				cacheTTL = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("no-cache") == 0) {
+				useCache = false;
+
+			} else if (i->string_key.compare("inventory") == 0) {
+				assert(i->value.size() != 0);
+				strInventory = i->value[0];
+
+			} else if (i->string_key.compare("no-inventory") == 0) {
+				useInventory = false;
+
+			} else if (i->string_key.compare("inventory-query") == 0) {
+				assert(i->value.size() != 0);
+				strInventoryQuery = i->value[0];
+				inventoryQuery = true;
+
+			} else if (i->string_key.compare("discover") == 0) {
+				assert(i->value.size() != 0);
+				discoverRanges.push_back(i->value[0]);
+
+			} else if (i->string_key.compare("rate") == 0) {
+				assert(i->value.size() != 0);
+				discoverRate = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("max-pending") == 0) {
+				assert(i->value.size() != 0);
+				discoverPending = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("connect-timeout") == 0) {
+				assert(i->value.size() != 0);
+				discoverTimeout = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("record") == 0) {
+				assert(i->value.size() != 0);
+				strRecord = i->value[0];
+				useCache = false;
+
+			} else if (i->string_key.compare("replay") == 0) {
+				assert(i->value.size() != 0);
+				strReplay = i->value[0];
+				useCache = false;
+
+			} else if (i->string_key.compare("replay-speed") == 0) {
+				assert(i->value.size() != 0);
+				replaySpeed = strtod(i->value[0].c_str(), NULL);
+
+			} else if (i->string_key.compare("trace-out") == 0) {
+				assert(i->value.size() != 0);
+				strTraceOut = i->value[0];
+
+			} else if (i->string_key.compare("trace-summary") == 0) {
+				traceSummary = true;
+
+			} else if (i->string_key.compare("metrics-file") == 0) {
+				assert(i->value.size() != 0);
+				strMetricsFile = i->value[0];
+
+			} else if (i->string_key.compare("metrics-listen") == 0) {
+				assert(i->value.size() != 0);
+				strMetricsListen = i->value[0];
+
+			} else if (i->string_key.compare("max-rate") == 0) {
+				assert(i->value.size() != 0);
+				throttle.maxRate = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("adaptive-rate") == 0) {
+				throttle.adaptive = true;
+
+			} else if (i->string_key.compare("max-load") == 0) {
+				assert(i->value.size() != 0);
+				throttle.maxLoad = strtod(i->value[0].c_str(), NULL);
+
+			} else if (i->string_key.compare("retries") == 0) {
+				assert(i->value.size() != 0);
+				retryPolicy.attempts = strtoul(i->value[0].c_str(), NULL, 10) + 1;
+
+			} else if (i->string_key.compare("retry-delay") == 0) {
+				assert(i->value.size() != 0);
+				retryPolicy.baseDelay = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("retry-max-delay") == 0) {
+				assert(i->value.size() != 0);
+				retryPolicy.maxDelay = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("timeout") == 0) {
+				assert(i->value.size() != 0);
+				retryPolicy.timeout = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("breaker-threshold") == 0) {
+				assert(i->value.size() != 0);
+				breakerThreshold = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("breaker-cooldown") == 0) {
+				assert(i->value.size() != 0);
+				breakerCooldown = strtoul(i->value[0].c_str(), NULL, 10);
+
+			} else if (i->string_key.compare("progress") == 0) {
+				assert(i->value.size() != 0);
+				if (!ProgressMonitor::parseMode(i->value[0], &progressMode)) {
+					std::cerr << PROGNAME ": --progress must be bar, json, none or auto"
+						<< std::endl;
+					return RET_BADARGS;
+				}
+
+			} else if (i->string_key.compare("progress-interval") == 0) {
+				assert(i->value.size() != 0);
+				progressInterval = strtoul(i->value[0].c_str(), NULL, 10);
+				if (progressInterval == 0) progressInterval = 1;
+
+			} else if (i->string_key.compare("snapshot-dir") == 0) {
+				assert(i->value.size() != 0);
+				strSnapshotDir = i->value[0];
+
+			} else if (i->string_key.compare("archive-dir") == 0) {
+				assert(i->value.size() != 0);
+				strArchiveDir = i->value[0];
+
+			} else if (i->string_key.compare("dump-format") == 0) {
+				assert(i->value.size() != 0);
+				if (i->value[0].compare("raw") == 0) {
+					sparseDumps = false;
+				} else if (i->value[0].compare("sparse") == 0) {
+					sparseDumps = true;
+				} else {
+					std::cerr << PROGNAME ": --dump-format must be raw or sparse"
+						<< std::endl;
+					return RET_BADARGS;
+				}
+
+			} else if (i->string_key.compare("expand-dump") == 0) {
+				assert(i->value.size() != 0);
+				std::ifstream infile(i->value[0].c_str(), std::ios::in | std::ios::binary);
+				if (!infile.is_open()) {
+					std::cerr << PROGNAME ": unable to open " << i->value[0] << std::endl;
+					return RET_BADARGS;
+				}
+				try {
+					SparseReader sparse(infile);
+					sparse.expand(std::cout);
+					std::cout.flush();
+				} catch (const std::string& err) {
+					std::cerr << PROGNAME ": " << i->value[0] << ": " << err << std::endl;
+					return RET_SHOWSTOPPER;
+				}
+				return RET_OK;
+
+			} else if (i->string_key.compare("analyse-dump") == 0) {
+				assert(i->value.size() != 0);
+				FirmwareLayout layout;
+				try {
+					analyseFile(i->value[0], &layout);
+				} catch (const std::string& err) {
+					std::cerr << PROGNAME ": " << err << std::endl;
+					return RET_SHOWSTOPPER;
+				}
+				printLayout(layout);
+				return RET_OK;
+
+			} else if (i->string_key.compare("list-files") == 0) {
+				assert(i->value.size() != 0);
+				strListFiles = i->value[0];
+
+			} else if (i->string_key.compare("extract-files") == 0) {
+				assert(i->value.size() != 0);
+				strExtractFiles = i->value[0];
+
+			} else if (i->string_key.compare("extract-path") == 0) {
+				assert(i->value.size() != 0);
+				extractPaths.push_back(i->value[0]);
+
+			} else if (i->string_key.compare("extract-dir") == 0) {
+				assert(i->value.size() != 0);
+				strExtractDir = i->value[0];
+
+			} else if (i->string_key.compare("catalog") == 0) {
+				assert(i->value.size() != 0);
+				strCatalog = i->value[0];
+
+			} else if (i->string_key.compare("catalog-add") == 0) {
+				assert(i->value.size() != 0);
+				catalogAdd.push_back(i->value[0]);
+
+			} else if (i->string_key.compare("catalog-name") == 0) {
+				assert(i->value.size() != 0);
+				strCatalogName = i->value[0];
+
+			} else if (i->string_key.compare("match-dump") == 0) {
+				assert(i->value.size() != 0);
+				strMatchDump = i->value[0];
+
+			} else if (i->string_key.compare("match-count") == 0) {
+				assert(i->value.size() != 0);
+				matchCount = strtoul(i->value[0].c_str(), NULL, 10);
+				if (matchCount == 0) matchCount = 1;
+
+			} else if (i->string_key.compare("restore-archive") == 0) {
+				assert(i->value.size() != 0);
+				strRestore = i->value[0];
+
+			} else if (i->string_key.compare("repack") == 0) {
+				assert(i->value.size() != 0);
+				strRepack = i->value[0];
+
+			} else if (i->string_key.compare("overlay") == 0) {
+				assert(i->value.size() != 0);
+				strOverlay = i->value[0];
+
+			} else if (i->string_key.compare("mtd-layout") == 0) {
+				assert(i->value.size() != 0);
+				strMtdLayout = i->value[0];
+
+			} else if (i->string_key.compare("repack-out") == 0) {
+				assert(i->value.size() != 0);
+				strRepackOut = i->value[0];
+
+			} else if (i->string_key.compare("batch") == 0) {
+				assert(i->value.size() != 0);
+				strBatch = i->value[0];
+
+			} else if (
+				(i->string_key.compare("j") == 0) ||
+				(i->string_key.compare("jobs") == 0)
+			) {
+				assert(i->value.size() != 0);
+				batchConfig.threads = strtoul(i->value[0].c_str(), NULL, 10);
+				daemonConfig.threads = batchConfig.threads;
+
+			} else if (i->string_key.compare("batch-out") == 0) {
+				assert(i->value.size() != 0);
+				strBatchOut = i->value[0];
+
+			} else if (i->string_key.compare("batch-state") == 0) {
+				assert(i->value.size() != 0);
+				batchConfig.stateFile = i->value[0];
+
+			} else if (i->string_key.compare("daemon") == 0) {
+				assert(i->value.size() != 0);
+				strDaemon = i->value[0];
+
+			} else if (i->string_key.compare("poll-interval") == 0) {
+				assert(i->value.size() != 0);
+				daemonConfig.interval = strtoul(i->value[0].c_str(), NULL, 10);
+				if (daemonConfig.interval == 0) daemonConfig.interval = 1;
+
+			} else if (i->string_key.compare("poll-jitter") == 0) {
+				assert(i->value.size() != 0);
+				daemonConfig.jitter = strtoul(i->value[0].c_str(), NULL, 10);
+				if (daemonConfig.jitter > 100) daemonConfig.jitter = 100;
+
+			} else if (i->string_key.compare("listen") == 0) {
+				assert(i->value.size() != 0);
+				strListen = i->value[0];
+
+			}
+		}
+
+		if (!strListFiles.empty()) {
+			return readFilesystems(strListFiles, NULL, std::string());
+		}
+		if (!strExtractFiles.empty()) {
+			return readFilesystems(strExtractFiles, &extractPaths, strExtractDir);
+		}
+		if (!catalogAdd.empty()) {
+			if (!strCatalogName.empty() && (catalogAdd.size() > 1)) {
+				std::cerr << PROGNAME ": --catalog-name can only be used with one "
+					"--catalog-add" << std::endl;
+				return RET_BADARGS;
+			}
+			return addToCatalog(strCatalog, catalogAdd, strCatalogName);
+		}
+		if (!strMatchDump.empty()) {
+			return matchDump(strCatalog, strMatchDump, matchCount);
+		}
+		if (!strRepack.empty()) {
+			if (strOverlay.empty() || strRepackOut.empty()) {
+				std::cerr << PROGNAME ": --repack needs --overlay and --repack-out"
+					<< std::endl;
+				return RET_BADARGS;
+			}
+			return repackDump(strRepack, strOverlay, strMtdLayout, strRepackOut);
+		}
+		if (inventoryQuery) {
+			return queryInventory(strInventory, strInventoryQuery);
+		}
+		if (!strRestore.empty()) {
+			// Needs no device, so done once --archive-dir is known
+			try {
+				ChunkArchive archive(strArchiveDir);
+				archive.restore(strRestore, std::cout);
+				std::cout.flush();
+			} catch (const std::string& err) {
+				std::cerr << PROGNAME ": " << err << std::endl;
+				return RET_SHOWSTOPPER;
 			}
+			return RET_OK;
+		}
+
+		if (
+			strHost.empty() && strSerial.empty() && discoverRanges.empty()
+			&& strReplay.empty() && strBatch.empty() && strDaemon.empty()
+		) {
+			std::cerr << PROGNAME << ": a hostname, serial port, --discover range, "
+				"--batch manifest or --daemon registry must be specified." << std::endl;
+			return RET_BADARGS;
+		}
+
+		TraceOutput traceOutput(strTraceOut, traceSummary);
+		ProgressMonitor progress(progressMode, progressInterval, std::cerr);
+
+		boost::shared_ptr<HttpServer> metricsServer;
+		if (!strMetricsListen.empty()) {
+			metricsServer.reset(startServer(strMetricsListen, serveMetrics));
 		}
 
-		if (strHost.empty() && strSerial.empty()) {
-			std::cerr << PROGNAME << ": a hostname or serial port must be specified." << std::endl;
+		boost::shared_ptr<CaptureWriter> record;
+		boost::shared_ptr<CaptureReader> replay;
+		try {
+			if (!strRecord.empty()) record.reset(new CaptureWriter(strRecord));
+			if (!strReplay.empty()) replay.reset(new CaptureReader(strReplay, replaySpeed));
+		} catch (const std::string& err) {
+			std::cerr << PROGNAME ": " << err << std::endl;
 			return RET_BADARGS;
 		}
 
@@ -484,89 +1476,152 @@ int main(int argc, char *argv[])
 			serial.open(strSerial);
 			serial.set_option(boost::asio::serial_port::baud_rate(115200));
 		}
-		Network network(strHost);
-
-		// Run through the actions on the command line
-		for (std::vector<po::option>::iterator i = pa.options.begin(); i != pa.options.end(); i++) {
-			if (i->string_key.compare("identify") == 0) {
-				Identify id(&network, &serial);
-				strType = id.getType();
-				std::cout << "device_type=";
-				if (strType.empty()) {
-					std::cout << "unknown" << std::endl;
-					std::cerr << "Unable to identify device!" << std::endl;
-				} else {
-					std::cout << strType << std::endl;
-				}
+		IdentifyCache cache(strCache, cacheTTL);
+		IdentifyCache *pCache = useCache ? &cache : NULL;
+		boost::scoped_ptr<InventoryStore> inventory;
+		if (useInventory) {
+			try {
+				inventory.reset(new InventoryStore(strInventory));
+			} catch (const std::string& err) {
+				if (verbose) std::cerr << "[inventory] " << err << std::endl;
+			}
+		}
+		CircuitBreaker breaker(breakerThreshold, breakerCooldown);
 
-			} else if (i->string_key.compare("dump-firmware") == 0) {
-				Device *dev = openDevice(strType, &network, &serial);
-				if (!dev) {
-					std::cerr << PROGNAME ": --type missing or invalid." << std::endl;
-					return RET_BADARGS;
-				}
-				const std::string& strFilename = i->value[0];
-				std::ofstream outfile(strFilename.c_str(),
-					std::ios::out | std::ios::trunc | std::ios::binary);
+		if (!strDaemon.empty()) {
+			std::vector<RegistryEntry> entries;
+			try {
+				std::ifstream registry(strDaemon.c_str());
+				if (!registry.is_open()) throw "unable to open " + strDaemon;
+				readRegistry(registry, &entries);
+			} catch (const std::string& err) {
+				std::cerr << PROGNAME ": " << err << std::endl;
+				return RET_BADARGS;
+			}
+			daemonConfig.type = strType;
+			daemonConfig.ports = ports;
+			daemonConfig.username = strUsername;
+			daemonConfig.password = strPassword;
+			daemonConfig.cache = pCache;
+			daemonConfig.retry = retryPolicy;
+			daemonConfig.breaker = &breaker;
+			Daemon daemon(daemonConfig);
+			for (std::vector<RegistryEntry>::const_iterator i = entries.begin();
+				i != entries.end(); i++
+			) {
+				daemon.add(*i);
+			}
+			boost::scoped_ptr<HttpServer> server(startServer(strListen,
+				boost::bind(serveDaemon, &daemon, _1, _2)));
+			std::cerr << PROGNAME ": polling " << entries.size() << " device(s), "
+				"serving on port " << server->port() << std::endl;
+			daemon.run();
+			return RET_OK;
+		}
 
-				std::vector<uint8_t> firmware;
-				fn_progress fnProg
-					= boost::bind(showProgress, "Downloading firmware", _1, _2);
-				try {
-					dev->getFirmware(outfile, fnProg);
-				} catch (const std::string& err) {
-					std::cerr << "Download failed: " << err
-						<< std::endl;
+		if (!strBatch.empty()) {
+			std::vector<BatchJob> jobs;
+			try {
+				if (strBatch.compare("-") == 0) {
+					readManifest(std::cin, &jobs);
+				} else {
+					std::ifstream manifest(strBatch.c_str());
+					if (!manifest.is_open()) throw "unable to open " + strBatch;
+					readManifest(manifest, &jobs);
 				}
-				outfile.close();
-				std::cout << "Saved to " << strFilename << std::endl;
-
-			} else if (i->string_key.compare("query") == 0) {
-				Device *dev = openDevice(strType, &network, &serial);
-				if (!dev) {
-					std::cerr << PROGNAME ": --type missing or invalid." << std::endl;
+			} catch (const std::string& err) {
+				std::cerr << PROGNAME ": " << err << std::endl;
+				return RET_BADARGS;
+			}
+			std::ofstream batchFile;
+			if (!strBatchOut.empty()) {
+				batchFile.open(strBatchOut.c_str(), std::ios::out | std::ios::trunc);
+				if (!batchFile.is_open()) {
+					std::cerr << PROGNAME ": unable to open " << strBatchOut << std::endl;
 					return RET_BADARGS;
 				}
-				bool known_model = false;
-				try {
-					unsigned long lenFlash;
-					dev->getFlashInfo(&lenFlash);
-					std::cout << "flash_size=" << lenFlash << std::endl;
-
-					unsigned short idVendor, idProduct;
-					unsigned char bInterfaceClass;
-					dev->getCameraInfo(&idVendor, &idProduct, &bInterfaceClass);
-					std::cout << std::hex
-						<< "camera_usb_vendor=" << std::setw(4) << std::setfill('0') << idVendor
-						<< "\ncamera_usb_product=" << std::setw(4) << std::setfill('0') << idProduct
-						<< "\ncamera_usb_class=" << std::setw(2) << std::setfill('0') << (unsigned int)bInterfaceClass
-						<< std::endl;
+			}
+			batchConfig.type = strType;
+			batchConfig.ports = ports;
+			batchConfig.username = strUsername;
+			batchConfig.password = strPassword;
+			batchConfig.cache = pCache;
+			batchConfig.inventory = inventory.get();
+			batchConfig.record = record.get();
+			batchConfig.replay = replay.get();
+			batchConfig.progress = &progress;
+			batchConfig.throttle = throttle;
+			batchConfig.retry = retryPolicy;
+			batchConfig.breaker = &breaker;
+			unsigned long failures;
+			{
+				Batch batch(batchConfig, strBatchOut.empty() ? std::cout : batchFile);
+				failures = batch.run(jobs);
+			}
+			writeMetrics(strMetricsFile);
+			if (failures) {
+				std::cerr << PROGNAME ": " << failures << " action(s) failed" << std::endl;
+				return RET_SHOWSTOPPER;
+			}
+			return RET_OK;
+		}
 
-					std::cout << "model=" << strType << "-";
-					if ((lenFlash == 0x400000) && (idVendor == 0x0c45) && (idProduct == 0x6360)) {
-						std::cout << "1.0";
-						known_model = true;
-					} else {
-						std::cout << "ver_unknown";
-					}
-					std::cout << "\n";
+		if (replay && strHost.empty()) {
+			std::vector<std::string> hosts = replay->hosts();
+			for (std::vector<std::string>::const_iterator i = hosts.begin(); i != hosts.end(); i++) {
+				if (hosts.size() > 1) std::cout << "host=" << *i << std::endl;
+				int ret = runActions(pa.options, *i, strType, ports, strUsername,
+					strPassword, &serial, NULL,
+					NULL, replay.get(), &progress, throttle,
+					retryPolicy, &breaker, strSnapshotDir, sparseDumps,
+					strArchiveDir, strCatalog, matchCount, NULL);
+				writeMetrics(strMetricsFile);
+				if (ret != RET_OK) return ret;
+			}
+			return RET_OK;
+		}
 
-					std::cout << "fwid=" << strType << "-" << (lenFlash >> 20) << "mb-";
-					if (bInterfaceClass == 0x0e) std::cout << "uvc";
-					else std::cout << "unknown_image_sensor";
-					std::cout << "\n";
+		if (discoverRanges.empty()) {
+			int ret = runActions(pa.options, strHost, strType, ports, strUsername,
+				strPassword, &serial, pCache,
+				record.get(), replay.get(), &progress, throttle,
+				retryPolicy, &breaker, strSnapshotDir, sparseDumps,
+					strArchiveDir, strCatalog, matchCount, inventory.get());
+			writeMetrics(strMetricsFile);
+			return ret;
+		}
 
-					if (!known_model) {
-						std::cerr << "\n\n >>> This camera is an unknown model!  Please get in "
-							"touch!\nhttp://www.openipcam.com/forum/\n" << std::endl;
-					}
-				} catch (const std::string& err) {
-					std::cerr << "Device query failed: " << err
-						<< std::endl;
-				}
+		Discover discover(discoverRate, discoverPending, discoverTimeout);
+		for (std::vector<std::string>::const_iterator i = discoverRanges.begin();
+			i != discoverRanges.end(); i++
+		) {
+			try {
+				discover.addRange(*i);
+			} catch (const std::string& err) {
+				std::cerr << PROGNAME ": " << err << std::endl;
+				return RET_BADARGS;
+			}
+		}
+		std::vector<std::string> found;
+		discover.run(boost::bind(foundHost, &found, _1, _2));
 
+		// Only hosts with open ports go on to the other actions
+		for (std::vector<std::string>::const_iterator i = found.begin(); i != found.end(); i++) {
+			std::cout << "host=" << *i << std::endl;
+			try {
+				int ret = runActions(pa.options, *i, strType, ports, strUsername,
+					strPassword, &serial, pCache,
+					record.get(), replay.get(), &progress, throttle,
+					retryPolicy, &breaker, strSnapshotDir, sparseDumps,
+					strArchiveDir, strCatalog, matchCount, inventory.get());
+				writeMetrics(strMetricsFile);
+				if (ret != RET_OK) return ret;
+			} catch (const boost::system::system_error& e) {
+				std::cerr << PROGNAME ": " << *i << ": " << e.what() << std::endl;
+				writeMetrics(strMetricsFile);
 			}
-		} // for (all command line elements)
+		}
+
 
 	} catch (const po::unknown_option& e) {
 		std::cerr << PROGNAME ": " << e.what()
@@ -579,9 +1634,8 @@ int main(int argc, char *argv[])
 		return RET_BADARGS;
 
 	} catch (const boost::system::system_error& e) {
-		std::cerr << PROGNAME ": " << e.what()
-			<< ".  Use --help for help." << std::endl;
-		return RET_BADARGS;
+		std::cerr << PROGNAME ": " << e.what() << std::endl;
+		return RET_SHOWSTOPPER;
 	}
 
 	return RET_OK;
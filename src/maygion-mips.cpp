@@ -18,146 +18,576 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <sstream>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include "checksum.hpp"
 #include "main.hpp"
 #include "maygion-mips.hpp"
+#include "metrics.hpp"
+#include "parse.hpp"
+#include "probes.hpp"
+#include "trace.hpp"
+
+/// Name the firmware image is staged under in /tmp before it is written.
+#define FLASH_IMAGE_NAME "camtickler-fw.bin"
+
+/// Erase blocks written and verified by each shell command.
+#define FLASH_BLOCKS_PER_COMMAND 8
+
+/// Number of times a block that fails verification is written again.
+#define FLASH_BLOCK_RETRIES 2
+
+/// Erase blocks checksummed by each shell command when looking for changes.
+#define FLASH_HASHES_PER_COMMAND 32
+
+/// Longest command typed at the shell prompt.  Busybox cuts off lines of
+/// more than about 1 kB, so longer ones are run from a script instead.
+#define SHELL_MAX_COMMAND 200
+
+/// Name a command too long for the prompt is saved under in /tmp.
+#define SHELL_SCRIPT_NAME "camtickler.sh"
 
 maygion_mips::maygion_mips(Network *network)
-	: network(network)
+	: network(network),
+	  markers(0)
 {
 }
 
 maygion_mips::~maygion_mips()
 {
+	if (this->shell) this->closeShell(this->shell);
 }
 
-void showProgress(unsigned long realTotal, fn_progress fnProgress,
-	unsigned long amount, unsigned long total)
+/// State shared with the progress callback while the firmware is downloaded.
+struct maygion_mips::DumpState
 {
-	if (total != (unsigned long)-1) total = realTotal;
-	fnProgress(amount, total);
-	return;
-}
+	DumpState()
+		: realTotal(0),
+		  received(0),
+		  controller(NULL)
+	{
+	}
+
+	unsigned long realTotal;   ///< Size of the flash
+	unsigned long received;    ///< Bytes downloaded so far
+	fn_progress fnProgress;    ///< Caller's progress callback
+
+	LoadController *controller;              ///< NULL unless throttling adaptively
+	boost::posix_time::ptime nextPoll;
+};
 
 void maygion_mips::getFirmware(std::ostream& target, fn_progress fnProgress)
 {
-	if (!this->network->ftp_login("MayGion", "maygion.com")) {
-		throw std::string("Unable to log in to device via FTP.");
+	metrics.dumps.add();
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	const ThrottleConfig& throttle = this->network->throttle();
+	TokenBucket bucket(throttle.maxRate);
+	DumpState state;
+	state.fnProgress = fnProgress;
+	try {
+		if (!this->network->ftp_login("MayGion", "maygion.com")) {
+			throw std::string("Unable to log in to device via FTP.");
+		}
+		this->getFlashInfo(&state.realTotal);
+
+		boost::scoped_ptr<LoadController> controller;
+		if (throttle.adaptive) {
+			controller.reset(new LoadController(throttle, &bucket,
+				this->network->hostname()));
+			state.controller = controller.get();
+
+			// Measure the traffic the device sends on its own before adding ours
+			if (verbose) std::cerr << "[throttle] Measuring device load before "
+				"downloading" << std::endl;
+			this->pollLoad(&state);
+			if (state.controller) {
+				boost::this_thread::sleep(boost::posix_time::milliseconds(
+					throttle.pollInterval));
+				this->pollLoad(&state);
+			}
+		}
+
+		fn_progress fnDumpProgress = boost::bind(&maygion_mips::onDumpProgress,
+			this, &state, _1, _2);
+		if (!this->network->ftp_get(target, "/dev", "mtdblock0", fnDumpProgress,
+			&bucket)
+		) {
+			throw std::string("Unable to download mtdblock0 via FTP.");
+		}
+	} catch (...) {
+		metrics.dumpFailures.add();
+		metrics.dumpBytes.add(state.received);
+		throw;
 	}
-	unsigned long lenFlash = 0;
-	this->getFlashInfo(&lenFlash);
-	fn_progress fnFixedSizeProgress = boost::bind(showProgress, lenFlash, fnProgress, _1, _2);
-	this->network->ftp_get(target, "/dev", "mtdblock0", fnFixedSizeProgress);
+	metrics.dumpBytes.add(state.received);
+	double elapsed = (boost::posix_time::microsec_clock::universal_time() - start)
+		.total_microseconds() / 1000000.0;
+	metrics.dumpTime.observe(elapsed);
+	if (elapsed > 0) metrics.dumpThroughput.observe(state.received / elapsed);
 	return;
 }
 
 void maygion_mips::getFlashInfo(unsigned long *length)
 {
-	boost::asio::io_service tcp_service;
-	boost::shared_ptr<boost::asio::ip::tcp::socket> telnet
-		= this->network->tcp_connect("telnet", &tcp_service);
-
-	boost::asio::streambuf response;
-	std::istream response_stream(&response);
-	boost::asio::streambuf request;
-	std::ostream request_stream(&request);
-
-	size_t read;
-	if (verbose > 1) std::cerr << "Waiting for prompt..." << std::flush;
-	read = boost::asio::read_until(*telnet, response, "# ");
-	response.consume(read);
-	if (verbose > 1) std::cerr << "ok.\n";
-
+	MTDPartition mtd0 = this->flashPartition();
+	*length = mtd0.size;
+	if (verbose) std::cerr << "mtd0 size of 0x" << std::hex << *length
+		<< std::dec << " == " << *length << " bytes" << std::endl;
+	return;
+}
 
-	if (verbose > 1) std::cerr << "Sending cat command" << std::endl;
-	request_stream << "cat /proc/mtd\r\n";
-	boost::asio::write(*telnet, request);
+void maygion_mips::getBlockChecksums(unsigned long blockSize,
+	std::vector<uint32_t> *sums)
+{
+	MTDPartition mtd = this->flashPartition();
+	unsigned long blocks = mtd.size / blockSize;
+	sums->clear();
+	for (unsigned long first = 0; first < blocks; first += FLASH_HASHES_PER_COMMAND) {
+		unsigned long last = std::min(first + FLASH_HASHES_PER_COMMAND, blocks);
+		std::stringstream cmd;
+		for (unsigned long b = first; b < last; b++) {
+			if (b != first) cmd << "; ";
+			cmd << readBlockCommand(mtd, blockSize, b);
+		}
+		std::istringstream result(this->command(cmd.str(), true));
+		for (unsigned long b = first; b < last; b++) {
+			unsigned long crc = 0, len = 0;
+			if (!(result >> crc >> len) || (len != blockSize)) {
+				throw std::string("Unable to checksum the flash.");
+			}
+			sums->push_back(crc);
+		}
+	}
+	return;
+}
 
-	// Read back what we just typed as that's just before the content
-	if (verbose > 1) std::cerr << "Waiting for ack..." << std::flush;
-	read = boost::asio::read_until(*telnet, response, "/proc/mtd\r\n");
-	response.consume(read);
-	if (verbose > 1) std::cerr << "ok.\nChecking result..." << std::flush;
+void maygion_mips::getCameraInfo(unsigned short *idVendor,
+	unsigned short *idProduct, unsigned char *bInterfaceClass)
+{
+	std::istringstream response_stream(this->command(
+		"cat /sys/class/video4linux/video0/device/../idVendor ; "
+		"cat /sys/class/video4linux/video0/device/../idProduct ; "
+		"cat /sys/class/video4linux/video0/device/bInterfaceClass", true));
 
-	boost::asio::read_until(*telnet, response, "# ");
 	std::string token;
 	response_stream >> token;
-	if (token.compare("dev:") != 0) {
-		throw std::string("Unable to get MTD info.");
-	}
-	if (verbose > 1) std::cerr << "ok.\nExamining data..." << std::endl;
-	std::getline(response_stream, token);
+	*idVendor = strtoul(token.c_str(), NULL, 16);
 
 	response_stream >> token;
-	if (token.compare("mtd0:") != 0) {
-		throw std::string("mtdblock0 doesn't exist!");
-	}
+	*idProduct = strtoul(token.c_str(), NULL, 16);
+
 	response_stream >> token;
-	*length = strtoul(token.c_str(), NULL, 16);
-	if (verbose) std::cerr << "mtd0 size of " << token << " == " << *length
-		<< " bytes" << std::endl;
-	response.consume(response.size());
+	*bInterfaceClass = strtoul(token.c_str(), NULL, 16);
+	return;
+}
 
-	if (verbose > 1) std::cerr << "Done." << std::endl;
+/// Pass on upload progress as the first part of the whole flash operation.
+static void uploadProgress(fn_progress fnProgress, unsigned long total,
+	unsigned long amount, unsigned long uploadTotal)
+{
+	if (fnProgress && (uploadTotal != (unsigned long)-1)) fnProgress(amount, total);
+	return;
+}
 
-	// Logout to avoid lingering shells
-	request_stream.write("\x03\x1A", 2);
-	boost::asio::write(*telnet, request);
+unsigned long maygion_mips::putFirmware(std::istream& source, bool onlyChanged,
+	fn_progress fnProgress)
+{
+	metrics.flashes.add();
+	try {
+		std::stringstream ss;
+		ss << source.rdbuf();
+		const std::string image = ss.str();
 
-	telnet->close();
+		// Only write an image made for exactly this flash layout
+		MTDPartition mtd0 = this->flashPartition();
+		if (image.length() != mtd0.size) {
+			std::stringstream err;
+			err << "Image is " << image.length() << " bytes but the flash is "
+				<< mtd0.size << " bytes, refusing to write it.";
+			throw err.str();
+		}
+		if ((mtd0.eraseSize == 0) || (mtd0.size % mtd0.eraseSize != 0)) {
+			throw std::string("Flash erase block size is not usable, refusing to "
+				"write.");
+		}
+		unsigned long blocks = mtd0.size / mtd0.eraseSize;
+
+		std::vector<unsigned long> todo;
+		if (onlyChanged) {
+			this->changedBlocks(mtd0, image, &todo);
+			metrics.flashBlocksSkipped.add(blocks - todo.size());
+			if (verbose) std::cerr << "[flash] " << todo.size() << " of " << blocks
+				<< " erase blocks differ" << std::endl;
+			if (todo.empty()) {
+				if (fnProgress) fnProgress(0, -1);
+				return 0;
+			}
+		} else {
+			for (unsigned long b = 0; b < blocks; b++) todo.push_back(b);
+		}
+
+		// Only the blocks being written are sent, one after the other, so
+		// block todo[n] is at offset n in the staged file.
+		std::string staged;
+		staged.reserve(todo.size() * mtd0.eraseSize);
+		for (std::vector<unsigned long>::const_iterator b = todo.begin(); b != todo.end(); b++) {
+			staged.append(image, *b * mtd0.eraseSize, mtd0.eraseSize);
+		}
+		unsigned long total = staged.length() * 2; // upload, then write
+
+		// Stage the image in tmpfs, then check it arrived intact before any of
+		// the flash is touched.
+		if (!this->network->ftp_login("MayGion", "maygion.com")) {
+			throw std::string("Unable to log in to device via FTP.");
+		}
+		TokenBucket bucket(this->network->throttle().maxRate);
+		std::istringstream upload(staged);
+		if (!this->network->ftp_put(upload, "/tmp", FLASH_IMAGE_NAME,
+			boost::bind(uploadProgress, fnProgress, total, _1, _2), &bucket)
+		) {
+			throw std::string("Unable to upload firmware via FTP.");
+		}
+		std::istringstream check(this->command("cksum /tmp/" FLASH_IMAGE_NAME,
+			true));
+		unsigned long crc = 0, len = 0;
+		check >> crc >> len;
+		if ((crc != posix_cksum(staged.data(), staged.length())) || (len != staged.length())) {
+			throw std::string("Uploaded image is corrupted, flash not modified.");
+		}
+
+		// Write and read back each erase block in turn, several to a command so
+		// the round trips don't dominate.  A block is verified straight after
+		// it is written, so a bad block is found without a second pass over
+		// the whole flash.  Writes are never sent twice; if the session drops
+		// part way through, the blocks are checksummed again on a new session
+		// and any that didn't make it are rewritten with the bad ones.
+		std::string blockDev = "/dev/mtdblock" + mtd0.dev.substr(3);
+		std::vector<unsigned long> bad;
+		for (unsigned long first = 0; first < todo.size(); first += FLASH_BLOCKS_PER_COMMAND) {
+			unsigned long last = std::min(first + FLASH_BLOCKS_PER_COMMAND, todo.size());
+			std::stringstream cmd;
+			for (unsigned long n = first; n < last; n++) {
+				if (n != first) cmd << "; ";
+				cmd << writeBlockCommand(blockDev, mtd0, n, todo[n]);
+			}
+			std::vector<unsigned long> failed;
+			try {
+				std::istringstream result(this->command(cmd.str(), false));
+				for (unsigned long n = first; n < last; n++) {
+					if (!blockMatches(result, image, mtd0.eraseSize, todo[n])) {
+						failed.push_back(n);
+					}
+				}
+			} catch (const boost::system::system_error& e) {
+				if (verbose) std::cerr << "[flash] Session lost while writing ("
+					<< e.what() << "), checking the blocks again" << std::endl;
+				this->recheckBlocks(mtd0, image, todo, first, last, &failed);
+			}
+			for (std::vector<unsigned long>::const_iterator n = failed.begin(); n != failed.end(); n++) {
+				if (verbose) std::cerr << "[flash] Block " << todo[*n]
+					<< " did not verify, will rewrite" << std::endl;
+			}
+			bad.insert(bad.end(), failed.begin(), failed.end());
+			if (fnProgress) fnProgress(staged.length() + last * mtd0.eraseSize, total);
+		}
+
+		for (std::vector<unsigned long>::const_iterator n = bad.begin(); n != bad.end(); n++) {
+			bool ok = false;
+			for (unsigned int attempt = 0; !ok && (attempt < FLASH_BLOCK_RETRIES); attempt++) {
+				metrics.flashBlockRetries.add();
+				try {
+					std::istringstream result(this->command(
+						writeBlockCommand(blockDev, mtd0, *n, todo[*n]), false));
+					ok = blockMatches(result, image, mtd0.eraseSize, todo[*n]);
+				} catch (const boost::system::system_error&) {
+					std::vector<unsigned long> failed;
+					this->recheckBlocks(mtd0, image, todo, *n, *n + 1, &failed);
+					ok = failed.empty();
+				}
+			}
+			if (!ok) {
+				std::stringstream err;
+				err << "Flash block " << todo[*n] << " (offset 0x" << std::hex
+					<< todo[*n] * mtd0.eraseSize << ") failed verification.  Do not "
+					"reboot the device; the blocks being written are still in /tmp/"
+					FLASH_IMAGE_NAME " to try again.";
+				throw err.str();
+			}
+		}
+
+		try {
+			this->command("rm /tmp/" FLASH_IMAGE_NAME, false);
+		} catch (const boost::system::system_error& e) {
+			// The flash is written, so only tmpfs is left holding the image
+			std::cerr << "Unable to remove /tmp/" FLASH_IMAGE_NAME " from the "
+				"device: " << e.what() << std::endl;
+		}
+		metrics.flashBlocksWritten.add(todo.size());
+		if (fnProgress) fnProgress(total, -1);
+		return todo.size();
+	} catch (...) {
+		metrics.flashFailures.add();
+		throw;
+	}
+}
+
+void maygion_mips::changedBlocks(const MTDPartition& mtd, const std::string& image,
+	std::vector<unsigned long> *changed)
+{
+	// Checksum each block on the device through the character device, which
+	// reads the flash itself rather than anything cached, then compare with
+	// the same block of the image.  A cksum line is tiny, so many blocks go
+	// in each command.
+	unsigned long blocks = mtd.size / mtd.eraseSize;
+	for (unsigned long first = 0; first < blocks; first += FLASH_HASHES_PER_COMMAND) {
+		unsigned long last = std::min(first + FLASH_HASHES_PER_COMMAND, blocks);
+		std::stringstream cmd;
+		for (unsigned long b = first; b < last; b++) {
+			if (b != first) cmd << "; ";
+			cmd << readBlockCommand(mtd, mtd.eraseSize, b);
+		}
+		std::istringstream result(this->command(cmd.str(), true));
+		for (unsigned long b = first; b < last; b++) {
+			if (!blockMatches(result, image, mtd.eraseSize, b)) changed->push_back(b);
+		}
+	}
 	return;
 }
 
-void maygion_mips::getCameraInfo(unsigned short *idVendor,
-	unsigned short *idProduct, unsigned char *bInterfaceClass)
+void maygion_mips::recheckBlocks(const MTDPartition& mtd,
+	const std::string& image, const std::vector<unsigned long>& todo,
+	unsigned long first, unsigned long last, std::vector<unsigned long> *bad)
+{
+	std::stringstream cmd;
+	for (unsigned long n = first; n < last; n++) {
+		if (n != first) cmd << "; ";
+		cmd << readBlockCommand(mtd, mtd.eraseSize, todo[n]);
+	}
+	std::istringstream result(this->command(cmd.str(), true));
+	for (unsigned long n = first; n < last; n++) {
+		if (!blockMatches(result, image, mtd.eraseSize, todo[n])) bad->push_back(n);
+	}
+	return;
+}
+
+std::string maygion_mips::writeBlockCommand(const std::string& blockDev,
+	const MTDPartition& mtd, unsigned long staged, unsigned long block)
 {
-	boost::asio::io_service tcp_service;
-	boost::shared_ptr<boost::asio::ip::tcp::socket> telnet
-		= this->network->tcp_connect("telnet", &tcp_service);
+	// Write through the block device, which erases as needed, then read back
+	// through the character device so nothing comes from the mtdblock cache.
+	std::stringstream cmd;
+	cmd << "dd if=/tmp/" FLASH_IMAGE_NAME " of=" << blockDev << " bs="
+		<< mtd.eraseSize << " skip=" << staged << " seek=" << block
+		<< " count=1 2>/dev/null; " << readBlockCommand(mtd, mtd.eraseSize, block);
+	return cmd.str();
+}
 
-	boost::asio::streambuf response;
-	std::istream response_stream(&response);
-	boost::asio::streambuf request;
-	std::ostream request_stream(&request);
+std::string maygion_mips::readBlockCommand(const MTDPartition& mtd,
+	unsigned long blockSize, unsigned long block)
+{
+	std::stringstream cmd;
+	cmd << "dd if=/dev/" << mtd.dev << " bs=" << blockSize << " skip=" << block
+		<< " count=1 2>/dev/null | cksum";
+	return cmd.str();
+}
 
-	size_t read;
-	if (verbose > 1) std::cerr << "Waiting for prompt..." << std::flush;
-	read = boost::asio::read_until(*telnet, response, "# ");
-	response.consume(read);
-	if (verbose > 1) std::cerr << "ok.\n";
+bool maygion_mips::blockMatches(std::istream& result, const std::string& image,
+	unsigned long eraseSize, unsigned long block)
+{
+	unsigned long crc = 0, len = 0;
+	if (!(result >> crc >> len)) return false;
+	return (len == eraseSize)
+		&& (crc == posix_cksum(image.data() + block * eraseSize, eraseSize));
+}
 
+std::string maygion_mips::getFirmwareVersion()
+{
+	// Not available without logging in to the web interface
+	return std::string();
+}
 
-	if (verbose > 1) std::cerr << "Sending cat command" << std::endl;
-	request_stream << "cat /sys/class/video4linux/video0/device/../idVendor ; "
-		"cat /sys/class/video4linux/video0/device/../idProduct ; "
-		"cat /sys/class/video4linux/video0/device/bInterfaceClass\r\n";
-	boost::asio::write(*telnet, request);
+std::string maygion_mips::getConfigStamp()
+{
+	if (!this->network->ftp_login("MayGion", "maygion.com")) {
+		throw std::string("Unable to log in to device via FTP.");
+	}
+	unsigned long size = 0;
+	std::string modified;
+	if (!this->network->ftp_file_info("/tmp/eye/app", "cs.ini", &size, &modified)) {
+		return std::string();
+	}
+	std::stringstream ss;
+	ss << size << " " << modified;
+	return ss.str();
+}
 
-	// Read back what we just typed as that's just before the content
-	if (verbose > 1) std::cerr << "Waiting for ack..." << std::flush;
-	read = boost::asio::read_until(*telnet, response, "Class\r\n");
-	response.consume(read);
-	if (verbose > 1) std::cerr << "ok.\nChecking result..." << std::flush;
+void maygion_mips::getConfig(std::ostream& target)
+{
+	if (!this->network->ftp_login("MayGion", "maygion.com")) {
+		throw std::string("Unable to log in to device via FTP.");
+	}
+	if (!this->network->ftp_get(target, "/tmp/eye/app", "cs.ini", fn_progress())) {
+		throw std::string("Unable to download cs.ini via FTP.");
+	}
+	return;
+}
 
-	boost::asio::read_until(*telnet, response, "# ");
-	std::string token;
-	response_stream >> token;
-	*idVendor = strtoul(token.c_str(), NULL, 16);
+void maygion_mips::onDumpProgress(DumpState *state, unsigned long amount,
+	unsigned long total)
+{
+	state->received = amount;
+	if (total != (unsigned long)-1) {
+		// ftp_get() doesn't know how big the file is, so it always reports a
+		// total of zero.
+		total = state->realTotal;
+		if (
+			state->controller
+			&& (boost::posix_time::microsec_clock::universal_time() >= state->nextPoll)
+		) {
+			this->pollLoad(state);
+		}
+	}
+	state->fnProgress(amount, total);
+	return;
+}
 
-	response_stream >> token;
-	*idProduct = strtoul(token.c_str(), NULL, 16);
+void maygion_mips::pollLoad(DumpState *state)
+{
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+	state->nextPoll = now + boost::posix_time::milliseconds(
+		this->network->throttle().pollInterval);
+	try {
+		std::string content = this->command("cat /proc/loadavg /proc/net/dev",
+			true);
+		double load;
+		std::vector<NetDevice> devs;
+		if (!parse_loadavg(content, &load) || !parse_proc_net_dev(content, &devs)) {
+			throw std::string("unexpected output from /proc/loadavg or /proc/net/dev");
+		}
+		unsigned long txBytes = 0;
+		for (std::vector<NetDevice>::const_iterator i = devs.begin(); i != devs.end(); i++) {
+			if (i->name.compare("lo") != 0) txBytes += i->txBytes;
+		}
+		state->controller->sample(now, load, txBytes, state->received);
+		return;
+	} catch (const std::string& err) {
+		std::cerr << "Unable to check device load, no longer adjusting the "
+			"download speed: " << err << std::endl;
+	} catch (const boost::system::system_error& e) {
+		std::cerr << "Unable to check device load, no longer adjusting the "
+			"download speed: " << e.what() << std::endl;
+	}
+	state->controller = NULL;
+	return;
+}
 
-	response_stream >> token;
-	*bInterfaceClass = strtoul(token.c_str(), NULL, 16);
+boost::shared_ptr<Connection> maygion_mips::openShell(
+	boost::asio::streambuf *response)
+{
+	boost::shared_ptr<Connection> telnet = this->network->tcp_connect("telnet");
+	Span spanPrompt("telnet", "prompt", this->network->hostname());
+	size_t read = boost::asio::read_until(*telnet, *response, "# ");
+	spanPrompt.finish();
+	PROBE2(telnet__prompt, this->network->hostname().c_str(), read);
+	response->consume(read);
+	return telnet;
+}
+
+std::string maygion_mips::shellCommand(boost::shared_ptr<Connection> telnet,
+	boost::asio::streambuf *response, const std::string& cmd)
+{
+	Span spanCommand("telnet", "command", this->network->hostname());
+	std::stringstream id;
+	id << ++this->markers;
+	std::string begin = "__CT_BEGIN_" + id.str() + "\r\n";
+	std::string end = "__CT_DONE_" + id.str() + "\r\n";
+
+	// The empty quotes stop the echo of the command line from matching the
+	// markers, so only the echo commands' own output does.
+	std::string line = "echo __CT_\"\"BEGIN_" + id.str() + "; " + cmd
+		+ "; echo __CT_\"\"DONE_" + id.str() + "\r\n";
+	boost::asio::write(*telnet, boost::asio::buffer(line));
+
+	size_t read = boost::asio::read_until(*telnet, *response, begin);
+	response->consume(read);
+	read = boost::asio::read_until(*telnet, *response, end);
+	boost::asio::streambuf::const_buffers_type bufs = response->data();
+	std::string content(boost::asio::buffers_begin(bufs),
+		boost::asio::buffers_begin(bufs) + read - end.length());
+	response->consume(read);
 
-	response.consume(response.size());
+	// Leave the shell waiting at the next prompt
+	read = boost::asio::read_until(*telnet, *response, "# ");
+	response->consume(read);
+	spanCommand.finish();
+	PROBE2(telnet__prompt, this->network->hostname().c_str(), read);
+	return content;
+}
 
-	if (verbose > 1) std::cerr << "Done." << std::endl;
+MTDPartition maygion_mips::flashPartition()
+{
+	std::string content = this->command("cat /proc/mtd", true);
+	std::vector<MTDPartition> parts;
+	if (!parse_proc_mtd(content, &parts)) {
+		throw std::string("Unable to get MTD info.");
+	}
+	if (verbose > 1) std::cerr << "Examining data..." << std::endl;
 
-	// Logout to avoid lingering shells
-	request_stream.write("\x03\x1A", 2);
-	boost::asio::write(*telnet, request);
+	std::vector<MTDPartition>::const_iterator mtd0 = parts.begin();
+	while ((mtd0 != parts.end()) && (mtd0->dev.compare("mtd0") != 0)) mtd0++;
+	if (mtd0 == parts.end()) {
+		throw std::string("mtdblock0 doesn't exist!");
+	}
+	return *mtd0;
+}
 
+std::string maygion_mips::command(const std::string& cmd, bool repeatable)
+{
+	std::string line = cmd;
+	if (cmd.length() > SHELL_MAX_COMMAND) {
+		if (!this->network->ftp_login("MayGion", "maygion.com")) {
+			throw std::string("Unable to log in to device via FTP.");
+		}
+		std::istringstream script(cmd + "\n");
+		if (!this->network->ftp_put(script, "/tmp", SHELL_SCRIPT_NAME, fn_progress())) {
+			throw std::string("Unable to upload commands via FTP.");
+		}
+		line = "sh /tmp/" SHELL_SCRIPT_NAME;
+	}
+
+	if (this->shell) {
+		try {
+			return this->shellCommand(this->shell, &this->shellResponse, line);
+		} catch (const boost::system::system_error& e) {
+			// The device may have dropped the session while it sat idle, so log
+			// in again.  Only a command the caller says is safe to run twice is
+			// sent again, as the device may have run some or all of it already.
+			this->shell.reset();
+			if (!repeatable) throw;
+			if (verbose) std::cerr << "[telnet] Session to "
+				<< this->network->hostname() << " lost (" << e.what()
+				<< "), logging in again" << std::endl;
+		}
+	}
+	this->shellResponse.consume(this->shellResponse.size());
+	this->shell = this->openShell(&this->shellResponse);
+	try {
+		return this->shellCommand(this->shell, &this->shellResponse, line);
+	} catch (...) {
+		this->shell.reset();
+		throw;
+	}
+}
+
+void maygion_mips::closeShell(boost::shared_ptr<Connection> telnet)
+{
+	// Logout to avoid lingering shells.  This is only tidying up, so errors
+	// don't matter.
+	boost::system::error_code ignored;
+	boost::asio::write(*telnet, boost::asio::buffer("\x03\x1A", 2), ignored);
 	telnet->close();
 	return;
 }
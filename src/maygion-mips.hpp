@@ -22,6 +22,7 @@
 #define MAYGION_MIPS_HPP
 
 #include "network.hpp"
+#include "parse.hpp"
 #include "device-interface.hpp"
 
 class maygion_mips: virtual public Device
@@ -31,12 +32,131 @@ class maygion_mips: virtual public Device
 		virtual ~maygion_mips();
 
 		virtual void getFirmware(std::ostream& target, fn_progress fnProgress);
+		virtual void getBlockChecksums(unsigned long blockSize,
+			std::vector<uint32_t> *sums);
 		virtual void getFlashInfo(unsigned long *length);
 		virtual void getCameraInfo(unsigned short *idVendor,
 			unsigned short *idProduct, unsigned char *bInterfaceClass);
+		virtual unsigned long putFirmware(std::istream& source, bool onlyChanged,
+			fn_progress fnProgress);
+		virtual std::string getFirmwareVersion();
+		virtual std::string getConfigStamp();
+		virtual void getConfig(std::ostream& target);
 
 	private:
+		struct DumpState;
+
 		Network *network;
+
+		/// Logged in shell, kept open between calls and closed on destruction.
+		boost::shared_ptr<Connection> shell;
+		boost::asio::streambuf shellResponse; ///< Unread output from the shell
+		unsigned long markers; ///< Commands sent so far, to number their markers
+
+		/// Pass on download progress, checking the device load when it's due.
+		void onDumpProgress(DumpState *state, unsigned long amount,
+			unsigned long total);
+
+		/// Read the load and network counters, and adjust the download speed.
+		/**
+		 * If the device can't be queried, a warning is shown and the speed is
+		 * left as it is for the rest of the download.
+		 */
+		void pollLoad(DumpState *state);
+
+		/// Log in over telnet and wait for the shell prompt.
+		/**
+		 * @param response
+		 *   Buffer to hold data read from the shell.  Must be passed to every
+		 *   shellCommand() call on this connection.
+		 */
+		boost::shared_ptr<Connection> openShell(boost::asio::streambuf *response);
+
+		/// Run a shell command and return its output.
+		/**
+		 * The output is found by echoing a numbered marker before and after
+		 * the command, as the shell's echo of the command line itself is
+		 * wrapped to the terminal width.
+		 *
+		 * @return Everything the command printed.
+		 */
+		std::string shellCommand(boost::shared_ptr<Connection> telnet,
+			boost::asio::streambuf *response, const std::string& cmd);
+
+		/// Find the partition holding the whole flash.
+		/**
+		 * @throw std::string if /proc/mtd can't be read or has no mtd0.
+		 */
+		MTDPartition flashPartition();
+
+		/// Find the erase blocks whose content on the device differs from an
+		/// image.
+		/**
+		 * @param changed
+		 *   The numbers of the blocks that differ are appended to this list.
+		 */
+		void changedBlocks(const MTDPartition& mtd, const std::string& image,
+			std::vector<unsigned long> *changed);
+
+		/// Build the shell command to write one erase block and checksum it.
+		/**
+		 * The command prints the cksum output for the block as read back.
+		 *
+		 * @param staged
+		 *   Block number within the file staged in /tmp.
+		 *
+		 * @param block
+		 *   Block number within the flash.
+		 */
+		static std::string writeBlockCommand(const std::string& blockDev,
+			const MTDPartition& mtd, unsigned long staged, unsigned long block);
+
+		/// Build the shell command to print the cksum of one block.
+		/**
+		 * @param blockSize
+		 *   Bytes in each block, usually the erase block size.
+		 */
+		static std::string readBlockCommand(const MTDPartition& mtd,
+			unsigned long blockSize, unsigned long block);
+
+		/// Read one block's cksum output and compare it with the image.
+		static bool blockMatches(std::istream& result, const std::string& image,
+			unsigned long eraseSize, unsigned long block);
+
+		/// Checksum blocks again after the session was lost while writing them.
+		/**
+		 * @param first
+		 *   Index into todo of the first block to check.
+		 *
+		 * @param last
+		 *   Index into todo one past the last block to check.
+		 *
+		 * @param bad
+		 *   The todo indices of the blocks that don't match the image are
+		 *   appended to this list.
+		 */
+		void recheckBlocks(const MTDPartition& mtd, const std::string& image,
+			const std::vector<unsigned long>& todo, unsigned long first,
+			unsigned long last, std::vector<unsigned long> *bad);
+
+		/// Run a command in the kept shell, logging in first if needed.
+		/**
+		 * A session that has been dropped since the last command is replaced
+		 * with a new one.  A command too long to type at the prompt is
+		 * uploaded to /tmp over FTP and run from there.
+		 *
+		 * @param repeatable
+		 *   true if the command can safely be run twice.  If the session is
+		 *   lost while it runs it is then sent again on a new session,
+		 *   otherwise the error is thrown, as there is no knowing how much of
+		 *   the command the device ran.
+		 *
+		 * @return Everything the command printed.
+		 */
+		std::string command(const std::string& cmd, bool repeatable);
+
+		/// Log out of the shell and disconnect.
+		void closeShell(boost::shared_ptr<Connection> telnet);
 };
 
 #endif // MAYGION_MIPS_HPP
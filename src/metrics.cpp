@@ -0,0 +1,241 @@
+/**
+ * @file   metrics.cpp
+ * @brief  Counters and histograms for monitoring batch runs.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <unistd.h>
+#include "metrics.hpp"
+
+/// Services that get their own labels; the last one catches everything else.
+static const char *service_names[METRICS_NUM_SERVICES] = {
+	"http", "ftp", "ftp-data", "telnet", "other"
+};
+
+/// Bucket bounds for connection and request latency, in seconds.
+static const double latency_bounds[] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+/// Bucket bounds for whole operations, in seconds.
+static const double operation_bounds[] = {
+	0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300, 600
+};
+
+/// Bucket bounds for transfer rates, in bytes per second.
+static const double throughput_bounds[] = {
+	16384, 32768, 65536, 131072, 262144, 524288, 1048576, 2097152, 4194304,
+	8388608, 16777216, 33554432
+};
+
+#define BOUNDS(b) b, sizeof(b) / sizeof(b[0])
+
+Metrics metrics;
+
+Histogram::Histogram(const double *bounds, unsigned int count)
+	: bounds(bounds),
+	  numBuckets(count > HISTOGRAM_MAX_BUCKETS ? HISTOGRAM_MAX_BUCKETS : count),
+	  sum(0)
+{
+	for (unsigned int i = 0; i <= HISTOGRAM_MAX_BUCKETS; i++) this->buckets[i] = 0;
+}
+
+void Histogram::observe(double value)
+{
+	// Only the bucket the value falls in is incremented, the cumulative counts
+	// Prometheus expects are worked out when writing.
+	unsigned int b = 0;
+	while ((b < this->numBuckets) && (value > this->bounds[b])) b++;
+	this->buckets[b].fetch_add(1, boost::memory_order_relaxed);
+
+	double old = this->sum.load(boost::memory_order_relaxed);
+	while (!this->sum.compare_exchange_weak(old, old + value,
+		boost::memory_order_relaxed));
+	return;
+}
+
+void Histogram::observeSince(boost::posix_time::ptime start)
+{
+	this->observe((boost::posix_time::microsec_clock::universal_time() - start)
+		.total_microseconds() / 1000000.0);
+	return;
+}
+
+void Histogram::write(std::ostream& out, const std::string& name,
+	const std::string& labels) const
+{
+	std::string sep = labels.empty() ? "" : ",";
+	uint64_t total = 0;
+	for (unsigned int b = 0; b <= this->numBuckets; b++) {
+		total += this->buckets[b].load(boost::memory_order_relaxed);
+		out << name << "_bucket{" << labels << sep << "le=\"";
+		if (b == this->numBuckets) out << "+Inf";
+		else out << this->bounds[b];
+		out << "\"} " << total << "\n";
+	}
+	std::string braces = labels.empty() ? "" : "{" + labels + "}";
+	out << name << "_sum" << braces << " "
+		<< this->sum.load(boost::memory_order_relaxed) << "\n";
+	out << name << "_count" << braces << " " << total << "\n";
+	return;
+}
+
+ServiceMetrics::ServiceMetrics()
+	: connectTime(BOUNDS(latency_bounds))
+{
+}
+
+Metrics::Metrics()
+	: identifyTime(BOUNDS(operation_bounds)),
+	  dumpTime(BOUNDS(operation_bounds)),
+	  dumpThroughput(BOUNDS(throughput_bounds)),
+	  pollTime(BOUNDS(latency_bounds))
+{
+}
+
+ServiceMetrics& Metrics::service(const std::string& name)
+{
+	for (unsigned int i = 0; i < METRICS_NUM_SERVICES - 1; i++) {
+		if (name.compare(service_names[i]) == 0) return this->services[i];
+	}
+	return this->services[METRICS_NUM_SERVICES - 1];
+}
+
+/// Write the HELP and TYPE lines for a metric.
+static void write_header(std::ostream& out, const char *name, const char *type,
+	const char *help)
+{
+	out << "# HELP " << name << " " << help << "\n"
+		<< "# TYPE " << name << " " << type << "\n";
+	return;
+}
+
+/// Write a counter with no labels.
+static void write_counter(std::ostream& out, const char *name, const char *help,
+	const Counter& counter)
+{
+	write_header(out, name, "counter", help);
+	out << name << " " << counter.get() << "\n";
+	return;
+}
+
+void Metrics::writePrometheus(std::ostream& out) const
+{
+	std::streamsize oldPrecision = out.precision(15);
+
+	// Per-service counters, one metric per field with a label per service
+	struct {
+		const char *name;
+		const char *help;
+		const Counter ServiceMetrics::*field;
+	} serviceCounters[] = {
+		{"camtickler_connect_attempts_total", "Connection attempts.", &ServiceMetrics::connects},
+		{"camtickler_connect_failures_total", "Connection attempts that failed.", &ServiceMetrics::connectFailures},
+		{"camtickler_timeouts_total", "Connections or reads that timed out.", &ServiceMetrics::timeouts},
+		{"camtickler_received_bytes_total", "Bytes received from devices.", &ServiceMetrics::bytesReceived},
+		{"camtickler_sent_bytes_total", "Bytes sent to devices.", &ServiceMetrics::bytesSent},
+	};
+	for (unsigned int c = 0; c < sizeof(serviceCounters) / sizeof(serviceCounters[0]); c++) {
+		write_header(out, serviceCounters[c].name, "counter", serviceCounters[c].help);
+		for (unsigned int i = 0; i < METRICS_NUM_SERVICES; i++) {
+			out << serviceCounters[c].name << "{service=\"" << service_names[i]
+				<< "\"} " << (this->services[i].*serviceCounters[c].field).get() << "\n";
+		}
+	}
+	write_header(out, "camtickler_connect_duration_seconds", "histogram",
+		"Time taken to connect, including name resolution.");
+	for (unsigned int i = 0; i < METRICS_NUM_SERVICES; i++) {
+		this->services[i].connectTime.write(out, "camtickler_connect_duration_seconds",
+			std::string("service=\"") + service_names[i] + "\"");
+	}
+
+	write_counter(out, "camtickler_identify_attempts_total",
+		"Devices identification was attempted on.", this->identifyAttempts);
+	write_counter(out, "camtickler_identify_success_total",
+		"Devices whose type was identified.", this->identifySuccess);
+	write_counter(out, "camtickler_identify_cache_hits_total",
+		"Identifications answered from the cache.", this->identifyCacheHits);
+	write_header(out, "camtickler_identify_duration_seconds", "histogram",
+		"Time taken to identify a device.");
+	this->identifyTime.write(out, "camtickler_identify_duration_seconds", "");
+
+	write_counter(out, "camtickler_dumps_total",
+		"Firmware downloads started.", this->dumps);
+	write_counter(out, "camtickler_dump_failures_total",
+		"Firmware downloads that failed.", this->dumpFailures);
+	write_counter(out, "camtickler_dump_bytes_total",
+		"Bytes of firmware downloaded.", this->dumpBytes);
+	write_header(out, "camtickler_dump_duration_seconds", "histogram",
+		"Time taken to download firmware.");
+	this->dumpTime.write(out, "camtickler_dump_duration_seconds", "");
+	write_header(out, "camtickler_dump_throughput_bytes_per_second", "histogram",
+		"Average transfer rate of each completed firmware download.");
+	this->dumpThroughput.write(out, "camtickler_dump_throughput_bytes_per_second", "");
+
+	write_counter(out, "camtickler_flashes_total",
+		"Firmware writes started.", this->flashes);
+	write_counter(out, "camtickler_flash_failures_total",
+		"Firmware writes that failed.", this->flashFailures);
+	write_counter(out, "camtickler_flash_block_retries_total",
+		"Erase blocks written again after failing to verify.", this->flashBlockRetries);
+	write_counter(out, "camtickler_flash_blocks_written_total",
+		"Erase blocks written to flash.", this->flashBlocksWritten);
+	write_counter(out, "camtickler_flash_blocks_skipped_total",
+		"Erase blocks not written because they already matched the image.",
+		this->flashBlocksSkipped);
+
+	write_counter(out, "camtickler_retries_total",
+		"Operations tried again after a transient error.", this->retries);
+	write_counter(out, "camtickler_circuit_rejections_total",
+		"Connections not attempted because the host had failed too often.",
+		this->circuitRejections);
+
+	write_counter(out, "camtickler_polls_total",
+		"Health polls run by the daemon.", this->polls);
+	write_counter(out, "camtickler_poll_failures_total",
+		"Health polls that failed.", this->pollFailures);
+	write_header(out, "camtickler_poll_duration_seconds", "histogram",
+		"Time taken by each health poll.");
+	this->pollTime.write(out, "camtickler_poll_duration_seconds", "");
+
+	out.precision(oldPrecision);
+	return;
+}
+
+bool Metrics::writeTextfile(const std::string& filename) const
+{
+	std::stringstream tmp;
+	tmp << filename << "." << getpid() << ".tmp";
+	std::string tmpName = tmp.str();
+	{
+		std::ofstream out(tmpName.c_str(), std::ios::out | std::ios::trunc);
+		this->writePrometheus(out);
+		out.close();
+		if (!out) {
+			unlink(tmpName.c_str());
+			return false;
+		}
+	}
+	if (rename(tmpName.c_str(), filename.c_str()) != 0) {
+		unlink(tmpName.c_str());
+		return false;
+	}
+	return true;
+}
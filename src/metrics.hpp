@@ -0,0 +1,177 @@
+/**
+ * @file   metrics.hpp
+ * @brief  Counters and histograms for monitoring batch runs.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <iostream>
+#include <string>
+#include <stdint.h>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+/// Value that only ever goes up.
+/**
+ * Updates are a single relaxed atomic add, so counters are always enabled.
+ */
+class Counter
+{
+	public:
+		Counter()
+			: value(0)
+		{
+		}
+
+		void add(uint64_t n = 1)
+		{
+			this->value.fetch_add(n, boost::memory_order_relaxed);
+			return;
+		}
+
+		uint64_t get() const
+		{
+			return this->value.load(boost::memory_order_relaxed);
+		}
+
+	private:
+		boost::atomic<uint64_t> value;
+};
+
+/// Maximum number of buckets in a Histogram, not counting +Inf.
+#define HISTOGRAM_MAX_BUCKETS 16
+
+/// Distribution of observed values, in Prometheus histogram form.
+class Histogram
+{
+	public:
+		/// Create a histogram.
+		/**
+		 * @param bounds
+		 *   Upper bound of each bucket, in ascending order.  Must not have more
+		 *   than HISTOGRAM_MAX_BUCKETS entries.
+		 *
+		 * @param count
+		 *   Number of entries in bounds.
+		 */
+		Histogram(const double *bounds, unsigned int count);
+
+		/// Record a value.
+		void observe(double value);
+
+		/// Record the time elapsed since start, in seconds.
+		void observeSince(boost::posix_time::ptime start);
+
+		/// Write the histogram in Prometheus text format.
+		/**
+		 * @param out
+		 *   Stream to write to.
+		 *
+		 * @param name
+		 *   Metric name.
+		 *
+		 * @param labels
+		 *   Labels to add to every sample, e.g. "service=\"ftp\"", or empty.
+		 */
+		void write(std::ostream& out, const std::string& name,
+			const std::string& labels) const;
+
+	private:
+		const double *bounds;
+		unsigned int numBuckets;
+		boost::atomic<uint64_t> buckets[HISTOGRAM_MAX_BUCKETS + 1];
+		boost::atomic<double> sum;
+};
+
+/// Metrics kept separately for each service (http, ftp, telnet...)
+struct ServiceMetrics
+{
+	ServiceMetrics();
+
+	Counter connects;        ///< Connection attempts
+	Counter connectFailures; ///< Connection attempts that failed
+	Counter timeouts;        ///< Connections or reads that timed out
+	Counter bytesReceived;
+	Counter bytesSent;
+	Histogram connectTime;   ///< Seconds taken to connect, including DNS
+};
+
+/// Number of services ServiceMetrics are kept for, including "other".
+#define METRICS_NUM_SERVICES 5
+
+/// Every metric kept by camtickler.
+class Metrics
+{
+	public:
+		Metrics();
+
+		/// Get the metrics for a service.
+		/**
+		 * @param name
+		 *   Service name, as passed to Network::tcp_connect().
+		 */
+		ServiceMetrics& service(const std::string& name);
+
+		/// Write all metrics in Prometheus text exposition format.
+		void writePrometheus(std::ostream& out) const;
+
+		/// Write all metrics to a file for the node_exporter textfile collector.
+		/**
+		 * The file is written under a temporary name and renamed into place,
+		 * so the collector never sees a partial file.
+		 *
+		 * @param filename
+		 *   File to write, usually ending in ".prom".
+		 *
+		 * @return true on success, false if the file could not be written.
+		 */
+		bool writeTextfile(const std::string& filename) const;
+
+		Counter identifyAttempts;
+		Counter identifySuccess;   ///< Identifications that found a device type
+		Counter identifyCacheHits; ///< Identifications answered from the cache
+		Histogram identifyTime;
+
+		Counter dumps;             ///< Firmware downloads started
+		Counter dumpFailures;
+		Counter dumpBytes;
+		Histogram dumpTime;
+		Histogram dumpThroughput;  ///< Bytes per second of each completed dump
+
+		Counter flashes;           ///< Firmware writes started
+		Counter flashFailures;
+		Counter flashBlockRetries; ///< Erase blocks written again after failing to verify
+		Counter flashBlocksWritten;
+		Counter flashBlocksSkipped; ///< Erase blocks already matching the image
+
+		Counter retries;           ///< Operations tried again after a transient error
+		Counter circuitRejections; ///< Connections skipped because the host kept failing
+
+		Counter polls;             ///< Daemon health polls
+		Counter pollFailures;
+		Histogram pollTime;
+
+	private:
+		ServiceMetrics services[METRICS_NUM_SERVICES];
+};
+
+/// Metrics for the whole process.
+extern Metrics metrics;
+
+#endif // METRICS_HPP
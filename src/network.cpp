@@ -18,38 +18,137 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <strings.h>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include "main.hpp"
+#include "metrics.hpp"
 #include "network.hpp"
+#include "parse.hpp"
+#include "probes.hpp"
+#include "trace.hpp"
+
+/// Smallest part of a file worth a connection of its own.
+#define HTTP_RANGE_MIN (256 * 1024)
+
+int verbose = 0; ///< Verbosity level of stderr messages
+
+/// One range of a file being downloaded by http_get_ranges().
+struct Network::RangePart
+{
+	RangePart()
+		: first(0),
+		  last(0),
+		  status(0)
+	{
+	}
+
+	unsigned long first, last;
+	std::string content;
+	unsigned int status;              ///< HTTP status, 0 if the request failed
+	boost::system::error_code error;  ///< Why the connection failed, if it did
+};
+
+/// Adds up progress from every connection of a download.
+struct Network::RangeProgress
+{
+	RangeProgress(fn_progress fnProgress)
+		: fnProgress(fnProgress),
+		  amount(0),
+		  total(0)
+	{
+	}
+
+	void add(unsigned long len)
+	{
+		boost::mutex::scoped_lock guard(this->mutex);
+		this->amount += len;
+		if (this->fnProgress) this->fnProgress(this->amount, this->total);
+		return;
+	}
+
+	boost::mutex mutex;
+	fn_progress fnProgress;
+	unsigned long amount;
+	unsigned long total;              ///< Set before any other thread starts
+};
 
 Network::Network(const std::string& host)
 	: host(host),
 	  port_http(0),
+	  capture_out(NULL),
+	  capture_in(NULL),
+	  breaker(NULL),
 	  okFTP(false)
 {
-	// Get a list of endpoints corresponding to the server name
-	this->set_http_port(0);
 }
 
-void Network::set_http_port(unsigned short port)
+void Network::set_port(const std::string& service, unsigned short port)
 {
-	this->port_http = port;
-	std::string service_name;
-	if (this->port_http != 0) {
-		std::stringstream ss;
-		ss << this->port_http;
-		service_name = ss.str();
+	if (port == 0) {
+		this->service_ports.erase(service);
 	} else {
-		service_name = "http"; // default port
+		std::stringstream ss;
+		ss << port;
+		this->service_ports[service] = ss.str();
 	}
-	boost::asio::ip::tcp::resolver resolver(this->io_service);
-	boost::asio::ip::tcp::resolver::query query(host, service_name);
-	this->endpoint_iterator_http = resolver.resolve(query);
+	return;
+}
+
+std::string Network::service(const std::string& name)
+{
+	std::map<std::string, std::string>::const_iterator i
+		= this->service_ports.find(name);
+	if (i != this->service_ports.end()) return i->second;
+	return name;
+}
+
+void Network::set_http_port(unsigned short port)
+{
+	this->port_http = port;
 	return;
 }
 
 unsigned short Network::get_http_port()
 {
-	return this->endpoint_iterator_http->endpoint().port();
+	if (this->port_http != 0) return this->port_http;
+	std::string service_name = this->service("http");
+	if (service_name.compare("http") == 0) return 80;
+	return strtoul(service_name.c_str(), NULL, 10);
+}
+
+/// Read the block of headers following an HTTP status line.
+/**
+ * @param socket
+ *   Connection to read from.
+ *
+ * @param response
+ *   Buffer holding any data read so far, with the status line already
+ *   consumed.  On return, only data after the headers remains.
+ *
+ * @return The headers, including the blank line that ends them.
+ */
+static std::string read_header_block(Connection& socket,
+	boost::asio::streambuf& response)
+{
+	std::size_t len;
+	boost::asio::streambuf::const_buffers_type bufs = response.data();
+	if (
+		(response.size() >= 2)
+		&& (*boost::asio::buffers_begin(bufs) == '\r')
+		&& (*(boost::asio::buffers_begin(bufs) + 1) == '\n')
+	) {
+		len = 2; // no headers at all
+	} else {
+		len = boost::asio::read_until(socket, response, "\r\n\r\n");
+		bufs = response.data();
+	}
+	std::string block(boost::asio::buffers_begin(bufs),
+		boost::asio::buffers_begin(bufs) + len);
+	response.consume(len);
+	return block;
 }
 
 std::vector<std::string> Network::http_headers()
@@ -58,9 +157,9 @@ std::vector<std::string> Network::http_headers()
 
 	if (verbose) std::cerr << "[http] Trying to get HTTP headers..." << std::endl;
 
-	// Try each endpoint until we successfully establish a connection
-	boost::asio::ip::tcp::socket socket(this->io_service);
-	boost::asio::connect(socket, this->endpoint_iterator_http);
+	Span spanRequest("http", "request", this->host);
+	boost::shared_ptr<Connection> conn = this->tcp_connect("http", this->port_http);
+	Connection& socket = *conn;
 
 	// Form the request. We specify the "Connection: close" header so that the
 	// server will close the socket after transmitting the response. This will
@@ -73,6 +172,7 @@ std::vector<std::string> Network::http_headers()
 	request_stream << "Connection: close\r\n\r\n";
 
 	// Send the request
+	Span spanFirstByte("http", "first_byte", this->host);
 	boost::asio::write(socket, request);
 
 	// Read the response status line. The response streambuf will automatically
@@ -80,30 +180,24 @@ std::vector<std::string> Network::http_headers()
 	// a maximum size to the streambuf constructor.
 	boost::asio::streambuf response;
 	boost::asio::read_until(socket, response, "\r\n");
+	spanFirstByte.finish();
 
 	// Check that response is OK.
 	std::istream response_stream(&response);
-	std::string http_version;
-	response_stream >> http_version;
+	std::string status_line;
+	std::getline(response_stream, status_line);
 	unsigned int status_code;
-	response_stream >> status_code;
-	std::string status_message;
-	std::getline(response_stream, status_message);
-	if (!response_stream || http_version.substr(0, 5) != "HTTP/") {
+	if (!parse_http_status(status_line, &status_code)) {
 		if (verbose) std::cerr << "[http] Invalid response (not HTTP)\n";
 		return headers;
 	}
 
-	// Read the response headers, which are terminated by a blank line.
-	boost::asio::read_until(socket, response, "\r\n\r\n");
-
-	// Process the response headers.
-	std::string header;
-	while (std::getline(response_stream, header) && header != "\r") {
-		std::string::size_type len = header.length();
-		if (header[len - 1] == '\r') header = header.substr(0, len - 1);
-		if (verbose > 1) std::cerr << "[http/header] " << header << "\n";
-		headers.push_back(header);
+	// Read and process the response headers
+	headers = parse_http_headers(read_header_block(socket, response));
+	if (verbose > 1) {
+		for (std::vector<std::string>::const_iterator i = headers.begin(); i != headers.end(); i++) {
+			std::cerr << "[http/header] " << *i << "\n";
+		}
 	}
 
 	return headers;
@@ -114,9 +208,9 @@ std::string Network::http_get(const std::string& path)
 	if (verbose) std::cerr << "[http] Trying to download \"" << path << "\"..."
 		<< std::endl;
 
-	// Try each endpoint until we successfully establish a connection
-	boost::asio::ip::tcp::socket socket(this->io_service);
-	boost::asio::connect(socket, this->endpoint_iterator_http);
+	Span spanRequest("http", "request", this->host);
+	boost::shared_ptr<Connection> conn = this->tcp_connect("http", this->port_http);
+	Connection& socket = *conn;
 
 	// Form the request. We specify the "Connection: close" header so that the
 	// server will close the socket after transmitting the response. This will
@@ -129,6 +223,7 @@ std::string Network::http_get(const std::string& path)
 	request_stream << "Connection: close\r\n\r\n";
 
 	// Send the request
+	Span spanFirstByte("http", "first_byte", this->host);
 	boost::asio::write(socket, request);
 
 	// Read the response status line. The response streambuf will automatically
@@ -136,16 +231,14 @@ std::string Network::http_get(const std::string& path)
 	// a maximum size to the streambuf constructor.
 	boost::asio::streambuf response;
 	boost::asio::read_until(socket, response, "\r\n");
+	spanFirstByte.finish();
 
 	// Check that response is OK.
 	std::istream response_stream(&response);
-	std::string http_version;
-	response_stream >> http_version;
+	std::string status_line;
+	std::getline(response_stream, status_line);
 	unsigned int status_code;
-	response_stream >> status_code;
-	std::string status_message;
-	std::getline(response_stream, status_message);
-	if (!response_stream || http_version.substr(0, 5) != "HTTP/")
+	if (!parse_http_status(status_line, &status_code))
 	{
 		if (verbose) std::cerr << "[http] Invalid response (not HTTP)\n";
 		return std::string();
@@ -156,17 +249,20 @@ std::string Network::http_get(const std::string& path)
 		return std::string();
 	}
 
-	// Read the response headers, which are terminated by a blank line.
-	boost::asio::read_until(socket, response, "\r\n\r\n");
-
-	// Process the response headers.
-	std::string header;
-	while (std::getline(response_stream, header) && header != "\r")
-		if (verbose > 1) std::cerr << "[http/header] " << header << "\n";
+	// Read and skip over the response headers
+	std::vector<std::string> headers
+		= parse_http_headers(read_header_block(socket, response));
+	if (verbose > 1) {
+		for (std::vector<std::string>::const_iterator i = headers.begin(); i != headers.end(); i++) {
+			std::cerr << "[http/header] " << *i << "\n";
+		}
+	}
 
 	// Read until EOF
+	Span spanTransfer("http", "transfer", this->host);
 	boost::system::error_code error;
 	boost::asio::read(socket, response, boost::asio::transfer_all(), error);
+	spanTransfer.finish();
 	if (error != boost::asio::error::eof)
 		throw boost::system::system_error(error);
 	boost::asio::streambuf::const_buffers_type response_bufs = response.data();
@@ -179,27 +275,280 @@ std::string Network::http_get(const std::string& path)
 	return content;
 }
 
-boost::shared_ptr<boost::asio::ip::tcp::socket> Network::tcp_connect(
-	const std::string& service, boost::asio::io_service *tcp_service)
-{
-	boost::asio::ip::tcp::resolver resolver(*tcp_service);
-	boost::asio::ip::tcp::resolver::query query(this->host, service);
-	boost::asio::ip::tcp::resolver::iterator it = resolver.resolve(query);
-	boost::shared_ptr<boost::asio::ip::tcp::socket> socket(new boost::asio::ip::tcp::socket(*tcp_service));
-	if (verbose) std::cerr << "[tcp] Connecting to " << this->host << " on port "
-		<< it->endpoint().port() << "..." << std::endl;
-	boost::asio::connect(*socket, it);
-	// TODO: check for timeout
-	return socket;
+bool Network::http_get_ranges(std::ostream& target, const std::string& path,
+	unsigned int connections, fn_progress fnProgress)
+{
+	if (verbose) std::cerr << "[http] Trying to download \"" << path
+		<< "\" in parts..." << std::endl;
+
+	RangeProgress progress(fnProgress);
+	std::string start;
+	unsigned long total;
+	unsigned int status = this->http_get_range(path, 0, HTTP_RANGE_MIN - 1,
+		&start, &total, &progress);
+	if (status == 200) {
+		if (verbose) std::cerr << "[http] Server sent the whole file" << std::endl;
+		target.write(start.data(), start.length());
+		if (fnProgress) fnProgress(start.length(), -1);
+		return true;
+	}
+	if (status != 206) {
+		if (verbose) std::cerr << "[http] Unexpected status code: " << status << "\n";
+		return false;
+	}
+	target.write(start.data(), start.length());
+	progress.total = total;
+
+	// Split what's left evenly, but not into parts too small to be worth a
+	// connection each.
+	unsigned long remaining = total - start.length();
+	if (remaining) {
+		unsigned long count = (remaining + HTTP_RANGE_MIN - 1) / HTTP_RANGE_MIN;
+		if (count > connections) count = connections;
+		if (count == 0) count = 1;
+		unsigned long size = (remaining + count - 1) / count;
+		std::vector<RangePart> parts(count);
+		for (unsigned long i = 0; i < count; i++) {
+			parts[i].first = start.length() + i * size;
+			parts[i].last = std::min(parts[i].first + size, total) - 1;
+		}
+
+		bool sequential = this->capture_in || this->capture_out;
+		if (verbose) std::cerr << "[http] Downloading the other " << remaining
+			<< " bytes in " << count << " parts" << std::endl;
+		if (sequential) {
+			for (unsigned long i = 0; i < count; i++) {
+				this->http_get_part(path, &parts[i], &progress);
+			}
+		} else {
+			boost::thread_group threads;
+			for (unsigned long i = 1; i < count; i++) {
+				threads.create_thread(boost::bind(&Network::http_get_part, this,
+					boost::cref(path), &parts[i], &progress));
+			}
+			this->http_get_part(path, &parts[0], &progress);
+			threads.join_all();
+		}
+
+		for (std::vector<RangePart>::const_iterator i = parts.begin(); i != parts.end(); i++) {
+			if (i->error) throw boost::system::system_error(i->error);
+			if ((i->status != 206) || (i->content.length() != i->last - i->first + 1)) {
+				if (verbose) std::cerr << "[http] Server did not send bytes "
+					<< i->first << "-" << i->last << std::endl;
+				return false;
+			}
+			target.write(i->content.data(), i->content.length());
+		}
+	}
+	if (fnProgress) fnProgress(total, -1);
+
+	if (verbose) std::cerr << "[http] Download successful" << std::endl;
+	return true;
+}
+
+unsigned int Network::http_get_range(const std::string& path,
+	unsigned long first, unsigned long last, std::string *content,
+	unsigned long *total, RangeProgress *progress)
+{
+	Span spanRequest("http", "request", this->host);
+	boost::shared_ptr<Connection> conn = this->tcp_connect("http", this->port_http);
+	Connection& socket = *conn;
+
+	boost::asio::streambuf request;
+	std::ostream request_stream(&request);
+	request_stream << "GET " << path << " HTTP/1.0\r\n";
+	request_stream << "Host: " << this->host << "\r\n";
+	request_stream << "Accept: */*\r\n";
+	request_stream << "Range: bytes=" << first << "-" << last << "\r\n";
+	request_stream << "Connection: close\r\n\r\n";
+
+	Span spanFirstByte("http", "first_byte", this->host);
+	boost::asio::write(socket, request);
+
+	boost::asio::streambuf response;
+	boost::asio::read_until(socket, response, "\r\n");
+	spanFirstByte.finish();
+
+	std::istream response_stream(&response);
+	std::string status_line;
+	std::getline(response_stream, status_line);
+	unsigned int status_code;
+	if (!parse_http_status(status_line, &status_code)) {
+		if (verbose) std::cerr << "[http] Invalid response (not HTTP)\n";
+		return 0;
+	}
+	std::vector<std::string> headers
+		= parse_http_headers(read_header_block(socket, response));
+	if (verbose > 1) {
+		for (std::vector<std::string>::const_iterator i = headers.begin(); i != headers.end(); i++) {
+			std::cerr << "[http/header] " << *i << "\n";
+		}
+	}
+
+	*total = 0;
+	unsigned long expected = 0;
+	if (status_code == 206) {
+		bool found = false;
+		for (std::vector<std::string>::const_iterator i = headers.begin(); i != headers.end(); i++) {
+			if (strncasecmp(i->c_str(), "Content-Range:", 14) != 0) continue;
+			std::string value = i->substr(14);
+			value.erase(0, value.find_first_not_of(" \t"));
+			unsigned long a, b;
+			if (parse_content_range(value, &a, &b, total) && (a == first)) {
+				expected = b - a + 1;
+				found = true;
+			}
+		}
+		if (!found) {
+			if (verbose) std::cerr << "[http] Partial response without a usable "
+				"Content-Range" << std::endl;
+			return 0;
+		}
+	} else if (status_code != 200) {
+		return status_code;
+	}
+
+	// Read until EOF, passing on progress as each read arrives
+	Span spanTransfer("http", "transfer", this->host);
+	std::string::size_type startLength = content->length();
+	boost::system::error_code error;
+	for (;;) {
+		std::size_t len = response.size();
+		if (len) {
+			boost::asio::streambuf::const_buffers_type bufs = response.data();
+			content->append(boost::asio::buffers_begin(bufs),
+				boost::asio::buffers_begin(bufs) + len);
+			response.consume(len);
+			if (progress) progress->add(len);
+		}
+		if (error) break;
+		boost::asio::read(socket, response, boost::asio::transfer_at_least(1), error);
+	}
+	spanTransfer.finish();
+	if (error != boost::asio::error::eof) throw boost::system::system_error(error);
+	if ((status_code == 206) && (content->length() - startLength != expected)) {
+		// Connection dropped part way through
+		throw boost::system::system_error(boost::asio::error::connection_reset);
+	}
+	return status_code;
+}
+
+void Network::http_get_part(const std::string& path, RangePart *part,
+	RangeProgress *progress)
+{
+	try {
+		unsigned long total;
+		part->status = this->http_get_range(path, part->first, part->last,
+			&part->content, &total, progress);
+	} catch (const boost::system::system_error& e) {
+		part->error = e.code();
+	}
+	return;
+}
+
+/// Connection that counts the traffic passing through it.
+class MeteredConnection: virtual public Connection
+{
+	public:
+		MeteredConnection(boost::shared_ptr<Connection> conn, ServiceMetrics *stats)
+			: conn(conn),
+			  stats(stats)
+		{
+		}
+
+		virtual std::size_t read(void *data, std::size_t len,
+			boost::system::error_code& error)
+		{
+			std::size_t lenRead = this->conn->read(data, len, error);
+			this->stats->bytesReceived.add(lenRead);
+			if (error == boost::asio::error::timed_out) this->stats->timeouts.add();
+			return lenRead;
+		}
+
+		virtual std::size_t write(const void *data, std::size_t len,
+			boost::system::error_code& error)
+		{
+			std::size_t lenWritten = this->conn->write(data, len, error);
+			this->stats->bytesSent.add(lenWritten);
+			if (error == boost::asio::error::timed_out) this->stats->timeouts.add();
+			return lenWritten;
+		}
+
+		virtual void close()
+		{
+			this->conn->close();
+			return;
+		}
+
+	private:
+		boost::shared_ptr<Connection> conn;
+		ServiceMetrics *stats;
+};
+
+boost::shared_ptr<Connection> Network::tcp_connect(const std::string& service,
+	unsigned short port)
+{
+	ServiceMetrics& stats = metrics.service(service);
+	std::string port_name;
+	if (port != 0) {
+		std::stringstream ss;
+		ss << port;
+		port_name = ss.str();
+	} else {
+		port_name = this->service(service);
+	}
+
+	if (this->breaker && !this->breaker->allow(this->host)) {
+		metrics.circuitRejections.add();
+		throw boost::system::system_error(retry_error::circuit_open,
+			retry_category(), this->host);
+	}
+	stats.connects.add();
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	PROBE2(connect__start, this->host.c_str(), service.c_str());
+	boost::shared_ptr<Connection> conn;
+	try {
+		if (this->capture_in) {
+			conn = this->capture_in->connect(this->host, service);
+		} else if (this->capture_out) {
+			conn = this->capture_out->connect(this->host, service, port_name,
+				this->retry.timeout);
+		} else {
+			conn.reset(new TcpConnection(this->host, port_name, this->retry.timeout));
+		}
+	} catch (const boost::system::system_error& e) {
+		stats.connectFailures.add();
+		if (e.code() == boost::asio::error::timed_out) stats.timeouts.add();
+		PROBE4(connect__done, this->host.c_str(), service.c_str(), e.code().value(),
+			(boost::posix_time::microsec_clock::universal_time() - start).total_microseconds());
+		if (this->breaker) {
+			// A refused connection means the host is up with the port closed,
+			// so only a host that can't be reached at all counts against it
+			if (e.code() == boost::asio::error::connection_refused) {
+				this->breaker->success(this->host);
+			} else if (is_transient(e.code())) {
+				this->breaker->failure(this->host);
+			}
+		}
+		throw;
+	}
+	if (this->breaker) this->breaker->success(this->host);
+	stats.connectTime.observeSince(start);
+	PROBE4(connect__done, this->host.c_str(), service.c_str(), 0,
+		(boost::posix_time::microsec_clock::universal_time() - start).total_microseconds());
+	return boost::shared_ptr<Connection>(new MeteredConnection(conn, &stats));
 }
 
 #define EXPECT_FTP_STATUS(s) \
 	for (;;) { \
-		boost::asio::read_until(*this->ftp_socket, response, "\r\n"); \
+		boost::asio::read_until(*this->ftp_conn, response, "\r\n"); \
 		std::string line; \
 		std::getline(response_stream, line); \
-		if (line[3] == ' ') { \
+		if ((line.length() > 3) && (line[3] == ' ')) { \
+			if (line[line.length() - 1] == '\r') line.erase(line.length() - 1); \
+			this->ftp_last_reply = line; \
 			status_code = strtoul(line.c_str(), NULL, 10); \
+			PROBE3(ftp__reply, this->host.c_str(), status_code, line.c_str()); \
 			if ((s != 0) && (status_code != s)) { \
 				if (verbose) std::cerr << "[ftp] Unexpected status code: " << status_code \
 					<< std::endl; \
@@ -213,13 +562,9 @@ bool Network::ftp_login(const std::string& user, const std::string& pass)
 {
 	if (this->okFTP) return true;
 
-	boost::asio::ip::tcp::resolver resolver(this->io_service_ftp);
-	boost::asio::ip::tcp::resolver::query query(host, "ftp");
-	this->endpoint_iterator_ftp = resolver.resolve(query);
-
-	this->ftp_socket.reset(new boost::asio::ip::tcp::socket(this->io_service_ftp));
+	Span spanLogin("ftp", "login", this->host);
 	try {
-		boost::asio::connect(*this->ftp_socket, this->endpoint_iterator_ftp);
+		this->ftp_conn = this->tcp_connect("ftp");
 	} catch (const boost::system::system_error& e) {
 		if (verbose) std::cerr << "[ftp] Login failed: " << e.what() << std::endl;
 		return false;
@@ -232,21 +577,24 @@ bool Network::ftp_login(const std::string& user, const std::string& pass)
 
 	unsigned int status_code;
 	if (verbose) std::cerr << "[ftp] Waiting for greeting" << std::endl;
+	Span spanGreeting("ftp", "greeting", this->host);
 	EXPECT_FTP_STATUS(220);
+	spanGreeting.finish();
+	this->ftp_greeting_line = this->ftp_last_reply;
 	if (verbose) std::cerr << "[ftp] Received greeting, logging in" << std::endl;
 
 	request_stream << "USER " << user << "\r\n";
-	boost::asio::write(*this->ftp_socket, request);
+	boost::asio::write(*this->ftp_conn, request);
 	EXPECT_FTP_STATUS(331);
 
 	request_stream << "PASS " << pass << "\r\n";
-	boost::asio::write(*this->ftp_socket, request);
+	boost::asio::write(*this->ftp_conn, request);
 	EXPECT_FTP_STATUS(230);
 
 	if (verbose) std::cerr << "[ftp] Login successful" << std::endl;
 
 	request_stream << "TYPE I\r\n";
-	boost::asio::write(*this->ftp_socket, request);
+	boost::asio::write(*this->ftp_conn, request);
 	EXPECT_FTP_STATUS(200);
 
 	if (verbose) std::cerr << "[ftp] Binary flag set ok" << std::endl;
@@ -256,102 +604,300 @@ bool Network::ftp_login(const std::string& user, const std::string& pass)
 }
 
 bool Network::ftp_get(std::ostream& target, const std::string& path,
-	const std::string& filename, fn_progress fnProgress)
+	const std::string& filename, fn_progress fnProgress, TokenBucket *limit)
+{
+	try {
+		boost::asio::streambuf request;
+		std::ostream request_stream(&request);
+		boost::asio::streambuf response;
+		std::istream response_stream(&response);
+
+		if (verbose) std::cerr << "[ftp] Setting passive mode" << std::endl;
+
+		Span spanPASV("ftp", "pasv", this->host);
+		request_stream << "PASV\r\n";
+		boost::asio::write(*this->ftp_conn, request);
+
+		boost::asio::read_until(*this->ftp_conn, response, "\r\n");
+		std::string line;
+		std::getline(response_stream, line);
+
+		unsigned int status_code;
+		unsigned short port;
+		if (!parse_pasv(line, &port)) {
+			if (verbose) std::cerr << "[ftp] Unable to set passive mode: " << line
+				<< std::endl;
+			return false;
+		}
+
+		if (verbose) std::cerr << "[ftp] Passive ok, connecing to port " << port << std::endl;
+
+		boost::shared_ptr<Connection> socket_data = this->tcp_connect("ftp-data", port);
+		spanPASV.finish();
+		boost::asio::streambuf response_data;
+		std::istream response_data_stream(&response_data);
+
+		if (verbose) std::cerr << "[ftp] Beginning download" << std::endl;
+
+		request_stream << "CWD " << path << "\r\n";
+		boost::asio::write(*this->ftp_conn, request);
+		EXPECT_FTP_STATUS(250);
+
+		Span spanTransfer("ftp", "transfer", this->host);
+		Span spanFirstByte("ftp", "first_byte", this->host);
+		request_stream << "RETR " << filename << "\r\n";
+		boost::asio::write(*this->ftp_conn, request);
+		EXPECT_FTP_STATUS(150);
+
+		if (verbose) std::cerr << "[ftp] Receiving data" << std::endl;
+
+		unsigned long amount = 0, total = 0;
+		boost::system::error_code error;
+		while (boost::asio::read(*socket_data, response_data,
+				boost::asio::transfer_at_least(1), error)
+		) {
+			spanFirstByte.finish();
+			PROBE3(ftp__chunk, this->host.c_str(), response_data.size(),
+				amount + response_data.size());
+			amount += response_data.size();
+			if (limit) limit->consume(response_data.size());
+			target << &response_data;
+			if (fnProgress) fnProgress(amount, total);
+		}
+		if (error != boost::asio::error::eof)
+			throw boost::system::system_error(error);
+		if (fnProgress) fnProgress(amount, -1); // signal download complete
+
+		EXPECT_FTP_STATUS(226);
+		socket_data->close();
+		spanTransfer.finish();
+
+		if (verbose) std::cerr << "[ftp] Download complete" << std::endl;
+
+		return true;
+	} catch (const boost::system::system_error&) {
+		// The control connection is probably dead too, so make the next
+		// ftp_login() start afresh
+		this->ftp_conn.reset();
+		this->okFTP = false;
+		throw;
+	}
+}
+
+bool Network::ftp_put(std::istream& source, const std::string& path,
+	const std::string& filename, fn_progress fnProgress, TokenBucket *limit)
+{
+	try {
+		boost::asio::streambuf request;
+		std::ostream request_stream(&request);
+		boost::asio::streambuf response;
+		std::istream response_stream(&response);
+
+		if (verbose) std::cerr << "[ftp] Setting passive mode" << std::endl;
+
+		Span spanPASV("ftp", "pasv", this->host);
+		request_stream << "PASV\r\n";
+		boost::asio::write(*this->ftp_conn, request);
+
+		boost::asio::read_until(*this->ftp_conn, response, "\r\n");
+		std::string line;
+		std::getline(response_stream, line);
+
+		unsigned int status_code;
+		unsigned short port;
+		if (!parse_pasv(line, &port)) {
+			if (verbose) std::cerr << "[ftp] Unable to set passive mode: " << line
+				<< std::endl;
+			return false;
+		}
+
+		boost::shared_ptr<Connection> socket_data = this->tcp_connect("ftp-data", port);
+		spanPASV.finish();
+
+		if (verbose) std::cerr << "[ftp] Beginning upload" << std::endl;
+
+		request_stream << "CWD " << path << "\r\n";
+		boost::asio::write(*this->ftp_conn, request);
+		EXPECT_FTP_STATUS(250);
+
+		Span spanTransfer("ftp", "transfer", this->host);
+		request_stream << "STOR " << filename << "\r\n";
+		boost::asio::write(*this->ftp_conn, request);
+		EXPECT_FTP_STATUS(150);
+
+		unsigned long amount = 0;
+		char buffer[65536];
+		while (source.read(buffer, sizeof(buffer)) || source.gcount()) {
+			std::streamsize len = source.gcount();
+			if (limit) limit->consume(len);
+			boost::asio::write(*socket_data, boost::asio::buffer(buffer, len));
+			amount += len;
+			PROBE3(ftp__chunk, this->host.c_str(), len, amount);
+			if (fnProgress) fnProgress(amount, 0);
+		}
+		// Closing the data connection marks the end of the file
+		socket_data->close();
+		EXPECT_FTP_STATUS(226);
+		spanTransfer.finish();
+		if (fnProgress) fnProgress(amount, -1);
+
+		if (verbose) std::cerr << "[ftp] Upload complete" << std::endl;
+
+		return true;
+	} catch (const boost::system::system_error&) {
+		this->ftp_conn.reset();
+		this->okFTP = false;
+		throw;
+	}
+}
+
+bool Network::ftp_file_info(const std::string& path,
+	const std::string& filename, unsigned long *size, std::string *modified)
+{
+	try {
+		boost::asio::streambuf request;
+		std::ostream request_stream(&request);
+		boost::asio::streambuf response;
+		std::istream response_stream(&response);
+		unsigned int status_code;
+		bool found = false;
+
+		Span spanInfo("ftp", "file_info", this->host);
+		request_stream << "SIZE " << path << "/" << filename << "\r\n";
+		boost::asio::write(*this->ftp_conn, request);
+		EXPECT_FTP_STATUS(0);
+		if ((status_code == 213) && (this->ftp_last_reply.length() > 4)) {
+			*size = strtoul(this->ftp_last_reply.c_str() + 4, NULL, 10);
+			found = true;
+		} else if (verbose) {
+			std::cerr << "[ftp] SIZE not available: " << this->ftp_last_reply
+				<< std::endl;
+		}
+
+		request_stream << "MDTM " << path << "/" << filename << "\r\n";
+		boost::asio::write(*this->ftp_conn, request);
+		EXPECT_FTP_STATUS(0);
+		if ((status_code == 213) && (this->ftp_last_reply.length() > 4)) {
+			*modified = this->ftp_last_reply.substr(4);
+			found = true;
+		} else if (verbose) {
+			std::cerr << "[ftp] MDTM not available: " << this->ftp_last_reply
+				<< std::endl;
+		}
+		return found;
+	} catch (const boost::system::system_error&) {
+		// As in ftp_get(), make the next ftp_login() start afresh
+		this->ftp_conn.reset();
+		this->okFTP = false;
+		throw;
+	}
+}
+
+void Network::ftp_close()
 {
+	if (!this->ftp_conn) return;
+
+	// Forget the connection first, so it's gone even if QUIT fails
+	boost::shared_ptr<Connection> conn;
+	conn.swap(this->ftp_conn);
+	this->okFTP = false;
+
 	boost::asio::streambuf request;
 	std::ostream request_stream(&request);
-	boost::asio::streambuf response;
-	std::istream response_stream(&response);
 
-	if (verbose) std::cerr << "[ftp] Setting passive mode" << std::endl;
+	request_stream << "QUIT\r\n";
+	boost::asio::write(*conn, request);
+	conn->close();
+	return;
+}
 
-	request_stream << "PASV\r\n";
-	boost::asio::write(*this->ftp_socket, request);
+const std::string& Network::ftp_greeting()
+{
+	return this->ftp_greeting_line;
+}
 
-	boost::asio::read_until(*this->ftp_socket, response, "\r\n");
-	std::string line;
-	std::getline(response_stream, line);
+std::string Network::ftp_banner()
+{
+	if (this->okFTP) return this->ftp_greeting_line;
 
-	char *tok = strtok(const_cast<char *>(line.c_str()), " "); // status code
-	unsigned int status_code = strtoul(tok, NULL, 10);
-	if (status_code != 227) {
-		if (verbose) std::cerr << "[ftp] Unable to set passive mode: " << line
+	try {
+		boost::shared_ptr<Connection> conn = this->tcp_connect("ftp");
+		Connection& socket = *conn;
+		Span spanGreeting("ftp", "greeting", this->host);
+
+		boost::asio::streambuf response;
+		std::istream response_stream(&response);
+		boost::asio::read_until(socket, response, "\r\n");
+		spanGreeting.finish();
+		std::string line;
+		std::getline(response_stream, line);
+		if (!line.empty() && (line[line.length() - 1] == '\r')) {
+			line.erase(line.length() - 1);
+		}
+
+		boost::asio::write(socket, boost::asio::buffer("QUIT\r\n", 6));
+		socket.close();
+		if (verbose) std::cerr << "[ftp] Banner: " << line << std::endl;
+		return line;
+	} catch (const boost::system::system_error& e) {
+		if (verbose) std::cerr << "[ftp] Unable to read banner: " << e.what()
 			<< std::endl;
-		return false;
 	}
-	tok = strtok(NULL, "("); // rest of message
-	tok = strtok(NULL, ","); // ip1
-	tok = strtok(NULL, ","); // ip2
-	tok = strtok(NULL, ","); // ip3
-	tok = strtok(NULL, ","); // ip4
-	tok = strtok(NULL, ","); // port high
-	unsigned short port = strtoul(tok, NULL, 10) << 8;
-	tok = strtok(NULL, ","); // port low
-	port += strtoul(tok, NULL, 10);
-
-	// Have to convert to a string because boost::asio can't accept int ports
-	std::stringstream ss;
-	ss << port;
-
-	if (verbose) std::cerr << "[ftp] Passive ok, connecing to port " << port << std::endl;
-
-	boost::asio::io_service io_service_ftp_data;
-	boost::asio::ip::tcp::resolver resolver(io_service_ftp_data);
-	boost::asio::ip::tcp::resolver::query query(host, ss.str(), boost::asio::ip::resolver_query_base::numeric_service);
-	boost::asio::ip::tcp::resolver::iterator endpoint_iterator_ftp_data
-		= resolver.resolve(query);
-
-	boost::asio::ip::tcp::socket socket_data(io_service_ftp_data);
-	boost::asio::connect(socket_data, endpoint_iterator_ftp_data);
-	boost::asio::streambuf response_data;
-	std::istream response_data_stream(&response_data);
-
-	if (verbose) std::cerr << "[ftp] Beginning download" << std::endl;
-
-	request_stream << "CWD " << path << "\r\n";
-	boost::asio::write(*this->ftp_socket, request);
-	EXPECT_FTP_STATUS(250);
-
-	request_stream << "RETR " << filename << "\r\n";
-	boost::asio::write(*this->ftp_socket, request);
-	EXPECT_FTP_STATUS(150);
-
-	if (verbose) std::cerr << "[ftp] Receiving data" << std::endl;
-
-	unsigned long amount = 0, total = 0;
-	boost::system::error_code error;
-	while (boost::asio::read(socket_data, response_data,
-			boost::asio::transfer_at_least(1), error)
-	) {
-		amount += response_data.size();
-		target << &response_data;
-		fnProgress(amount, total);
-	}
-	fnProgress(amount, -1); // signal download complete
-	if (error != boost::asio::error::eof)
-		throw boost::system::system_error(error);
+	return std::string();
+}
 
-	EXPECT_FTP_STATUS(226);
-	socket_data.close();
+void Network::record(CaptureWriter *capture)
+{
+	this->capture_out = capture;
+	return;
+}
 
-	if (verbose) std::cerr << "[ftp] Download complete" << std::endl;
+void Network::replay(CaptureReader *capture)
+{
+	this->capture_in = capture;
+	return;
+}
 
-	return true;
+void Network::set_retry(const RetryPolicy& policy, CircuitBreaker *breaker)
+{
+	this->retry = policy;
+	this->breaker = breaker;
+	return;
 }
 
-void Network::ftp_close()
+const RetryPolicy& Network::retry_policy()
 {
-	boost::asio::streambuf request;
-	std::ostream request_stream(&request);
+	return this->retry;
+}
 
-	request_stream << "QUIT\r\n";
-	boost::asio::write(*this->ftp_socket, request);
-	this->ftp_socket->close();
+void Network::set_throttle(const ThrottleConfig& config)
+{
+	this->throttle_config = config;
+	return;
+}
 
-	this->okFTP = false;
+const ThrottleConfig& Network::throttle()
+{
+	return this->throttle_config;
+}
+
+void Network::set_login(const std::string& username, const std::string& password)
+{
+	this->username = username;
+	this->password = password;
 	return;
 }
 
+const std::string& Network::login_username()
+{
+	return this->username;
+}
+
+const std::string& Network::login_password()
+{
+	return this->password;
+}
+
 const std::string& Network::hostname()
 {
 	return this->host;
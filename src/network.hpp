@@ -21,11 +21,16 @@
 #ifndef NETWORK_HPP
 #define NETWORK_HPP
 
+#include <map>
 #include <string>
 #include <vector>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
+#include "capture.hpp"
+#include "connection.hpp"
 #include "device-interface.hpp"
+#include "retry.hpp"
+#include "throttle.hpp"
 
 class Network {
 	public:
@@ -36,6 +41,21 @@ class Network {
 		 */
 		Network(const std::string& host);
 
+		/// Use a non-standard port for a service.
+		/**
+		 * This is needed when a device is behind port forwarding, or when
+		 * testing against a local emulator that cannot bind to privileged ports.
+		 *
+		 * @param service
+		 *   Service name, e.g. "ftp", "telnet" or "http".  For HTTP, this
+		 *   replaces the default port, which set_http_port() can still override.
+		 *
+		 * @param port
+		 *   Port number to connect to instead of the standard one, or 0 to go
+		 *   back to the standard port.
+		 */
+		void set_port(const std::string& service, unsigned short port);
+
 		/// Change the port used for outgoing HTTP connections.
 		/**
 		 * @param port
@@ -67,14 +87,216 @@ class Network {
 		 */
 		std::string http_get(const std::string& path);
 
-		boost::shared_ptr<boost::asio::ip::tcp::socket> tcp_connect(
-			const std::string& service, boost::asio::io_service *tcp_service);
+		/// Download a file over HTTP, several parts at once if it is large.
+		/**
+		 * The first request asks for the start of the file with a Range
+		 * header.  If the server honours it and there is more to come, the
+		 * rest is split into ranges downloaded over separate connections at
+		 * the same time.  A server that ignores Range sends the whole file in
+		 * reply to the first request instead.
+		 *
+		 * While recording or replaying, the ranges are requested one after
+		 * another so the connections are always made in the same order.
+		 *
+		 * @param target
+		 *   Stream to write the file's content to.
+		 *
+		 * @param path
+		 *   Path to download, including any query string.
+		 *
+		 * @param connections
+		 *   Most connections to use at once.
+		 *
+		 * @param fnProgress
+		 *   Called as data arrives.  The total is 0 until the server has said
+		 *   how big the file is, and is (unsigned long)-1 once the file is
+		 *   complete.  May be empty.
+		 *
+		 * @return true on success, false if the server refused the request.
+		 *
+		 * @throw boost::system::system_error if a connection failed.
+		 */
+		bool http_get_ranges(std::ostream& target, const std::string& path,
+			unsigned int connections, fn_progress fnProgress);
+
+		/// Open a connection to a service on the device.
+		/**
+		 * @param service
+		 *   Service name, e.g. "telnet".  Any port set with set_port() (or
+		 *   set_http_port() for "http") is used in place of the standard one.
+		 *
+		 * @param port
+		 *   If nonzero, connect to this port number instead.  The service name
+		 *   is still used to identify the connection in captures.
+		 *
+		 * Only one attempt is made, as callers retry the whole operation
+		 * according to the policy given to set_retry(), which also sets how
+		 * long to wait for the device.
+		 *
+		 * @return The open connection.
+		 *
+		 * @throw boost::system::system_error if the connection failed, or with
+		 *   retry_error::circuit_open if the host has failed too often recently.
+		 */
+		boost::shared_ptr<Connection> tcp_connect(const std::string& service,
+			unsigned short port = 0);
 
 		bool ftp_login(const std::string& user, const std::string& pass);
+
+		/// Download a file over FTP.
+		/**
+		 * @param target
+		 *   Stream to write the file's content to.
+		 *
+		 * @param path
+		 *   Directory containing the file.
+		 *
+		 * @param filename
+		 *   File to download.
+		 *
+		 * @param fnProgress
+		 *   Called after each read.  The total is always 0 as the size is not
+		 *   known in advance, and is (unsigned long)-1 once the file is complete.
+		 *   May be empty.
+		 *
+		 * @param limit
+		 *   If not NULL, every read is passed through this bucket to cap the
+		 *   download speed.
+		 *
+		 * @return true on success, false if the file could not be retrieved.
+		 */
 		bool ftp_get(std::ostream& target, const std::string& path,
-			const std::string& filename, fn_progress fnProgress);
+			const std::string& filename, fn_progress fnProgress,
+			TokenBucket *limit = NULL);
+
+		/// Upload a file over FTP.
+		/**
+		 * Must be logged in with ftp_login() first.
+		 *
+		 * @param source
+		 *   Data to upload, read until the end of the stream.
+		 *
+		 * @param path
+		 *   Folder to put the file in.
+		 *
+		 * @param filename
+		 *   Name to give the file, replacing any existing file.
+		 *
+		 * @param fnProgress
+		 *   Called after each write with a total of 0, then with a total of
+		 *   (unsigned long)-1 once the server has accepted the file.  May be
+		 *   empty.
+		 *
+		 * @param limit
+		 *   If not NULL, every write is passed through this bucket to cap the
+		 *   upload speed.
+		 *
+		 * @return true on success, false if the server refused the file.
+		 */
+		bool ftp_put(std::istream& source, const std::string& path,
+			const std::string& filename, fn_progress fnProgress,
+			TokenBucket *limit = NULL);
+
+		/// Get the size and modification time of a file without downloading it.
+		/**
+		 * Uses the SIZE and MDTM commands, which not every server supports.
+		 * Must be logged in with ftp_login() first.
+		 *
+		 * @param path
+		 *   Folder containing the file.
+		 *
+		 * @param filename
+		 *   File to look at.
+		 *
+		 * @param size
+		 *   On return, the size in bytes, or unchanged if the server would not
+		 *   say.
+		 *
+		 * @param modified
+		 *   On return, the modification time as sent by the server
+		 *   (YYYYMMDDhhmmss, UTC), or unchanged if the server would not say.
+		 *
+		 * @return true if either value was found.
+		 */
+		bool ftp_file_info(const std::string& path, const std::string& filename,
+			unsigned long *size, std::string *modified);
+
 		void ftp_close();
 
+		/// Get the greeting sent by the FTP server during the last login.
+		/**
+		 * @return The 220 status line with any trailing \r removed, or an
+		 *   empty string if ftp_login() has not connected successfully.
+		 */
+		const std::string& ftp_greeting();
+
+		/// Connect to the FTP server only long enough to read its greeting.
+		/**
+		 * This is a cheap way to check whether a device is still the same one
+		 * seen previously, as the greeting usually includes the server version.
+		 *
+		 * @return The greeting line, or an empty string if FTP is unavailable.
+		 */
+		std::string ftp_banner();
+
+		/// Record all traffic to and from the device.
+		/**
+		 * @param capture
+		 *   Capture file to write to, or NULL to stop recording.  Must remain
+		 *   valid until this object is destroyed.
+		 */
+		void record(CaptureWriter *capture);
+
+		/// Replay traffic from a previous recording instead of connecting.
+		/**
+		 * @param capture
+		 *   Capture to serve connections from, or NULL to use the network again.
+		 *   Must remain valid until this object is destroyed.
+		 */
+		void replay(CaptureReader *capture);
+
+		/// Set how failed connections are retried.
+		/**
+		 * @param policy
+		 *   Number of attempts and delays between them, and the timeout for
+		 *   each connection, read and write.
+		 *
+		 * @param breaker
+		 *   Breaker to record successes and failures in, so hosts that keep
+		 *   failing are skipped, or NULL to always try.  Must remain valid until
+		 *   this object is destroyed.
+		 */
+		void set_retry(const RetryPolicy& policy, CircuitBreaker *breaker);
+
+		/// Get the policy set by set_retry().
+		const RetryPolicy& retry_policy();
+
+		/// Limit how fast firmware is downloaded.
+		/**
+		 * @param config
+		 *   Limits to apply.  Devices read these with throttle() when dumping.
+		 */
+		void set_throttle(const ThrottleConfig& config);
+
+		/// Get the limits set by set_throttle().
+		const ThrottleConfig& throttle();
+
+		/// Log in to the device's web interface with a different account.
+		/**
+		 * @param username
+		 *   Admin username, or empty to use the device's factory login.
+		 *
+		 * @param password
+		 *   Password for username.
+		 */
+		void set_login(const std::string& username, const std::string& password);
+
+		/// Get the username set by set_login(), empty for the factory login.
+		const std::string& login_username();
+
+		/// Get the password set by set_login().
+		const std::string& login_password();
+
 		/// Get the hostname we are connecting to.
 		/**
 		 * @return The value passed as 'host' to the constructor.
@@ -82,15 +304,51 @@ class Network {
 		const std::string& hostname();
 
 	private:
+		struct RangePart;
+		struct RangeProgress;
+
 		const std::string& host;
+		std::map<std::string, std::string> service_ports; ///< set_port() overrides
 		unsigned short port_http;
-		boost::asio::io_service io_service;
-		boost::asio::ip::tcp::resolver::iterator endpoint_iterator_http;
+		CaptureWriter *capture_out;
+		CaptureReader *capture_in;
+		ThrottleConfig throttle_config;
+		std::string username, password; ///< set_login() values
+		RetryPolicy retry;
+		CircuitBreaker *breaker;
 
 		bool okFTP; // true if FTP is connected
-		boost::asio::io_service io_service_ftp;
-		boost::asio::ip::tcp::resolver::iterator endpoint_iterator_ftp;
-		boost::shared_ptr<boost::asio::ip::tcp::socket> ftp_socket;
+		boost::shared_ptr<Connection> ftp_conn;
+		std::string ftp_last_reply; // last status line read by EXPECT_FTP_STATUS
+		std::string ftp_greeting_line;
+
+		/// Get the service name or port number to connect to for a service.
+		std::string service(const std::string& name);
+
+		/// Request part of a file over HTTP.
+		/**
+		 * @param first
+		 *   Offset of the first byte wanted.
+		 *
+		 * @param last
+		 *   Offset of the last byte wanted.
+		 *
+		 * @param content
+		 *   The body of the response is appended to this.
+		 *
+		 * @param total
+		 *   On return, the size of the whole file if the server sent a range,
+		 *   or 0 if it sent the whole file.
+		 *
+		 * @return The HTTP status code, or 0 if the response was not valid.
+		 */
+		unsigned int http_get_range(const std::string& path, unsigned long first,
+			unsigned long last, std::string *content, unsigned long *total,
+			RangeProgress *progress);
+
+		/// Download one part of a file, keeping any error for the caller.
+		void http_get_part(const std::string& path, RangePart *part,
+			RangeProgress *progress);
 };
 
 #endif // NETWORK_HPP
@@ -0,0 +1,388 @@
+/**
+ * @file   parse.cpp
+ * @brief  Parsers for data received from devices.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <string.h>
+#include "parse.hpp"
+
+/// Get the end of the line starting at pos, excluding any \r\n or \n.
+/**
+ * @param s
+ *   String to search.
+ *
+ * @param pos
+ *   Start of the line.
+ *
+ * @param next
+ *   On return, the start of the following line, or s.length() if this was the
+ *   last line.
+ *
+ * @return Offset of the first character after the line's content.
+ */
+static std::string::size_type line_end(const std::string& s,
+	std::string::size_type pos, std::string::size_type *next)
+{
+	std::string::size_type end = s.find('\n', pos);
+	if (end == std::string::npos) {
+		*next = end = s.length();
+	} else {
+		*next = end + 1;
+	}
+	if ((end > pos) && (s[end - 1] == '\r')) end--;
+	return end;
+}
+
+/// Read a number of up to a given value, advancing pos past it.
+/**
+ * @return true if at least one digit was read and the value is within range.
+ */
+static bool read_number(const std::string& s, std::string::size_type *pos,
+	int base, unsigned long max, unsigned long *value)
+{
+	std::string::size_type i = *pos;
+	unsigned long v = 0;
+	for (; i < s.length(); i++) {
+		char c = s[i];
+		unsigned int digit;
+		if ((c >= '0') && (c <= '9')) digit = c - '0';
+		else if ((base == 16) && (c >= 'a') && (c <= 'f')) digit = c - 'a' + 10;
+		else if ((base == 16) && (c >= 'A') && (c <= 'F')) digit = c - 'A' + 10;
+		else break;
+		v = v * base + digit;
+		if (v > max) return false;
+	}
+	if (i == *pos) return false;
+	*pos = i;
+	*value = v;
+	return true;
+}
+
+static void skip_spaces(const std::string& s, std::string::size_type *pos,
+	std::string::size_type end)
+{
+	while ((*pos < end) && ((s[*pos] == ' ') || (s[*pos] == '\t'))) (*pos)++;
+	return;
+}
+
+bool parse_http_status(const std::string& line, unsigned int *status)
+{
+	if (line.compare(0, 5, "HTTP/") != 0) return false;
+	std::string::size_type pos = line.find(' ', 5);
+	if (pos == std::string::npos) return false;
+	skip_spaces(line, &pos, line.length());
+	unsigned long code;
+	if (!read_number(line, &pos, 10, 999, &code)) return false;
+	*status = code;
+	return true;
+}
+
+std::vector<std::string> parse_http_headers(const std::string& block)
+{
+	std::vector<std::string> headers;
+	std::string::size_type pos = 0, next;
+	while (pos < block.length()) {
+		std::string::size_type end = line_end(block, pos, &next);
+		if (end == pos) break; // blank line ends the headers
+		headers.push_back(block.substr(pos, end - pos));
+		pos = next;
+	}
+	return headers;
+}
+
+bool parse_content_range(const std::string& value, unsigned long *first,
+	unsigned long *last, unsigned long *total)
+{
+	if (value.compare(0, 6, "bytes ") != 0) return false;
+	std::string::size_type pos = 6;
+	skip_spaces(value, &pos, value.length());
+	unsigned long a, b, t;
+	if (!read_number(value, &pos, 10, ULONG_MAX / 10, &a)) return false;
+	if ((pos >= value.length()) || (value[pos] != '-')) return false;
+	pos++;
+	if (!read_number(value, &pos, 10, ULONG_MAX / 10, &b)) return false;
+	if ((pos >= value.length()) || (value[pos] != '/')) return false;
+	pos++;
+	if (!read_number(value, &pos, 10, ULONG_MAX / 10, &t)) return false;
+	if ((a > b) || (b >= t)) return false;
+	*first = a;
+	*last = b;
+	*total = t;
+	return true;
+}
+
+bool parse_pasv(const std::string& line, unsigned short *port)
+{
+	if (line.compare(0, 4, "227 ") != 0) return false;
+
+	// The address is normally in brackets, but some servers leave them off, so
+	// just look for the first digit after the status code.
+	std::string::size_type pos = line.find('(', 4);
+	if (pos == std::string::npos) pos = 4;
+	pos = line.find_first_of("0123456789", pos);
+
+	unsigned long v[6];
+	for (int i = 0; i < 6; i++) {
+		if (pos == std::string::npos) return false;
+		if (!read_number(line, &pos, 10, 255, &v[i])) return false;
+		if (i < 5) {
+			skip_spaces(line, &pos, line.length());
+			if ((pos >= line.length()) || (line[pos] != ',')) return false;
+			pos++;
+			skip_spaces(line, &pos, line.length());
+		}
+	}
+	*port = (v[4] << 8) | v[5];
+	return true;
+}
+
+bool parse_proc_mtd(const std::string& content, std::vector<MTDPartition> *parts)
+{
+	std::string::size_type pos = 0, next;
+
+	// Skip any blank lines before the header
+	std::string::size_type end;
+	for (;;) {
+		if (pos >= content.length()) return false;
+		end = line_end(content, pos, &next);
+		skip_spaces(content, &pos, end);
+		if (pos < end) break;
+		pos = next;
+	}
+	if (content.compare(pos, 4, "dev:") != 0) return false;
+	pos = next;
+
+	while (pos < content.length()) {
+		end = line_end(content, pos, &next);
+
+		// mtd0: 00400000 00010000 "spi_flash"
+		MTDPartition part;
+		std::string::size_type colon = content.find(':', pos);
+		if ((colon != std::string::npos) && (colon < end)) {
+			std::string::size_type p = colon + 1;
+			skip_spaces(content, &p, end);
+			if (read_number(content, &p, 16, 0xFFFFFFFFUL, &part.size)) {
+				skip_spaces(content, &p, end);
+				if (read_number(content, &p, 16, 0xFFFFFFFFUL, &part.eraseSize)) {
+					part.dev = content.substr(pos, colon - pos);
+					skip_spaces(content, &p, end);
+					if ((p < end) && (content[p] == '"')) {
+						std::string::size_type q = content.find('"', p + 1);
+						if ((q == std::string::npos) || (q > end)) q = end;
+						part.name = content.substr(p + 1, q - p - 1);
+					} else {
+						part.name = content.substr(p, end - p);
+					}
+					parts->push_back(part);
+				}
+			}
+		}
+		pos = next;
+	}
+	return true;
+}
+
+bool parse_loadavg(const std::string& content, double *load1)
+{
+	std::string::size_type pos = 0;
+	skip_spaces(content, &pos, content.length());
+	unsigned long whole, fraction = 0, scale = 1;
+	if (!read_number(content, &pos, 10, 1000000, &whole)) return false;
+	if ((pos < content.length()) && (content[pos] == '.')) {
+		pos++;
+		// Only the first few decimal places matter
+		while ((pos < content.length()) && (content[pos] >= '0')
+			&& (content[pos] <= '9')
+		) {
+			if (scale < 1000000) {
+				fraction = fraction * 10 + (content[pos] - '0');
+				scale *= 10;
+			}
+			pos++;
+		}
+	}
+	*load1 = whole + (double)fraction / scale;
+	return true;
+}
+
+bool parse_proc_net_dev(const std::string& content, std::vector<NetDevice> *devs)
+{
+	bool found = false;
+	std::string::size_type pos = 0, next;
+	while (pos < content.length()) {
+		std::string::size_type end = line_end(content, pos, &next);
+
+		//   eth0:12345678  9876 0 0 0 0 0 0 87654321  6543 0 0 0 0 0 0
+		// There may be no space after the colon once the counter gets big.
+		std::string::size_type colon = content.find(':', pos);
+		if ((colon != std::string::npos) && (colon < end)) {
+			std::string::size_type start = pos;
+			skip_spaces(content, &start, colon);
+			std::string::size_type p = colon + 1;
+			unsigned long v[9];
+			int i;
+			for (i = 0; i < 9; i++) {
+				skip_spaces(content, &p, end);
+				if (!read_number(content, &p, 10, ULONG_MAX, &v[i])) break;
+			}
+			if ((i == 9) && (start < colon)) {
+				NetDevice dev;
+				dev.name = content.substr(start, colon - start);
+				dev.rxBytes = v[0];
+				dev.txBytes = v[8];
+				devs->push_back(dev);
+				found = true;
+			}
+		}
+		pos = next;
+	}
+	return found;
+}
+
+std::string base64_decode(const std::string& in)
+{
+	std::string out;
+	out.reserve(in.length() / 4 * 3);
+	unsigned long acc = 0;
+	int bits = 0;
+	for (std::string::const_iterator i = in.begin(); i != in.end(); i++) {
+		char c = *i;
+		unsigned int v;
+		if ((c >= 'A') && (c <= 'Z')) v = c - 'A';
+		else if ((c >= 'a') && (c <= 'z')) v = c - 'a' + 26;
+		else if ((c >= '0') && (c <= '9')) v = c - '0' + 52;
+		else if (c == '+') v = 62;
+		else if (c == '/') v = 63;
+		else if (c == '=') break;
+		else continue;
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out += (char)((acc >> bits) & 0xFF);
+		}
+	}
+	return out;
+}
+
+/// Get the value of a "key=" line from decoded credentials.
+static std::string cred_value(const std::string& cred, const char *key)
+{
+	std::string::size_type start = cred.find(key);
+	if (start == std::string::npos) return std::string();
+	start += strlen(key);
+	std::string::size_type next;
+	std::string::size_type end = line_end(cred, start, &next);
+	return cred.substr(start, end - start);
+}
+
+void parse_cs_ini(const std::string& content, unsigned int *httpPort,
+	std::string *user, std::string *pass)
+{
+	enum section {SECTION_NONE, SECTION_HTTP, SECTION_USR};
+	enum section curSection = SECTION_NONE;
+	*httpPort = 0;
+
+	std::string::size_type pos = 0, next;
+	while (pos < content.length()) {
+		std::string::size_type end = line_end(content, pos, &next);
+		std::string::size_type len = end - pos;
+		if ((len >= 6) && (content.compare(pos, 6, "[http]") == 0)) {
+			curSection = SECTION_HTTP;
+		} else if ((len >= 5) && (content.compare(pos, 5, "[usr]") == 0)) {
+			curSection = SECTION_USR;
+		} else if ((len >= 1) && (content[pos] == '[')) {
+			// Some other section we don't care about.  If we don't do this, a
+			// "port=" in "[smtp]" or similar can override the HTTP port.
+			curSection = SECTION_NONE;
+		} else if (
+			(curSection == SECTION_USR)
+			&& (len >= 3)
+			&& (content.compare(pos, 3, "ui=") == 0)
+		) {
+			// Base64-encoded "usr=...\r\npwd=...\r\n"
+			std::string cred = base64_decode(content.substr(pos + 3, len - 3));
+			*user = cred_value(cred, "usr=");
+			*pass = cred_value(cred, "pwd=");
+		} else if (
+			(curSection == SECTION_HTTP)
+			&& (len >= 5)
+			&& (content.compare(pos, 5, "port=") == 0)
+		) {
+			std::string::size_type p = pos + 5;
+			unsigned long port;
+			if (read_number(content, &p, 10, 65535, &port)) *httpPort = port;
+		}
+		pos = next;
+	}
+	return;
+}
+
+void parse_cgi_vars(const std::string& content,
+	std::map<std::string, std::string> *vars)
+{
+	vars->clear();
+	std::string::size_type pos = 0;
+	while ((pos = content.find("var ", pos)) != std::string::npos) {
+		pos += 4;
+		std::string::size_type eq = content.find('=', pos);
+		if (eq == std::string::npos) break;
+		std::string name = content.substr(pos, eq - pos);
+		if (name.find_first_of(" \t\r\n;") != std::string::npos) continue;
+		pos = eq + 1;
+		std::string::size_type end;
+		if ((pos < content.length()) && (content[pos] == '\'')) {
+			pos++;
+			end = content.find('\'', pos);
+			if (end == std::string::npos) break;
+			(*vars)[name] = content.substr(pos, end - pos);
+			pos = end + 1;
+		} else {
+			end = content.find_first_of(";\r\n", pos);
+			if (end == std::string::npos) end = content.length();
+			(*vars)[name] = content.substr(pos, end - pos);
+			pos = end;
+		}
+	}
+	return;
+}
+
+void parse_ini(const std::string& content, IniFile *ini)
+{
+	ini->clear();
+	IniSection *section = NULL;
+	std::string::size_type pos = 0, next;
+	while (pos < content.length()) {
+		std::string::size_type end = line_end(content, pos, &next);
+		std::string::size_type len = end - pos;
+		std::string::size_type eq;
+		if ((len >= 2) && (content[pos] == '[') && (content[end - 1] == ']')) {
+			section = &(*ini)[content.substr(pos + 1, len - 2)];
+		} else if (
+			((eq = content.find('=', pos)) != std::string::npos)
+			&& (eq > pos) && (eq < end)
+		) {
+			if (!section) section = &(*ini)[""];
+			(*section)[content.substr(pos, eq - pos)]
+				= content.substr(eq + 1, end - eq - 1);
+		}
+		pos = next;
+	}
+	return;
+}
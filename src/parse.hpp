@@ -0,0 +1,210 @@
+/**
+ * @file   parse.hpp
+ * @brief  Parsers for data received from devices.
+ *
+ * These are kept separate from the code doing the I/O so they can be
+ * benchmarked and fuzzed in isolation.  None of them trust their input.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARSE_HPP
+#define PARSE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+/// One line from /proc/mtd.
+struct MTDPartition
+{
+	std::string dev;         ///< Device name, e.g. "mtd0"
+	unsigned long size;      ///< Size in bytes
+	unsigned long eraseSize; ///< Erase block size in bytes
+	std::string name;        ///< Partition name, without quotes
+};
+
+/// One interface from /proc/net/dev.
+struct NetDevice
+{
+	std::string name;        ///< Interface name, e.g. "eth0"
+	unsigned long rxBytes;   ///< Bytes received, wraps at 2^32 on 32-bit kernels
+	unsigned long txBytes;   ///< Bytes sent, wraps at 2^32 on 32-bit kernels
+};
+
+/// Parse the status line of an HTTP response.
+/**
+ * @param line
+ *   First line of the response, e.g. "HTTP/1.0 200 OK", with or without the
+ *   trailing \r\n.
+ *
+ * @param status
+ *   On return, the numeric status code.
+ *
+ * @return true if this was a valid HTTP status line, false if not.
+ */
+bool parse_http_status(const std::string& line, unsigned int *status);
+
+/// Split a block of HTTP headers into individual lines.
+/**
+ * @param block
+ *   Headers following the status line, up to and including the blank line
+ *   that ends them.
+ *
+ * @return One string per header, with the trailing \r\n removed.  Parsing
+ *   stops at the first blank line.
+ */
+std::vector<std::string> parse_http_headers(const std::string& block);
+
+/// Parse the value of an HTTP Content-Range header.
+/**
+ * @param value
+ *   Header value, e.g. "bytes 0-262143/4194304".
+ *
+ * @param first
+ *   On return, offset of the first byte sent.
+ *
+ * @param last
+ *   On return, offset of the last byte sent.
+ *
+ * @param total
+ *   On return, size of the whole file.
+ *
+ * @return true if this was a valid byte range with a known total, false if
+ *   not.
+ */
+bool parse_content_range(const std::string& value, unsigned long *first,
+	unsigned long *last, unsigned long *total);
+
+/// Extract the data port from an FTP PASV reply.
+/**
+ * @param line
+ *   Reply to the PASV command, e.g.
+ *   "227 Entering Passive Mode (192,168,0,1,4,12)".
+ *
+ * @param port
+ *   On return, the port the server is listening on for the data connection.
+ *
+ * @return true if this was a valid 227 reply, false if not.
+ */
+bool parse_pasv(const std::string& line, unsigned short *port);
+
+/// Parse the output of "cat /proc/mtd".
+/**
+ * @param content
+ *   Command output, starting with the "dev:" header line.
+ *
+ * @param parts
+ *   On return, one entry for each partition listed.
+ *
+ * @return true if the header line was present, false if the content is not
+ *   from /proc/mtd.
+ */
+bool parse_proc_mtd(const std::string& content, std::vector<MTDPartition> *parts);
+
+/// Parse the first line of "cat /proc/loadavg".
+/**
+ * @param content
+ *   Command output, e.g. "0.52 0.48 0.40 1/45 123".
+ *
+ * @param load1
+ *   On return, the one-minute load average.
+ *
+ * @return true if the line started with a load average, false if not.
+ */
+bool parse_loadavg(const std::string& content, double *load1);
+
+/// Parse the output of "cat /proc/net/dev".
+/**
+ * Lines that are not interface counters are skipped, so this can be given
+ * the output of several files at once.
+ *
+ * @param content
+ *   Command output.
+ *
+ * @param devs
+ *   On return, one entry for each interface listed.
+ *
+ * @return true if at least one interface was found.
+ */
+bool parse_proc_net_dev(const std::string& content, std::vector<NetDevice> *devs);
+
+/// Decode base64 data.
+/**
+ * @param in
+ *   Encoded data.  Characters outside the base64 alphabet are skipped and
+ *   decoding stops at the first '='.
+ *
+ * @return Decoded data.
+ */
+std::string base64_decode(const std::string& in);
+
+/// Parse the variables set by a Netwave CGI script such as get_status.cgi.
+/**
+ * These are JavaScript statements of the form "var name='value';" or
+ * "var name=123;", normally one to a line.  Anything else is skipped.
+ *
+ * @param content
+ *   Script output.
+ *
+ * @param vars
+ *   On return, the value of each variable with any quotes removed.  Any
+ *   existing content is replaced.
+ */
+void parse_cgi_vars(const std::string& content,
+	std::map<std::string, std::string> *vars);
+
+/// Extract the interesting values from a MayGion cs.ini config file.
+/**
+ * @param content
+ *   Content of /tmp/eye/app/cs.ini.
+ *
+ * @param httpPort
+ *   On return, the port= value from the [http] section, or 0 if not present.
+ *
+ * @param user
+ *   On return, the web interface username from the [usr] section, or empty
+ *   if not present.
+ *
+ * @param pass
+ *   On return, the web interface password from the [usr] section, or empty
+ *   if not present.
+ */
+void parse_cs_ini(const std::string& content, unsigned int *httpPort,
+	std::string *user, std::string *pass);
+
+/// Keys and values in one section of an INI file.
+typedef std::map<std::string, std::string> IniSection;
+
+/// Sections of an INI file by name.  Keys before the first section header
+/// are in the section named "".
+typedef std::map<std::string, IniSection> IniFile;
+
+/// Parse an INI file such as cs.ini.
+/**
+ * Lines of the form "[section]" start a section and "key=value" lines set a
+ * key within it.  Whitespace is kept as-is, blank lines and anything else are
+ * ignored, and a repeated key keeps the last value.
+ *
+ * @param content
+ *   Content of the file.
+ *
+ * @param ini
+ *   On return, the sections found.  Any existing content is replaced.
+ */
+void parse_ini(const std::string& content, IniFile *ini);
+
+#endif // PARSE_HPP
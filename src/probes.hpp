@@ -0,0 +1,57 @@
+/**
+ * @file   probes.hpp
+ * @brief  USDT static tracepoints.
+ *
+ * When configured with --enable-usdt, these compile to a single nop each,
+ * which bpftrace, perf or SystemTap can attach to at runtime, e.g.
+ *
+ *   bpftrace -e 'usdt:./camtickler:camtickler:ftp__chunk { @[str(arg0)] = sum(arg1); }'
+ *
+ * Otherwise they compile to nothing and their arguments are not evaluated.
+ *
+ * Probes available (provider "camtickler"):
+ *
+ *   connect__start(host, service)
+ *   connect__done(host, service, error, microseconds)
+ *     error is 0 on success, otherwise the errno-style value
+ *   ftp__reply(host, status, line)
+ *   ftp__chunk(host, bytes, total)
+ *     bytes in this read and total received so far for the current file
+ *   telnet__prompt(host, bytes)
+ *     bytes read up to and including the shell prompt
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBES_HPP
+#define PROBES_HPP
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define PROBE2(name, a, b)       DTRACE_PROBE2(camtickler, name, a, b)
+#define PROBE3(name, a, b, c)    DTRACE_PROBE3(camtickler, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(camtickler, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#define PROBE4(name, a, b, c, d)
+#endif
+
+#endif // PROBES_HPP
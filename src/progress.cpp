@@ -0,0 +1,336 @@
+/**
+ * @file   progress.cpp
+ * @brief  Periodic progress reporting for transfers.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sstream>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include "json.hpp"
+#include "progress.hpp"
+
+/// Seconds over which the transfer rate is smoothed.
+#define RATE_TIME_CONSTANT 2.0
+
+struct ProgressMonitor::Transfer
+{
+	Transfer(const std::string& label, const std::string& host,
+		boost::condition_variable *wake)
+		: label(label),
+		  host(host),
+		  wake(wake),
+		  amount(0),
+		  total(0),
+		  complete(false),
+		  started(boost::posix_time::microsec_clock::universal_time()),
+		  lastAmount(0),
+		  lastSample(started),
+		  rate(-1),
+		  state(Running)
+	{
+	}
+
+	/// Called by the transfer function, possibly from another thread.
+	void update(unsigned long amount, unsigned long total)
+	{
+		this->amount.store(amount, boost::memory_order_relaxed);
+		if (total == (unsigned long)-1) {
+			this->complete.store(true, boost::memory_order_release);
+			// Report the completion now rather than at the next interval
+			this->wake->notify_one();
+			return;
+		}
+		this->total.store(total, boost::memory_order_relaxed);
+		return;
+	}
+
+	std::string label;
+	std::string host;
+	boost::condition_variable *wake;
+
+	// Written by update()
+	boost::atomic<uint64_t> amount;
+	boost::atomic<uint64_t> total;    ///< 0 if unknown
+	boost::atomic<bool> complete;
+
+	// Only used by the monitor thread
+	boost::posix_time::ptime started;
+	uint64_t lastAmount;
+	boost::posix_time::ptime lastSample;
+	double rate;                      ///< Bytes per second, or -1 if unknown
+	enum { Running, Done, Failed } state;
+};
+
+/// Transfer::state as shown in JSON output.
+static const char *state_names[] = {"running", "done", "failed"};
+
+/// Callback handed out when progress is not being shown.
+static void ignore_progress(unsigned long amount, unsigned long total)
+{
+	return;
+}
+
+/// Format a byte count for people, e.g. "1.5 MiB".
+static std::string format_bytes(double bytes)
+{
+	static const char *units[] = {"B", "KiB", "MiB", "GiB"};
+	unsigned int u = 0;
+	while ((bytes >= 1024) && (u < sizeof(units) / sizeof(units[0]) - 1)) {
+		bytes /= 1024;
+		u++;
+	}
+	char buf[32];
+	snprintf(buf, sizeof(buf), u ? "%.1f %s" : "%.0f %s", bytes, units[u]);
+	return buf;
+}
+
+/// Format a number of seconds as m:ss or h:mm:ss.
+static std::string format_duration(double seconds)
+{
+	unsigned long s = (unsigned long)(seconds + 0.5);
+	char buf[32];
+	if (s >= 3600) {
+		snprintf(buf, sizeof(buf), "%lu:%02lu:%02lu", s / 3600, (s / 60) % 60, s % 60);
+	} else {
+		snprintf(buf, sizeof(buf), "%lu:%02lu", s / 60, s % 60);
+	}
+	return buf;
+}
+
+/// Seconds between two times.
+static double seconds_between(boost::posix_time::ptime start,
+	boost::posix_time::ptime end)
+{
+	return (end - start).total_microseconds() / 1000000.0;
+}
+
+ProgressMonitor::ProgressMonitor(Mode mode, unsigned int interval,
+	std::ostream& out)
+	: mode(mode),
+	  interval(boost::posix_time::milliseconds(interval)),
+	  out(out),
+	  epoch(boost::posix_time::microsec_clock::universal_time()),
+	  stopping(false),
+	  lastWidth(0)
+{
+	if (this->mode != None) {
+		this->thread = boost::thread(boost::bind(&ProgressMonitor::run, this));
+	}
+}
+
+ProgressMonitor::~ProgressMonitor()
+{
+	if (this->mode == None) return;
+	{
+		boost::lock_guard<boost::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->wake.notify_one();
+	this->thread.join();
+}
+
+fn_progress ProgressMonitor::start(const std::string& label,
+	const std::string& host)
+{
+	if (this->mode == None) return ignore_progress;
+
+	boost::shared_ptr<Transfer> transfer(new Transfer(label, host, &this->wake));
+	{
+		boost::lock_guard<boost::mutex> lock(this->mutex);
+		this->transfers.push_back(transfer);
+	}
+	return boost::bind(&Transfer::update, transfer, _1, _2);
+}
+
+void ProgressMonitor::sync()
+{
+	if (this->mode == None) return;
+	boost::lock_guard<boost::mutex> lock(this->mutex);
+	this->sample();
+	return;
+}
+
+bool ProgressMonitor::parseMode(const std::string& name, Mode *mode)
+{
+	if (name.compare("auto") == 0) {
+		*mode = isatty(STDERR_FILENO) ? Bar : None;
+	} else if (name.compare("bar") == 0) {
+		*mode = Bar;
+	} else if (name.compare("json") == 0) {
+		*mode = Json;
+	} else if (name.compare("none") == 0) {
+		*mode = None;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void ProgressMonitor::run()
+{
+	boost::unique_lock<boost::mutex> lock(this->mutex);
+	while (!this->stopping) {
+		this->wake.timed_wait(lock, this->interval);
+		this->sample();
+	}
+	if (this->lastWidth) {
+		this->out << std::endl;
+		this->lastWidth = 0;
+	}
+	return;
+}
+
+void ProgressMonitor::sample()
+{
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+	for (std::vector<boost::shared_ptr<Transfer> >::iterator i = this->transfers.begin();
+		i != this->transfers.end(); i++
+	) {
+		Transfer& t = **i;
+		// Checked before reading the amount, so a finished transfer is always
+		// reported with its final size.
+		if (t.complete.load(boost::memory_order_acquire)) t.state = Transfer::Done;
+		else if (i->use_count() == 1) t.state = Transfer::Failed;
+		uint64_t amount = t.amount.load(boost::memory_order_relaxed);
+		double elapsed = seconds_between(t.lastSample, now);
+		if (elapsed > 0) {
+			double instant = (amount - t.lastAmount) / elapsed;
+			if (t.rate < 0) {
+				t.rate = instant;
+			} else {
+				// Exponentially weighted, with the weight scaled by the time since the
+				// last sample so the smoothing doesn't depend on the interval.
+				t.rate += (1 - exp(-elapsed / RATE_TIME_CONSTANT)) * (instant - t.rate);
+			}
+		}
+		t.lastAmount = amount;
+		t.lastSample = now;
+	}
+
+	if (this->mode == Bar) this->writeBar(now);
+	else this->writeJson(now);
+
+	// Forget any transfers that have been reported as finished
+	std::vector<boost::shared_ptr<Transfer> >::iterator i = this->transfers.begin();
+	while (i != this->transfers.end()) {
+		if ((*i)->state != Transfer::Running) {
+			i = this->transfers.erase(i);
+		} else {
+			i++;
+		}
+	}
+	return;
+}
+
+void ProgressMonitor::writeBar(boost::posix_time::ptime now)
+{
+	unsigned int active = 0;
+	uint64_t amount = 0, total = 0;
+	bool totalKnown = true;
+	double rate = 0;
+	std::string label;
+	for (std::vector<boost::shared_ptr<Transfer> >::iterator i = this->transfers.begin();
+		i != this->transfers.end(); i++
+	) {
+		Transfer& t = **i;
+		if (t.state != Transfer::Running) {
+			double elapsed = seconds_between(t.started, now);
+			std::stringstream line;
+			line << t.label << " from " << t.host << ": ";
+			if (t.state == Transfer::Done) {
+				line << t.lastAmount << " bytes in " << format_duration(elapsed);
+				if (elapsed > 0) line << " (" << format_bytes(t.lastAmount / elapsed) << "/s)";
+			} else {
+				line << "failed after " << t.lastAmount << " bytes";
+			}
+			this->writeLine(line.str(), true);
+			continue;
+		}
+		active++;
+		label = t.label;
+		amount += t.lastAmount;
+		uint64_t tTotal = t.total.load(boost::memory_order_relaxed);
+		if (tTotal) total += tTotal;
+		else totalKnown = false;
+		if (t.rate > 0) rate += t.rate;
+	}
+	if (!active) return;
+
+	std::stringstream line;
+	if (active == 1) line << label << ": ";
+	else line << active << " transfers: ";
+	line << format_bytes(amount);
+	if (totalKnown && total) {
+		line << " of " << format_bytes(total) << " (" << (amount * 100 / total) << "%)";
+	}
+	line << " at " << format_bytes(rate) << "/s";
+	if (totalKnown && total && (rate > 0) && (amount <= total)) {
+		line << ", ETA " << format_duration((total - amount) / rate);
+	}
+	this->writeLine(line.str(), false);
+	return;
+}
+
+void ProgressMonitor::writeJson(boost::posix_time::ptime now)
+{
+	for (std::vector<boost::shared_ptr<Transfer> >::iterator i = this->transfers.begin();
+		i != this->transfers.end(); i++
+	) {
+		Transfer& t = **i;
+		uint64_t total = t.total.load(boost::memory_order_relaxed);
+
+		this->out << "{\"elapsed\":" << seconds_between(this->epoch, now)
+			<< ",\"host\":";
+		write_json_string(this->out, t.host);
+		this->out << ",\"transfer\":";
+		write_json_string(this->out, t.label);
+		this->out << ",\"state\":\"" << state_names[t.state] << "\",\"bytes\":" << t.lastAmount
+			<< ",\"total\":";
+		if (total) this->out << total;
+		else this->out << "null";
+		this->out << ",\"rate\":" << (t.rate > 0 ? t.rate : 0) << ",\"eta\":";
+		if (total && (t.rate > 0) && (t.lastAmount <= total)) {
+			this->out << (total - t.lastAmount) / t.rate;
+		} else {
+			this->out << "null";
+		}
+		this->out << "}\n";
+	}
+	this->out << std::flush;
+	return;
+}
+
+void ProgressMonitor::writeLine(const std::string& line, bool final)
+{
+	this->out << '\r' << line;
+	if (line.length() < this->lastWidth) {
+		this->out << std::string(this->lastWidth - line.length(), ' ');
+	}
+	if (final) {
+		this->out << '\n';
+		this->lastWidth = 0;
+	} else {
+		this->lastWidth = line.length();
+	}
+	this->out << std::flush;
+	return;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file   progress.hpp
+ * @brief  Periodic progress reporting for transfers.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRESS_HPP
+#define PROGRESS_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "device-interface.hpp"
+
+/// Reports the progress of all running transfers at a fixed rate.
+/**
+ * The fn_progress callbacks handed out by start() only store the latest byte
+ * counts, so they are cheap enough to call on every read.  A background
+ * thread samples them every interval, smooths the transfer rate and writes
+ * either a single status line covering every transfer, or one JSON object
+ * per transfer per line.
+ */
+class ProgressMonitor
+{
+	public:
+		/// How progress is shown.
+		enum Mode {
+			None, ///< Nothing is shown, start() returns a callback that does nothing
+			Bar,  ///< Status line, rewritten in place
+			Json  ///< One JSON object per line, for other programs to read
+		};
+
+		/// Start reporting progress.
+		/**
+		 * @param mode
+		 *   How progress is shown.
+		 *
+		 * @param interval
+		 *   Milliseconds between updates.
+		 *
+		 * @param out
+		 *   Stream to write to, usually std::cerr.
+		 */
+		ProgressMonitor(Mode mode, unsigned int interval, std::ostream& out);
+
+		/// Report any transfers that have just finished and stop the thread.
+		~ProgressMonitor();
+
+		/// Begin tracking a transfer.
+		/**
+		 * The transfer is finished when the callback is passed a total of
+		 * (unsigned long)-1, as ftp_get() does on completion.  If every copy of
+		 * the callback is destroyed before that, the transfer is reported as
+		 * having failed.
+		 *
+		 * @param label
+		 *   Description of the transfer, e.g. "Downloading firmware".
+		 *
+		 * @param host
+		 *   Device the transfer is from.
+		 *
+		 * @return Callback to pass to the transfer function.  It may be called
+		 *   from any thread.
+		 */
+		fn_progress start(const std::string& label, const std::string& host);
+
+		/// Report progress now, from the calling thread.
+		/**
+		 * Call this after a transfer finishes and before writing anything else,
+		 * so the completed transfer is reported before the output that follows.
+		 */
+		void sync();
+
+		/// Parse a --progress value.
+		/**
+		 * @param name
+		 *   "bar", "json", "none", or "auto" for a bar if stderr is a terminal
+		 *   and nothing otherwise.
+		 *
+		 * @param mode
+		 *   Set to the mode on success.
+		 *
+		 * @return true on success, false if name is not a known mode.
+		 */
+		static bool parseMode(const std::string& name, Mode *mode);
+
+	private:
+		struct Transfer;
+
+		Mode mode;
+		boost::posix_time::time_duration interval;
+		std::ostream& out;
+		boost::posix_time::ptime epoch;
+
+		boost::mutex mutex;
+		boost::condition_variable wake;
+		bool stopping;
+		std::vector<boost::shared_ptr<Transfer> > transfers;
+		std::string::size_type lastWidth; ///< Length of the last status line
+		boost::thread thread;
+
+		void run();
+
+		/// Update the rate of every transfer and write out the progress.
+		/**
+		 * Must be called with the mutex held.
+		 */
+		void sample();
+
+		void writeBar(boost::posix_time::ptime now);
+		void writeJson(boost::posix_time::ptime now);
+
+		/// Write a status line, padded to overwrite the previous one.
+		void writeLine(const std::string& line, bool final);
+};
+
+#endif // PROGRESS_HPP
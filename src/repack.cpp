@@ -0,0 +1,1148 @@
+/**
+ * @file   repack.cpp
+ * @brief  Rebuild the filesystems inside a firmware image with changes.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "fileutil.hpp"
+#include "repack.hpp"
+#include "main.hpp"
+
+/// Identifies a squashfs superblock.
+#define SQUASHFS_MAGIC 0x73717368
+
+/// Size of a squashfs superblock.
+#define SQUASHFS_SUPERBLOCK_LEN 96
+
+/// Largest uncompressed squashfs metadata block.
+#define SQUASHFS_METADATA_SIZE 8192
+
+/// Marks a squashfs block or metadata stored without compression.
+#define SQUASHFS_BLOCK_RAW (1 << 24)
+#define SQUASHFS_META_RAW 0x8000
+
+/// Fragment index meaning a squashfs file has no tail fragment.
+#define SQUASHFS_NO_FRAGMENT 0xFFFFFFFF
+
+/// Superblock flag saying there are no extended attributes.
+#define SQUASHFS_NO_XATTRS 0x0200
+
+/// Longest name in a squashfs folder.
+#define SQUASHFS_MAX_NAME 256
+
+/// squashfs images are padded to a multiple of this, as mksquashfs does.
+#define SQUASHFS_PADDING 4096
+
+/// squashfs compression types that can be written.
+enum {
+	SquashGzip = 1,
+	SquashLZMA = 2,
+	SquashXZ = 4
+};
+
+/// JFFS2 node types and compression methods used here.
+#define JFFS2_MAGIC 0x1985
+#define JFFS2_NODETYPE_DIRENT 0xE001
+#define JFFS2_NODETYPE_INODE 0xE002
+#define JFFS2_NODETYPE_CLEANMARKER 0x2003
+#define JFFS2_COMPR_NONE 0x00
+#define JFFS2_COMPR_ZLIB 0x06
+
+/// Sizes of the JFFS2 nodes written, without their data.
+#define JFFS2_CLEANMARKER_LEN 12
+#define JFFS2_DIRENT_LEN 40
+#define JFFS2_INODE_LEN 68
+
+/// Most file data in one JFFS2 node, which is the kernel's page size.
+#define JFFS2_PAGE_SIZE 4096
+
+/// Longest name in a JFFS2 folder.
+#define JFFS2_MAX_NAME 254
+
+/// Erase block size assumed when there is no MTD layout to go by.
+#define REPACK_DEFAULT_ERASE 65536
+
+static void set16(unsigned char *p, uint16_t v, bool bigEndian)
+{
+	if (bigEndian) {
+		p[0] = v >> 8;
+		p[1] = v & 0xFF;
+	} else {
+		p[0] = v & 0xFF;
+		p[1] = v >> 8;
+	}
+	return;
+}
+
+static void set32(unsigned char *p, uint32_t v, bool bigEndian)
+{
+	set16(p + (bigEndian ? 0 : 2), v >> 16, bigEndian);
+	set16(p + (bigEndian ? 2 : 0), v & 0xFFFF, bigEndian);
+	return;
+}
+
+/// CRC used by JFFS2, which is zlib's with the inversions undone.
+static uint32_t jffs2Crc(const void *data, size_t len)
+{
+	return ~crc32(0xFFFFFFFF, (const Bytef *)data, len) & 0xFFFFFFFF;
+}
+
+static bool isZero(const char *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) if (data[i]) return false;
+	return true;
+}
+
+/// Where each entry sits in the folder tree.
+struct TreeNode
+{
+	size_t parent;
+	std::string name;
+	std::vector<size_t> children;  ///< Sorted by name
+};
+
+/// Orders entries by name, as squashfs folders must be.
+struct ByName
+{
+	const std::vector<TreeNode> *tree;
+
+	bool operator()(size_t a, size_t b) const
+	{
+		return (*this->tree)[a].name < (*this->tree)[b].name;
+	}
+};
+
+/// Work out the folder tree from the path of each entry.
+/**
+ * @throw std::string if the list doesn't start with the root folder, or
+ *   an entry comes before its folder.
+ */
+static void buildTree(const std::vector<FirmwareFile>& files,
+	std::vector<TreeNode> *tree)
+{
+	if (
+		files.empty() || (files[0].type != FirmwareFile::Directory)
+		|| (files[0].path.compare("/") != 0)
+	) {
+		throw std::string("the filesystem has no root folder");
+	}
+	tree->clear();
+	tree->resize(files.size());
+	(*tree)[0].parent = 0;
+	std::map<std::string, size_t> dirs;
+	dirs[""] = 0;
+	for (size_t i = 1; i < files.size(); i++) {
+		const std::string& path = files[i].path;
+		std::string::size_type slash = path.rfind('/');
+		std::map<std::string, size_t>::const_iterator parent =
+			dirs.find(path.substr(0, slash == std::string::npos ? 0 : slash));
+		if ((slash == std::string::npos) || (parent == dirs.end())) {
+			throw path + " is not inside a folder";
+		}
+		TreeNode& node = (*tree)[i];
+		node.parent = parent->second;
+		node.name = path.substr(slash + 1);
+		(*tree)[node.parent].children.push_back(i);
+		if (files[i].type == FirmwareFile::Directory) dirs[path] = i;
+	}
+	ByName byName;
+	byName.tree = tree;
+	for (size_t i = 0; i < tree->size(); i++) {
+		std::sort((*tree)[i].children.begin(), (*tree)[i].children.end(), byName);
+	}
+	return;
+}
+
+/// List a folder and everything in it, each folder after its content.
+static void postOrder(const std::vector<TreeNode>& tree, size_t node,
+	std::vector<size_t> *order)
+{
+	const std::vector<size_t>& children = tree[node].children;
+	for (std::vector<size_t>::const_iterator i = children.begin();
+		i != children.end(); i++
+	) {
+		postOrder(tree, *i, order);
+	}
+	order->push_back(node);
+	return;
+}
+
+/// Compress a squashfs block.
+/**
+ * Called from worker threads, so it only touches its arguments.
+ *
+ * @return false if the block didn't get any smaller, so should be stored
+ *   as it is.
+ *
+ * @throw std::string if the compression isn't supported.
+ */
+static bool squashCompress(unsigned int comp, uint32_t blockSize,
+	const char *in, size_t len, std::string *out)
+{
+	if (len < 2) return false;
+	switch (comp) {
+		case SquashGzip: {
+			uLongf outLen = compressBound(len);
+			out->resize(outLen);
+			if (compress2((Bytef *)&(*out)[0], &outLen, (const Bytef *)in, len, 9) != Z_OK) {
+				break;
+			}
+			out->resize(outLen);
+			return outLen < len;
+		}
+#ifdef HAVE_LIBLZMA
+		case SquashXZ: {
+			// Same settings as mksquashfs, so no compressor options are needed
+			lzma_options_lzma opt;
+			if (lzma_lzma_preset(&opt, 6)) break;
+			opt.dict_size = std::max<uint32_t>(blockSize, LZMA_DICT_SIZE_MIN);
+			lzma_filter filters[2];
+			filters[0].id = LZMA_FILTER_LZMA2;
+			filters[0].options = &opt;
+			filters[1].id = LZMA_VLI_UNKNOWN;
+			filters[1].options = NULL;
+			// Only room for a smaller result
+			out->resize(len - 1);
+			size_t outPos = 0;
+			lzma_ret ret = lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32, NULL,
+				(const uint8_t *)in, len, (uint8_t *)&(*out)[0], &outPos, len - 1);
+			if (ret == LZMA_BUF_ERROR) return false;
+			if (ret != LZMA_OK) break;
+			out->resize(outPos);
+			return true;
+		}
+		case SquashLZMA: {
+			lzma_options_lzma opt;
+			if (lzma_lzma_preset(&opt, 6)) break;
+			opt.dict_size = std::max<uint32_t>(blockSize, LZMA_DICT_SIZE_MIN);
+			lzma_stream strm = LZMA_STREAM_INIT;
+			if (lzma_alone_encoder(&strm, &opt) != LZMA_OK) break;
+			out->resize(len - 1);
+			strm.next_in = (const uint8_t *)in;
+			strm.avail_in = len;
+			strm.next_out = (uint8_t *)&(*out)[0];
+			strm.avail_out = len - 1;
+			lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+			size_t outLen = len - 1 - strm.avail_out;
+			lzma_end(&strm);
+			if ((ret == LZMA_OK) || (ret == LZMA_BUF_ERROR)) return false;
+			if ((ret != LZMA_STREAM_END) || (outLen < 13)) break;
+			out->resize(outLen);
+			// The header says the size is unknown, but the squashfs-lzma
+			// decompressors need to be told
+			for (unsigned int i = 0; i < 8; i++) {
+				(*out)[5 + i] = (char)(((uint64_t)len >> (i * 8)) & 0xFF);
+			}
+			return true;
+		}
+#endif
+	}
+	std::ostringstream ss;
+	ss << "squashfs compression type " << comp << " can't be written";
+	throw ss.str();
+}
+
+/// Compress a squashfs data block or fragment, working out its size word.
+/**
+ * Called from worker threads, so it only touches its arguments.
+ *
+ * @param sparse
+ *   true to store a block of zeroes as a hole, which is allowed for data
+ *   blocks but not fragments.
+ */
+static void squashPackTask(unsigned int comp, uint32_t blockSize,
+	const char *in, size_t len, bool sparse, std::string *out, uint32_t *size)
+{
+	if (sparse && isZero(in, len)) {
+		out->clear();
+		*size = 0;
+		return;
+	}
+	if (squashCompress(comp, blockSize, in, len, out)) {
+		*size = out->length();
+		return;
+	}
+	out->assign(in, len);
+	*size = len | SQUASHFS_BLOCK_RAW;
+	return;
+}
+
+/// Writes a squashfs metadata table in compressed 8 kB blocks.
+class SquashMetaWriter
+{
+	public:
+		SquashMetaWriter(unsigned int comp, uint32_t blockSize)
+			: comp(comp),
+			  blockSize(blockSize)
+		{
+		}
+
+		/// Get the reference to the next byte written.
+		/**
+		 * @return Offset of its block in the table in the upper bits, and its
+		 *   offset in the uncompressed block in the lower 16.
+		 */
+		uint64_t ref() const
+		{
+			return ((uint64_t)this->table.length() << 16) | this->pending.length();
+		}
+
+		void append(const std::string& data)
+		{
+			this->pending.append(data);
+			while (this->pending.length() >= SQUASHFS_METADATA_SIZE) {
+				this->flush(SQUASHFS_METADATA_SIZE);
+			}
+			return;
+		}
+
+		/// Write out the last block and get the whole table.
+		const std::string& finish()
+		{
+			if (!this->pending.empty()) this->flush(this->pending.length());
+			return this->table;
+		}
+
+		/// Offset of each block in the table.
+		const std::vector<uint64_t>& blockStarts() const
+		{
+			return this->blocks;
+		}
+
+	private:
+		unsigned int comp;
+		uint32_t blockSize;
+		std::string table;    ///< Blocks written so far
+		std::string pending;  ///< Content of the block being filled
+		std::vector<uint64_t> blocks;
+
+		void flush(size_t len)
+		{
+			this->blocks.push_back(this->table.length());
+			std::string packed;
+			if (squashCompress(this->comp, this->blockSize, this->pending.data(), len,
+				&packed)
+			) {
+				append16le(&this->table, packed.length());
+			} else {
+				packed.assign(this->pending, 0, len);
+				append16le(&this->table, len | SQUASHFS_META_RAW);
+			}
+			this->table.append(packed);
+			this->pending.erase(0, len);
+			return;
+		}
+};
+
+/// Write a table of entries as metadata blocks, followed by the position of
+/// each block.
+/**
+ * @return Position of the list of blocks, which is what the superblock
+ *   points to.
+ */
+static uint64_t squashTable(unsigned int comp, uint32_t blockSize,
+	const std::string& entries, std::string *out)
+{
+	SquashMetaWriter meta(comp, blockSize);
+	meta.append(entries);
+	uint64_t start = out->length();
+	out->append(meta.finish());
+	uint64_t index = out->length();
+	const std::vector<uint64_t>& blocks = meta.blockStarts();
+	for (std::vector<uint64_t>::const_iterator i = blocks.begin();
+		i != blocks.end(); i++
+	) {
+		append64le(out, start + *i);
+	}
+	return index;
+}
+
+/// Get the basic squashfs inode type for an entry.
+static uint16_t squashType(const FirmwareFile& file)
+{
+	switch (file.type) {
+		case FirmwareFile::Directory: return 1;
+		case FirmwareFile::File: return 2;
+		case FirmwareFile::Symlink: return 3;
+		case FirmwareFile::Other: break;
+	}
+	switch (file.mode & S_IFMT) {
+		case S_IFBLK: return 4;
+		case S_IFCHR: return 5;
+		case S_IFIFO: return 6;
+		case S_IFSOCK: return 7;
+	}
+	throw file.path + " is not a kind of file squashfs can hold";
+}
+
+void buildSquashFS(const std::vector<FirmwareFile>& files,
+	const std::vector<std::string>& contents, const FirmwareFSFormat& fmt,
+	TaskPool *pool, std::string *out)
+{
+	unsigned int comp = fmt.compression;
+	uint32_t blockSize = fmt.blockSize;
+	uint16_t blockLog = 12;
+	while ((blockLog < 20) && ((1u << blockLog) < blockSize)) blockLog++;
+	if ((1u << blockLog) != blockSize) throw std::string("squashfs block size is invalid");
+
+	std::vector<TreeNode> tree;
+	buildTree(files, &tree);
+
+	// Owners and groups are stored once each, and referred to by index
+	std::map<uint32_t, uint16_t> ids;
+	std::string idTable;
+	uint32_t mkfsTime = 0;
+	for (std::vector<FirmwareFile>::const_iterator i = files.begin();
+		i != files.end(); i++
+	) {
+		uint32_t owners[2] = {i->uid, i->gid};
+		for (unsigned int o = 0; o < 2; o++) {
+			if (ids.find(owners[o]) != ids.end()) continue;
+			if (ids.size() >= 0xFFFF) throw std::string("too many owners for squashfs");
+			uint16_t index = ids.size();
+			ids[owners[o]] = index;
+			append32le(&idTable, owners[o]);
+		}
+		// Newest file as the creation time, so the same files give the same
+		// image
+		mkfsTime = std::max(mkfsTime, i->mtime);
+	}
+
+	// Compress every full block of every file at once, and pack the tails
+	// of files together into fragments
+	std::vector<std::vector<std::string> > blocks(files.size());
+	std::vector<std::vector<uint32_t> > sizes(files.size());
+	std::vector<uint32_t> fragment(files.size(), SQUASHFS_NO_FRAGMENT);
+	std::vector<uint32_t> fragOffset(files.size(), 0);
+	std::vector<std::string> fragments;
+	for (size_t f = 0; f < files.size(); f++) {
+		if (files[f].type != FirmwareFile::File) continue;
+		const std::string& content = contents[f];
+		if (content.length() > 0xFFFFFFFFu) {
+			throw files[f].path + " is too large for squashfs";
+		}
+		size_t full = content.length() / blockSize;
+		blocks[f].resize(full);
+		sizes[f].resize(full);
+		for (size_t b = 0; b < full; b++) {
+			pool->post(boost::bind(squashPackTask, comp, blockSize,
+				content.data() + b * blockSize, (size_t)blockSize, true,
+				&blocks[f][b], &sizes[f][b]));
+		}
+		size_t tail = content.length() % blockSize;
+		if (tail == 0) continue;
+		if (fragments.empty() || (fragments.back().length() + tail > blockSize)) {
+			fragments.push_back(std::string());
+		}
+		fragment[f] = fragments.size() - 1;
+		fragOffset[f] = fragments.back().length();
+		fragments.back().append(content, content.length() - tail, tail);
+	}
+	std::vector<std::string> packedFrags(fragments.size());
+	std::vector<uint32_t> fragSizes(fragments.size());
+	for (size_t i = 0; i < fragments.size(); i++) {
+		pool->post(boost::bind(squashPackTask, comp, blockSize, fragments[i].data(),
+			fragments[i].length(), false, &packedFrags[i], &fragSizes[i]));
+	}
+	pool->wait();
+
+	// Data blocks of each file in turn, then the fragments
+	out->assign(SQUASHFS_SUPERBLOCK_LEN, '\0');
+	std::vector<uint64_t> start(files.size(), 0);
+	for (size_t f = 0; f < files.size(); f++) {
+		start[f] = out->length();
+		for (size_t b = 0; b < blocks[f].size(); b++) {
+			out->append(blocks[f][b]);
+			std::string().swap(blocks[f][b]);
+		}
+	}
+	if (out->length() > 0xFFFFFFFFu) throw std::string("too much data for squashfs");
+	std::string fragTable;
+	for (size_t i = 0; i < packedFrags.size(); i++) {
+		append64le(&fragTable, out->length());
+		append32le(&fragTable, fragSizes[i]);
+		append32le(&fragTable, 0);
+		out->append(packedFrags[i]);
+	}
+
+	// Inodes are numbered in the order they are written, which puts each
+	// folder after its content so its listing can refer to their inodes
+	std::vector<size_t> order;
+	postOrder(tree, 0, &order);
+	std::vector<uint32_t> ino(files.size());
+	for (size_t i = 0; i < order.size(); i++) ino[order[i]] = i + 1;
+	std::vector<uint64_t> ref(files.size());
+	SquashMetaWriter inodes(comp, blockSize), dirs(comp, blockSize);
+	for (std::vector<size_t>::const_iterator o = order.begin(); o != order.end(); o++) {
+		size_t i = *o;
+		const FirmwareFile& file = files[i];
+		uint16_t type = squashType(file);
+		std::string detail;
+		switch (type) {
+			case 1: {
+				// Entries are grouped under headers giving the metadata block
+				// and a base inode number that they are relative to
+				const std::vector<size_t>& children = tree[i].children;
+				uint64_t listing = dirs.ref();
+				std::string entries;
+				uint32_t subdirs = 0;
+				size_t c = 0;
+				while (c < children.size()) {
+					uint64_t block = ref[children[c]] >> 16;
+					int64_t base = ino[children[c]];
+					size_t end = c;
+					while (
+						(end < children.size()) && (end - c < 256)
+						&& ((ref[children[end]] >> 16) == block)
+						&& (ino[children[end]] - base >= -32768)
+						&& (ino[children[end]] - base <= 32767)
+					) {
+						end++;
+					}
+					append32le(&entries, end - c - 1);
+					append32le(&entries, block);
+					append32le(&entries, base);
+					for (; c < end; c++) {
+						size_t e = children[c];
+						const std::string& name = tree[e].name;
+						if (name.empty() || (name.length() > SQUASHFS_MAX_NAME)) {
+							throw files[e].path + " has a name too long for squashfs";
+						}
+						append16le(&entries, ref[e] & 0xFFFF);
+						append16le(&entries, (uint16_t)(ino[e] - base));
+						append16le(&entries, squashType(files[e]));
+						append16le(&entries, name.length() - 1);
+						entries.append(name);
+						if (files[e].type == FirmwareFile::Directory) subdirs++;
+					}
+				}
+				dirs.append(entries);
+
+				// The root's parent is one past the last inode
+				uint32_t parent = i ? ino[tree[i].parent] : files.size() + 1;
+				uint32_t dirSize = entries.length() + 3;
+				if (dirSize <= 0xFFFF) {
+					append32le(&detail, listing >> 16);
+					append32le(&detail, 2 + subdirs);
+					append16le(&detail, dirSize);
+					append16le(&detail, listing & 0xFFFF);
+					append32le(&detail, parent);
+				} else {
+					// Extended folder, with an empty index
+					type = 8;
+					append32le(&detail, 2 + subdirs);
+					append32le(&detail, dirSize);
+					append32le(&detail, listing >> 16);
+					append32le(&detail, parent);
+					append16le(&detail, 0);
+					append16le(&detail, listing & 0xFFFF);
+					append32le(&detail, 0xFFFFFFFF);
+				}
+				break;
+			}
+			case 2:
+				append32le(&detail, start[i]);
+				append32le(&detail, fragment[i]);
+				append32le(&detail, fragOffset[i]);
+				append32le(&detail, contents[i].length());
+				for (size_t b = 0; b < sizes[i].size(); b++) append32le(&detail, sizes[i][b]);
+				break;
+			case 3:
+				append32le(&detail, 1);
+				append32le(&detail, file.target.length());
+				detail.append(file.target);
+				break;
+			case 4:
+			case 5:
+				append32le(&detail, 1);
+				append32le(&detail, file.rdev);
+				break;
+			default:
+				append32le(&detail, 1);
+				break;
+		}
+		std::string inode;
+		append16le(&inode, type);
+		append16le(&inode, file.mode & 07777);
+		append16le(&inode, ids[file.uid]);
+		append16le(&inode, ids[file.gid]);
+		append32le(&inode, file.mtime);
+		append32le(&inode, ino[i]);
+		inode.append(detail);
+		ref[i] = inodes.ref();
+		inodes.append(inode);
+	}
+
+	uint64_t inodeTable = out->length();
+	out->append(inodes.finish());
+	uint64_t dirTable = out->length();
+	out->append(dirs.finish());
+	uint64_t fragIndex = squashTable(comp, blockSize, fragTable, out);
+	uint64_t idIndex = squashTable(comp, blockSize, idTable, out);
+
+	std::string sb;
+	append32le(&sb, SQUASHFS_MAGIC);
+	append32le(&sb, files.size());
+	append32le(&sb, mkfsTime);
+	append32le(&sb, blockSize);
+	append32le(&sb, fragments.size());
+	append16le(&sb, comp);
+	append16le(&sb, blockLog);
+	append16le(&sb, SQUASHFS_NO_XATTRS);
+	append16le(&sb, ids.size());
+	append16le(&sb, 4);
+	append16le(&sb, 0);
+	append64le(&sb, ref[0]);
+	append64le(&sb, out->length());
+	append64le(&sb, idIndex);
+	append64le(&sb, ~(uint64_t)0); // no extended attributes
+	append64le(&sb, inodeTable);
+	append64le(&sb, dirTable);
+	append64le(&sb, fragIndex);
+	append64le(&sb, ~(uint64_t)0); // no export table
+	out->replace(0, SQUASHFS_SUPERBLOCK_LEN, sb);
+	if (out->length() % SQUASHFS_PADDING) {
+		out->append(SQUASHFS_PADDING - out->length() % SQUASHFS_PADDING, '\0');
+	}
+	return;
+}
+
+/// Compress one page of a JFFS2 file with zlib, if that makes it smaller.
+/**
+ * Called from worker threads, so it only touches its arguments.
+ */
+static void jffs2PageTask(const char *in, size_t len, bool zlib,
+	std::string *out, unsigned char *compr)
+{
+	if (zlib && len) {
+		uLongf outLen = compressBound(len);
+		out->resize(outLen);
+		if (
+			(compress2((Bytef *)&(*out)[0], &outLen, (const Bytef *)in, len, 9) == Z_OK)
+			&& (outLen < len)
+		) {
+			out->resize(outLen);
+			*compr = JFFS2_COMPR_ZLIB;
+			return;
+		}
+	}
+	out->assign(in, len);
+	*compr = JFFS2_COMPR_NONE;
+	return;
+}
+
+/// Lays out JFFS2 nodes in erase blocks.
+class JFFS2Writer
+{
+	public:
+		/// Start writing.
+		/**
+		 * @param out
+		 *   Image to append to.
+		 */
+		JFFS2Writer(uint32_t eraseSize, bool bigEndian, std::string *out)
+			: eraseSize(eraseSize),
+			  bigEndian(bigEndian),
+			  version(1),
+			  out(out)
+		{
+		}
+
+		/// Add an entry to a folder.
+		void dirent(uint32_t parent, uint32_t ino, const FirmwareFile& file,
+			const std::string& name)
+		{
+			if (name.empty() || (name.length() > JFFS2_MAX_NAME)) {
+				throw file.path + " has a name too long for jffs2";
+			}
+			std::string node(JFFS2_DIRENT_LEN + name.length(), '\0');
+			unsigned char *p = (unsigned char *)&node[0];
+			this->header(p, JFFS2_NODETYPE_DIRENT, node.length());
+			set32(p + 12, parent, this->bigEndian);
+			set32(p + 16, this->version++, this->bigEndian);
+			set32(p + 20, ino, this->bigEndian);
+			set32(p + 24, file.mtime, this->bigEndian);
+			p[28] = name.length();
+			p[29] = (file.mode & S_IFMT) >> 12;
+			set32(p + 32, jffs2Crc(p, 32), this->bigEndian);
+			set32(p + 36, jffs2Crc(name.data(), name.length()), this->bigEndian);
+			memcpy(p + JFFS2_DIRENT_LEN, name.data(), name.length());
+			this->add(node);
+			return;
+		}
+
+		/// Add an inode with some of its data.
+		/**
+		 * @param size
+		 *   Size of the whole file.
+		 *
+		 * @param offset
+		 *   Where the data goes in the file.
+		 *
+		 * @param dataLen
+		 *   Size of the data once decompressed.
+		 *
+		 * @param compr
+		 *   How the data is compressed.
+		 */
+		void inode(uint32_t ino, const FirmwareFile& file, uint32_t size,
+			uint32_t offset, uint32_t dataLen, unsigned char compr,
+			const std::string& data)
+		{
+			std::string node(JFFS2_INODE_LEN + data.length(), '\0');
+			unsigned char *p = (unsigned char *)&node[0];
+			this->header(p, JFFS2_NODETYPE_INODE, node.length());
+			set32(p + 12, ino, this->bigEndian);
+			set32(p + 16, this->version++, this->bigEndian);
+			set32(p + 20, file.mode, this->bigEndian);
+			set16(p + 24, file.uid, this->bigEndian);
+			set16(p + 26, file.gid, this->bigEndian);
+			set32(p + 28, size, this->bigEndian);
+			set32(p + 32, file.mtime, this->bigEndian); // atime
+			set32(p + 36, file.mtime, this->bigEndian);
+			set32(p + 40, file.mtime, this->bigEndian); // ctime
+			set32(p + 44, offset, this->bigEndian);
+			set32(p + 48, data.length(), this->bigEndian);
+			set32(p + 52, dataLen, this->bigEndian);
+			p[56] = compr;
+			set32(p + 60, jffs2Crc(data.data(), data.length()), this->bigEndian);
+			set32(p + 64, jffs2Crc(p, 60), this->bigEndian);
+			if (!data.empty()) memcpy(p + JFFS2_INODE_LEN, data.data(), data.length());
+			this->add(node);
+			return;
+		}
+
+	private:
+		uint32_t eraseSize;
+		bool bigEndian;
+		uint32_t version;  ///< Next node version, shared by every inode
+		std::string *out;
+
+		void header(unsigned char *p, uint16_t type, uint32_t len)
+		{
+			set16(p, JFFS2_MAGIC, this->bigEndian);
+			set16(p + 2, type, this->bigEndian);
+			set32(p + 4, len, this->bigEndian);
+			set32(p + 8, jffs2Crc(p, 8), this->bigEndian);
+			return;
+		}
+
+		/// Append a node, moving on to the next erase block if it won't fit.
+		void add(const std::string& node)
+		{
+			size_t pos = this->out->length() % this->eraseSize;
+			if (pos && (pos + node.length() > this->eraseSize)) {
+				this->out->append(this->eraseSize - pos, '\xFF');
+				pos = 0;
+			}
+			if (pos == 0) {
+				unsigned char marker[JFFS2_CLEANMARKER_LEN];
+				this->header(marker, JFFS2_NODETYPE_CLEANMARKER, sizeof(marker));
+				this->out->append((const char *)marker, sizeof(marker));
+			}
+			this->out->append(node);
+			if (this->out->length() % 4) {
+				this->out->append(4 - this->out->length() % 4, '\xFF');
+			}
+			return;
+		}
+};
+
+void buildJFFS2(const std::vector<FirmwareFile>& files,
+	const std::vector<std::string>& contents, const FirmwareFSFormat& fmt,
+	uint32_t eraseSize, TaskPool *pool, std::string *out)
+{
+	// Data nodes are split further if they wouldn't fit in an erase block
+	// along with its clean marker
+	if ((eraseSize < 1024) || (eraseSize % 4)) {
+		throw std::string("jffs2 erase block size is invalid");
+	}
+	uint32_t page = std::min<uint32_t>(JFFS2_PAGE_SIZE,
+		(eraseSize - JFFS2_CLEANMARKER_LEN - JFFS2_INODE_LEN) & ~3);
+
+	std::vector<TreeNode> tree;
+	buildTree(files, &tree);
+
+	// Compress every page of every file at once
+	bool zlib = fmt.compression == JFFS2_COMPR_ZLIB;
+	std::vector<std::vector<std::string> > pages(files.size());
+	std::vector<std::vector<unsigned char> > compr(files.size());
+	for (size_t f = 0; f < files.size(); f++) {
+		if (files[f].type != FirmwareFile::File) continue;
+		const std::string& content = contents[f];
+		if (content.length() > 0xFFFFFFFFu) throw files[f].path + " is too large for jffs2";
+		size_t count = (content.length() + page - 1) / page;
+		pages[f].resize(count);
+		compr[f].resize(count);
+		for (size_t p = 0; p < count; p++) {
+			size_t offset = p * page;
+			pool->post(boost::bind(jffs2PageTask, content.data() + offset,
+				std::min<size_t>(page, content.length() - offset), zlib, &pages[f][p],
+				&compr[f][p]));
+		}
+	}
+	pool->wait();
+
+	// Inode numbers follow the list, which makes the root 1 as it must be
+	out->clear();
+	JFFS2Writer writer(eraseSize, fmt.bigEndian, out);
+	for (size_t i = 0; i < files.size(); i++) {
+		const FirmwareFile& file = files[i];
+		uint32_t ino = i + 1;
+		if (i) writer.dirent(tree[i].parent + 1, ino, file, tree[i].name);
+		switch (file.type) {
+			case FirmwareFile::File: {
+				uint32_t size = contents[i].length();
+				if (pages[i].empty()) writer.inode(ino, file, 0, 0, 0, JFFS2_COMPR_NONE, "");
+				for (size_t p = 0; p < pages[i].size(); p++) {
+					uint32_t offset = p * page;
+					writer.inode(ino, file, size, offset, std::min(page, size - offset),
+						compr[i][p], pages[i][p]);
+					std::string().swap(pages[i][p]);
+				}
+				break;
+			}
+			case FirmwareFile::Symlink:
+				writer.inode(ino, file, file.target.length(), 0, file.target.length(),
+					JFFS2_COMPR_NONE, file.target);
+				break;
+			case FirmwareFile::Other:
+				if (S_ISCHR(file.mode) || S_ISBLK(file.mode)) {
+					// The device number is the data, in the new 32-bit form
+					unsigned char dev[4];
+					set32(dev, file.rdev, fmt.bigEndian);
+					writer.inode(ino, file, sizeof(dev), 0, sizeof(dev), JFFS2_COMPR_NONE,
+						std::string((const char *)dev, sizeof(dev)));
+					break;
+				}
+				writer.inode(ino, file, 0, 0, 0, JFFS2_COMPR_NONE, "");
+				break;
+			case FirmwareFile::Directory:
+				writer.inode(ino, file, 0, 0, 0, JFFS2_COMPR_NONE, "");
+				break;
+		}
+	}
+	return;
+}
+
+/// A file to go into a rebuilt filesystem.
+struct RepackEntry
+{
+	FirmwareFile file;
+	std::string content;
+};
+
+/// Everything in a filesystem by path, which puts each folder before its
+/// content.
+typedef std::map<std::string, RepackEntry> RepackTree;
+
+/// Remove an entry, and everything in it if it's a folder.
+/**
+ * @return true if there was anything to remove.
+ */
+static bool removePath(RepackTree *tree, const std::string& path)
+{
+	bool found = tree->erase(path) > 0;
+	std::string prefix = path + "/";
+	RepackTree::iterator i = tree->lower_bound(prefix);
+	while ((i != tree->end()) && (i->first.compare(0, prefix.length(), prefix) == 0)) {
+		tree->erase(i++);
+		found = true;
+	}
+	return found;
+}
+
+/// Apply one folder of an overlay.
+/**
+ * @param dir
+ *   Folder on disk.
+ *
+ * @param path
+ *   Where it is in the filesystem.
+ *
+ * @return Number of entries added, replaced or removed.
+ *
+ * @throw std::string if the overlay could not be read.
+ */
+static unsigned long applyOverlay(const std::string& dir, const std::string& path,
+	RepackTree *tree)
+{
+	DIR *d = opendir(dir.c_str());
+	if (!d) throw "unable to read " + dir + ": " + strerror(errno);
+	std::vector<std::string> names;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		std::string name = e->d_name;
+		if ((name.compare(".") != 0) && (name.compare("..") != 0)) names.push_back(name);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	std::string prefix = (path.compare("/") == 0) ? "" : path;
+	unsigned long changed = 0;
+
+	// Removals first, so "x" and ".wh.x" together replace a folder outright
+	for (std::vector<std::string>::const_iterator i = names.begin();
+		i != names.end(); i++
+	) {
+		if (i->compare(0, 4, ".wh.") != 0) continue;
+		if (removePath(tree, prefix + "/" + i->substr(4))) changed++;
+	}
+
+	for (std::vector<std::string>::const_iterator i = names.begin();
+		i != names.end(); i++
+	) {
+		if (i->compare(0, 4, ".wh.") == 0) continue;
+		std::string src = dir + "/" + *i;
+		struct stat st;
+		if (lstat(src.c_str(), &st) != 0) {
+			throw "unable to read " + src + ": " + strerror(errno);
+		}
+		RepackEntry entry;
+		entry.file.path = prefix + "/" + *i;
+		entry.file.size = 0;
+		entry.file.mode = st.st_mode;
+		entry.file.uid = 0;
+		entry.file.gid = 0;
+		entry.file.mtime = st.st_mtime;
+		entry.file.rdev = 0;
+		entry.file.ref = 0;
+		if (S_ISDIR(st.st_mode)) {
+			entry.file.type = FirmwareFile::Directory;
+		} else if (S_ISREG(st.st_mode)) {
+			entry.file.type = FirmwareFile::File;
+			std::ifstream file(src.c_str(), std::ios::in | std::ios::binary);
+			std::stringstream content;
+			content << file.rdbuf();
+			if (!file) throw "unable to read " + src;
+			entry.content = content.str();
+			entry.file.size = entry.content.length();
+		} else if (S_ISLNK(st.st_mode)) {
+			entry.file.type = FirmwareFile::Symlink;
+			std::vector<char> target(st.st_size + 1);
+			ssize_t len = readlink(src.c_str(), &target[0], target.size());
+			if ((len < 0) || ((size_t)len >= target.size())) {
+				throw "unable to read " + src + ": " + strerror(errno);
+			}
+			entry.file.target.assign(&target[0], len);
+		} else {
+			if (verbose) std::cerr << "[repack] Skipping special file " << src
+				<< std::endl;
+			continue;
+		}
+
+		RepackTree::iterator existing = tree->find(entry.file.path);
+		if ((existing != tree->end()) && (existing->second.file.type == entry.file.type)) {
+			// Replacing something keeps its owner and permissions
+			RepackEntry& old = existing->second;
+			bool same = (old.file.type == FirmwareFile::Directory)
+				|| ((old.file.type == FirmwareFile::File) && (old.content == entry.content))
+				|| ((old.file.type == FirmwareFile::Symlink)
+					&& (old.file.target == entry.file.target));
+			if (!same) {
+				old.content.swap(entry.content);
+				old.file.size = entry.file.size;
+				old.file.target = entry.file.target;
+				old.file.mtime = entry.file.mtime;
+				changed++;
+			}
+		} else {
+			if (existing != tree->end()) removePath(tree, entry.file.path);
+			(*tree)[entry.file.path] = entry;
+			changed++;
+		}
+		if (S_ISDIR(st.st_mode)) changed += applyOverlay(src, entry.file.path, tree);
+	}
+	return changed;
+}
+
+/// Space one filesystem can use.
+struct RepackRange
+{
+	uint64_t start;
+	uint64_t end;
+	uint32_t eraseSize;
+};
+
+/// Work out where a filesystem may be written.
+/**
+ * @param parts
+ *   Partitions, without any that cover the whole flash.
+ *
+ * @param eraseSize
+ *   Erase block size to use if the filesystem isn't in a partition.
+ */
+static RepackRange repackRange(const FirmwareLayout& layout,
+	std::vector<FirmwarePart>::const_iterator part,
+	const std::vector<RepackRange>& parts, uint32_t eraseSize)
+{
+	RepackRange range;
+	range.start = part->offset;
+	range.end = layout.size;
+	range.eraseSize = eraseSize;
+	for (std::vector<RepackRange>::const_iterator i = parts.begin();
+		i != parts.end(); i++
+	) {
+		if ((part->offset >= i->start) && (part->offset < i->end)) {
+			range.end = i->end;
+			range.eraseSize = i->eraseSize;
+			break;
+		}
+	}
+
+	// Don't overwrite anything following the filesystem in the same space,
+	// apart from more nodes of the same JFFS2 filesystem
+	for (std::vector<FirmwarePart>::const_iterator i = part + 1;
+		i != layout.parts.end(); i++
+	) {
+		if (i->offset < part->offset + part->length) continue;
+		if ((i->type == FirmwarePart::JFFS2) && (part->type == FirmwarePart::JFFS2)) {
+			continue;
+		}
+		range.end = std::min(range.end, i->offset);
+		break;
+	}
+	return range;
+}
+
+void repackFirmware(const char *data, size_t len,
+	const std::vector<MTDPartition>& mtd, const std::string& overlay,
+	TaskPool *pool, std::string *image, std::vector<RepackResult> *results)
+{
+	struct stat st;
+	if ((stat(overlay.c_str(), &st) != 0) || !S_ISDIR(st.st_mode)) {
+		throw "overlay folder " + overlay + " does not exist";
+	}
+	image->assign(data, len);
+	results->clear();
+	FirmwareLayout layout;
+	analyseFirmware(data, len, &layout);
+
+	// Partitions follow on from each other, apart from one for the whole
+	// flash which only gives the erase block size
+	std::vector<RepackRange> parts;
+	uint32_t flashErase = REPACK_DEFAULT_ERASE;
+	uint64_t pos = 0;
+	for (std::vector<MTDPartition>::const_iterator i = mtd.begin(); i != mtd.end(); i++) {
+		if (i->size >= len) {
+			if (i->eraseSize) flashErase = i->eraseSize;
+			continue;
+		}
+		RepackRange range;
+		range.start = pos;
+		range.end = std::min<uint64_t>(pos + i->size, len);
+		range.eraseSize = i->eraseSize ? i->eraseSize : flashErase;
+		parts.push_back(range);
+		pos += i->size;
+	}
+
+	uint64_t rewritten = 0; // End of the last filesystem written
+	for (std::vector<FirmwarePart>::const_iterator i = layout.parts.begin();
+		i != layout.parts.end(); i++
+	) {
+		if ((i->type != FirmwarePart::SquashFS) && (i->type != FirmwarePart::JFFS2)) {
+			continue;
+		}
+		if (i->offset < rewritten) continue;
+		std::string label = firmwarePartLabel(*i);
+		std::string dir = overlay + "/" + label;
+		if ((stat(dir.c_str(), &st) != 0) || !S_ISDIR(st.st_mode)) continue;
+
+		RepackResult result;
+		result.label = label;
+		result.size = 0;
+		RepackRange range = repackRange(layout, i, parts, flashErase);
+		result.space = range.end - range.start;
+
+		boost::scoped_ptr<FirmwareFS> fs(openFirmwareFS(data, len, *i, pool));
+		std::vector<FirmwareFile> files;
+		std::vector<std::string> contents;
+		fs->list(&files);
+		fs->read(files, &contents);
+		FirmwareFSFormat fmt;
+		fs->format(&fmt);
+		fs.reset();
+
+		RepackTree tree;
+		for (size_t f = 0; f < files.size(); f++) {
+			RepackEntry& entry = tree[files[f].path];
+			entry.file = files[f];
+			entry.content.swap(contents[f]);
+		}
+		result.changed = applyOverlay(dir, "/", &tree);
+		if (result.changed == 0) {
+			results->push_back(result);
+			continue;
+		}
+		files.clear();
+		contents.clear();
+		for (RepackTree::iterator f = tree.begin(); f != tree.end(); f++) {
+			files.push_back(f->second.file);
+			contents.push_back(std::string());
+			contents.back().swap(f->second.content);
+		}
+		tree.clear();
+
+		std::string built;
+		if (fmt.type == FirmwarePart::SquashFS) {
+			buildSquashFS(files, contents, fmt, pool, &built);
+		} else {
+			if (i->offset % range.eraseSize) {
+				throw label + " does not start on an erase block";
+			}
+			buildJFFS2(files, contents, fmt, range.eraseSize, pool, &built);
+		}
+		if (built.length() > result.space) {
+			std::ostringstream ss;
+			ss << label << " is now " << built.length() << " bytes, but only "
+				<< result.space << " bytes are free before the next partition";
+			throw ss.str();
+		}
+		if (verbose) std::cerr << "[repack] " << label << ": " << result.changed
+			<< " changes, rebuilt in " << built.length() << " of " << result.space
+			<< " bytes" << std::endl;
+
+		// Erase the rest of the space, including any old JFFS2 nodes
+		image->replace(range.start, built.length(), built);
+		memset(&(*image)[range.start + built.length()], 0xFF,
+			result.space - built.length());
+		result.size = built.length();
+		results->push_back(result);
+		rewritten = range.end;
+	}
+	return;
+}
@@ -0,0 +1,126 @@
+/**
+ * @file   repack.hpp
+ * @brief  Rebuild the filesystems inside a firmware image with changes.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPACK_HPP
+#define REPACK_HPP
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "extract.hpp"
+#include "parse.hpp"
+
+/// What was done to one filesystem with an overlay folder.
+struct RepackResult
+{
+	std::string label;     ///< As from firmwarePartLabel()
+	unsigned long changed; ///< Files added, replaced or removed
+	uint64_t size;         ///< Size of the rebuilt filesystem, 0 if left alone
+	uint64_t space;        ///< Bytes available for it before the next partition
+};
+
+/// Build a squashfs 4 image.
+/**
+ * Every data block and fragment is compressed as a separate task on the
+ * pool.
+ *
+ * @param files
+ *   Everything to include, each folder before its content, starting with
+ *   the root folder "/".
+ *
+ * @param contents
+ *   Content of each file, in the same order.  Ignored for anything else.
+ *
+ * @param fmt
+ *   Compression and block size to use.
+ *
+ * @param out
+ *   On return, the image, padded to a multiple of 4 kB.
+ *
+ * @throw std::string if the compression isn't supported.
+ */
+void buildSquashFS(const std::vector<FirmwareFile>& files,
+	const std::vector<std::string>& contents, const FirmwareFSFormat& fmt,
+	TaskPool *pool, std::string *out);
+
+/// Build a JFFS2 image.
+/**
+ * Each erase block starts with a clean marker and no node crosses into the
+ * next block.  Each 4 kB page of a file is compressed as a separate task.
+ *
+ * @param files
+ *   As for buildSquashFS().
+ *
+ * @param contents
+ *   As for buildSquashFS().
+ *
+ * @param fmt
+ *   Byte order, and whether to use zlib.
+ *
+ * @param eraseSize
+ *   Erase block size of the flash.
+ *
+ * @param out
+ *   On return, the image.  The last erase block is not padded.
+ *
+ * @throw std::string if the erase block size is too small.
+ */
+void buildJFFS2(const std::vector<FirmwareFile>& files,
+	const std::vector<std::string>& contents, const FirmwareFSFormat& fmt,
+	uint32_t eraseSize, TaskPool *pool, std::string *out);
+
+/// Apply an overlay to the filesystems in a firmware image.
+/**
+ * Each filesystem is looked for in a folder under the overlay named by
+ * firmwarePartLabel(), e.g. "overlay/squashfs-0x00120000/etc/passwd".
+ * Files there are added or replace those in the image, and an empty file
+ * named ".wh.NAME" removes NAME.  Replaced files keep their owner and
+ * permissions.  Any filesystem that changes is rebuilt the way it was made
+ * and written back where it was, with the rest of its partition erased.
+ *
+ * @param data
+ *   Image content.
+ *
+ * @param len
+ *   Size of the image.
+ *
+ * @param mtd
+ *   Partitions from the device's /proc/mtd.  A partition covering the
+ *   whole flash is ignored.  If empty, a filesystem may use the space up to
+ *   the next part of the image.
+ *
+ * @param overlay
+ *   Folder holding the changes.
+ *
+ * @param image
+ *   On return, the new image, the same size as the original.
+ *
+ * @param results
+ *   On return, one entry for each filesystem with an overlay folder.
+ *
+ * @throw std::string if a filesystem could not be read or rebuilt, or no
+ *   longer fits in its partition.
+ */
+void repackFirmware(const char *data, size_t len,
+	const std::vector<MTDPartition>& mtd, const std::string& overlay,
+	TaskPool *pool, std::string *image, std::vector<RepackResult> *results);
+
+#endif // REPACK_HPP
@@ -0,0 +1,165 @@
+/**
+ * @file   retry.cpp
+ * @brief  Retrying failed network operations, and giving up on dead hosts.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include <boost/asio/error.hpp>
+#include <boost/thread/thread.hpp>
+#include "main.hpp"
+#include "metrics.hpp"
+#include "retry.hpp"
+
+class retry_category_impl: public boost::system::error_category
+{
+	public:
+		const char *name() const BOOST_SYSTEM_NOEXCEPT
+		{
+			return "camtickler.retry";
+		}
+
+		std::string message(int value) const
+		{
+			if (value == retry_error::circuit_open) {
+				return "Too many recent failures, skipping host for now";
+			}
+			return "Unknown retry error";
+		}
+};
+
+const boost::system::error_category& retry_category()
+{
+	static retry_category_impl instance;
+	return instance;
+}
+
+bool is_transient(const boost::system::error_code& error)
+{
+	return
+		(error == boost::asio::error::timed_out)
+		|| (error == boost::asio::error::connection_reset)
+		|| (error == boost::asio::error::connection_aborted)
+		|| (error == boost::asio::error::network_reset)
+		|| (error == boost::asio::error::broken_pipe)
+		|| (error == boost::asio::error::eof)
+		|| (error == boost::asio::error::host_unreachable)
+		|| (error == boost::asio::error::network_unreachable)
+		|| (error == boost::asio::error::network_down)
+		|| (error == boost::asio::error::try_again)
+		|| (error == boost::asio::error::interrupted)
+		|| (error == boost::asio::error::no_buffer_space)
+		|| (error == boost::asio::error::host_not_found_try_again)
+	;
+}
+
+RetryPolicy::RetryPolicy()
+	: attempts(3),
+	  baseDelay(500),
+	  maxDelay(10000),
+	  timeout(30)
+{
+}
+
+Retry::Retry(const RetryPolicy& policy, const std::string& host)
+	: policy(policy),
+	  host(host),
+	  attempt(1),
+	  seed((unsigned long)this
+		^ boost::posix_time::microsec_clock::universal_time().time_of_day().total_microseconds())
+{
+}
+
+bool Retry::again(const boost::system::error_code& error)
+{
+	if (!is_transient(error)) return false;
+	if (this->attempt >= this->policy.attempts) return false;
+
+	// Exponential backoff, with the delay picked at random from the upper half
+	// of the range so that many hosts failing at once don't all retry at once.
+	unsigned long delay = this->policy.baseDelay;
+	for (unsigned int i = 1; (i < this->attempt) && (delay < this->policy.maxDelay); i++) {
+		delay *= 2;
+	}
+	if (delay > this->policy.maxDelay) delay = this->policy.maxDelay;
+	delay = delay / 2 + (delay ? rand_r(&this->seed) % (delay / 2 + 1) : 0);
+
+	if (verbose) std::cerr << "[retry] " << this->host << ": " << error.message()
+		<< ", trying again in " << delay << " ms (attempt "
+		<< this->attempt + 1 << " of " << this->policy.attempts << ")" << std::endl;
+	metrics.retries.add();
+	boost::this_thread::sleep(boost::posix_time::milliseconds(delay));
+	this->attempt++;
+	return true;
+}
+
+CircuitBreaker::HostState::HostState()
+	: failures(0)
+{
+}
+
+CircuitBreaker::CircuitBreaker(unsigned int threshold, unsigned int cooldown)
+	: threshold(threshold),
+	  cooldown(boost::posix_time::seconds(cooldown))
+{
+}
+
+bool CircuitBreaker::allow(const std::string& host)
+{
+	if (this->threshold == 0) return true;
+	boost::mutex::scoped_lock guard(this->mutex);
+	std::map<std::string, HostState>::iterator i = this->hosts.find(host);
+	if (i == this->hosts.end()) return true;
+	HostState& state = i->second;
+	if (state.failures < this->threshold) return true;
+
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+	if (now < state.openUntil) return false;
+
+	// Let one attempt through, and keep everyone else out until it's done
+	state.openUntil = now + this->cooldown;
+	if (verbose) std::cerr << "[retry] " << host << ": trying again after "
+		"too many failures" << std::endl;
+	return true;
+}
+
+void CircuitBreaker::success(const std::string& host)
+{
+	if (this->threshold == 0) return;
+	boost::mutex::scoped_lock guard(this->mutex);
+	this->hosts.erase(host);
+	return;
+}
+
+void CircuitBreaker::failure(const std::string& host)
+{
+	if (this->threshold == 0) return;
+	boost::mutex::scoped_lock guard(this->mutex);
+	HostState& state = this->hosts[host];
+	state.failures++;
+	if (verbose && (state.failures == this->threshold)) {
+		std::cerr << "[retry] Skipping " << host << " for "
+			<< this->cooldown.total_seconds() << " seconds after "
+			<< state.failures << " failures in a row" << std::endl;
+	}
+	if (state.failures >= this->threshold) {
+		state.openUntil = boost::posix_time::microsec_clock::universal_time()
+			+ this->cooldown;
+	}
+	return;
+}
@@ -0,0 +1,150 @@
+/**
+ * @file   retry.hpp
+ * @brief  Retrying failed network operations, and giving up on dead hosts.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RETRY_HPP
+#define RETRY_HPP
+
+#include <map>
+#include <string>
+#include <boost/system/error_code.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+/// How failed operations are retried.
+struct RetryPolicy
+{
+	/// Set everything to defaults.
+	RetryPolicy();
+
+	unsigned int attempts;   ///< Total attempts including the first, 1 for no retries
+	unsigned int baseDelay;  ///< Milliseconds before the first retry
+	unsigned int maxDelay;   ///< Longest delay between attempts, in milliseconds
+	unsigned int timeout;    ///< Seconds to wait for a device to respond, 0 for ever
+};
+
+/// Errors raised by the retry code itself.
+namespace retry_error {
+	enum errors {
+		circuit_open = 1 ///< Host has failed too often recently to be tried again yet
+	};
+}
+
+/// Error category for retry_error values.
+const boost::system::error_category& retry_category();
+
+/// Decide whether an error might go away if the operation is tried again.
+/**
+ * Timeouts, resets, unreachable networks and connections dropped part way
+ * through are transient.  Refused connections, unknown hostnames and
+ * anything else are treated as fatal, since retrying is unlikely to help.
+ */
+bool is_transient(const boost::system::error_code& error);
+
+/// Tracks the attempts made at one operation.
+/**
+ * Use in a loop around the operation:
+ *
+ *   Retry retry(policy, host);
+ *   for (;;) {
+ *     try {
+ *       doSomething();
+ *       break;
+ *     } catch (const boost::system::system_error& e) {
+ *       if (!retry.again(e.code())) throw;
+ *     }
+ *   }
+ */
+class Retry
+{
+	public:
+		/// Begin a new operation.
+		/**
+		 * @param policy
+		 *   How many times to try, and how long to wait in between.
+		 *
+		 * @param host
+		 *   Device being talked to, for log messages.
+		 */
+		Retry(const RetryPolicy& policy, const std::string& host);
+
+		/// Decide whether to try again after a failure.
+		/**
+		 * If the error is transient and there are attempts left, this sleeps
+		 * for the backoff delay before returning.
+		 *
+		 * @param error
+		 *   Reason the last attempt failed.
+		 *
+		 * @return true to try again, false to give up.
+		 */
+		bool again(const boost::system::error_code& error);
+
+	private:
+		RetryPolicy policy;
+		std::string host;
+		unsigned int attempt;  ///< Attempts made so far
+		unsigned int seed;     ///< For rand_r()
+};
+
+/// Stops connecting to hosts that keep failing.
+/**
+ * After a number of failures in a row a host's circuit is opened, and
+ * connections to it are refused without touching the network until the
+ * cooldown expires.  Then a single attempt is let through, which closes the
+ * circuit again if it works or restarts the cooldown if it doesn't.  This is
+ * safe to share between threads.
+ */
+class CircuitBreaker
+{
+	public:
+		/// Create a breaker.
+		/**
+		 * @param threshold
+		 *   Failures in a row before a host is skipped, or 0 to never skip.
+		 *
+		 * @param cooldown
+		 *   Seconds to skip a host for.
+		 */
+		CircuitBreaker(unsigned int threshold, unsigned int cooldown);
+
+		/// Check whether a host may be contacted now.
+		bool allow(const std::string& host);
+
+		/// Record a successful connection to a host.
+		void success(const std::string& host);
+
+		/// Record a failed connection to a host.
+		void failure(const std::string& host);
+
+	private:
+		struct HostState
+		{
+			HostState();
+			unsigned int failures;  ///< Failures in a row
+			boost::posix_time::ptime openUntil; ///< Skip the host until this time
+		};
+
+		unsigned int threshold;
+		boost::posix_time::time_duration cooldown;
+		boost::mutex mutex;
+		std::map<std::string, HostState> hosts;
+};
+
+#endif // RETRY_HPP
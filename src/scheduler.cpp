@@ -0,0 +1,117 @@
+/**
+ * @file   scheduler.cpp
+ * @brief  Work-stealing thread pool.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include "scheduler.hpp"
+
+WorkStealingPool::WorkStealingPool(unsigned int threads)
+	: next(0),
+	  pending(0),
+	  queued(0)
+{
+	if (threads < 1) threads = 1;
+	for (unsigned int i = 0; i < threads; i++) {
+		this->workers.push_back(boost::shared_ptr<Worker>(new Worker()));
+	}
+}
+
+void WorkStealingPool::submit(const Task& task)
+{
+	unsigned int index;
+	if (this->current.get()) {
+		index = *this->current;
+	} else {
+		index = this->next++ % this->workers.size();
+	}
+	this->pending++;
+	{
+		Worker& worker = *this->workers[index];
+		boost::mutex::scoped_lock guard(worker.mutex);
+		worker.tasks.push_back(task);
+	}
+	this->queued++;
+
+	// Taking the lock means an idle worker is either already waiting and will
+	// be woken, or hasn't checked queued yet and will see the new task.
+	boost::mutex::scoped_lock guard(this->idleMutex);
+	this->idle.notify_one();
+	return;
+}
+
+void WorkStealingPool::run()
+{
+	boost::thread_group threads;
+	for (unsigned int i = 1; i < this->workers.size(); i++) {
+		threads.create_thread(boost::bind(&WorkStealingPool::work, this, i));
+	}
+	this->work(0);
+	threads.join_all();
+	return;
+}
+
+void WorkStealingPool::work(unsigned int index)
+{
+	this->current.reset(new unsigned int(index));
+	Task task;
+	for (;;) {
+		if (this->take(index, &task) || this->steal(index, &task)) {
+			this->queued--;
+			task();
+			task.clear();
+			if (--this->pending == 0) {
+				boost::mutex::scoped_lock guard(this->idleMutex);
+				this->idle.notify_all();
+			}
+			continue;
+		}
+
+		boost::mutex::scoped_lock guard(this->idleMutex);
+		if (this->pending == 0) break;
+		// A task may be running that will submit more, so wait for it
+		if (this->queued == 0) this->idle.wait(guard);
+	}
+	this->current.reset();
+	return;
+}
+
+bool WorkStealingPool::take(unsigned int index, Task *task)
+{
+	Worker& worker = *this->workers[index];
+	boost::mutex::scoped_lock guard(worker.mutex);
+	if (worker.tasks.empty()) return false;
+	task->swap(worker.tasks.back());
+	worker.tasks.pop_back();
+	return true;
+}
+
+bool WorkStealingPool::steal(unsigned int index, Task *task)
+{
+	unsigned int count = this->workers.size();
+	for (unsigned int i = 1; i < count; i++) {
+		Worker& victim = *this->workers[(index + i) % count];
+		boost::mutex::scoped_lock guard(victim.mutex);
+		if (victim.tasks.empty()) continue;
+		task->swap(victim.tasks.front());
+		victim.tasks.pop_front();
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,91 @@
+/**
+ * @file   scheduler.hpp
+ * @brief  Work-stealing thread pool.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <deque>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+/// Runs tasks across a fixed number of threads, balanced by work stealing.
+/**
+ * Each worker has its own queue.  A worker runs the newest task in its own
+ * queue first, so a task submitted by another task (such as the next action
+ * for the same device) follows straight on in the same thread.  A worker
+ * with nothing left to do takes the oldest task from another worker's queue,
+ * so slow devices don't hold up the rest of the work.
+ */
+class WorkStealingPool
+{
+	public:
+		/// A unit of work.  It must not throw.
+		typedef boost::function<void()> Task;
+
+		/// Create a pool.
+		/**
+		 * @param threads
+		 *   Number of worker threads, at least 1.
+		 */
+		WorkStealingPool(unsigned int threads);
+
+		/// Add a task.
+		/**
+		 * Called from a task, the new task goes on the current worker's queue.
+		 * Otherwise tasks are shared out between the workers in turn.  This
+		 * may be called before or during run().
+		 */
+		void submit(const Task& task);
+
+		/// Run tasks until every task, including any they submit, has finished.
+		void run();
+
+	private:
+		struct Worker
+		{
+			boost::mutex mutex;     ///< Protects tasks
+			std::deque<Task> tasks;
+		};
+
+		std::vector<boost::shared_ptr<Worker> > workers;
+		boost::thread_specific_ptr<unsigned int> current; ///< Index of this thread's worker
+		boost::atomic<unsigned int> next;       ///< Worker to give the next outside task to
+		boost::atomic<unsigned long> pending;   ///< Tasks submitted but not finished
+		boost::atomic<unsigned long> queued;    ///< Tasks waiting in any queue
+
+		boost::mutex idleMutex;
+		boost::condition_variable idle;         ///< Signalled when there's work or all is done
+
+		/// Body of each worker thread.
+		void work(unsigned int index);
+
+		/// Take a task from a worker's own queue, newest first.
+		bool take(unsigned int index, Task *task);
+
+		/// Take a task from another worker's queue, oldest first.
+		bool steal(unsigned int index, Task *task);
+};
+
+#endif // SCHEDULER_HPP
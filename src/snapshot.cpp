@@ -0,0 +1,256 @@
+/**
+ * @file   snapshot.cpp
+ * @brief  Versioned copies of device configurations, and what changed.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fileutil.hpp"
+#include "main.hpp"
+#include "parse.hpp"
+#include "snapshot.hpp"
+
+/// Format version written on the first line of each index file.
+#define SNAPSHOT_SIGNATURE "camtickler-snapshot 1"
+
+/// Name of the index file in each host's folder.
+#define SNAPSHOT_INDEX "latest"
+
+/// List every key in a section as added or removed.
+static void listKeys(const std::string& name, const IniSection& section,
+	ConfigChange::Type type, std::vector<ConfigChange> *changes)
+{
+	for (IniSection::const_iterator k = section.begin(); k != section.end(); k++) {
+		ConfigChange change;
+		change.type = type;
+		change.section = name;
+		change.key = k->first;
+		if (type == ConfigChange::KeyAdded) {
+			change.newValue = k->second;
+		} else {
+			change.oldValue = k->second;
+		}
+		changes->push_back(change);
+	}
+	return;
+}
+
+void diff_ini(const std::string& before, const std::string& after,
+	std::vector<ConfigChange> *changes)
+{
+	IniFile a, b;
+	parse_ini(before, &a);
+	parse_ini(after, &b);
+
+	// Walk both sorted maps together
+	IniFile::const_iterator i = a.begin(), j = b.begin();
+	while ((i != a.end()) || (j != b.end())) {
+		ConfigChange change;
+		if ((j == b.end()) || ((i != a.end()) && (i->first < j->first))) {
+			change.type = ConfigChange::SectionRemoved;
+			change.section = i->first;
+			changes->push_back(change);
+			listKeys(i->first, i->second, ConfigChange::KeyRemoved, changes);
+			i++;
+		} else if ((i == a.end()) || (j->first < i->first)) {
+			change.type = ConfigChange::SectionAdded;
+			change.section = j->first;
+			changes->push_back(change);
+			listKeys(j->first, j->second, ConfigChange::KeyAdded, changes);
+			j++;
+		} else {
+			IniSection::const_iterator k = i->second.begin(), l = j->second.begin();
+			while ((k != i->second.end()) || (l != j->second.end())) {
+				change.section = i->first;
+				if ((l == j->second.end()) || ((k != i->second.end()) && (k->first < l->first))) {
+					change.type = ConfigChange::KeyRemoved;
+					change.key = k->first;
+					change.oldValue = k->second;
+					change.newValue.clear();
+					changes->push_back(change);
+					k++;
+				} else if ((k == i->second.end()) || (l->first < k->first)) {
+					change.type = ConfigChange::KeyAdded;
+					change.key = l->first;
+					change.oldValue.clear();
+					change.newValue = l->second;
+					changes->push_back(change);
+					l++;
+				} else {
+					if (k->second.compare(l->second) != 0) {
+						change.type = ConfigChange::KeyChanged;
+						change.key = k->first;
+						change.oldValue = k->second;
+						change.newValue = l->second;
+						changes->push_back(change);
+					}
+					k++;
+					l++;
+				}
+			}
+			i++;
+			j++;
+		}
+	}
+	return;
+}
+
+SnapshotStore::SnapshotStore(const std::string& dir)
+	: dir(dir.empty() ? defaultDir() : dir)
+{
+}
+
+std::string SnapshotStore::defaultDir()
+{
+	const char *xdg = getenv("XDG_DATA_HOME");
+	if (xdg && xdg[0]) return std::string(xdg) + "/camtickler/snapshots";
+	const char *home = getenv("HOME");
+	if (home && home[0]) return std::string(home) + "/.local/share/camtickler/snapshots";
+	return std::string();
+}
+
+bool SnapshotStore::latest(const std::string& host, Snapshot *snap)
+{
+	std::string base = this->hostDir(host);
+	std::ifstream index((base + SNAPSHOT_INDEX).c_str());
+	if (!index.is_open()) return false;
+
+	std::string line;
+	std::getline(index, line);
+	if (line.compare(SNAPSHOT_SIGNATURE) != 0) {
+		if (verbose) std::cerr << "[snapshot] Ignoring unrecognised index in "
+			<< base << std::endl;
+		return false;
+	}
+	snap->version = 0;
+	snap->stamp.clear();
+	snap->taken = 0;
+	while (std::getline(index, line)) {
+		std::string::size_type tab = line.find('\t');
+		if (tab == std::string::npos) continue;
+		std::string key = line.substr(0, tab);
+		std::string value = line.substr(tab + 1);
+		if (key.compare("version") == 0) {
+			snap->version = strtoul(value.c_str(), NULL, 10);
+		} else if (key.compare("stamp") == 0) {
+			snap->stamp = value;
+		} else if (key.compare("taken") == 0) {
+			snap->taken = strtoul(value.c_str(), NULL, 10);
+		}
+	}
+	if (snap->version == 0) return false;
+
+	std::stringstream filename;
+	filename << base << "config." << snap->version;
+	std::ifstream file(filename.str().c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) return false;
+	std::stringstream content;
+	content << file.rdbuf();
+	snap->content = content.str();
+	return true;
+}
+
+unsigned int SnapshotStore::save(const std::string& host,
+	const std::string& stamp, const std::string& content)
+{
+	if (this->dir.empty()) {
+		throw std::string("no snapshot folder, set --snapshot-dir or $HOME");
+	}
+	Snapshot snap;
+	if (!this->latest(host, &snap)) snap.version = 0;
+	snap.version++;
+	snap.stamp = stamp;
+	snap.taken = time(NULL);
+
+	// Write the content first, so the index never points at a missing file
+	std::stringstream filename;
+	filename << this->hostDir(host) << "config." << snap.version;
+	replaceFile(filename.str(), content);
+	this->writeIndex(host, snap);
+	return snap.version;
+}
+
+void SnapshotStore::restamp(const std::string& host, const std::string& stamp)
+{
+	Snapshot snap;
+	if (!this->latest(host, &snap)) return;
+	if (snap.stamp.compare(stamp) == 0) return;
+	snap.stamp = stamp;
+	this->writeIndex(host, snap);
+	return;
+}
+
+void SnapshotStore::writeIndex(const std::string& host, const Snapshot& snap)
+{
+	std::stringstream ss;
+	ss << SNAPSHOT_SIGNATURE << "\n"
+		<< "version\t" << snap.version << "\n"
+		<< "stamp\t" << snap.stamp << "\n"
+		<< "taken\t" << (unsigned long)snap.taken << "\n";
+	replaceFile(this->hostDir(host) + SNAPSHOT_INDEX, ss.str());
+	return;
+}
+
+std::string SnapshotStore::hostDir(const std::string& host)
+{
+	// Hostnames can't contain slashes, but don't let one escape the folder
+	std::string name = host;
+	for (std::string::iterator i = name.begin(); i != name.end(); i++) {
+		if (*i == '/') *i = '_';
+	}
+	if (name.empty() || (name[0] == '.')) name = "_" + name;
+	return this->dir + "/" + name + "/";
+}
+
+SnapshotStatus snapshotConfig(Device *dev, SnapshotStore *store,
+	const std::string& host, unsigned int *version,
+	std::vector<ConfigChange> *changes)
+{
+	Snapshot last;
+	bool haveLast = store->latest(host, &last);
+	std::string stamp = dev->getConfigStamp();
+	if (haveLast && !stamp.empty() && (stamp.compare(last.stamp) == 0)) {
+		if (verbose) std::cerr << "[snapshot] " << host << ": config stamp \""
+			<< stamp << "\" unchanged, not downloading" << std::endl;
+		*version = last.version;
+		return SnapshotUnchanged;
+	}
+
+	std::stringstream config;
+	dev->getConfig(config);
+	if (haveLast && (config.str().compare(last.content) == 0)) {
+		// Touched but not changed, so remember the new stamp to avoid
+		// downloading it again next time
+		store->restamp(host, stamp);
+		*version = last.version;
+		return SnapshotUnchanged;
+	}
+
+	*version = store->save(host, stamp, config.str());
+	if (!haveLast) return SnapshotNew;
+	diff_ini(last.content, config.str(), changes);
+	return SnapshotChanged;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file   snapshot.hpp
+ * @brief  Versioned copies of device configurations, and what changed.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+#include <time.h>
+#include "device-interface.hpp"
+
+/// One saved copy of a device's configuration.
+struct Snapshot
+{
+	unsigned int version;  ///< 1 for the first snapshot of a device, and so on
+	std::string stamp;     ///< Device::getConfigStamp() when last checked
+	time_t taken;          ///< When this version was saved
+	std::string content;
+};
+
+/// A difference between two versions of an INI configuration file.
+struct ConfigChange
+{
+	enum Type {
+		SectionAdded,
+		SectionRemoved,
+		KeyAdded,
+		KeyRemoved,
+		KeyChanged
+	};
+
+	Type type;
+	std::string section;
+	std::string key;       ///< Empty for section changes
+	std::string oldValue;  ///< Empty unless removed or changed
+	std::string newValue;  ///< Empty unless added or changed
+};
+
+/// List the sections and keys that differ between two INI files.
+/**
+ * A section that was added or removed is listed once, followed by each of
+ * its keys.
+ *
+ * @param before
+ *   Earlier content.
+ *
+ * @param after
+ *   Later content.
+ *
+ * @param changes
+ *   The differences are appended to this list, in section and key order.
+ */
+void diff_ini(const std::string& before, const std::string& after,
+	std::vector<ConfigChange> *changes);
+
+/// Saves each version of each device's configuration in a directory.
+/**
+ * Each device has its own folder named after the host, holding one file per
+ * version plus a small index of the latest one.  The files hold passwords, so
+ * they are readable only by the owner.
+ */
+class SnapshotStore
+{
+	public:
+		/// Open the store.
+		/**
+		 * @param dir
+		 *   Folder to keep snapshots in.  It need not exist yet.  If empty,
+		 *   the default location returned by defaultDir() is used.
+		 */
+		SnapshotStore(const std::string& dir);
+
+		/// Get the default snapshot location.
+		/**
+		 * @return $XDG_DATA_HOME/camtickler/snapshots, falling back to
+		 *   $HOME/.local/share/camtickler/snapshots.  Empty if neither is set.
+		 */
+		static std::string defaultDir();
+
+		/// Get the latest snapshot of a device.
+		/**
+		 * @return true if one was found, false if this device has none yet.
+		 */
+		bool latest(const std::string& host, Snapshot *snap);
+
+		/// Save a new version.
+		/**
+		 * @return The new version number.
+		 *
+		 * @throw std::string if the snapshot could not be written.
+		 */
+		unsigned int save(const std::string& host, const std::string& stamp,
+			const std::string& content);
+
+		/// Record a new stamp for the latest version, whose content is the same.
+		/**
+		 * @throw std::string if the index could not be written.
+		 */
+		void restamp(const std::string& host, const std::string& stamp);
+
+	private:
+		std::string dir;
+
+		/// Write the index for a host's latest version.
+		void writeIndex(const std::string& host, const Snapshot& snap);
+
+		/// Get the folder for a host's snapshots.
+		std::string hostDir(const std::string& host);
+};
+
+/// What snapshotConfig() found.
+enum SnapshotStatus {
+	SnapshotNew,       ///< First snapshot of this device
+	SnapshotChanged,   ///< Configuration differs from the last snapshot
+	SnapshotUnchanged  ///< Same as the last snapshot, nothing saved
+};
+
+/// Save a device's configuration if it has changed since the last snapshot.
+/**
+ * If the device's config stamp matches the one saved with the last snapshot,
+ * nothing is downloaded.  Otherwise the configuration is downloaded and
+ * compared with the last snapshot, and saved as a new version if it differs.
+ *
+ * @param dev
+ *   Device to check.
+ *
+ * @param store
+ *   Where snapshots are kept.
+ *
+ * @param host
+ *   Name the snapshots are kept under.
+ *
+ * @param version
+ *   On return, the version now current.
+ *
+ * @param changes
+ *   On return, what changed since the previous version if the status is
+ *   SnapshotChanged.
+ *
+ * @throw std::string on error, content is error message.
+ */
+SnapshotStatus snapshotConfig(Device *dev, SnapshotStore *store,
+	const std::string& host, unsigned int *version,
+	std::vector<ConfigChange> *changes);
+
+#endif // SNAPSHOT_HPP
@@ -0,0 +1,351 @@
+/**
+ * @file   sparse.cpp
+ * @brief  Compressed firmware dumps that leave out erased flash.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+#include <zlib.h>
+#include <boost/bind.hpp>
+#include "fileutil.hpp"
+#include "sparse.hpp"
+
+/// First bytes of every sparse dump.
+#define SPARSE_SIGNATURE "CTSPARSE"
+
+/// Format version written after the signature.
+#define SPARSE_VERSION 1
+
+/// Size of the header at the start of the file.
+#define SPARSE_HEADER_LEN 64
+
+/// Size of each index entry at the end of the file.
+#define SPARSE_ENTRY_LEN 48
+
+/// Largest image accepted, so a damaged header can't ask for a huge index.
+#define SPARSE_MAX_IMAGE (1ULL << 36)
+
+// All numbers in the file are little-endian.
+
+/// A block waiting to be compressed or written out.
+struct SparseWriter::Block
+{
+	Block()
+		: done(false)
+	{
+	}
+
+	std::string raw;
+	std::string stored;
+	SparseIndexEntry entry;
+	bool done;          ///< Compressed and ready to write
+};
+
+SparseWriter::SparseWriter(std::ostream& target, unsigned int threads)
+	: target(target),
+	  imageSize(0),
+	  offset(SPARSE_HEADER_LEN),
+	  work(new boost::asio::io_service::work(io_service))
+{
+	// Leave room for the header, which is written once the size is known
+	char header[SPARSE_HEADER_LEN];
+	memset(header, 0, sizeof(header));
+	this->target.write(header, sizeof(header));
+
+	if (threads < 1) threads = 1;
+	this->maxPending = threads * 4;
+	for (unsigned int i = 0; i < threads; i++) {
+		this->threads.create_thread(boost::bind(&boost::asio::io_service::run,
+			&this->io_service));
+	}
+}
+
+SparseWriter::~SparseWriter()
+{
+	this->stop();
+}
+
+std::streamsize SparseWriter::xsputn(const char *s, std::streamsize n)
+{
+	std::streamsize left = n;
+	while (left) {
+		std::streamsize len = std::min(left,
+			(std::streamsize)(SPARSE_BLOCK_SIZE - this->current.length()));
+		this->current.append(s, len);
+		s += len;
+		left -= len;
+		if (this->current.length() == SPARSE_BLOCK_SIZE) this->submit();
+	}
+	this->imageSize += n;
+	return n;
+}
+
+SparseWriter::int_type SparseWriter::overflow(int_type c)
+{
+	if (traits_type::eq_int_type(c, traits_type::eof())) {
+		return traits_type::not_eof(c);
+	}
+	char ch = traits_type::to_char_type(c);
+	this->xsputn(&ch, 1);
+	return c;
+}
+
+void SparseWriter::finish()
+{
+	if (!this->current.empty()) this->submit();
+	this->writeFinished(0);
+	this->stop();
+
+	std::string index(this->index.size() * SPARSE_ENTRY_LEN, '\0');
+	unsigned char *p = (unsigned char *)&index[0];
+	for (std::vector<SparseIndexEntry>::const_iterator i = this->index.begin();
+		i != this->index.end(); i++, p += SPARSE_ENTRY_LEN
+	) {
+		put64le(p, i->offset);
+		put32le(p + 8, i->length);
+		p[12] = i->type;
+		memcpy(p + 16, i->hash, SHA256_DIGEST_LEN);
+	}
+	this->target.write(index.data(), index.length());
+
+	unsigned char header[SPARSE_HEADER_LEN];
+	memset(header, 0, sizeof(header));
+	memcpy(header, SPARSE_SIGNATURE, 8);
+	put32le(header + 8, SPARSE_VERSION);
+	put32le(header + 12, SPARSE_BLOCK_SIZE);
+	put64le(header + 16, this->imageSize);
+	put64le(header + 24, this->offset);
+	put32le(header + 32, this->index.size());
+	put32le(header + 36, crc32(0, (const Bytef *)index.data(), index.length()));
+	this->target.seekp(0);
+	this->target.write((const char *)header, sizeof(header));
+	this->target.seekp(0, std::ios::end);
+	this->target.flush();
+	if (!this->target) throw std::string("unable to write sparse dump");
+	return;
+}
+
+void SparseWriter::submit()
+{
+	boost::shared_ptr<Block> block(new Block());
+	block->raw.swap(this->current);
+	{
+		boost::mutex::scoped_lock guard(this->mutex);
+		this->pending.push_back(block);
+	}
+	this->io_service.post(boost::bind(&SparseWriter::compress, this, block));
+
+	// Don't let the download get too far ahead of the compression
+	this->writeFinished(this->maxPending);
+	return;
+}
+
+void SparseWriter::compress(boost::shared_ptr<Block> block)
+{
+	const std::string& raw = block->raw;
+	SparseIndexEntry& entry = block->entry;
+	sha256(raw.data(), raw.length(), entry.hash);
+	entry.offset = 0;
+	entry.length = 0;
+
+	if (raw.find_first_not_of('\xFF') == std::string::npos) {
+		entry.type = SparseErased;
+	} else {
+		uLongf len = compressBound(raw.length());
+		block->stored.resize(len);
+		if (
+			(compress2((Bytef *)&block->stored[0], &len, (const Bytef *)raw.data(),
+				raw.length(), Z_DEFAULT_COMPRESSION) == Z_OK)
+			&& (len < raw.length())
+		) {
+			block->stored.resize(len);
+			entry.type = SparseZlib;
+		} else {
+			block->stored = raw;
+			entry.type = SparseRaw;
+		}
+		entry.length = block->stored.length();
+	}
+
+	boost::mutex::scoped_lock guard(this->mutex);
+	block->done = true;
+	this->done.notify_all();
+	return;
+}
+
+void SparseWriter::writeFinished(unsigned int keep)
+{
+	boost::mutex::scoped_lock guard(this->mutex);
+	while (!this->pending.empty()) {
+		boost::shared_ptr<Block> block = this->pending.front();
+		if (!block->done) {
+			if (this->pending.size() <= keep) break;
+			this->done.wait(guard);
+			continue;
+		}
+		this->pending.pop_front();
+		if (block->entry.type != SparseErased) {
+			block->entry.offset = this->offset;
+			this->target.write(block->stored.data(), block->stored.length());
+			this->offset += block->stored.length();
+		}
+		this->index.push_back(block->entry);
+	}
+	return;
+}
+
+void SparseWriter::stop()
+{
+	// Let any blocks already queued finish, so none are left using this
+	this->work.reset();
+	this->threads.join_all();
+	return;
+}
+
+SparseReader::SparseReader(std::istream& source)
+	: source(source)
+{
+	unsigned char header[SPARSE_HEADER_LEN];
+	this->source.seekg(0);
+	if (
+		!this->source.read((char *)header, sizeof(header))
+		|| (memcmp(header, SPARSE_SIGNATURE, 8) != 0)
+	) {
+		throw std::string("not a sparse dump");
+	}
+	if (get32le(header + 8) != SPARSE_VERSION) {
+		throw std::string("sparse dump is from a newer version of camtickler");
+	}
+	this->blockSize = get32le(header + 12);
+	this->imageSize = get64le(header + 16);
+	uint64_t indexOffset = get64le(header + 24);
+	uint32_t count = get32le(header + 32);
+	if (
+		(this->blockSize == 0)
+		|| (this->imageSize > SPARSE_MAX_IMAGE)
+		|| (count != (this->imageSize + this->blockSize - 1) / this->blockSize)
+	) {
+		throw std::string("sparse dump header is damaged");
+	}
+
+	std::string index(count * SPARSE_ENTRY_LEN, '\0');
+	this->source.seekg(indexOffset);
+	if (
+		!this->source.read(&index[0], index.length())
+		|| (crc32(0, (const Bytef *)index.data(), index.length()) != get32le(header + 36))
+	) {
+		throw std::string("sparse dump index is damaged");
+	}
+	const unsigned char *p = (const unsigned char *)index.data();
+	for (uint32_t i = 0; i < count; i++, p += SPARSE_ENTRY_LEN) {
+		SparseIndexEntry entry;
+		entry.offset = get64le(p);
+		entry.length = get32le(p + 8);
+		if (p[12] > SparseRaw) throw std::string("sparse dump index is damaged");
+		entry.type = (SparseBlockType)p[12];
+		memcpy(entry.hash, p + 16, SHA256_DIGEST_LEN);
+		this->index.push_back(entry);
+	}
+}
+
+uint64_t SparseReader::size() const
+{
+	return this->imageSize;
+}
+
+const std::vector<SparseIndexEntry>& SparseReader::blocks() const
+{
+	return this->index;
+}
+
+void SparseReader::read(uint64_t offset, uint64_t len, std::string *out)
+{
+	if (offset >= this->imageSize) return;
+	if (len > this->imageSize - offset) len = this->imageSize - offset;
+	std::string block;
+	while (len) {
+		uint32_t b = offset / this->blockSize;
+		uint32_t start = offset % this->blockSize;
+		this->readBlock(b, &block);
+		uint64_t n = std::min<uint64_t>(len, block.length() - start);
+		out->append(block, start, n);
+		offset += n;
+		len -= n;
+	}
+	return;
+}
+
+void SparseReader::expand(std::ostream& target)
+{
+	std::string block;
+	for (uint32_t b = 0; b < this->index.size(); b++) {
+		this->readBlock(b, &block);
+		target.write(block.data(), block.length());
+		if (!target) throw std::string("unable to write expanded image");
+	}
+	return;
+}
+
+void SparseReader::readBlock(uint32_t block, std::string *out)
+{
+	const SparseIndexEntry& entry = this->index[block];
+	uint64_t rawLen = std::min<uint64_t>(this->blockSize,
+		this->imageSize - (uint64_t)block * this->blockSize);
+
+	bool ok = true;
+	if (entry.type == SparseErased) {
+		out->assign(rawLen, '\xFF');
+	} else {
+		std::string stored(entry.length, '\0');
+		this->source.clear();
+		this->source.seekg(entry.offset);
+		ok = entry.length && this->source.read(&stored[0], stored.length());
+		if (ok && (entry.type == SparseZlib)) {
+			out->resize(rawLen);
+			uLongf len = rawLen;
+			ok = (uncompress((Bytef *)&(*out)[0], &len, (const Bytef *)stored.data(),
+				stored.length()) == Z_OK) && (len == rawLen);
+		} else if (ok) {
+			ok = stored.length() == rawLen;
+			out->swap(stored);
+		}
+	}
+	unsigned char hash[SHA256_DIGEST_LEN];
+	if (ok) {
+		sha256(out->data(), out->length(), hash);
+		ok = memcmp(hash, entry.hash, SHA256_DIGEST_LEN) == 0;
+	}
+	if (!ok) {
+		std::stringstream ss;
+		ss << "sparse dump block " << block << " (offset 0x" << std::hex
+			<< (uint64_t)block * this->blockSize << ") is damaged";
+		throw ss.str();
+	}
+	return;
+}
+
+bool isSparseDump(std::istream& source)
+{
+	char sig[8];
+	bool sparse = source.read(sig, sizeof(sig))
+		&& (memcmp(sig, SPARSE_SIGNATURE, sizeof(sig)) == 0);
+	source.clear();
+	source.seekg(0);
+	return sparse;
+}
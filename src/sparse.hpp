@@ -0,0 +1,195 @@
+/**
+ * @file   sparse.hpp
+ * @brief  Compressed firmware dumps that leave out erased flash.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPARSE_HPP
+#define SPARSE_HPP
+
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/asio.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "checksum.hpp"
+
+/// Size of each block in a sparse dump, the same as a typical erase block.
+#define SPARSE_BLOCK_SIZE 65536
+
+/// How one block of a sparse dump is stored.
+enum SparseBlockType {
+	SparseErased = 0,  ///< Every byte is 0xFF, nothing stored
+	SparseZlib = 1,    ///< Compressed with zlib
+	SparseRaw = 2      ///< Stored as-is, as it didn't compress
+};
+
+/// Where to find one block of a sparse dump.
+struct SparseIndexEntry
+{
+	uint64_t offset;        ///< Position of the stored data in the file
+	uint32_t length;        ///< Bytes stored, 0 for an erased block
+	SparseBlockType type;
+	unsigned char hash[SHA256_DIGEST_LEN]; ///< SHA-256 of the original block
+};
+
+/// Writes a firmware dump as a sparse, compressed file.
+/**
+ * The file starts with a header, followed by each block that isn't erased,
+ * compressed on its own so any block can be read without the others, and
+ * ends with an index of every block and the SHA-256 of its original content.
+ *
+ * Data written to this stream buffer is split into blocks, and each full
+ * block is compressed on a worker thread while more data arrives.  Blocks
+ * are written to the file in order as they are finished.
+ */
+class SparseWriter: public std::streambuf
+{
+	public:
+		/// Start a sparse dump.
+		/**
+		 * @param target
+		 *   File to write to.  It must be seekable, as the header is filled in
+		 *   once the size is known.
+		 *
+		 * @param threads
+		 *   Number of blocks to compress at once.
+		 */
+		SparseWriter(std::ostream& target, unsigned int threads);
+
+		~SparseWriter();
+
+		/// Write out the last block and the index.
+		/**
+		 * The file is not valid until this has been called.
+		 *
+		 * @throw std::string if the file could not be written.
+		 */
+		void finish();
+
+	protected:
+		virtual std::streamsize xsputn(const char *s, std::streamsize n);
+		virtual int_type overflow(int_type c);
+
+	private:
+		struct Block;
+
+		std::ostream& target;
+		uint64_t imageSize;              ///< Bytes received so far
+		uint64_t offset;                 ///< Where the next stored block goes
+		std::string current;             ///< Block being filled
+		std::vector<SparseIndexEntry> index;
+		unsigned int maxPending;         ///< Most blocks waiting at once
+
+		boost::asio::io_service io_service;
+		boost::scoped_ptr<boost::asio::io_service::work> work;
+		boost::thread_group threads;
+
+		boost::mutex mutex;              ///< Protects Block::done
+		boost::condition_variable done;  ///< Signalled when a block is finished
+		std::deque<boost::shared_ptr<Block> > pending; ///< In file order
+
+		/// Hand the current block to a worker.
+		void submit();
+
+		/// Compress and hash a block.  Runs on a worker thread.
+		void compress(boost::shared_ptr<Block> block);
+
+		/// Write out finished blocks from the front of the queue.
+		/**
+		 * @param keep
+		 *   Wait until no more than this many blocks are still pending.
+		 */
+		void writeFinished(unsigned int keep);
+
+		/// Stop the worker threads.
+		void stop();
+};
+
+/// Reads a sparse dump, one block at a time as needed.
+class SparseReader
+{
+	public:
+		/// Open a sparse dump.
+		/**
+		 * @param source
+		 *   File to read from.  It must be seekable, and must remain valid
+		 *   until this object is destroyed.
+		 *
+		 * @throw std::string if this is not a valid sparse dump.
+		 */
+		SparseReader(std::istream& source);
+
+		/// Get the size of the original image.
+		uint64_t size() const;
+
+		/// Get the index of every block.
+		const std::vector<SparseIndexEntry>& blocks() const;
+
+		/// Read part of the original image.
+		/**
+		 * Only the blocks covering the range are decompressed, and each is
+		 * checked against its SHA-256.
+		 *
+		 * @param offset
+		 *   Position in the original image to start at.
+		 *
+		 * @param len
+		 *   Number of bytes to read.  The read stops early at the end of the
+		 *   image.
+		 *
+		 * @param out
+		 *   The data is appended to this.
+		 *
+		 * @throw std::string if a block is damaged.
+		 */
+		void read(uint64_t offset, uint64_t len, std::string *out);
+
+		/// Write out the whole original image.
+		/**
+		 * @throw std::string if a block is damaged or the target can't be
+		 *   written.
+		 */
+		void expand(std::ostream& target);
+
+	private:
+		std::istream& source;
+		uint64_t imageSize;
+		uint32_t blockSize;
+		std::vector<SparseIndexEntry> index;
+
+		/// Get the original content of one block.
+		/**
+		 * @throw std::string if the block is damaged.
+		 */
+		void readBlock(uint32_t block, std::string *out);
+};
+
+/// Check whether a file starts like a sparse dump.
+/**
+ * @param source
+ *   File to look at.  Its position is left at the start.
+ */
+bool isSparseDump(std::istream& source);
+
+#endif // SPARSE_HPP
@@ -0,0 +1,194 @@
+/**
+ * @file   throttle.cpp
+ * @brief  Limit how fast data is pulled from a device.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <boost/thread/thread.hpp>
+#include "main.hpp"
+#include "throttle.hpp"
+
+/// Seconds worth of data that can be sent in one go after being idle.
+#define BURST_SECONDS 0.1
+
+/// Smallest burst in bytes, so slow rates still allow a reasonable read size.
+#define MIN_BURST 16384
+
+/// Slowest the adaptive mode will go, in bytes per second.
+#define MIN_RATE 16384
+
+/// Other traffic below this many bytes per second is too little to judge by.
+#define MIN_OTHER_RATE 8192
+
+/// The device is busy if other traffic drops below this fraction of what it
+/// was before the download started...
+#define STARVED_FRACTION 0.5
+
+/// ...for this many samples in a row.  Data queued in socket buffers makes a
+/// single sample unreliable.
+#define STARVED_SAMPLES 2
+
+/// Samples to wait after slowing down before slowing down again, to give the
+/// load average a chance to catch up.
+#define HOLD_OFF_SAMPLES 3
+
+ThrottleConfig::ThrottleConfig()
+	: maxRate(0),
+	  adaptive(false),
+	  maxLoad(1.5),
+	  pollInterval(2000)
+{
+}
+
+TokenBucket::TokenBucket(double rate)
+	: rate(rate),
+	  tokens(0),
+	  last(boost::posix_time::microsec_clock::universal_time())
+{
+}
+
+void TokenBucket::setRate(double rate)
+{
+	this->rate = rate;
+	return;
+}
+
+double TokenBucket::getRate() const
+{
+	return this->rate;
+}
+
+void TokenBucket::consume(unsigned long bytes)
+{
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+	if (this->rate <= 0) {
+		this->last = now;
+		return;
+	}
+
+	double burst = this->rate * BURST_SECONDS;
+	if (burst < MIN_BURST) burst = MIN_BURST;
+	this->tokens += (now - this->last).total_microseconds() / 1000000.0 * this->rate;
+	if (this->tokens > burst) this->tokens = burst;
+	this->last = now;
+
+	this->tokens -= bytes;
+	if (this->tokens < 0) {
+		// The time slept is paid back as tokens on the next call
+		boost::this_thread::sleep(boost::posix_time::microseconds(
+			(long)(-this->tokens / this->rate * 1000000)));
+	}
+	return;
+}
+
+LoadController::LoadController(const ThrottleConfig& config,
+	TokenBucket *bucket, const std::string& host)
+	: config(config),
+	  bucket(bucket),
+	  host(host),
+	  first(true),
+	  lastTx(0),
+	  lastTransferred(0),
+	  baselineOther(0),
+	  starved(0),
+	  holdOff(0)
+{
+}
+
+void LoadController::sample(boost::posix_time::ptime now, double load,
+	unsigned long txBytes, unsigned long transferred)
+{
+	if (this->first) {
+		this->first = false;
+		this->last = now;
+		this->lastTx = txBytes;
+		this->lastTransferred = transferred;
+		return;
+	}
+	double elapsed = (now - this->last).total_microseconds() / 1000000.0;
+	if (elapsed <= 0) return;
+
+	// The camera's counters are 32-bit, so allow for them wrapping
+	unsigned long txDelta = txBytes - this->lastTx;
+	if (txBytes < this->lastTx) txDelta = txBytes + (0xFFFFFFFFUL - this->lastTx) + 1;
+	double ours = (transferred - this->lastTransferred) / elapsed;
+	double other = txDelta / elapsed - ours;
+	if (other < 0) other = 0;
+	this->last = now;
+	this->lastTx = txBytes;
+	this->lastTransferred = transferred;
+
+	if (transferred == 0) {
+		// Not downloading yet, so all the traffic is other traffic
+		this->baselineOther = other;
+		return;
+	}
+
+	if (
+		(this->baselineOther >= MIN_OTHER_RATE)
+		&& (other < this->baselineOther * STARVED_FRACTION)
+	) {
+		this->starved++;
+	} else {
+		this->starved = 0;
+	}
+	const char *reason = NULL;
+	if (load > this->config.maxLoad) {
+		reason = "load average";
+	} else if (this->starved >= STARVED_SAMPLES) {
+		reason = "other traffic";
+	}
+
+	double rate = this->bucket->getRate();
+	double newRate = rate;
+	if (reason) {
+		if (this->holdOff) {
+			this->holdOff--;
+			return;
+		}
+		double base = ours;
+		if ((rate > 0) && (rate < base)) base = rate;
+		newRate = base / 2;
+		if (newRate < MIN_RATE) newRate = MIN_RATE;
+		this->holdOff = HOLD_OFF_SAMPLES;
+	} else {
+		if (this->holdOff) this->holdOff--;
+		if (rate <= 0) return; // already unlimited
+		newRate = rate * 1.25;
+		if (this->config.maxRate) {
+			if (newRate > this->config.maxRate) newRate = this->config.maxRate;
+		} else if ((ours > 0) && (newRate > ours * 2)) {
+			// Something else is limiting the speed now, so stop throttling
+			newRate = 0;
+		}
+	}
+	if (newRate == rate) return;
+
+	if (verbose) {
+		std::cerr << "[throttle] " << this->host << ": load " << load
+			<< ", other traffic " << (unsigned long)other << " B/s, ";
+		if (reason) std::cerr << "busy (" << reason << "), slowing";
+		else std::cerr << "speeding up";
+		std::cerr << " to ";
+		if (newRate > 0) std::cerr << (unsigned long)newRate << " B/s";
+		else std::cerr << "unlimited";
+		std::cerr << std::endl;
+	}
+	this->bucket->setRate(newRate);
+	return;
+}
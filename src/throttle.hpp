@@ -0,0 +1,139 @@
+/**
+ * @file   throttle.hpp
+ * @brief  Limit how fast data is pulled from a device.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THROTTLE_HPP
+#define THROTTLE_HPP
+
+#include <string>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+/// Settings for limiting the speed of firmware downloads.
+struct ThrottleConfig
+{
+	/// Set everything to defaults (no limit).
+	ThrottleConfig();
+
+	unsigned long maxRate;      ///< Bytes/sec, 0 for unlimited
+	bool adaptive;              ///< Slow down when the device is busy
+	double maxLoad;             ///< Load average above which the device is busy
+	unsigned int pollInterval;  ///< Milliseconds between checking the device
+};
+
+/// Token bucket rate limiter.
+/**
+ * Tokens are taken after data has been read rather than before, so a large
+ * read is allowed through and the following read is delayed instead.  This
+ * means the bucket never has to know how big a read will be.
+ */
+class TokenBucket
+{
+	public:
+		/// Create a bucket.
+		/**
+		 * @param rate
+		 *   Bytes per second, or 0 for no limit.
+		 */
+		TokenBucket(double rate);
+
+		/// Change the rate.
+		/**
+		 * @param rate
+		 *   Bytes per second, or 0 for no limit.
+		 */
+		void setRate(double rate);
+
+		/// Get the current rate in bytes per second, or 0 if unlimited.
+		double getRate() const;
+
+		/// Account for data that has been transferred, sleeping if it went over
+		/// the rate.
+		/**
+		 * @param bytes
+		 *   Number of bytes just transferred.
+		 */
+		void consume(unsigned long bytes);
+
+	private:
+		double rate;
+		double tokens;  ///< Bytes that can be sent now, negative if in debt
+		boost::posix_time::ptime last;
+};
+
+/// Adjust a TokenBucket according to how busy the device is.
+/**
+ * The rate is halved whenever the device looks busy and raised by a quarter
+ * when it doesn't (AIMD, as TCP does), between a floor and the configured
+ * maximum.  The device counts as busy when its load average is over the
+ * limit, or when the traffic it is sending other than ours (normally the
+ * video stream) has dropped well below what it was before the download
+ * started, which means our download is crowding it out.
+ *
+ * Samples taken before any data has been transferred set that baseline, so
+ * at least two should be taken before the download begins.
+ */
+class LoadController
+{
+	public:
+		/// Start controlling a bucket.
+		/**
+		 * @param config
+		 *   Limits to work within.
+		 *
+		 * @param bucket
+		 *   Bucket to adjust.
+		 *
+		 * @param host
+		 *   Device name, for log messages.
+		 */
+		LoadController(const ThrottleConfig& config, TokenBucket *bucket,
+			const std::string& host);
+
+		/// Adjust the rate based on a new reading from the device.
+		/**
+		 * @param now
+		 *   Time the reading was taken.
+		 *
+		 * @param load
+		 *   One minute load average.
+		 *
+		 * @param txBytes
+		 *   Total bytes sent by the device on all interfaces.
+		 *
+		 * @param transferred
+		 *   Bytes of our own download received so far.
+		 */
+		void sample(boost::posix_time::ptime now, double load,
+			unsigned long txBytes, unsigned long transferred);
+
+	private:
+		ThrottleConfig config;
+		TokenBucket *bucket;
+		std::string host;
+
+		bool first;                      ///< No sample taken yet
+		boost::posix_time::ptime last;
+		unsigned long lastTx;
+		unsigned long lastTransferred;
+		double baselineOther;            ///< Rate of other traffic before the download
+		unsigned int starved;            ///< Consecutive samples with little other traffic
+		unsigned int holdOff;            ///< Samples to wait before backing off again
+};
+
+#endif // THROTTLE_HPP
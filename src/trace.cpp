@@ -0,0 +1,135 @@
+/**
+ * @file   trace.cpp
+ * @brief  Timing of each phase of communication with a device.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include "json.hpp"
+#include "trace.hpp"
+
+/// Number of histogram buckets.  The last one covers 2^(n-2) ms and above.
+#define HISTOGRAM_BUCKETS 16
+
+Tracer *tracer = NULL;
+
+Tracer::Tracer()
+	: epoch(boost::posix_time::microsec_clock::universal_time())
+{
+}
+
+void Tracer::add(const char *category, const char *name,
+	const std::string& host, boost::posix_time::ptime start,
+	boost::posix_time::ptime end)
+{
+	SpanRecord span;
+	span.category = category;
+	span.name = name;
+	span.host = host;
+	span.start = start;
+	span.duration = (end - start).total_microseconds();
+
+	boost::mutex::scoped_lock lock(this->mutex);
+	boost::thread::id id = boost::this_thread::get_id();
+	std::map<boost::thread::id, unsigned int>::const_iterator t = this->threads.find(id);
+	if (t == this->threads.end()) {
+		span.thread = this->threads.size() + 1;
+		this->threads[id] = span.thread;
+	} else {
+		span.thread = t->second;
+	}
+	this->spans.push_back(span);
+	return;
+}
+
+void Tracer::writeChromeTrace(std::ostream& out)
+{
+	boost::mutex::scoped_lock lock(this->mutex);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	for (std::vector<SpanRecord>::const_iterator i = this->spans.begin();
+		i != this->spans.end(); i++
+	) {
+		if (i != this->spans.begin()) out << ",\n";
+		out << "{\"name\":";
+		write_json_string(out, i->name);
+		out << ",\"cat\":";
+		write_json_string(out, i->category);
+		out << ",\"ph\":\"X\",\"ts\":" << (i->start - this->epoch).total_microseconds()
+			<< ",\"dur\":" << i->duration
+			<< ",\"pid\":1,\"tid\":" << i->thread
+			<< ",\"args\":{\"host\":";
+		write_json_string(out, i->host);
+		out << "}}";
+	}
+	out << "\n]}\n";
+	return;
+}
+
+void Tracer::writeSummary(std::ostream& out)
+{
+	boost::mutex::scoped_lock lock(this->mutex);
+
+	// Group the durations by span type
+	std::map<std::string, std::vector<long> > types;
+	for (std::vector<SpanRecord>::const_iterator i = this->spans.begin();
+		i != this->spans.end(); i++
+	) {
+		std::string type = i->category;
+		type += '.';
+		type += i->name;
+		types[type].push_back(i->duration);
+	}
+
+	out << std::fixed << std::setprecision(3);
+	for (std::map<std::string, std::vector<long> >::iterator i = types.begin();
+		i != types.end(); i++
+	) {
+		std::vector<long>& d = i->second;
+		std::sort(d.begin(), d.end());
+		double total = 0;
+		unsigned long buckets[HISTOGRAM_BUCKETS] = {0};
+		for (std::vector<long>::const_iterator j = d.begin(); j != d.end(); j++) {
+			total += *j;
+			// Bucket 0 is under 1ms, bucket n is [2^(n-1), 2^n) ms
+			int b = 0;
+			for (long ms = *j / 1000; (ms > 0) && (b < HISTOGRAM_BUCKETS - 1); ms >>= 1) b++;
+			buckets[b]++;
+		}
+		out << "span=" << i->first
+			<< " count=" << d.size()
+			<< " mean_ms=" << total / d.size() / 1000.0
+			<< " p50_ms=" << d[d.size() * 50 / 100] / 1000.0
+			<< " p90_ms=" << d[d.size() * 90 / 100] / 1000.0
+			<< " p99_ms=" << d[d.size() * 99 / 100] / 1000.0
+			<< " max_ms=" << d.back() / 1000.0
+			<< " hist_ms=";
+		bool first = true;
+		for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+			if (!buckets[b]) continue;
+			if (!first) out << ',';
+			first = false;
+			// Label each bucket with its upper bound
+			if (b == HISTOGRAM_BUCKETS - 1) out << "inf";
+			else out << "<" << (1L << b);
+			out << ':' << buckets[b];
+		}
+		out << "\n";
+	}
+	out << std::flush;
+	return;
+}
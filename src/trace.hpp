@@ -0,0 +1,134 @@
+/**
+ * @file   trace.hpp
+ * @brief  Timing of each phase of communication with a device.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+/// A completed span.
+struct SpanRecord
+{
+	const char *category;  ///< Protocol or area, e.g. "ftp"
+	const char *name;      ///< Phase, e.g. "greeting"
+	std::string host;      ///< Device being talked to
+	boost::posix_time::ptime start;
+	long duration;         ///< Microseconds
+	unsigned int thread;   ///< Small number identifying the thread
+};
+
+/// Collects spans so they can be written out once the work is done.
+class Tracer
+{
+	public:
+		Tracer();
+
+		/// Add a completed span.
+		void add(const char *category, const char *name, const std::string& host,
+			boost::posix_time::ptime start, boost::posix_time::ptime end);
+
+		/// Write all spans in Chrome trace event format.
+		/**
+		 * The output can be loaded into chrome://tracing or Perfetto.
+		 *
+		 * @param out
+		 *   Stream to write the JSON to.
+		 */
+		void writeChromeTrace(std::ostream& out);
+
+		/// Write latency statistics for each type of span.
+		/**
+		 * One line is written per category/name pair, giving the count,
+		 * percentiles and a histogram with power-of-two millisecond buckets.
+		 *
+		 * @param out
+		 *   Stream to write the summary to.
+		 */
+		void writeSummary(std::ostream& out);
+
+	private:
+		boost::mutex mutex; ///< Protects everything below
+		boost::posix_time::ptime epoch;
+		std::vector<SpanRecord> spans;
+		std::map<boost::thread::id, unsigned int> threads;
+};
+
+/// Where spans are collected, or NULL if tracing is disabled.
+extern Tracer *tracer;
+
+/// Time one phase of an operation.
+/**
+ * The span starts when the object is created and ends when finish() is
+ * called or it goes out of scope, whichever happens first.  If tracing is
+ * disabled this does nothing, so spans can be left in hot paths.
+ */
+class Span
+{
+	public:
+		/// Start timing.
+		/**
+		 * @param category
+		 *   Protocol or area, e.g. "ftp".  Must be a string literal.
+		 *
+		 * @param name
+		 *   Phase, e.g. "greeting".  Must be a string literal.
+		 *
+		 * @param host
+		 *   Device being talked to.  Must remain valid for the life of the span.
+		 */
+		Span(const char *category, const char *name, const std::string& host)
+			: category(category),
+			  name(name),
+			  host(host),
+			  active(tracer != NULL)
+		{
+			if (this->active) this->start = boost::posix_time::microsec_clock::universal_time();
+		}
+
+		~Span()
+		{
+			this->finish();
+		}
+
+		/// Stop timing and record the span.
+		void finish()
+		{
+			if (!this->active) return;
+			this->active = false;
+			tracer->add(this->category, this->name, this->host, this->start,
+				boost::posix_time::microsec_clock::universal_time());
+			return;
+		}
+
+	private:
+		const char *category;
+		const char *name;
+		const std::string& host;
+		bool active;
+		boost::posix_time::ptime start;
+};
+
+#endif // TRACE_HPP
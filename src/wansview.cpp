@@ -0,0 +1,145 @@
+/**
+ * @file   wansview.cpp
+ * @brief  Device driver for Wansview and other Netwave based cameras.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <iomanip>
+#include <sstream>
+#include "main.hpp"
+#include "parse.hpp"
+#include "wansview.hpp"
+
+/// Connections used at once to download large files.
+#define WANSVIEW_CONNECTIONS 4
+
+/// Admin login for the CGI scripts as set at the factory, used unless another
+/// is given.
+#define WANSVIEW_USER "admin"
+#define WANSVIEW_PASS ""
+
+wansview::wansview(Network *network)
+	: network(network)
+{
+}
+
+wansview::~wansview()
+{
+}
+
+void wansview::getFirmware(std::ostream& target, fn_progress fnProgress)
+{
+	throw std::string("Netwave cameras can't send back their firmware, only "
+		"their settings (try --config-snapshot).");
+}
+
+unsigned long wansview::putFirmware(std::istream& source, bool onlyChanged,
+	fn_progress fnProgress)
+{
+	throw std::string("Writing firmware to Netwave cameras is not supported.");
+}
+
+void wansview::getBlockChecksums(unsigned long blockSize,
+	std::vector<uint32_t> *sums)
+{
+	throw std::string("Netwave cameras can't read back their firmware, so it "
+		"can't be checksummed.");
+}
+
+void wansview::getFlashInfo(unsigned long *length)
+{
+	// Not reported by the CGI scripts, but check the camera is answering so
+	// a query still means something.
+	std::map<std::string, std::string> vars;
+	this->getStatus(&vars);
+	*length = 0;
+	return;
+}
+
+void wansview::getCameraInfo(unsigned short *idVendor,
+	unsigned short *idProduct, unsigned char *bInterfaceClass)
+{
+	// The image sensor isn't on USB
+	*idVendor = 0;
+	*idProduct = 0;
+	*bInterfaceClass = 0;
+	return;
+}
+
+std::string wansview::getFirmwareVersion()
+{
+	std::map<std::string, std::string> vars;
+	this->getStatus(&vars);
+	std::string version = vars["sys_ver"];
+	if (verbose) std::cerr << "[wansview] System firmware " << version
+		<< ", web UI " << vars["app_ver"] << std::endl;
+	return version;
+}
+
+std::string wansview::getConfigStamp()
+{
+	// Nothing cheaper than downloading the settings says when they changed
+	return std::string();
+}
+
+void wansview::getConfig(std::ostream& target)
+{
+	if (!this->network->http_get_ranges(target,
+		"/backup_params.cgi?" + this->credentials(), WANSVIEW_CONNECTIONS,
+		fn_progress())
+	) {
+		throw std::string("Unable to download settings, check the admin "
+			"password.");
+	}
+	return;
+}
+
+void wansview::getStatus(std::map<std::string, std::string> *vars)
+{
+	std::string content = this->network->http_get("/get_status.cgi");
+	parse_cgi_vars(content, vars);
+	if (vars->find("sys_ver") == vars->end()) {
+		throw std::string("Unable to get camera status.");
+	}
+	return;
+}
+
+/// Escape a value for use in a URL query string.
+static std::string url_encode(const std::string& value)
+{
+	std::stringstream ss;
+	ss << std::hex << std::uppercase << std::setfill('0');
+	for (std::string::const_iterator i = value.begin(); i != value.end(); i++) {
+		unsigned char c = *i;
+		if (isalnum(c) || (c == '-') || (c == '_') || (c == '.') || (c == '~')) {
+			ss << c;
+		} else {
+			ss << '%' << std::setw(2) << (unsigned int)c;
+		}
+	}
+	return ss.str();
+}
+
+std::string wansview::credentials()
+{
+	if (this->network->login_username().empty()) {
+		return "user=" + url_encode(WANSVIEW_USER) + "&pwd=" + url_encode(WANSVIEW_PASS);
+	}
+	return "user=" + url_encode(this->network->login_username())
+		+ "&pwd=" + url_encode(this->network->login_password());
+}
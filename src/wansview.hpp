@@ -0,0 +1,72 @@
+/**
+ * @file   wansview.hpp
+ * @brief  Device driver for Wansview and other Netwave based cameras.
+ *
+ * Copyright (C) 2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WANSVIEW_HPP
+#define WANSVIEW_HPP
+
+#include <map>
+#include "network.hpp"
+#include "device-interface.hpp"
+
+/// Wansview and other cameras built on the Netwave board.
+/**
+ * Everything is done through the CGI scripts of the web interface.  These
+ * cameras have no way to read back their firmware, so only the settings can
+ * be backed up.
+ */
+class wansview: virtual public Device
+{
+	public:
+		wansview(Network *network);
+		virtual ~wansview();
+
+		virtual void getFirmware(std::ostream& target, fn_progress fnProgress);
+		virtual unsigned long putFirmware(std::istream& source, bool onlyChanged,
+			fn_progress fnProgress);
+		virtual void getBlockChecksums(unsigned long blockSize,
+			std::vector<uint32_t> *sums);
+		virtual void getFlashInfo(unsigned long *length);
+		virtual void getCameraInfo(unsigned short *idVendor,
+			unsigned short *idProduct, unsigned char *bInterfaceClass);
+		virtual std::string getFirmwareVersion();
+		virtual std::string getConfigStamp();
+		virtual void getConfig(std::ostream& target);
+
+	private:
+		Network *network;
+
+		/// Run get_status.cgi.
+		/**
+		 * @param vars
+		 *   On return, the variables it set.
+		 *
+		 * @throw std::string if the camera didn't answer.
+		 */
+		void getStatus(std::map<std::string, std::string> *vars);
+
+		/// Get the query string that logs in to a CGI script.
+		/**
+		 * Uses the login given to Network::set_login(), or the factory login
+		 * if none was.
+		 */
+		std::string credentials();
+};
+
+#endif // WANSVIEW_HPP